@@ -0,0 +1,159 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	// Enough for a few hundred overlays with their labels
+	DEFAULT_CHUNK_SIZE = 16 * 1024,
+	ALIGNMENT = alignof(max_align_t),
+};
+
+typedef struct arena_chunk
+{
+	// Chunk filled up before this one
+	struct arena_chunk *previous;
+	size_t size;
+	size_t used;
+	alignas(max_align_t) unsigned char data[];
+} arena_chunk;
+
+struct xg_arena
+{
+	// Chunk currently being allocated from
+	arena_chunk *current;
+	// Total size of all chunks, which is what the arena shrinks back to a
+	// single chunk of on reset
+	size_t total_size;
+};
+
+static arena_chunk *create_chunk(size_t size)
+{
+	arena_chunk *chunk = malloc(sizeof(arena_chunk) + size);
+	if (chunk == NULL)
+	{
+		return NULL;
+	}
+	chunk->previous = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+xg_arena *xg_arena_create(size_t initial_size)
+{
+	xg_arena *arena = calloc(1, sizeof(xg_arena));
+	if (arena == NULL)
+	{
+		return NULL;
+	}
+	arena->total_size = initial_size > 0 ? initial_size : DEFAULT_CHUNK_SIZE;
+	arena->current = create_chunk(arena->total_size);
+	if (arena->current == NULL)
+	{
+		free(arena);
+		return NULL;
+	}
+	return arena;
+}
+
+void *xg_arena_alloc(xg_arena *arena, size_t size)
+{
+	size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+	arena_chunk *chunk = arena->current;
+	if (chunk->size - chunk->used < size)
+	{
+		// Grow geometrically, so a frame with unusually many results only
+		// takes a few extra chunks
+		size_t chunk_size = chunk->size * 2;
+		if (chunk_size < size)
+		{
+			chunk_size = size;
+		}
+		arena_chunk *next = create_chunk(chunk_size);
+		if (next == NULL)
+		{
+			return NULL;
+		}
+		next->previous = chunk;
+		arena->current = chunk = next;
+		arena->total_size += chunk_size;
+	}
+	void *result = chunk->data + chunk->used;
+	chunk->used += size;
+	return result;
+}
+
+void *xg_arena_calloc(xg_arena *arena, size_t count, size_t size)
+{
+	if (size != 0 && count > SIZE_MAX / size)
+	{
+		return NULL;
+	}
+	void *result = xg_arena_alloc(arena, count * size);
+	if (result != NULL)
+	{
+		memset(result, 0, count * size);
+	}
+	return result;
+}
+
+char *xg_arena_strdup(xg_arena *arena, const char *string)
+{
+	size_t size = strlen(string) + 1;
+	char *result = xg_arena_alloc(arena, size);
+	if (result != NULL)
+	{
+		memcpy(result, string, size);
+	}
+	return result;
+}
+
+static void free_chunks(arena_chunk *chunk)
+{
+	while (chunk != NULL)
+	{
+		arena_chunk *previous = chunk->previous;
+		free(chunk);
+		chunk = previous;
+	}
+}
+
+void xg_arena_reset(xg_arena *arena)
+{
+	arena_chunk *chunk = arena->current;
+	if (chunk->previous != NULL)
+	{
+		// The last use needed more than one chunk; replace them with one that
+		// holds as much. If that fails, keep the newest (largest) chunk.
+		arena_chunk *merged = create_chunk(arena->total_size);
+		if (merged != NULL)
+		{
+			free_chunks(chunk);
+			chunk = merged;
+		}
+		else
+		{
+			free_chunks(chunk->previous);
+			chunk->previous = NULL;
+			arena->total_size = chunk->size;
+		}
+		arena->current = chunk;
+	}
+	chunk->used = 0;
+}
+
+void xg_arena_free(xg_arena *arena)
+{
+	if (arena == NULL)
+	{
+		return;
+	}
+	free_chunks(arena->current);
+	free(arena);
+}
@@ -0,0 +1,36 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_ARENA_H__
+#define __COMMON_UTIL_ARENA_H__
+
+#include <stddef.h>
+
+// Bump allocator for memory that all dies at once, such as everything built
+// from one frame's inference result: the bounding box array, the overlays and
+// their labels. Allocating is a pointer increment, nothing is freed
+// individually, and xg_arena_reset() empties the whole arena in constant time.
+//
+// When an arena runs out of room it chains on a bigger chunk; the next reset
+// merges the chunks into one large enough for everything, so once warmed up an
+// arena allocates nothing at all. Not thread-safe: an arena belongs to one
+// thread at a time.
+typedef struct xg_arena xg_arena;
+
+// Creates an arena whose first chunk holds @initial_size bytes (0 for a
+// default size). Returns NULL if out of memory.
+xg_arena *xg_arena_create(size_t initial_size);
+
+// Returns @size bytes aligned for any type, or NULL if out of memory. The
+// memory stays valid until the arena is reset or freed.
+void *xg_arena_alloc(xg_arena *arena, size_t size);
+// Like xg_arena_alloc() for @count zeroed elements of @size bytes
+void *xg_arena_calloc(xg_arena *arena, size_t count, size_t size);
+// Copies @string into the arena
+char *xg_arena_strdup(xg_arena *arena, const char *string);
+
+// Releases everything allocated from the arena at once
+void xg_arena_reset(xg_arena *arena);
+
+void xg_arena_free(xg_arena *arena);
+
+#endif  // __COMMON_UTIL_ARENA_H__
@@ -0,0 +1,251 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "box_tracker.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// An overlay of a keyframe, and how far it moves per frame
+typedef struct track
+{
+	// Its text is in the track set's arena; @next is unused
+	xg_overlay overlay;
+	float dx, dy, dwidth, dheight;
+} track;
+
+// Everything remembered about one keyframe
+typedef struct track_set
+{
+	track *tracks;
+	int32_t count, capacity;
+	xg_arena *labels;
+	uint64_t sequence;
+} track_set;
+
+struct xg_box_tracker
+{
+	// The latest keyframe is @sets[@current], the one before the other
+	track_set sets[2];
+	int32_t current;
+	bool has_keyframe;
+	// Frames between the last two keyframes, as far as boxes are moved along
+	uint64_t keyframe_gap;
+};
+
+xg_box_tracker *xg_box_tracker_create(void)
+{
+	xg_box_tracker *tracker = calloc(1, sizeof(xg_box_tracker));
+	if (tracker == NULL)
+	{
+		fputs("Couldn't allocate memory for box tracker\n", stderr);
+		return NULL;
+	}
+	for (int32_t i = 0; i < 2; ++i)
+	{
+		tracker->sets[i].labels = xg_arena_create(0);
+		if (tracker->sets[i].labels == NULL)
+		{
+			fputs("Couldn't allocate memory for box tracker\n", stderr);
+			xg_box_tracker_free(tracker);
+			return NULL;
+		}
+	}
+	return tracker;
+}
+
+void xg_box_tracker_free(xg_box_tracker *tracker)
+{
+	if (tracker == NULL)
+	{
+		return;
+	}
+	for (int32_t i = 0; i < 2; ++i)
+	{
+		free(tracker->sets[i].tracks);
+		xg_arena_free(tracker->sets[i].labels);
+	}
+	free(tracker);
+}
+
+static float intersection_over_union(const xg_overlay *a, const xg_overlay *b)
+{
+	float left = a->x > b->x ? a->x : b->x;
+	float top = a->y > b->y ? a->y : b->y;
+	float right = a->x + a->width < b->x + b->width ? a->x + a->width
+							 : b->x + b->width;
+	float bottom = a->y + a->height < b->y + b->height ? a->y + a->height
+							     : b->y + b->height;
+	if (right <= left || bottom <= top)
+	{
+		return 0;
+	}
+	float intersection = (right - left) * (bottom - top);
+	return intersection /
+	       (a->width * a->height + b->width * b->height - intersection);
+}
+
+static bool same_label(const xg_overlay *a, const xg_overlay *b)
+{
+	if (a->text == NULL || b->text == NULL)
+	{
+		return a->text == b->text;
+	}
+	return strcmp(a->text, b->text) == 0;
+}
+
+// The box in @previous that @box most likely is, or NULL if none overlaps it
+static const track *find_match(const track_set *previous, const xg_overlay *box)
+{
+	const track *best = NULL;
+	float best_overlap = 0;
+	for (int32_t i = 0; i < previous->count; ++i)
+	{
+		const xg_overlay *candidate = &previous->tracks[i].overlay;
+		if (candidate->type != XG_OVERLAY_BOUNDING_BOX ||
+		    !same_label(candidate, box))
+		{
+			continue;
+		}
+		float overlap = intersection_over_union(candidate, box);
+		if (overlap > best_overlap)
+		{
+			best = &previous->tracks[i];
+			best_overlap = overlap;
+		}
+	}
+	return best;
+}
+
+static track *add_track(track_set *set)
+{
+	if (set->count == set->capacity)
+	{
+		int32_t capacity = set->capacity > 0 ? set->capacity * 2 : 16;
+		track *tracks = realloc(set->tracks, capacity * sizeof(track));
+		if (tracks == NULL)
+		{
+			return NULL;
+		}
+		set->tracks = tracks;
+		set->capacity = capacity;
+	}
+	return &set->tracks[set->count++];
+}
+
+bool xg_box_tracker_update(xg_box_tracker *tracker, uint64_t sequence,
+			   const xg_overlay *overlays)
+{
+	const track_set *previous = &tracker->sets[tracker->current];
+	bool has_previous = tracker->has_keyframe && sequence > previous->sequence;
+	uint64_t gap = has_previous ? sequence - previous->sequence : 0;
+	tracker->current = 1 - tracker->current;
+	track_set *current = &tracker->sets[tracker->current];
+	current->count = 0;
+	current->sequence = sequence;
+	xg_arena_reset(current->labels);
+	tracker->has_keyframe = true;
+	tracker->keyframe_gap = gap;
+
+	for (const xg_overlay *overlay = overlays; overlay != NULL;
+	     overlay = overlay->next)
+	{
+		track *added = add_track(current);
+		if (added == NULL)
+		{
+			fputs("Couldn't allocate memory for tracked boxes\n", stderr);
+			return false;
+		}
+		memset(added, 0, sizeof(track));
+		added->overlay = *overlay;
+		added->overlay.next = NULL;
+		if (overlay->text != NULL)
+		{
+			added->overlay.text =
+			    xg_arena_strdup(current->labels, overlay->text);
+			if (added->overlay.text == NULL)
+			{
+				fputs("Couldn't allocate memory for tracked boxes\n",
+				      stderr);
+				return false;
+			}
+		}
+		if (!has_previous || overlay->type != XG_OVERLAY_BOUNDING_BOX)
+		{
+			continue;
+		}
+		const track *match = find_match(previous, overlay);
+		if (match != NULL)
+		{
+			const xg_overlay *before = &match->overlay;
+			added->dx = (overlay->x - before->x) / gap;
+			added->dy = (overlay->y - before->y) / gap;
+			added->dwidth = (overlay->width - before->width) / gap;
+			added->dheight = (overlay->height - before->height) / gap;
+		}
+	}
+	return true;
+}
+
+// Clamps @value to [0, 1], the range of normalized frame coordinates
+static float clamp_unit(float value)
+{
+	return fminf(fmaxf(value, 0), 1);
+}
+
+bool xg_box_tracker_predict(xg_box_tracker *tracker, uint64_t sequence,
+			    xg_arena *arena, xg_overlay **overlays_out)
+{
+	*overlays_out = NULL;
+	if (!tracker->has_keyframe)
+	{
+		return true;
+	}
+	const track_set *current = &tracker->sets[tracker->current];
+	// Don't guess further ahead than the keyframes were apart
+	uint64_t ahead = sequence > current->sequence
+			     ? sequence - current->sequence
+			     : 0;
+	if (ahead > tracker->keyframe_gap)
+	{
+		ahead = tracker->keyframe_gap;
+	}
+
+	xg_overlay **tail = overlays_out;
+	for (int32_t i = 0; i < current->count; ++i)
+	{
+		const track *tracked = &current->tracks[i];
+		const xg_overlay *from = &tracked->overlay;
+		xg_overlay *overlay;
+		if (from->type == XG_OVERLAY_BOUNDING_BOX)
+		{
+			// Boxes moving or shrinking steadily leave the frame or
+			// turn inside out if followed far enough
+			float x = clamp_unit(from->x + tracked->dx * ahead);
+			float y = clamp_unit(from->y + tracked->dy * ahead);
+			float width = clamp_unit(from->width +
+						 tracked->dwidth * ahead);
+			float height = clamp_unit(from->height +
+						  tracked->dheight * ahead);
+			overlay = xg_overlay_create_bounding_box_in(
+			    arena, x, y, fminf(width, 1 - x), fminf(height, 1 - y),
+			    from->text, from->bg_color);
+		}
+		else
+		{
+			overlay = xg_overlay_create_text_in(arena, from->x, from->y,
+							    from->text,
+							    from->bg_color);
+		}
+		if (overlay == NULL)
+		{
+			fputs("Couldn't allocate memory for tracked boxes\n", stderr);
+			return false;
+		}
+		overlay->text_color = from->text_color;
+		*tail = overlay;
+		tail = &overlay->next;
+	}
+	return true;
+}
@@ -0,0 +1,32 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_BOX_TRACKER_H__
+#define __COMMON_UTIL_BOX_TRACKER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "overlays.h"
+
+// Fills in overlays for the frames between keyframes (see rate_controller.h).
+// Each bounding box of the latest keyframe is matched to the nearest
+// overlapping box with the same label in the keyframe before it, and moved
+// along at the speed it moved between them; boxes without a match, and text
+// overlays, stay where they were. That costs a few multiplications per box,
+// next to a whole evaluation.
+typedef struct xg_box_tracker xg_box_tracker;
+
+// Returns NULL and prints a message to stderr on failure
+xg_box_tracker *xg_box_tracker_create(void);
+void xg_box_tracker_free(xg_box_tracker *tracker);
+// Remembers the overlays evaluated for keyframe @sequence. Keeps its own copy,
+// so the overlays may be published afterwards. Returns false if out of memory.
+bool xg_box_tracker_update(xg_box_tracker *tracker, uint64_t sequence,
+			   const xg_overlay *overlays);
+// Builds the overlays predicted for frame @sequence, which must come after the
+// last keyframe, allocating them from @arena. Returns false if out of memory.
+bool xg_box_tracker_predict(xg_box_tracker *tracker, uint64_t sequence,
+			    xg_arena *arena, xg_overlay **overlays_out);
+
+#endif  // __COMMON_UTIL_BOX_TRACKER_H__
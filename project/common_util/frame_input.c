@@ -0,0 +1,183 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "frame_input.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Layout of a tightly packed plane: bytes per row, and how many rows
+typedef struct plane_layout
+{
+	int32_t row_size;
+	int32_t rows;
+} plane_layout;
+
+// Fills in the packed layout of every plane of @frame. Returns the number of
+// planes, or 0 if the format is not one an xnor_input can be made from.
+static int32_t packed_layout(const xg_frame *frame, plane_layout *layout)
+{
+	int32_t chroma_width = (frame->width + 1) / 2;
+	int32_t chroma_height = (frame->height + 1) / 2;
+	if (strcmp(frame->format, "RGB") == 0)
+	{
+		layout[0] = (plane_layout){frame->width * 3, frame->height};
+		return 1;
+	}
+	if (strcmp(frame->format, "YUY2") == 0)
+	{
+		layout[0] = (plane_layout){chroma_width * 4, frame->height};
+		return 1;
+	}
+	if (strcmp(frame->format, "NV12") == 0 ||
+	    strcmp(frame->format, "NV21") == 0)
+	{
+		layout[0] = (plane_layout){frame->width, frame->height};
+		layout[1] = (plane_layout){chroma_width * 2, chroma_height};
+		return 2;
+	}
+	if (strcmp(frame->format, "I420") == 0)
+	{
+		layout[0] = (plane_layout){frame->width, frame->height};
+		layout[1] = (plane_layout){chroma_width, chroma_height};
+		layout[2] = (plane_layout){chroma_width, chroma_height};
+		return 3;
+	}
+	return 0;
+}
+
+// Returns pointers to packed copies of the frame's planes. Planes whose stride
+// already matches the packed row size are used in place; the others are copied
+// row by row into @frame->packed.
+static bool pack_planes(xg_frame *frame, const plane_layout *layout,
+			int32_t n_planes, const uint8_t **planes_out)
+{
+	size_t packed_size = 0;
+	for (int32_t i = 0; i < n_planes; ++i)
+	{
+		if (frame->strides[i] != layout[i].row_size)
+		{
+			packed_size += (size_t)layout[i].row_size * layout[i].rows;
+		}
+	}
+
+	// Pooled frames keep their scratch buffer from one use to the next, so it
+	// only has to grow when the caps do
+	if (packed_size > frame->packed_size)
+	{
+		free(frame->packed);
+		frame->packed_size = 0;
+		frame->packed = malloc(packed_size);
+		if (frame->packed == NULL)
+		{
+			fputs("Couldn't allocate memory to repack frame\n", stderr);
+			return false;
+		}
+		frame->packed_size = packed_size;
+	}
+
+	uint8_t *dest = frame->packed;
+	for (int32_t i = 0; i < n_planes; ++i)
+	{
+		if (frame->strides[i] == layout[i].row_size)
+		{
+			planes_out[i] = frame->planes[i];
+			continue;
+		}
+		planes_out[i] = dest;
+		for (int32_t row = 0; row < layout[i].rows; ++row)
+		{
+			memcpy(dest, frame->planes[i] + (size_t)row * frame->strides[i],
+			       layout[i].row_size);
+			dest += layout[i].row_size;
+		}
+	}
+	return true;
+}
+
+bool xg_frame_create_model_input(xg_frame *frame,
+				 const xg_model_library *library,
+				 xnor_input **input_out)
+{
+	plane_layout layout[XG_FRAME_MAX_PLANES];
+	int32_t n_planes = packed_layout(frame, layout);
+	if (n_planes == 0 || n_planes > frame->n_planes)
+	{
+		fprintf(stderr, "Unsupported frame format %s\n", frame->format);
+		return false;
+	}
+
+	const uint8_t *planes[XG_FRAME_MAX_PLANES];
+	if (!pack_planes(frame, layout, n_planes, planes))
+	{
+		return false;
+	}
+
+	enum image_format format;
+	if (strcmp(frame->format, "RGB") == 0)
+	{
+		format = kImageFormatRGB;
+	}
+	else if (strcmp(frame->format, "YUY2") == 0)
+	{
+		format = kImageFormatYUV422;
+	}
+	else if (strcmp(frame->format, "NV12") == 0)
+	{
+		format = kImageFormatNV12;
+	}
+	else if (strcmp(frame->format, "NV21") == 0)
+	{
+		format = kImageFormatNV21;
+	}
+	else
+	{
+		format = kImageFormatYUV420P;
+	}
+	return xg_model_library_create_input(library, format, frame->width,
+					     frame->height, planes, input_out);
+}
+
+bool xg_frame_create_xnor_input(xg_frame *frame, xnor_input **input_out)
+{
+	return xg_frame_create_model_input(frame, xg_model_library_linked(),
+					   input_out);
+}
+
+void xg_pipeline_fill_warmup_config(xg_pipeline *pipeline,
+				    xg_warmup_config *config)
+{
+	if (config->width > 0 && config->height > 0)
+	{
+		return;
+	}
+	config->width = pipeline->inference_width > 0 ? pipeline->inference_width
+						      : pipeline->config.width;
+	config->height = pipeline->inference_height > 0
+			     ? pipeline->inference_height
+			     : pipeline->config.height;
+	// Native format pipelines deliver whatever the camera captures, which is
+	// YUY2 for most webcams unless the config says otherwise
+	const char *format = pipeline->config.format;
+	if (!pipeline->native_format || (format && strcmp(format, "RGB") == 0))
+	{
+		config->format = kImageFormatRGB;
+	}
+	else if (format && strcmp(format, "NV12") == 0)
+	{
+		config->format = kImageFormatNV12;
+	}
+	else if (format && strcmp(format, "NV21") == 0)
+	{
+		config->format = kImageFormatNV21;
+	}
+	else if (format && strcmp(format, "I420") == 0)
+	{
+		config->format = kImageFormatYUV420P;
+	}
+	else
+	{
+		config->format = kImageFormatYUV422;
+	}
+}
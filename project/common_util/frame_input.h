@@ -0,0 +1,31 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_FRAME_INPUT_H__
+#define __COMMON_UTIL_FRAME_INPUT_H__
+
+#include <stdbool.h>
+
+#include "gstreamer_video_pipeline.h"
+#include "model_library.h"
+#include "model_warmup.h"
+#include "xnornet.h"
+
+// Creates an Xnor model input from a video frame, using whichever
+// xnor_input_create_* constructor matches the frame's format (RGB, YUY2, NV12,
+// NV21 or I420). Rows padded out by GStreamer are repacked into a scratch
+// buffer owned by the frame; otherwise the input points straight at the frame
+// data. The frame must outlive the input. Returns false and prints a message
+// to stderr if the format is unsupported or the input can't be created.
+bool xg_frame_create_xnor_input(xg_frame *frame, xnor_input **input_out);
+// Like xg_frame_create_xnor_input(), for a model loaded from @library (see
+// model_library.h)
+bool xg_frame_create_model_input(xg_frame *frame,
+				 const xg_model_library *library,
+				 xnor_input **input_out);
+
+// Gives @config's dummy image (see model_warmup.h) the size and format of the
+// frames @pipeline hands to the model, unless its size is already set
+void xg_pipeline_fill_warmup_config(xg_pipeline *pipeline,
+				    xg_warmup_config *config);
+
+#endif  // __COMMON_UTIL_FRAME_INPUT_H__
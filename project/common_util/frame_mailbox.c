@@ -0,0 +1,92 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "frame_mailbox.h"
+
+#include <errno.h>
+#include <stddef.h>
+
+bool xg_mailbox_init(xg_mailbox *mailbox, void (*discard)(void *item))
+{
+	atomic_init(&mailbox->slot, NULL);
+	atomic_init(&mailbox->closed, false);
+	mailbox->discard = discard;
+	if (sem_init(&mailbox->ready, 0, 0) != 0)
+	{
+		return false;
+	}
+	if (sem_init(&mailbox->taken, 0, 0) != 0)
+	{
+		sem_destroy(&mailbox->ready);
+		return false;
+	}
+	return true;
+}
+
+void xg_mailbox_post(xg_mailbox *mailbox, void *item)
+{
+	void *previous = atomic_exchange(&mailbox->slot, item);
+	if (previous != NULL)
+	{
+		// The consumer never saw it; it has already been woken up for it, so
+		// there's no need to post the semaphore again.
+		mailbox->discard(previous);
+		return;
+	}
+	sem_post(&mailbox->ready);
+}
+
+bool xg_mailbox_post_wait(xg_mailbox *mailbox, void *item)
+{
+	xg_mailbox_post(mailbox, item);
+	// @taken may hold stale posts for items taken earlier, so check the slot
+	// itself each time around
+	while (atomic_load(&mailbox->slot) != NULL &&
+	       !atomic_load(&mailbox->closed))
+	{
+		while (sem_wait(&mailbox->taken) != 0 && errno == EINTR)
+		{
+		}
+	}
+	return !atomic_load(&mailbox->closed);
+}
+
+void *xg_mailbox_take(xg_mailbox *mailbox)
+{
+	for (;;)
+	{
+		if (atomic_load(&mailbox->closed))
+		{
+			return NULL;
+		}
+		void *item = atomic_exchange(&mailbox->slot, NULL);
+		if (item != NULL)
+		{
+			sem_post(&mailbox->taken);
+			return item;
+		}
+		// Empty: sleep until the next post. A wakeup can be stale (the item it
+		// was posted for was already taken), in which case we just go around
+		// again.
+		while (sem_wait(&mailbox->ready) != 0 && errno == EINTR)
+		{
+		}
+	}
+}
+
+void xg_mailbox_close(xg_mailbox *mailbox)
+{
+	atomic_store(&mailbox->closed, true);
+	sem_post(&mailbox->ready);
+	sem_post(&mailbox->taken);
+}
+
+void xg_mailbox_destroy(xg_mailbox *mailbox)
+{
+	void *item = atomic_exchange(&mailbox->slot, NULL);
+	if (item != NULL)
+	{
+		mailbox->discard(item);
+	}
+	sem_destroy(&mailbox->ready);
+	sem_destroy(&mailbox->taken);
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_FRAME_MAILBOX_H__
+#define __COMMON_UTIL_FRAME_MAILBOX_H__
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Single-slot "latest item" mailbox between one producer and one consumer.
+// Posting replaces whatever the consumer hasn't picked up yet, so the consumer
+// always gets the most recent item and never works through a backlog. The
+// slot itself is a lock-free pointer exchange; a semaphore is only used to put
+// the consumer to sleep while the mailbox is empty.
+typedef struct xg_mailbox
+{
+	_Atomic(void *) slot;
+	atomic_bool closed;
+	sem_t ready;
+	// Posted whenever the consumer takes an item, for xg_mailbox_post_wait()
+	sem_t taken;
+	// Frees items that were replaced before being taken, or left over when
+	// the mailbox is destroyed
+	void (*discard)(void *item);
+} xg_mailbox;
+
+bool xg_mailbox_init(xg_mailbox *mailbox, void (*discard)(void *item));
+// Publishes @item, discarding the previous item if it was never taken
+void xg_mailbox_post(xg_mailbox *mailbox, void *item);
+// Publishes @item, then waits until the consumer has taken it, so no item is
+// ever discarded and the producer goes no faster than the consumer. Returns
+// false if the mailbox was closed first.
+bool xg_mailbox_post_wait(xg_mailbox *mailbox, void *item);
+// Takes the latest item, blocking until one is posted. Returns NULL once the
+// mailbox has been closed.
+void *xg_mailbox_take(xg_mailbox *mailbox);
+// Wakes up the consumer (and a producer waiting in xg_mailbox_post_wait()) and
+// makes every later xg_mailbox_take() return NULL
+void xg_mailbox_close(xg_mailbox *mailbox);
+// Discards any pending item and releases the mailbox's resources
+void xg_mailbox_destroy(xg_mailbox *mailbox);
+
+#endif  // __COMMON_UTIL_FRAME_MAILBOX_H__
@@ -0,0 +1,141 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "frame_pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Frames kept for reuse. Anything beyond this (e.g. after a burst of frames
+// queued up for an inference pool) goes back to the allocator.
+enum
+{
+	MAX_CACHED_FRAMES = 8,
+};
+
+struct xg_frame_pool
+{
+	// One for the owner, plus one per frame that has been handed out
+	atomic_int refs;
+
+	pthread_mutex_t lock;
+	// Size of the buffers currently being handed out, rounded up to a
+	// multiple of XG_FRAME_POOL_ALIGNMENT
+	size_t buffer_size;
+	xg_frame *cached[MAX_CACHED_FRAMES];
+	int32_t n_cached;
+};
+
+static void destroy_frame(xg_frame *frame)
+{
+	free(frame->storage);
+	free(frame->packed);
+	free(frame);
+}
+
+static void unref_pool(xg_frame_pool *pool)
+{
+	if (atomic_fetch_sub(&pool->refs, 1) != 1)
+	{
+		return;
+	}
+	for (int32_t i = 0; i < pool->n_cached; ++i)
+	{
+		destroy_frame(pool->cached[i]);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+xg_frame_pool *xg_frame_pool_create(void)
+{
+	xg_frame_pool *pool = calloc(1, sizeof(xg_frame_pool));
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+	atomic_init(&pool->refs, 1);
+	pthread_mutex_init(&pool->lock, NULL);
+	return pool;
+}
+
+xg_frame *xg_frame_pool_acquire(xg_frame_pool *pool, size_t size)
+{
+	size_t buffer_size = (size + XG_FRAME_POOL_ALIGNMENT - 1) /
+			     XG_FRAME_POOL_ALIGNMENT * XG_FRAME_POOL_ALIGNMENT;
+	xg_frame *frame = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if (buffer_size != 0)
+	{
+		pool->buffer_size = buffer_size;
+	}
+	if (pool->n_cached > 0)
+	{
+		frame = pool->cached[--pool->n_cached];
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (frame == NULL)
+	{
+		frame = calloc(1, sizeof(xg_frame));
+		if (frame == NULL)
+		{
+			return NULL;
+		}
+	}
+	if (buffer_size != 0 && frame->storage_size != buffer_size)
+	{
+		free(frame->storage);
+		frame->storage = aligned_alloc(XG_FRAME_POOL_ALIGNMENT, buffer_size);
+		frame->storage_size = frame->storage ? buffer_size : 0;
+		if (frame->storage == NULL)
+		{
+			destroy_frame(frame);
+			return NULL;
+		}
+	}
+	frame->pool = pool;
+	atomic_fetch_add(&pool->refs, 1);
+	return frame;
+}
+
+void xg_frame_pool_release(xg_frame *frame)
+{
+	xg_frame_pool *pool = frame->pool;
+
+	// Everything but the buffers goes back to how calloc() left it
+	uint8_t *storage = frame->storage;
+	size_t storage_size = frame->storage_size;
+	uint8_t *packed = frame->packed;
+	size_t packed_size = frame->packed_size;
+	memset(frame, 0, sizeof(xg_frame));
+	frame->storage = storage;
+	frame->storage_size = storage_size;
+	frame->packed = packed;
+	frame->packed_size = packed_size;
+
+	pthread_mutex_lock(&pool->lock);
+	// Buffers sized for old caps would only be reallocated on reuse anyway
+	bool keep = pool->n_cached < MAX_CACHED_FRAMES &&
+		    (storage_size == 0 || storage_size == pool->buffer_size);
+	if (keep)
+	{
+		pool->cached[pool->n_cached++] = frame;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (!keep)
+	{
+		destroy_frame(frame);
+	}
+	unref_pool(pool);
+}
+
+void xg_frame_pool_free(xg_frame_pool *pool)
+{
+	if (pool != NULL)
+	{
+		unref_pool(pool);
+	}
+}
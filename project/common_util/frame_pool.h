@@ -0,0 +1,40 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_FRAME_POOL_H__
+#define __COMMON_UTIL_FRAME_POOL_H__
+
+#include <stddef.h>
+
+#include "gstreamer_video_pipeline.h"
+
+// Recycles xg_frame structs together with their pixel buffers, so that
+// pulling frames at video rate doesn't allocate or page-fault once the pool has
+// warmed up. Every pipeline owns one.
+//
+// Buffers are aligned to a cache line and all have the size of the most recent
+// request, which is a frame of the negotiated caps; when the caps change, older
+// buffers are dropped as they come back. Frames are handed back with
+// xg_frame_free(), from any thread, and may outlive the pipeline: the pool is
+// only destroyed once its owner has let go of it and every frame is back.
+typedef struct xg_frame_pool xg_frame_pool;
+
+// Size every pooled buffer is a multiple of, and aligned to
+#define XG_FRAME_POOL_ALIGNMENT 64
+
+xg_frame_pool *xg_frame_pool_create(void);
+
+// Gets a cleared frame from the pool, or a new one if the pool is empty. If
+// @size is nonzero, the frame's @storage holds at least @size bytes; if it is
+// zero, the frame won't need its own buffer (e.g. it will be zero-copy) and
+// @storage is left as it is. Returns NULL if out of memory.
+xg_frame *xg_frame_pool_acquire(xg_frame_pool *pool, size_t size);
+
+// Gives a frame back to the pool it came from. Called by xg_frame_free() once
+// whatever the frame referenced has been released.
+void xg_frame_pool_release(xg_frame *frame);
+
+// Lets go of the owner's reference to the pool. Frames still out keep it alive
+// until they are freed.
+void xg_frame_pool_free(xg_frame_pool *pool);
+
+#endif  // __COMMON_UTIL_FRAME_POOL_H__
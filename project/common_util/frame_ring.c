@@ -0,0 +1,519 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "frame_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gstreamer_video_pipeline.h"
+
+enum
+{
+	RING_MAGIC = 0x474e5258,  // "XRNG"
+	RING_VERSION = 1,
+	// Slot headers and frame data start on their own cache lines
+	RING_ALIGNMENT = 64,
+	// Most slots a ring may have
+	RING_MAX_SLOTS = 64,
+};
+
+// Start of the shared memory. Written only by the producer.
+typedef struct ring_header
+{
+	// Stored last, once the rest of the ring is set up
+	atomic_uint magic;
+	uint32_t version;
+	uint32_t n_slots;
+	// Bytes from one slot header to the next, and of frame data in each slot
+	uint32_t slot_stride;
+	uint32_t data_capacity;
+	atomic_uint closed;
+	// Futex readers sleep on; bumped with every frame and on closing
+	atomic_uint wakeups;
+	// Frames published so far. Frame i is in slot i % @n_slots.
+	_Atomic uint64_t published;
+} ring_header;
+
+typedef struct slot_header
+{
+	// Seqlock count: odd while the slot is being written
+	atomic_uint lock;
+	char format[8];
+	int32_t width, height;
+	int32_t n_planes;
+	uint32_t offsets[XG_FRAME_RING_MAX_PLANES];
+	int32_t strides[XG_FRAME_RING_MAX_PLANES];
+	uint32_t size;
+	// Which published frame this is
+	uint64_t index;
+	uint64_t sequence, pts, published_ns;
+} slot_header;
+
+static size_t align_up(size_t size)
+{
+	return (size + RING_ALIGNMENT - 1) & ~(size_t)(RING_ALIGNMENT - 1);
+}
+
+static slot_header *get_slot(const ring_header *header, uint32_t slot)
+{
+	uint8_t *slots = (uint8_t *)header + align_up(sizeof(ring_header));
+	return (slot_header *)(slots + (size_t)slot * header->slot_stride);
+}
+
+static uint8_t *slot_data(slot_header *slot)
+{
+	return (uint8_t *)slot + align_up(sizeof(slot_header));
+}
+
+static size_t ring_size(uint32_t n_slots, uint32_t slot_stride)
+{
+	return align_up(sizeof(ring_header)) + (size_t)n_slots * slot_stride;
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Shared memory object names must start with a slash
+static char *shm_name(const char *name)
+{
+	if (name[0] == '\0' || strchr(name + 1, '/') != NULL)
+	{
+		fprintf(stderr, "Invalid frame ring name: %s\n", name);
+		return NULL;
+	}
+	size_t length = strlen(name) + 2;
+	char *full_name = malloc(length);
+	if (full_name == NULL)
+	{
+		fputs("Couldn't allocate memory for frame ring\n", stderr);
+		return NULL;
+	}
+	snprintf(full_name, length, "%s%s", name[0] == '/' ? "" : "/", name);
+	return full_name;
+}
+
+struct xg_frame_ring
+{
+	char *name;
+	int32_t n_slots;
+	// Mapped when the first frame is published
+	ring_header *header;
+	size_t size;
+	bool failed;
+	bool warned;
+};
+
+xg_frame_ring *xg_frame_ring_create(const char *name, int32_t n_slots)
+{
+	if (n_slots < 2 || n_slots > RING_MAX_SLOTS)
+	{
+		fprintf(stderr, "A frame ring needs 2 to %d slots\n",
+			RING_MAX_SLOTS);
+		return NULL;
+	}
+	xg_frame_ring *ring = calloc(1, sizeof(xg_frame_ring));
+	if (ring == NULL)
+	{
+		fputs("Couldn't allocate memory for frame ring\n", stderr);
+		return NULL;
+	}
+	ring->name = shm_name(name);
+	if (ring->name == NULL)
+	{
+		free(ring);
+		return NULL;
+	}
+	ring->n_slots = n_slots;
+	return ring;
+}
+
+// Bytes the planes of @frame span from the start of its data. Planes after the
+// first are chroma planes, which all the multi-planar formats subsample
+// vertically.
+static size_t frame_span(const xg_frame *frame)
+{
+	size_t span = 0;
+	for (int32_t i = 0; i < frame->n_planes; ++i)
+	{
+		int32_t rows = i == 0 ? frame->height : (frame->height + 1) / 2;
+		size_t end = (size_t)(frame->planes[i] - frame->data) +
+			     (size_t)frame->strides[i] * rows;
+		if (end > span)
+		{
+			span = end;
+		}
+	}
+	return span;
+}
+
+// Creates the shared memory with slots big enough for @data_capacity bytes.
+// Readers only accept the ring once its magic number is set, so they never
+// see it half set up.
+static bool map_ring(xg_frame_ring *ring, size_t data_capacity)
+{
+	data_capacity = align_up(data_capacity);
+	size_t slot_stride = align_up(sizeof(slot_header)) + data_capacity;
+	if (slot_stride > UINT32_MAX)
+	{
+		fputs("Frames are too large for a frame ring\n", stderr);
+		return false;
+	}
+	size_t size = ring_size(ring->n_slots, slot_stride);
+
+	// Replace any ring left behind by a producer that didn't exit cleanly,
+	// rather than resizing it under its readers
+	shm_unlink(ring->name);
+	int fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Couldn't create frame ring %s: %s\n", ring->name,
+			strerror(errno));
+		return false;
+	}
+	if (ftruncate(fd, size) != 0)
+	{
+		fprintf(stderr, "Couldn't size frame ring %s: %s\n", ring->name,
+			strerror(errno));
+		close(fd);
+		shm_unlink(ring->name);
+		return false;
+	}
+	void *memory =
+	    mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (memory == MAP_FAILED)
+	{
+		fprintf(stderr, "Couldn't map frame ring %s: %s\n", ring->name,
+			strerror(errno));
+		shm_unlink(ring->name);
+		return false;
+	}
+
+	// ftruncate() zeroed everything, so every slot starts out unlocked and
+	// empty
+	ring_header *header = memory;
+	header->version = RING_VERSION;
+	header->n_slots = ring->n_slots;
+	header->slot_stride = slot_stride;
+	header->data_capacity = data_capacity;
+	atomic_store_explicit(&header->magic, RING_MAGIC, memory_order_release);
+	ring->header = header;
+	ring->size = size;
+	return true;
+}
+
+static void wake_readers(ring_header *header)
+{
+	atomic_fetch_add_explicit(&header->wakeups, 1, memory_order_release);
+	syscall(SYS_futex, &header->wakeups, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+bool xg_frame_ring_publish(xg_frame_ring *ring, const xg_frame *frame)
+{
+	if (ring->failed)
+	{
+		return false;
+	}
+	size_t span = frame_span(frame);
+	if (ring->header == NULL && !map_ring(ring, span))
+	{
+		ring->failed = true;
+		return false;
+	}
+	ring_header *header = ring->header;
+	if (span > header->data_capacity || frame->n_planes < 1 ||
+	    frame->n_planes > XG_FRAME_RING_MAX_PLANES)
+	{
+		if (!ring->warned)
+		{
+			fprintf(stderr,
+				"Skipping %dx%d %s frames, which don't fit the "
+				"frame ring's slots\n",
+				frame->width, frame->height, frame->format);
+			ring->warned = true;
+		}
+		return true;
+	}
+
+	uint64_t index =
+	    atomic_load_explicit(&header->published, memory_order_relaxed);
+	slot_header *slot = get_slot(header, index % header->n_slots);
+	uint32_t lock = atomic_load_explicit(&slot->lock, memory_order_relaxed);
+	atomic_store_explicit(&slot->lock, lock + 1, memory_order_relaxed);
+	// Readers that see any of what follows also see the slot locked
+	atomic_thread_fence(memory_order_release);
+
+	snprintf(slot->format, sizeof(slot->format), "%s", frame->format);
+	slot->width = frame->width;
+	slot->height = frame->height;
+	slot->n_planes = frame->n_planes;
+	for (int32_t i = 0; i < frame->n_planes; ++i)
+	{
+		slot->offsets[i] = frame->planes[i] - frame->data;
+		slot->strides[i] = frame->strides[i];
+	}
+	slot->size = span;
+	slot->index = index;
+	slot->sequence = frame->sequence;
+	slot->pts = frame->pts;
+	slot->published_ns = monotonic_ns();
+	memcpy(slot_data(slot), frame->data, span);
+
+	atomic_store_explicit(&slot->lock, lock + 2, memory_order_release);
+	atomic_store_explicit(&header->published, index + 1,
+			      memory_order_release);
+	wake_readers(header);
+	return true;
+}
+
+void xg_frame_ring_free(xg_frame_ring *ring)
+{
+	if (ring == NULL)
+	{
+		return;
+	}
+	if (ring->header != NULL)
+	{
+		// Readers that still have it mapped find it closed; new ones
+		// can't open it any more
+		atomic_store_explicit(&ring->header->closed, 1,
+				      memory_order_release);
+		wake_readers(ring->header);
+		munmap(ring->header, ring->size);
+		shm_unlink(ring->name);
+	}
+	free(ring->name);
+	free(ring);
+}
+
+struct xg_frame_ring_reader
+{
+	const ring_header *header;
+	size_t size;
+	xg_frame_ring_mode mode;
+	// Index of the first frame not read yet, and how many before it were
+	// overwritten before they could be read
+	uint64_t next_index;
+	uint64_t skipped;
+};
+
+xg_frame_ring_reader *xg_frame_ring_reader_open(const char *name,
+						xg_frame_ring_mode mode)
+{
+	char *full_name = shm_name(name);
+	if (full_name == NULL)
+	{
+		return NULL;
+	}
+	int fd = shm_open(full_name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		fprintf(stderr,
+			"Couldn't open frame ring %s: %s\n"
+			"(Has its producer published a frame yet?)\n",
+			full_name, strerror(errno));
+		free(full_name);
+		return NULL;
+	}
+	struct stat info;
+	const ring_header *header = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(ring_header))
+	{
+		header = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (header == MAP_FAILED)
+	{
+		fprintf(stderr, "Couldn't map frame ring %s\n", full_name);
+		free(full_name);
+		return NULL;
+	}
+	if (atomic_load_explicit((atomic_uint *)&header->magic,
+				 memory_order_acquire) != RING_MAGIC ||
+	    header->version != RING_VERSION || header->n_slots == 0 ||
+	    ring_size(header->n_slots, header->slot_stride) > (size_t)info.st_size)
+	{
+		fprintf(stderr, "%s isn't a frame ring this program can read\n",
+			full_name);
+		munmap((void *)header, info.st_size);
+		free(full_name);
+		return NULL;
+	}
+	free(full_name);
+
+	xg_frame_ring_reader *reader = calloc(1, sizeof(xg_frame_ring_reader));
+	if (reader == NULL)
+	{
+		fputs("Couldn't allocate memory for frame ring reader\n", stderr);
+		munmap((void *)header, info.st_size);
+		return NULL;
+	}
+	reader->header = header;
+	reader->size = info.st_size;
+	reader->mode = mode;
+	// Start with the frames published from now on
+	reader->next_index = atomic_load_explicit(
+	    (_Atomic uint64_t *)&header->published, memory_order_acquire);
+	return reader;
+}
+
+// Describes frame @index in @frame_out. Returns false if its slot has been or
+// is being overwritten.
+static bool read_slot(const xg_frame_ring_reader *reader, uint64_t index,
+		      xg_frame_ring_frame *frame_out)
+{
+	const ring_header *header = reader->header;
+	uint32_t slot_number = index % header->n_slots;
+	slot_header *slot = get_slot(header, slot_number);
+	uint32_t lock = atomic_load_explicit(&slot->lock, memory_order_acquire);
+	if (lock % 2 != 0)
+	{
+		return false;
+	}
+	slot_header copy;
+	memcpy((uint8_t *)&copy + sizeof(copy.lock),
+	       (const uint8_t *)slot + sizeof(copy.lock),
+	       sizeof(copy) - sizeof(copy.lock));
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&slot->lock, memory_order_relaxed) != lock ||
+	    copy.index != index)
+	{
+		return false;
+	}
+
+	// The producer is trusted, but a bad header mustn't send the reader
+	// outside the slot
+	if (copy.size > header->data_capacity || copy.n_planes < 1 ||
+	    copy.n_planes > XG_FRAME_RING_MAX_PLANES)
+	{
+		return false;
+	}
+	for (int32_t i = 0; i < copy.n_planes; ++i)
+	{
+		if (copy.offsets[i] >= copy.size)
+		{
+			return false;
+		}
+	}
+
+	memcpy(frame_out->format, copy.format, sizeof(frame_out->format));
+	frame_out->format[sizeof(frame_out->format) - 1] = '\0';
+	frame_out->width = copy.width;
+	frame_out->height = copy.height;
+	frame_out->sequence = copy.sequence;
+	frame_out->pts = copy.pts;
+	frame_out->published_ns = copy.published_ns;
+	frame_out->data = slot_data(slot);
+	frame_out->size = copy.size;
+	frame_out->n_planes = copy.n_planes;
+	for (int32_t i = 0; i < copy.n_planes; ++i)
+	{
+		frame_out->planes[i] = frame_out->data + copy.offsets[i];
+		frame_out->strides[i] = copy.strides[i];
+	}
+	frame_out->slot = slot_number;
+	frame_out->lock = lock;
+	return true;
+}
+
+xg_frame_ring_status xg_frame_ring_reader_next(xg_frame_ring_reader *reader,
+					       int32_t timeout_ms,
+					       xg_frame_ring_frame *frame_out)
+{
+	const ring_header *header = reader->header;
+	atomic_uint *wakeups = (atomic_uint *)&header->wakeups;
+	_Atomic uint64_t *published = (_Atomic uint64_t *)&header->published;
+	uint64_t deadline = monotonic_ns() + (uint64_t)timeout_ms * 1000000;
+	for (;;)
+	{
+		// Read the futex word first, so a frame published after the
+		// check below still wakes us up
+		uint32_t seen = atomic_load_explicit(wakeups, memory_order_acquire);
+		uint64_t available =
+		    atomic_load_explicit(published, memory_order_acquire);
+		if (available > reader->next_index)
+		{
+			uint64_t index = available - 1;
+			if (reader->mode == XG_FRAME_RING_IN_ORDER)
+			{
+				// Frames older than a full ring are gone
+				uint64_t oldest = available > header->n_slots
+						      ? available - header->n_slots
+						      : 0;
+				index = reader->next_index > oldest
+					    ? reader->next_index
+					    : oldest;
+			}
+			if (read_slot(reader, index, frame_out))
+			{
+				frame_out->dropped = reader->skipped + index -
+						     reader->next_index;
+				reader->skipped = 0;
+				reader->next_index = index + 1;
+				return XG_FRAME_RING_FRAME;
+			}
+			if (reader->mode == XG_FRAME_RING_IN_ORDER)
+			{
+				// It was being overwritten, so it's lost
+				reader->skipped += index + 1 - reader->next_index;
+				reader->next_index = index + 1;
+			}
+			continue;
+		}
+		if (atomic_load_explicit((atomic_uint *)&header->closed,
+					 memory_order_acquire))
+		{
+			return XG_FRAME_RING_CLOSED;
+		}
+
+		struct timespec wait;
+		struct timespec *wait_for = NULL;
+		if (timeout_ms >= 0)
+		{
+			uint64_t now = monotonic_ns();
+			if (now >= deadline)
+			{
+				return XG_FRAME_RING_TIMEOUT;
+			}
+			wait.tv_sec = (deadline - now) / 1000000000;
+			wait.tv_nsec = (deadline - now) % 1000000000;
+			wait_for = &wait;
+		}
+		syscall(SYS_futex, wakeups, FUTEX_WAIT, seen, wait_for, NULL, 0);
+	}
+}
+
+bool xg_frame_ring_reader_check(const xg_frame_ring_reader *reader,
+				const xg_frame_ring_frame *frame)
+{
+	slot_header *slot = get_slot(reader->header, frame->slot);
+	// Everything read from the frame happens before the lock is read again
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&slot->lock, memory_order_relaxed) ==
+	       frame->lock;
+}
+
+void xg_frame_ring_reader_close(xg_frame_ring_reader *reader)
+{
+	if (reader == NULL)
+	{
+		return;
+	}
+	munmap((void *)reader->header, reader->size);
+	free(reader);
+}
@@ -0,0 +1,104 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_FRAME_RING_H__
+#define __COMMON_UTIL_FRAME_RING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Shares the frames one process captures with any number of others, through a
+// ring of fixed-size slots in POSIX shared memory (/dev/shm/<name>). Only one
+// process can own the camera, but a recorder or a health monitor can read the
+// same frames from the ring without capturing anything themselves.
+//
+// The producer copies each frame into the next slot, overwriting the oldest,
+// and never waits for readers. Every slot header is a seqlock: its lock count
+// is odd while the slot is being written, and goes up by two with every frame,
+// so a reader can tell whether the slot changed under it. Readers map the ring
+// read-only and use the frames in place, checking afterwards that they weren't
+// overwritten in the meantime (see xg_frame_ring_reader_check()).
+struct xg_frame;
+
+// Producer side
+typedef struct xg_frame_ring xg_frame_ring;
+
+// Creates (or replaces) the ring @name with @n_slots slots. Each slot is sized
+// for the first frame published. Returns NULL and prints a message to stderr
+// on failure.
+xg_frame_ring *xg_frame_ring_create(const char *name, int32_t n_slots);
+// Copies @frame into the next slot and wakes up waiting readers. Frames larger
+// than the first one are skipped with a warning. Returns false if the ring
+// couldn't be set up.
+bool xg_frame_ring_publish(xg_frame_ring *ring, const struct xg_frame *frame);
+// Tells readers that no more frames are coming and removes the ring's name
+void xg_frame_ring_free(xg_frame_ring *ring);
+
+// Reader side
+typedef struct xg_frame_ring_reader xg_frame_ring_reader;
+
+typedef enum xg_frame_ring_mode
+{
+	// Every read returns the newest frame, skipping whatever came before it,
+	// for readers that only care about the current picture
+	XG_FRAME_RING_LATEST,
+	// Reads go through the frames in order, skipping only those overwritten
+	// before they were read, for readers such as recorders
+	XG_FRAME_RING_IN_ORDER,
+} xg_frame_ring_mode;
+
+typedef enum xg_frame_ring_status
+{
+	XG_FRAME_RING_FRAME,
+	XG_FRAME_RING_TIMEOUT,
+	// The producer has gone away
+	XG_FRAME_RING_CLOSED,
+} xg_frame_ring_status;
+
+enum
+{
+	XG_FRAME_RING_MAX_PLANES = 3
+};
+
+// A frame as it sits in the ring. Everything points into the shared memory.
+typedef struct xg_frame_ring_frame
+{
+	// Video format, e.g. "RGB", "YUY2" or "NV12"
+	char format[8];
+	int32_t width, height;
+	// The producer's xg_frame sequence number and presentation timestamp
+	// (UINT64_MAX if the source doesn't have one), and the CLOCK_MONOTONIC
+	// time it was published at
+	uint64_t sequence;
+	uint64_t pts;
+	uint64_t published_ns;
+	// Frames the reader missed since the one it read before
+	uint64_t dropped;
+	const uint8_t *data;
+	size_t size;
+	int32_t n_planes;
+	const uint8_t *planes[XG_FRAME_RING_MAX_PLANES];
+	int32_t strides[XG_FRAME_RING_MAX_PLANES];
+
+	// Slot the frame is in, and its lock count when it was read
+	uint32_t slot;
+	uint32_t lock;
+} xg_frame_ring_frame;
+
+// Maps the ring @name read-only. Returns NULL and prints a message to stderr
+// if there is no such ring yet.
+xg_frame_ring_reader *xg_frame_ring_reader_open(const char *name,
+						xg_frame_ring_mode mode);
+// Waits up to @timeout_ms (-1 for ever) for a frame the reader hasn't seen and
+// describes it in @frame_out
+xg_frame_ring_status xg_frame_ring_reader_next(xg_frame_ring_reader *reader,
+					       int32_t timeout_ms,
+					       xg_frame_ring_frame *frame_out);
+// Returns true if @frame is still intact, i.e. the producer hasn't started
+// overwriting it since it was read. Call this after using the frame's data, and
+// discard whatever was computed from it otherwise.
+bool xg_frame_ring_reader_check(const xg_frame_ring_reader *reader,
+				const xg_frame_ring_frame *frame);
+void xg_frame_ring_reader_close(xg_frame_ring_reader *reader);
+
+#endif  // __COMMON_UTIL_FRAME_RING_H__
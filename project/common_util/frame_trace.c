@@ -0,0 +1,458 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+// pthread_getname_np
+#define _GNU_SOURCE
+
+#include "frame_trace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency_histogram.h"
+
+// Events held per thread. At 30 frames a second this is over a minute of
+// history for every thread.
+enum
+{
+	RING_CAPACITY = 1 << 14,
+	THREAD_NAME_LENGTH = 32,
+};
+
+static const char *const STAGE_NAMES[XG_TRACE_STAGE_COUNT] = {
+	[XG_TRACE_PULL_SAMPLE] = "pull_sample",
+	[XG_TRACE_COPY_FRAME] = "copy_frame",
+	[XG_TRACE_CREATE_INPUT] = "create_input",
+	[XG_TRACE_EVALUATE] = "evaluate",
+	[XG_TRACE_BUILD_OVERLAYS] = "build_overlays",
+	[XG_TRACE_DRAW] = "draw",
+	[XG_TRACE_CAPTURE_TO_INFERENCE] = "capture_to_infer",
+	[XG_TRACE_CAPTURE_TO_DRAWN] = "capture_to_drawn",
+	[XG_TRACE_OVERLAY_LAG] = "overlay_lag",
+};
+
+// Latencies overlap each other on the thread that records them, which
+// complete events can't, so they are exported as async spans with a track of
+// their own
+static bool is_latency(uint32_t stage)
+{
+	return stage >= XG_TRACE_CAPTURE_TO_INFERENCE;
+}
+
+typedef struct trace_event
+{
+	uint64_t start;
+	uint64_t end;
+	uint64_t frame;
+	uint32_t stage;
+} trace_event;
+
+// Only the owning thread writes to a ring; readers copy events out and then
+// check whether the writer might have overwritten any of them meanwhile, like
+// a seqlock.
+typedef struct trace_ring
+{
+	struct trace_ring *next;
+	int32_t id;
+	char name[THREAD_NAME_LENGTH];
+	// Number of events the writer has started writing
+	_Atomic uint64_t claimed;
+	// Number of events completely written. The newest is at
+	// (head - 1) % RING_CAPACITY.
+	_Atomic uint64_t head;
+	// First event of the current tracing session
+	uint64_t session_start;
+	// Events before this have been counted in a summary
+	uint64_t summarized;
+	trace_event events[RING_CAPACITY];
+} trace_ring;
+
+static atomic_bool enabled;
+static uint64_t session_start_time;
+
+// Rings are created on each thread's first event and never freed, since a
+// thread may still be recording when tracing stops. rings_lock only guards the
+// list itself and the readers' cursors.
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *rings;
+static int32_t n_rings;
+static _Thread_local trace_ring *thread_ring;
+
+static pthread_mutex_t summary_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t summary_wake;
+static pthread_t summary_thread;
+static bool summary_running;
+static bool summary_stopping;
+static double summary_interval;
+
+uint64_t xg_trace_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+bool xg_trace_enabled(void)
+{
+	return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+static trace_ring *get_thread_ring(void)
+{
+	if (thread_ring != NULL)
+	{
+		return thread_ring;
+	}
+	trace_ring *ring = calloc(1, sizeof(trace_ring));
+	if (ring == NULL)
+	{
+		return NULL;
+	}
+	pthread_mutex_lock(&rings_lock);
+	ring->id = n_rings++;
+	// GStreamer names its streaming threads after their elements, which is
+	// as good a default as any
+	if (pthread_getname_np(pthread_self(), ring->name,
+			       sizeof(ring->name)) != 0 ||
+	    ring->name[0] == '\0')
+	{
+		snprintf(ring->name, sizeof(ring->name), "thread %d", ring->id);
+	}
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+	thread_ring = ring;
+	return ring;
+}
+
+void xg_trace_set_thread_name(const char *name)
+{
+	trace_ring *ring = get_thread_ring();
+	if (ring == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock(&rings_lock);
+	snprintf(ring->name, sizeof(ring->name), "%s", name);
+	pthread_mutex_unlock(&rings_lock);
+}
+
+void xg_trace_record(xg_trace_stage stage, uint64_t start, uint64_t frame)
+{
+	if (!xg_trace_enabled())
+	{
+		return;
+	}
+	uint64_t end = xg_trace_now();
+	trace_ring *ring = get_thread_ring();
+	if (ring == NULL)
+	{
+		return;
+	}
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	trace_event *event = &ring->events[head % RING_CAPACITY];
+	atomic_store_explicit(&ring->claimed, head + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	__atomic_store_n(&event->start, start, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->end, end, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->frame, frame, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->stage, (uint32_t)stage, __ATOMIC_RELAXED);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Copies the events @ring recorded from event number *@from onwards (or as
+// many of those as it still holds) into @out, which has room for RING_CAPACITY
+// events, and advances *@from past them. Returns the number copied.
+// Called with rings_lock held.
+static int32_t copy_events(trace_ring *ring, uint64_t *from, trace_event *out)
+{
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t first = *from;
+	if (head - first > RING_CAPACITY)
+	{
+		first = head - RING_CAPACITY;
+	}
+	for (uint64_t i = first; i < head; ++i)
+	{
+		const trace_event *event = &ring->events[i % RING_CAPACITY];
+		trace_event *copy = &out[i - first];
+		copy->start = __atomic_load_n(&event->start, __ATOMIC_RELAXED);
+		copy->end = __atomic_load_n(&event->end, __ATOMIC_RELAXED);
+		copy->frame = __atomic_load_n(&event->frame, __ATOMIC_RELAXED);
+		copy->stage = __atomic_load_n(&event->stage, __ATOMIC_RELAXED);
+	}
+	*from = head;
+
+	// Event i is overwritten by event i + RING_CAPACITY, so drop any whose
+	// replacement the writer had started on by the time we were done
+	atomic_thread_fence(memory_order_acquire);
+	uint64_t claimed =
+	    atomic_load_explicit(&ring->claimed, memory_order_relaxed);
+	uint64_t valid_from =
+	    claimed > RING_CAPACITY ? claimed - RING_CAPACITY : 0;
+	int32_t count = (int32_t)(head - first);
+	if (valid_from > first)
+	{
+		int32_t torn = (int32_t)(valid_from - first);
+		torn = torn < count ? torn : count;
+		memmove(out, out + torn, (count - torn) * sizeof(trace_event));
+		count -= torn;
+	}
+	return count;
+}
+
+static void print_summary(trace_event *scratch, double elapsed)
+{
+	static latency_histogram histograms[XG_TRACE_STAGE_COUNT];
+	for (int i = 0; i < XG_TRACE_STAGE_COUNT; ++i)
+	{
+		latency_histogram_reset(&histograms[i]);
+	}
+
+	pthread_mutex_lock(&rings_lock);
+	for (trace_ring *ring = rings; ring != NULL; ring = ring->next)
+	{
+		int32_t count = copy_events(ring, &ring->summarized, scratch);
+		for (int32_t i = 0; i < count; ++i)
+		{
+			if (scratch[i].stage < XG_TRACE_STAGE_COUNT)
+			{
+				latency_histogram_record(
+				    &histograms[scratch[i].stage],
+				    scratch[i].end - scratch[i].start);
+			}
+		}
+	}
+	pthread_mutex_unlock(&rings_lock);
+
+	uint64_t total = 0;
+	for (int i = 0; i < XG_TRACE_STAGE_COUNT; ++i)
+	{
+		total += histograms[i].total_count;
+	}
+	if (total == 0)
+	{
+		return;
+	}
+	fprintf(stderr, "Frame timing over the last %.1f s (ms):\n", elapsed);
+	for (int i = 0; i < XG_TRACE_STAGE_COUNT; ++i)
+	{
+		const latency_histogram *histogram = &histograms[i];
+		if (histogram->total_count == 0)
+		{
+			continue;
+		}
+		fprintf(stderr,
+			"  %-17s %6.1f/s  mean %7.2f  p50 %7.2f  p99 %7.2f  "
+			"max %7.2f\n",
+			STAGE_NAMES[i], histogram->total_count / elapsed,
+			latency_histogram_mean(histogram) / 1e6,
+			latency_histogram_percentile(histogram, 50) / 1e6,
+			latency_histogram_percentile(histogram, 99) / 1e6,
+			latency_histogram_percentile(histogram, 100) / 1e6);
+	}
+}
+
+static void *summary_main(void *unused)
+{
+	trace_event *scratch = malloc(RING_CAPACITY * sizeof(trace_event));
+	if (scratch == NULL)
+	{
+		fputs("Couldn't allocate memory for the trace summary\n", stderr);
+		return NULL;
+	}
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	uint64_t last = xg_trace_now();
+
+	pthread_mutex_lock(&summary_lock);
+	while (!summary_stopping)
+	{
+		uint64_t interval_ns = (uint64_t)(summary_interval * 1e9);
+		deadline.tv_sec += (deadline.tv_nsec + interval_ns) / 1000000000;
+		deadline.tv_nsec = (deadline.tv_nsec + interval_ns) % 1000000000;
+		while (!summary_stopping &&
+		       pthread_cond_timedwait(&summary_wake, &summary_lock,
+					      &deadline) != ETIMEDOUT)
+		{
+		}
+		if (summary_stopping)
+		{
+			break;
+		}
+		pthread_mutex_unlock(&summary_lock);
+		uint64_t now = xg_trace_now();
+		print_summary(scratch, (now - last) / 1e9);
+		last = now;
+		pthread_mutex_lock(&summary_lock);
+	}
+	pthread_mutex_unlock(&summary_lock);
+	free(scratch);
+	return NULL;
+}
+
+bool xg_trace_start(double interval)
+{
+	if (xg_trace_enabled())
+	{
+		return true;
+	}
+	// Each session only reports its own events
+	pthread_mutex_lock(&rings_lock);
+	for (trace_ring *ring = rings; ring != NULL; ring = ring->next)
+	{
+		ring->session_start = ring->summarized =
+		    atomic_load_explicit(&ring->head, memory_order_acquire);
+	}
+	pthread_mutex_unlock(&rings_lock);
+	session_start_time = xg_trace_now();
+	atomic_store(&enabled, true);
+
+	if (interval <= 0)
+	{
+		return true;
+	}
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&summary_wake, &attr);
+	pthread_condattr_destroy(&attr);
+	summary_interval = interval;
+	summary_stopping = false;
+	if (pthread_create(&summary_thread, NULL, summary_main, NULL) != 0)
+	{
+		fputs("Couldn't start trace summary thread\n", stderr);
+		pthread_cond_destroy(&summary_wake);
+		atomic_store(&enabled, false);
+		return false;
+	}
+	summary_running = true;
+	return true;
+}
+
+bool xg_trace_start_from_env(void)
+{
+	const char *interval = getenv("XG_TRACE");
+	if (interval == NULL)
+	{
+		return true;
+	}
+	return xg_trace_start(strtod(interval, NULL));
+}
+
+// Writes the current session as Chrome trace JSON: one complete ("X") event
+// per stage, with timestamps in microseconds since tracing started, plus the
+// name of each thread.
+static bool export_trace(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	trace_event *scratch = malloc(RING_CAPACITY * sizeof(trace_event));
+	if (file == NULL || scratch == NULL)
+	{
+		perror("Error writing trace");
+		if (file != NULL)
+		{
+			fclose(file);
+		}
+		free(scratch);
+		return false;
+	}
+
+	int pid = (int)getpid();
+	bool first = true;
+	uint64_t span_id = 0;
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+	pthread_mutex_lock(&rings_lock);
+	for (trace_ring *ring = rings; ring != NULL; ring = ring->next)
+	{
+		fprintf(file,
+			"%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",", pid, ring->id, ring->name);
+		first = false;
+
+		uint64_t from = ring->session_start;
+		int32_t count = copy_events(ring, &from, scratch);
+		for (int32_t i = 0; i < count; ++i)
+		{
+			const trace_event *event = &scratch[i];
+			if (event->stage >= XG_TRACE_STAGE_COUNT ||
+			    event->start < session_start_time)
+			{
+				continue;
+			}
+			double start = (event->start - session_start_time) / 1e3;
+			double end = (event->end - session_start_time) / 1e3;
+			if (is_latency(event->stage))
+			{
+				// A frame's overlays can be drawn many times, so spans
+				// get ids of their own
+				++span_id;
+				fprintf(file,
+					",\n{\"name\":\"%s\",\"cat\":\"latency\","
+					"\"ph\":\"b\",\"id\":%" PRIu64 ",\"pid\":%d,"
+					"\"tid\":%d,\"ts\":%.3f,"
+					"\"args\":{\"frame\":%" PRIu64 "}}"
+					",\n{\"name\":\"%s\",\"cat\":\"latency\","
+					"\"ph\":\"e\",\"id\":%" PRIu64 ",\"pid\":%d,"
+					"\"tid\":%d,\"ts\":%.3f}",
+					STAGE_NAMES[event->stage], span_id, pid, ring->id,
+					start, event->frame, STAGE_NAMES[event->stage],
+					span_id, pid, ring->id, end);
+				continue;
+			}
+			fprintf(file,
+				",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\","
+				"\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+				STAGE_NAMES[event->stage], pid, ring->id, start,
+				end - start);
+			if (event->frame != XG_TRACE_NO_FRAME)
+			{
+				fprintf(file, ",\"args\":{\"frame\":%" PRIu64 "}",
+					event->frame);
+			}
+			fputc('}', file);
+		}
+	}
+	pthread_mutex_unlock(&rings_lock);
+	fputs("\n]}\n", file);
+	free(scratch);
+	if (fclose(file) != 0)
+	{
+		perror("Error writing trace");
+		return false;
+	}
+	fprintf(stderr, "Wrote frame trace to %s\n", path);
+	return true;
+}
+
+bool xg_trace_stop(const char *export_path)
+{
+	if (!xg_trace_enabled())
+	{
+		return true;
+	}
+	atomic_store(&enabled, false);
+	if (summary_running)
+	{
+		pthread_mutex_lock(&summary_lock);
+		summary_stopping = true;
+		pthread_cond_signal(&summary_wake);
+		pthread_mutex_unlock(&summary_lock);
+		pthread_join(summary_thread, NULL);
+		pthread_cond_destroy(&summary_wake);
+		summary_running = false;
+	}
+	return export_path == NULL || export_trace(export_path);
+}
+
+bool xg_trace_stop_from_env(void)
+{
+	return xg_trace_stop(getenv("XG_TRACE_FILE"));
+}
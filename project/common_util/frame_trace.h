@@ -0,0 +1,94 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_FRAME_TRACE_H__
+#define __COMMON_UTIL_FRAME_TRACE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Lightweight timing of every stage a frame goes through, from pulling it out
+// of the pipeline to drawing its overlays. Each thread records into its own
+// fixed-size ring of events, so recording never locks or allocates (apart from
+// setting up the ring on a thread's first event) and costs one atomic load when
+// tracing is off.
+//
+// While tracing, a background thread can print a per-stage latency summary
+// every few seconds, and when tracing stops the events still in the rings can
+// be exported as Chrome trace JSON, which chrome://tracing and
+// https://ui.perfetto.dev open as a timeline.
+//
+// xg_runner_run() traces by itself when the XG_TRACE environment variable is
+// set: XG_TRACE=5 prints a summary every 5 seconds (0 for none), and
+// XG_TRACE_FILE=trace.json exports the timeline when the runner finishes.
+
+typedef enum xg_trace_stage
+{
+	// Waiting for the appsink to hand over the next sample
+	XG_TRACE_PULL_SAMPLE,
+	// Mapping or copying the sample into an xg_frame
+	XG_TRACE_COPY_FRAME,
+	// Creating the model's input from the frame
+	XG_TRACE_CREATE_INPUT,
+	XG_TRACE_EVALUATE,
+	// Turning the evaluation result into overlays and publishing them
+	XG_TRACE_BUILD_OVERLAYS,
+	// Drawing the overlays onto a video frame
+	XG_TRACE_DRAW,
+	// The rest measure how stale results are rather than work done on the
+	// recording thread. Each runs from the moment a frame was captured (as
+	// timestamped by its source) until its overlays were published...
+	XG_TRACE_CAPTURE_TO_INFERENCE,
+	// ...and until they were first drawn on the video
+	XG_TRACE_CAPTURE_TO_DRAWN,
+	// How far the frame the overlays came from trails the video frame they
+	// are drawn on, recorded for every drawn frame
+	XG_TRACE_OVERLAY_LAG,
+	XG_TRACE_STAGE_COUNT,
+} xg_trace_stage;
+
+// Frame number to record for events that don't belong to a known frame
+#define XG_TRACE_NO_FRAME UINT64_MAX
+
+// Starts recording events. If @summary_interval is positive, a background
+// thread prints a summary of the stages completed in each interval of that many
+// seconds to stderr. Returns false if tracing couldn't be started.
+bool xg_trace_start(double summary_interval);
+
+// Like xg_trace_start(), configured from the XG_TRACE environment variable as
+// described above. Does nothing and returns true when it isn't set.
+bool xg_trace_start_from_env(void);
+
+// Stops recording and the summary thread. If @export_path isn't NULL, writes
+// every event still held in the rings there as Chrome trace JSON.
+bool xg_trace_stop(const char *export_path);
+
+// Stops recording, exporting to XG_TRACE_FILE if it is set
+bool xg_trace_stop_from_env(void);
+
+bool xg_trace_enabled(void);
+
+// Monotonic clock in nanoseconds, the time base of every event
+uint64_t xg_trace_now(void);
+
+// Records that the calling thread spent from @start (an xg_trace_now() value)
+// until now in @stage, working on frame number @frame
+void xg_trace_record(xg_trace_stage stage, uint64_t start, uint64_t frame);
+
+// Names the calling thread in summaries and exported timelines
+void xg_trace_set_thread_name(const char *name);
+
+// Shorthand for timing a stage only when tracing is on:
+//   uint64_t start = XG_TRACE_BEGIN();
+//   ...
+//   XG_TRACE_END(XG_TRACE_EVALUATE, start, frame->sequence);
+#define XG_TRACE_BEGIN() (xg_trace_enabled() ? xg_trace_now() : 0)
+#define XG_TRACE_END(stage, start, frame)                                      \
+	do                                                                     \
+	{                                                                      \
+		if ((start) != 0)                                              \
+		{                                                              \
+			xg_trace_record((stage), (start), (frame));            \
+		}                                                              \
+	} while (0)
+
+#endif // __COMMON_UTIL_FRAME_TRACE_H__
@@ -1,17 +1,21 @@
 // Copyright (c) 2019 Xnor.ai, Inc.
 //
+#include <dirent.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
+#include <strings.h>
 
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <glib-object.h>
 #include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
 #include <gst/gst.h>
+#include <gst/video/video.h>
 #include <gst/video/videooverlay.h>
 #include <gtk/gtk.h>
 #include <pthread.h>
@@ -24,10 +28,24 @@
 #error "Wayland is not supported in GTK+"
 #endif
 
+#include "frame_pool.h"
+#include "frame_trace.h"
 #include "gstreamer_video_pipeline.h"
+#include "overlay_raster.h"
+#include "settings.h"
+#include "startup_profile.h"
 
 static void on_destroy_event(GtkWidget *widget, gpointer user_data);
 
+// Caps requested from the appsink branch. The native caps list the formats an
+// xnor_input can be created from directly; videoconvert passes any of them
+// through untouched and only converts other camera formats.
+static const char *const APPSINK_RGB_CAPS = "video/x-raw,format=RGB";
+static const char *const APPSINK_NATIVE_CAPS =
+    "video/x-raw,format={ YUY2, NV12, NV21, I420, RGB }";
+// What the overlay branch's converter must be able to produce
+static const char *const OVERLAY_CAPS = "video/x-raw,format={ BGRx, BGRA }";
+
 ///////////////////
 // COLLABORA
 //////////////////
@@ -111,6 +129,138 @@ static void release_mutex_or_die(pthread_mutex_t *mutex)
 	}
 }
 
+/////////////////
+// Overlay sets
+/////////////////
+
+// A complete list of overlays, published to the draw callback as a unit
+typedef struct xg_overlay_set
+{
+	xg_overlay *head;
+	// Where the overlays were allocated, if they came from an arena
+	xg_arena *arena;
+	// The frame the overlays were made from, if any
+	uint64_t sequence;
+	GstClockTime pts;
+	GstClockTime running_time;
+	// Whether the set has been drawn at least once
+	atomic_bool drawn;
+} xg_overlay_set;
+
+static void free_overlay_list(xg_overlay *item)
+{
+	while (item != NULL)
+	{
+		xg_overlay *next = item->next;
+		xg_overlay_free(item);
+		item = next;
+	}
+}
+
+static void free_overlay_set(xg_pipeline *pipeline, xg_overlay_set *set)
+{
+	if (set == NULL)
+	{
+		return;
+	}
+	free_overlay_list(set->head);
+	xg_pipeline_release_arena(pipeline, set->arena);
+	free(set);
+}
+
+// Pins the current overlay set so it isn't freed while being drawn. Only the
+// draw callback may call this, and must call release_overlays() when done.
+static xg_overlay_set *acquire_overlays(xg_pipeline *pipeline)
+{
+	xg_overlay_set *set = atomic_load(&pipeline->overlays);
+	for (;;)
+	{
+		atomic_store(&pipeline->overlays_hazard, set);
+		// Re-check after announcing: if it was swapped out in the meantime,
+		// the publisher may not have seen our hazard, so try again.
+		xg_overlay_set *current = atomic_load(&pipeline->overlays);
+		if (current == set)
+		{
+			return set;
+		}
+		set = current;
+	}
+}
+
+static void release_overlays(xg_pipeline *pipeline)
+{
+	atomic_store(&pipeline->overlays_hazard, NULL);
+}
+
+// Makes @set the current overlay set, freeing the previous one unless the draw
+// callback is still using it. At most one set is ever left waiting.
+static void publish_overlays(xg_pipeline *pipeline, xg_overlay_set *set)
+{
+	xg_overlay_set *old = atomic_exchange(&pipeline->overlays, set);
+	xg_overlay_set *in_use = atomic_load(&pipeline->overlays_hazard);
+	xg_overlay_set *retired = pipeline->retired_overlays;
+	pipeline->retired_overlays = NULL;
+
+	if (retired == in_use)
+	{
+		pipeline->retired_overlays = retired;
+	}
+	else
+	{
+		free_overlay_set(pipeline, retired);
+	}
+	if (old == in_use && old != NULL)
+	{
+		// The hazard is a single pointer, so @retired can't also be in use
+		pipeline->retired_overlays = old;
+	}
+	else
+	{
+		free_overlay_set(pipeline, old);
+	}
+}
+
+// Records a trace event spanning from the capture of the frame at
+// @running_time until now
+static void trace_since_capture(xg_pipeline *pipeline, xg_trace_stage stage,
+				GstClockTime running_time, uint64_t sequence)
+{
+	if (!xg_trace_enabled() || !GST_CLOCK_TIME_IS_VALID(running_time))
+	{
+		return;
+	}
+	GstClockTime now = xg_pipeline_running_time(pipeline);
+	if (!GST_CLOCK_TIME_IS_VALID(now) || now < running_time)
+	{
+		return;
+	}
+	// The pipeline clock needn't be the trace clock, so only the age of the
+	// frame carries over
+	xg_trace_record(stage, xg_trace_now() - (now - running_time), sequence);
+}
+
+// Records how stale @set is when drawn on the video frame with PTS @timestamp
+static void trace_overlays_drawn(xg_pipeline *pipeline, xg_overlay_set *set,
+				 GstClockTime timestamp)
+{
+	if (set == NULL || !xg_trace_enabled())
+	{
+		return;
+	}
+	if (!atomic_exchange(&set->drawn, true))
+	{
+		trace_since_capture(pipeline, XG_TRACE_CAPTURE_TO_DRAWN,
+				    set->running_time, set->sequence);
+	}
+	if (GST_CLOCK_TIME_IS_VALID(timestamp) &&
+	    GST_CLOCK_TIME_IS_VALID(set->pts) && timestamp >= set->pts)
+	{
+		xg_trace_record(XG_TRACE_OVERLAY_LAG,
+				xg_trace_now() - (timestamp - set->pts),
+				set->sequence);
+	}
+}
+
 //////////////
 // Callbacks
 //////////////
@@ -120,27 +270,96 @@ static void draw_overlays(GstElement *gst_overlay, cairo_t *cr,
 			  gpointer user_data)
 {
 	xg_pipeline *pipeline = (xg_pipeline *)user_data;
+	uint64_t trace_start = XG_TRACE_BEGIN();
 
-	acquire_mutex_or_die(&pipeline->overlay_lock);
-	// Got the lock, now draw the overlays
 	cairo_surface_t *surface = cairo_get_target(cr);
 	if (cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE)
 	{
 		errorf(pipeline, "Unexpected surface type %d when drawing overlays",
 		       cairo_surface_get_type(surface));
-		release_mutex_or_die(&pipeline->overlay_lock);
 		return;
 	}
 	int32_t surface_width = cairo_image_surface_get_width(surface);
 	int32_t surface_height = cairo_image_surface_get_height(surface);
 
-	xg_overlay *overlay = pipeline->overlay_list;
-	while (overlay != NULL)
+	xg_overlay_set *set = acquire_overlays(pipeline);
+	if (set != NULL)
+	{
+		xg_startup_mark(XG_STARTUP_FIRST_OVERLAY);
+	}
+	trace_overlays_drawn(pipeline, set, timestamp);
+	// A published set is never modified, so it can be walked without any
+	// further synchronization
+	for (xg_overlay *overlay = set ? set->head : NULL; overlay != NULL;
+	     overlay = overlay->next)
+	{
+		xg_overlay_draw_cached(overlay, pipeline->label_cache, cr,
+				       surface_width, surface_height);
+	}
+	release_overlays(pipeline);
+	XG_TRACE_END(XG_TRACE_DRAW, trace_start, XG_TRACE_NO_FRAME);
+}
+
+// Parses the caps on @pad if they changed since the last frame
+static bool update_direct_info(xg_pipeline *pipeline, GstPad *pad)
+{
+	GstCaps *caps = gst_pad_get_current_caps(pad);
+	if (caps == NULL)
+	{
+		return false;
+	}
+	bool ok = true;
+	if (caps != pipeline->direct_caps)
+	{
+		ok = gst_video_info_from_caps(&pipeline->direct_info, caps);
+		gst_caps_replace(&pipeline->direct_caps, ok ? caps : NULL);
+	}
+	gst_caps_unref(caps);
+	return ok;
+}
+
+// Buffer probe on the display branch that draws overlays straight into the
+// video, in place of cairooverlay. See xg_pipeline_set_direct_overlays().
+static GstPadProbeReturn draw_overlays_direct(GstPad *pad,
+					      GstPadProbeInfo *info,
+					      gpointer user_data)
+{
+	xg_pipeline *pipeline = (xg_pipeline *)user_data;
+	uint64_t trace_start = XG_TRACE_BEGIN();
+
+	xg_overlay_set *set = acquire_overlays(pipeline);
+	if (set != NULL)
+	{
+		xg_startup_mark(XG_STARTUP_FIRST_OVERLAY);
+	}
+	if (set == NULL || set->head == NULL)
+	{
+		// Nothing to draw, so no need to touch the buffer
+		release_overlays(pipeline);
+		return GST_PAD_PROBE_OK;
+	}
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	trace_overlays_drawn(pipeline, set, GST_BUFFER_PTS(buffer));
+	if (!update_direct_info(pipeline, pad))
+	{
+		release_overlays(pipeline);
+		return GST_PAD_PROBE_OK;
+	}
+
+	// The tee hands the same buffer to the appsink branch, which may still
+	// be reading it, so this copies it unless nothing else holds it
+	buffer = gst_buffer_make_writable(buffer);
+	GST_PAD_PROBE_INFO_DATA(info) = buffer;
+	GstVideoFrame frame;
+	if (gst_video_frame_map(&frame, &pipeline->direct_info, buffer,
+				GST_MAP_WRITE))
 	{
-		xg_overlay_draw(overlay, cr, surface_width, surface_height);
-		overlay = overlay->next;
+		xg_raster_draw_overlays(&frame, set->head, pipeline->label_cache);
+		gst_video_frame_unmap(&frame);
 	}
-	release_mutex_or_die(&pipeline->overlay_lock);
+	release_overlays(pipeline);
+	XG_TRACE_END(XG_TRACE_DRAW, trace_start, XG_TRACE_NO_FRAME);
+	return GST_PAD_PROBE_OK;
 }
 
 static gboolean on_key_press_event(GtkWidget *widget, GdkEvent *event,
@@ -297,6 +516,339 @@ static void link_elements(xg_pipeline *pipeline, GstElement *src,
 	}
 }
 
+// Hardware colour converters to try before falling back to videoconvert,
+// best first: the i.MX 2D engine, then any V4L2 memory-to-memory converter.
+// Both also scale, which videoconvert can't.
+static const char *const HARDWARE_CONVERTERS[] = {
+    "imxvideoconvert_g2d",
+    "v4l2convert",
+};
+
+// Whether the converter @type is installed and its src pad template can
+// produce @output_caps
+static bool converter_can_output(const char *type, const char *output_caps)
+{
+	GstElementFactory *factory = gst_element_factory_find(type);
+	if (factory == NULL)
+	{
+		return false;
+	}
+	bool can_output = true;
+	if (output_caps != NULL)
+	{
+		GstCaps *caps = gst_caps_from_string(output_caps);
+		can_output = gst_element_factory_can_src_any_caps(factory, caps);
+		gst_caps_unref(caps);
+	}
+	gst_object_unref(factory);
+	return can_output;
+}
+
+// Makes the best colour converter available on this system, preferring
+// hardware. Hardware converters only handle some formats, so those that
+// can't produce @output_caps (NULL for any) are passed over; videoconvert
+// produces everything. Sets *@scales_out to whether it can also scale.
+static GstElement *make_converter(xg_pipeline *pipeline, const char *name,
+				  const char *output_caps, bool *scales_out)
+{
+	for (size_t i = 0; i < G_N_ELEMENTS(HARDWARE_CONVERTERS); ++i)
+	{
+		if (!converter_can_output(HARDWARE_CONVERTERS[i], output_caps))
+		{
+			continue;
+		}
+		// Not make_element(), since a converter that's missing here is
+		// no error
+		GstElement *converter =
+		    gst_element_factory_make(HARDWARE_CONVERTERS[i], name);
+		if (converter == NULL)
+		{
+			continue;
+		}
+		if (!gst_bin_add(GST_BIN(pipeline->gst_pipeline), converter))
+		{
+			gst_object_unref(GST_OBJECT(converter));
+			continue;
+		}
+		printf("Using %s for %s\n", HARDWARE_CONVERTERS[i], name);
+		*scales_out = true;
+		return converter;
+	}
+	*scales_out = false;
+	return make_element(pipeline, "videoconvert", name);
+}
+
+// A raw video mode the camera can capture in
+typedef struct camera_mode
+{
+	const char *format;
+	int32_t width, height;
+	// 0/1 if the camera doesn't say
+	int32_t fps_n, fps_d;
+} camera_mode;
+
+// Picks the smallest integer @value allows that is at least @wanted. Returns
+// false if it allows none.
+static bool pick_int(const GValue *value, int32_t wanted, int32_t *out)
+{
+	if (G_VALUE_HOLDS_INT(value))
+	{
+		*out = g_value_get_int(value);
+		return *out >= wanted;
+	}
+	if (GST_VALUE_HOLDS_INT_RANGE(value))
+	{
+		int32_t min = gst_value_get_int_range_min(value);
+		*out = wanted > min ? wanted : min;
+		return *out <= gst_value_get_int_range_max(value);
+	}
+	if (GST_VALUE_HOLDS_LIST(value))
+	{
+		bool found = false;
+		for (guint i = 0; i < gst_value_list_get_size(value); ++i)
+		{
+			int32_t item;
+			if (pick_int(gst_value_list_get_value(value, i), wanted,
+				     &item) &&
+			    (!found || item < *out))
+			{
+				*out = item;
+				found = true;
+			}
+		}
+		return found;
+	}
+	return false;
+}
+
+// Picks the lowest frame rate @value allows that is at least @wanted, or the
+// highest it allows if @wanted is 0. Returns false if it allows none.
+static bool pick_fps(const GValue *value, int32_t wanted, int32_t *n_out,
+		     int32_t *d_out)
+{
+	if (GST_VALUE_HOLDS_FRACTION(value))
+	{
+		*n_out = gst_value_get_fraction_numerator(value);
+		*d_out = gst_value_get_fraction_denominator(value);
+		return (double)*n_out / *d_out >= wanted;
+	}
+	if (GST_VALUE_HOLDS_FRACTION_RANGE(value))
+	{
+		const GValue *min = gst_value_get_fraction_range_min(value);
+		const GValue *max = gst_value_get_fraction_range_max(value);
+		if (!pick_fps(max, wanted, n_out, d_out))
+		{
+			return false;
+		}
+		if (wanted > 0)
+		{
+			int32_t min_n = gst_value_get_fraction_numerator(min);
+			int32_t min_d = gst_value_get_fraction_denominator(min);
+			bool min_enough = (double)min_n / min_d >= wanted;
+			*n_out = min_enough ? min_n : wanted;
+			*d_out = min_enough ? min_d : 1;
+		}
+		return true;
+	}
+	if (GST_VALUE_HOLDS_LIST(value))
+	{
+		bool found = false;
+		for (guint i = 0; i < gst_value_list_get_size(value); ++i)
+		{
+			int32_t n, d;
+			if (!pick_fps(gst_value_list_get_value(value, i), wanted, &n,
+				      &d))
+			{
+				continue;
+			}
+			double rate = (double)n / d;
+			double best = found ? (double)*n_out / *d_out : 0;
+			if (!found || (wanted > 0 ? rate < best : rate > best))
+			{
+				*n_out = n;
+				*d_out = d;
+				found = true;
+			}
+		}
+		return found;
+	}
+	return false;
+}
+
+// Formats the appsink passes straight to the model, which break ties
+// between otherwise equally cheap modes
+static bool is_native_format(const char *format)
+{
+	static const char *const native[] = {"YUY2", "NV12", "NV21", "I420",
+					     "RGB"};
+	for (size_t i = 0; i < G_N_ELEMENTS(native); ++i)
+	{
+		if (strcmp(format, native[i]) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Considers capturing in @format with the sizes and rates of @structure,
+// replacing *@best if that satisfies @config more cheaply
+static void consider_mode(const xg_pipeline_config *config,
+			  const GstStructure *structure, const char *format,
+			  camera_mode *best, double *best_cost)
+{
+	if (config->format != NULL && strcmp(format, config->format) != 0)
+	{
+		return;
+	}
+	camera_mode mode = {format, 0, 0, 0, 1};
+	const GValue *width = gst_structure_get_value(structure, "width");
+	const GValue *height = gst_structure_get_value(structure, "height");
+	const GValue *framerate = gst_structure_get_value(structure, "framerate");
+	if (width == NULL || height == NULL ||
+	    !pick_int(width, config->width, &mode.width) ||
+	    !pick_int(height, config->height, &mode.height))
+	{
+		return;
+	}
+	if (framerate != NULL)
+	{
+		if (!pick_fps(framerate, config->fps, &mode.fps_n, &mode.fps_d))
+		{
+			return;
+		}
+	}
+	else if (config->fps > 0)
+	{
+		return;
+	}
+
+	// Pixels per second is what every later stage pays for. Without a rate
+	// to meet, the highest rate of each size was picked, so only size counts.
+	double cost = (double)mode.width * mode.height;
+	if (config->fps > 0)
+	{
+		cost *= (double)mode.fps_n / mode.fps_d;
+	}
+	if (!is_native_format(format))
+	{
+		cost *= 1.0001;
+	}
+	if (best->format == NULL || cost < *best_cost)
+	{
+		*best = mode;
+		*best_cost = cost;
+	}
+}
+
+// Asks @source which raw modes it supports and picks the cheapest one that
+// satisfies @config. Returns false if the camera couldn't be queried or has no
+// such mode.
+static bool pick_camera_mode(GstElement *source,
+			     const xg_pipeline_config *config,
+			     camera_mode *mode_out)
+{
+	// The device is only opened, and its modes known, from READY on
+	if (gst_element_set_state(source, GST_STATE_READY) ==
+	    GST_STATE_CHANGE_FAILURE)
+	{
+		gst_element_set_state(source, GST_STATE_NULL);
+		return false;
+	}
+	GstPad *pad = gst_element_get_static_pad(source, "src");
+	GstCaps *caps = gst_pad_query_caps(pad, NULL);
+	gst_object_unref(pad);
+
+	camera_mode best = {NULL};
+	double best_cost = 0;
+	for (guint i = 0; caps != NULL && i < gst_caps_get_size(caps); ++i)
+	{
+		const GstStructure *structure = gst_caps_get_structure(caps, i);
+		if (!gst_structure_has_name(structure, "video/x-raw"))
+		{
+			// Compressed modes would need a decoder
+			continue;
+		}
+		const GValue *formats = gst_structure_get_value(structure, "format");
+		if (formats != NULL && G_VALUE_HOLDS_STRING(formats))
+		{
+			consider_mode(config, structure,
+				      g_intern_string(g_value_get_string(formats)),
+				      &best, &best_cost);
+		}
+		else if (formats != NULL && GST_VALUE_HOLDS_LIST(formats))
+		{
+			for (guint j = 0; j < gst_value_list_get_size(formats); ++j)
+			{
+				const GValue *format =
+				    gst_value_list_get_value(formats, j);
+				if (G_VALUE_HOLDS_STRING(format))
+				{
+					consider_mode(
+					    config, structure,
+					    g_intern_string(g_value_get_string(format)),
+					    &best, &best_cost);
+				}
+			}
+		}
+	}
+	if (caps != NULL)
+	{
+		gst_caps_unref(caps);
+	}
+	gst_element_set_state(source, GST_STATE_NULL);
+	*mode_out = best;
+	return best.format != NULL;
+}
+
+// Caps with whichever of the configured size, fps and format are set
+static GstCaps *make_config_caps(const xg_pipeline_config *config)
+{
+	GstCaps *caps = gst_caps_new_empty_simple("video/x-raw");
+	if (config->width > 0 && config->height > 0)
+	{
+		gst_caps_set_simple(caps, "width", G_TYPE_INT, config->width,
+				    "height", G_TYPE_INT, config->height, NULL);
+	}
+	if (config->fps > 0)
+	{
+		gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION,
+				    config->fps, 1, NULL);
+	}
+	if (config->format != NULL)
+	{
+		gst_caps_set_simple(caps, "format", G_TYPE_STRING, config->format,
+				    NULL);
+	}
+	return caps;
+}
+
+// Caps to capture with: the camera mode picked for the configuration, or if
+// the camera couldn't be asked, just the configuration's own constraints
+static GstCaps *make_source_caps(xg_pipeline *pipeline, GstElement *source)
+{
+	const xg_pipeline_config *config = &pipeline->config;
+	camera_mode mode;
+	if (pick_camera_mode(source, config, &mode))
+	{
+		printf("Capturing %s at %dx%d", mode.format, mode.width,
+		       mode.height);
+		GstCaps *caps = gst_caps_new_simple(
+		    "video/x-raw", "format", G_TYPE_STRING, mode.format, "width",
+		    G_TYPE_INT, mode.width, "height", G_TYPE_INT, mode.height, NULL);
+		if (mode.fps_n > 0)
+		{
+			printf(", %.4g fps", (double)mode.fps_n / mode.fps_d);
+			gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION,
+					    mode.fps_n, mode.fps_d, NULL);
+		}
+		putchar('\n');
+		return caps;
+	}
+
+	return make_config_caps(config);
+}
+
 static GstElement *make_video_source(xg_pipeline *pipeline, const char *device)
 {
 	printf("Using device %s\n", device);
@@ -304,106 +856,410 @@ static GstElement *make_video_source(xg_pipeline *pipeline, const char *device)
 	// common g_objects
 	GstElement *videoflip = 
 		make_element(pipeline, "videoflip", "video_mirror");
-	g_object_set(G_OBJECT(videoflip), "video-direction", 4, NULL);
-	GstElement *jpegdecoder =
-		make_element(pipeline, "autovideoconvert", "source_jpegdec");
+	bool scales;
+	GstElement *converter =
+		make_converter(pipeline, "source_converter", NULL, &scales);
 	GstElement *capsfilter = 
 		make_element(pipeline, "capsfilter", "source_capsfilter");
-	GstCaps *caps_settings =
-		gst_caps_from_string(
-			"video/x-raw,width=320,height=240"
-		);
-	g_object_set(capsfilter, "caps", caps_settings, NULL);
 
 	// mount video 4 linux and pipeline
 	GstElement *v4l2src =
 		make_element(pipeline, "v4l2src", "source_v4l2src");
+	if (pipeline->error_occurred)
+	{
+		return NULL;
+	}
 	g_object_set(G_OBJECT(v4l2src), "device", device, NULL);
-	GstElement *scale =
-		make_element(pipeline, "videoscale", "source_videoscale");
+	g_object_set(G_OBJECT(videoflip), "video-direction",
+		     pipeline->config.flip, NULL);
+	GstCaps *caps_settings = make_source_caps(pipeline, v4l2src);
+	g_object_set(capsfilter, "caps", caps_settings, NULL);
+	gst_caps_unref(caps_settings);
 
 	link_elements(pipeline, v4l2src, capsfilter);
-	link_elements(pipeline, capsfilter, jpegdecoder);
-	link_elements(pipeline, jpegdecoder, videoflip);
+	link_elements(pipeline, capsfilter, converter);
+	link_elements(pipeline, converter, videoflip);
 
 	return videoflip;
 }
 
-static GstElement *make_app_sink(xg_pipeline *pipeline)
+static GstElement *make_test_source(xg_pipeline *pipeline)
 {
-	GstElement *queue;
-	GstElement *converter;
-	GstElement *capsfilter;
-	GstElement *appsink;
-
-	queue = make_element(pipeline, "queue", "appsink_queue");
-	converter = make_element(pipeline, "videoconvert", "appsink_converter");
-	capsfilter = make_element(pipeline, "capsfilter", "appsink_capsfilter");
-	appsink = make_element(pipeline, "appsink", "appsink");
-
+	GstElement *source =
+	    make_element(pipeline, "videotestsrc", "source_videotestsrc");
+	GstElement *capsfilter =
+	    make_element(pipeline, "capsfilter", "source_capsfilter");
 	if (pipeline->error_occurred)
 	{
 		return NULL;
 	}
 
-	g_object_set(capsfilter, "caps",
-		     gst_caps_from_string("video/x-raw,format=RGB"), NULL);
-	gst_app_sink_set_max_buffers(GST_APP_SINK(appsink), 1);
-	gst_app_sink_set_drop(GST_APP_SINK(appsink), true);
-	link_elements(pipeline, queue, converter);
-	link_elements(pipeline, converter, capsfilter);
-	link_elements(pipeline, capsfilter, appsink);
-
-	pipeline->appsink = appsink;
-	return queue;
+	// Paced like a camera unless asked to go as fast as possible
+	g_object_set(source, "is-live",
+		     pipeline->config.pacing == XG_PACING_REALTIME, NULL);
+	GstCaps *caps = make_config_caps(&pipeline->config);
+	g_object_set(capsfilter, "caps", caps, NULL);
+	gst_caps_unref(caps);
+	link_elements(pipeline, source, capsfilter);
+	return capsfilter;
 }
 
-static void make_overlay(xg_pipeline *pipeline, GstElement **overlay_in,
-			 GstElement **overlay_out)
+static GstElement *make_shm_source(xg_pipeline *pipeline,
+				   const char *socket_path)
 {
-	GstElement *queue = NULL;
-	GstElement *converter = NULL;
-	GstElement *overlay = NULL;
-	queue = make_element(pipeline, "queue", "overlay_queue");
-	converter = make_element(pipeline, "videoconvert", "overlay_converter");
-	overlay = make_element(pipeline, "cairooverlay", "overlay");
-
+	// shmsink only passes the bytes on, so the caps must be spelled out
+	const xg_pipeline_config *config = &pipeline->config;
+	if (config->width <= 0 || config->height <= 0 || config->fps <= 0 ||
+	    config->format == NULL)
+	{
+		errorf(pipeline, "Shared memory sources need the exact size, fps "
+				 "and format of their frames");
+		return NULL;
+	}
+	GstElement *source = make_element(pipeline, "shmsrc", "source_shmsrc");
+	GstElement *capsfilter =
+	    make_element(pipeline, "capsfilter", "source_capsfilter");
 	if (pipeline->error_occurred)
 	{
-		return;
+		return NULL;
 	}
 
-	g_signal_connect(overlay, "draw", G_CALLBACK(draw_overlays), pipeline);
-	link_elements(pipeline, queue, converter);
-	link_elements(pipeline, converter, overlay);
-	*overlay_in = queue;
-	*overlay_out = overlay;
+	g_object_set(source, "socket-path", socket_path, "is-live", TRUE,
+		     "do-timestamp", TRUE, NULL);
+	GstCaps *caps = make_config_caps(config);
+	g_object_set(capsfilter, "caps", caps, NULL);
+	gst_caps_unref(caps);
+	link_elements(pipeline, source, capsfilter);
+	return capsfilter;
 }
 
-static GstElement *make_auto_sink(xg_pipeline *pipeline)
+// Links decodebin's video pad to the element after it once it appears.
+// Anything else (e.g. audio) is left unlinked.
+static void on_decoded_pad(GstElement *decodebin, GstPad *pad,
+			   gpointer user_data)
 {
-	GstElement *queue;
-	GstElement *converter;
-	GstElement *sink;
-	queue = make_element(pipeline, "queue", "auto_sink_queue");
-	converter = make_element(pipeline, "videoconvert", "auto_sink_converter");
-	sink = make_element(pipeline, "waylandsink", "auto_sink");
-
-	// set context
-	GdkDisplay *display = gtk_widget_get_display(pipeline->video_widget);
-	struct wl_display *display_handle = gdk_wayland_display_get_wl_display(display);
-	GstContext *context = gst_wayland_display_handle_context_new(display_handle);
-	gst_element_set_context(sink, context);
-	GstElementFactory *queue_factory = gst_element_factory_find("waylandsink");
-	g_assert(G_IS_OBJECT(queue_factory));
+	GstElement *next = (GstElement *)user_data;
+	GstPad *sink_pad = gst_element_get_static_pad(next, "sink");
+	GstCaps *caps = gst_pad_get_current_caps(pad);
+	if (caps == NULL)
+	{
+		caps = gst_pad_query_caps(pad, NULL);
+	}
+	// Only caps with a structure say what the pad carries
+	if (gst_caps_is_any(caps) || gst_caps_is_empty(caps))
+	{
+		gst_caps_unref(caps);
+		gst_object_unref(sink_pad);
+		return;
+	}
+	const char *media =
+	    gst_structure_get_name(gst_caps_get_structure(caps, 0));
+	if (!gst_pad_is_linked(sink_pad) &&
+	    strncmp(media, "video/", strlen("video/")) == 0 &&
+	    gst_pad_link(pad, sink_pad) != GST_PAD_LINK_OK)
+	{
+		fprintf(stderr, "Couldn't link decoded %s video\n", media);
+	}
+	gst_caps_unref(caps);
+	gst_object_unref(sink_pad);
+}
 
+// Adds a decodebin fed by @input and returns the element its video comes out
+// of. The queue after it lets decoding run on its own thread.
+static GstElement *make_decoder(xg_pipeline *pipeline, GstElement *input)
+{
+	GstElement *decodebin =
+	    make_element(pipeline, "decodebin", "source_decodebin");
+	GstElement *queue = make_element(pipeline, "queue", "source_queue");
 	if (pipeline->error_occurred)
 	{
 		return NULL;
 	}
-
-	link_elements(pipeline, queue, converter);
-	link_elements(pipeline, converter, sink);
+	g_signal_connect(decodebin, "pad-added", G_CALLBACK(on_decoded_pad),
+			 queue);
+	link_elements(pipeline, input, decodebin);
+	return queue;
+}
+
+static GstElement *make_file_source(xg_pipeline *pipeline, const char *path)
+{
+	GstElement *source = make_element(pipeline, "filesrc", "source_filesrc");
+	if (pipeline->error_occurred)
+	{
+		return NULL;
+	}
+	g_object_set(source, "location", path, NULL);
+	return make_decoder(pipeline, source);
+}
+
+// The files an image-sequence source plays, and how far it has got
+typedef struct xg_image_sequence
+{
+	struct dirent **files;
+	int n_files;
+	int next;
+	char *directory;
+	GstClockTime frame_duration;
+} xg_image_sequence;
+
+static void free_image_sequence(xg_image_sequence *sequence)
+{
+	if (sequence == NULL)
+	{
+		return;
+	}
+	for (int i = 0; i < sequence->n_files; ++i)
+	{
+		free(sequence->files[i]);
+	}
+	free(sequence->files);
+	g_free(sequence->directory);
+	free(sequence);
+}
+
+static int is_image_file(const struct dirent *entry)
+{
+	const char *extension = strrchr(entry->d_name, '.');
+	return extension != NULL && (strcasecmp(extension, ".jpg") == 0 ||
+				     strcasecmp(extension, ".jpeg") == 0 ||
+				     strcasecmp(extension, ".png") == 0);
+}
+
+// Pushes the next image of the sequence whenever appsrc wants more data
+static void on_image_sequence_need_data(GstAppSrc *appsrc, guint length,
+					gpointer user_data)
+{
+	xg_image_sequence *sequence = (xg_image_sequence *)user_data;
+	while (sequence->next < sequence->n_files)
+	{
+		int index = sequence->next++;
+		char *path = g_build_filename(
+		    sequence->directory, sequence->files[index]->d_name, NULL);
+		gchar *contents = NULL;
+		gsize size = 0;
+		GError *error = NULL;
+		bool loaded = g_file_get_contents(path, &contents, &size, &error);
+		g_free(path);
+		if (!loaded)
+		{
+			fprintf(stderr, "Skipping image: %s\n", error->message);
+			g_error_free(error);
+			continue;
+		}
+		GstBuffer *buffer = gst_buffer_new_wrapped(contents, size);
+		GST_BUFFER_PTS(buffer) = index * sequence->frame_duration;
+		GST_BUFFER_DURATION(buffer) = sequence->frame_duration;
+		gst_app_src_push_buffer(appsrc, buffer);
+		return;
+	}
+	gst_app_src_end_of_stream(appsrc);
+}
+
+static GstElement *make_image_sequence_source(xg_pipeline *pipeline,
+					      const char *directory)
+{
+	xg_image_sequence *sequence = calloc(1, sizeof(xg_image_sequence));
+	if (sequence == NULL)
+	{
+		errorf(pipeline, "Couldn't allocate memory for image sequence");
+		return NULL;
+	}
+	pipeline->image_sequence = sequence;
+	sequence->n_files =
+	    scandir(directory, &sequence->files, is_image_file, alphasort);
+	if (sequence->n_files <= 0)
+	{
+		sequence->n_files = 0;
+		errorf(pipeline, "No JPEG or PNG images in %s", directory);
+		return NULL;
+	}
+	sequence->directory = g_strdup(directory);
+	int32_t fps = pipeline->config.fps > 0 ? pipeline->config.fps : 30;
+	sequence->frame_duration = GST_SECOND / fps;
+
+	GstElement *source = make_element(pipeline, "appsrc", "source_appsrc");
+	if (pipeline->error_occurred)
+	{
+		return NULL;
+	}
+	// Each buffer is one whole image file, which decodebin identifies itself
+	g_object_set(source, "format", GST_FORMAT_TIME, NULL);
+	GstAppSrcCallbacks callbacks = {.need_data = on_image_sequence_need_data};
+	gst_app_src_set_callbacks(GST_APP_SRC(source), &callbacks, sequence,
+				  NULL);
+	return make_decoder(pipeline, source);
+}
+
+// Picks the source element(s) for @source as described for
+// xg_create_video_overlay_pipeline() and returns the last one
+static GstElement *make_source(xg_pipeline *pipeline, const char *source)
+{
+	static const char FILE_SCHEME[] = "file://";
+	static const char SHM_SCHEME[] = "shm://";
+	if (strncmp(source, FILE_SCHEME, strlen(FILE_SCHEME)) == 0)
+	{
+		return make_file_source(pipeline, source + strlen(FILE_SCHEME));
+	}
+	if (strncmp(source, SHM_SCHEME, strlen(SHM_SCHEME)) == 0)
+	{
+		return make_shm_source(pipeline, source + strlen(SHM_SCHEME));
+	}
+	if (strcmp(source, "videotestsrc") == 0)
+	{
+		return make_test_source(pipeline);
+	}
+	if (g_file_test(source, G_FILE_TEST_IS_DIR))
+	{
+		return make_image_sequence_source(pipeline, source);
+	}
+	return make_video_source(pipeline, source);
+}
+
+// Sets the appsink's caps from the format and size selected for inference
+static void update_appsink_caps(xg_pipeline *pipeline)
+{
+	GstCaps *caps = gst_caps_from_string(
+	    pipeline->native_format ? APPSINK_NATIVE_CAPS : APPSINK_RGB_CAPS);
+	if (pipeline->inference_width > 0 && pipeline->inference_height > 0)
+	{
+		gst_caps_set_simple(caps, "width", G_TYPE_INT,
+				    pipeline->inference_width, "height",
+				    G_TYPE_INT, pipeline->inference_height, NULL);
+	}
+	g_object_set(pipeline->appsink_capsfilter, "caps", caps, NULL);
+	gst_caps_unref(caps);
+}
+
+static GstElement *make_app_sink(xg_pipeline *pipeline)
+{
+	GstElement *queue;
+	GstElement *scale = NULL;
+	GstElement *converter;
+	GstElement *capsfilter;
+	GstElement *appsink;
+
+	// Frames are scaled down to the inference size here, in the appsink
+	// branch only, so the display keeps the camera's full resolution
+	bool converter_scales;
+	queue = make_element(pipeline, "queue", "appsink_queue");
+	// RGB is the one format both caps modes accept, and the mode can be
+	// switched once the pipeline is built
+	converter = make_converter(pipeline, "appsink_converter",
+				   APPSINK_RGB_CAPS, &converter_scales);
+	if (!converter_scales)
+	{
+		// Scale before converting, so there are fewer pixels to convert
+		scale = make_element(pipeline, "videoscale", "appsink_scale");
+	}
+	capsfilter = make_element(pipeline, "capsfilter", "appsink_capsfilter");
+	appsink = make_element(pipeline, "appsink", "appsink");
+
+	if (pipeline->error_occurred)
+	{
+		return NULL;
+	}
+
+	if (pipeline->config.appsink_queue_depth > 0)
+	{
+		g_object_set(queue, "max-size-buffers",
+			     pipeline->config.appsink_queue_depth, NULL);
+	}
+	pipeline->appsink_capsfilter = capsfilter;
+	update_appsink_caps(pipeline);
+	// Unpaced sources wait for each frame to be taken instead
+	bool fast = pipeline->config.pacing == XG_PACING_FAST;
+	gst_app_sink_set_max_buffers(GST_APP_SINK(appsink), 1);
+	gst_app_sink_set_drop(GST_APP_SINK(appsink), !fast);
+	g_object_set(appsink, "sync", !fast, NULL);
+	if (scale != NULL)
+	{
+		link_elements(pipeline, queue, scale);
+		link_elements(pipeline, scale, converter);
+	}
+	else
+	{
+		link_elements(pipeline, queue, converter);
+	}
+	link_elements(pipeline, converter, capsfilter);
+	link_elements(pipeline, capsfilter, appsink);
+
+	pipeline->appsink = appsink;
+	return queue;
+}
+
+static void make_overlay(xg_pipeline *pipeline, GstElement **overlay_in,
+			 GstElement **overlay_out)
+{
+	GstElement *queue = NULL;
+	GstElement *converter = NULL;
+	GstElement *capsfilter = NULL;
+	GstElement *overlay = NULL;
+	bool scales;
+	queue = make_element(pipeline, "queue", "overlay_queue");
+	// Formats both cairooverlay and the direct rasterizer draw into, since
+	// xg_pipeline_set_direct_overlays() switches between them
+	converter = make_converter(pipeline, "overlay_converter",
+				   OVERLAY_CAPS, &scales);
+	// Unconstrained unless overlays are drawn directly, in which case it
+	// limits the converter to formats the rasterizer can draw into
+	capsfilter = make_element(pipeline, "capsfilter", "overlay_capsfilter");
+	overlay = make_element(pipeline, "cairooverlay", "overlay");
+
+	if (pipeline->error_occurred)
+	{
+		return;
+	}
+
+	if (pipeline->config.display_queue_depth > 0)
+	{
+		g_object_set(queue, "max-size-buffers",
+			     pipeline->config.display_queue_depth, NULL);
+	}
+	g_signal_connect(overlay, "draw", G_CALLBACK(draw_overlays), pipeline);
+	link_elements(pipeline, queue, converter);
+	link_elements(pipeline, converter, capsfilter);
+	link_elements(pipeline, capsfilter, overlay);
+	pipeline->overlay_capsfilter = capsfilter;
+	pipeline->cairo_overlay = overlay;
+	*overlay_in = queue;
+	*overlay_out = overlay;
+}
+
+static GstElement *make_auto_sink(xg_pipeline *pipeline)
+{
+	GstElement *queue;
+	GstElement *converter;
+	GstElement *sink;
+	queue = make_element(pipeline, "queue", "auto_sink_queue");
+	bool scales;
+	converter =
+	    make_converter(pipeline, "auto_sink_converter", NULL, &scales);
+	sink = make_element(pipeline, "waylandsink", "auto_sink");
+
+	if (pipeline->error_occurred)
+	{
+		return NULL;
+	}
+	if (pipeline->config.pacing == XG_PACING_FAST)
+	{
+		g_object_set(sink, "sync", FALSE, NULL);
+	}
+
+	// Share the window's Wayland display with the sink. Without a window
+	// (nogui), waylandsink opens its own.
+	if (pipeline->video_widget != NULL)
+	{
+		GdkDisplay *display = gtk_widget_get_display(pipeline->video_widget);
+		struct wl_display *display_handle =
+		    gdk_wayland_display_get_wl_display(display);
+		GstContext *context =
+		    gst_wayland_display_handle_context_new(display_handle);
+		gst_element_set_context(sink, context);
+		gst_context_unref(context);
+	}
+
+	link_elements(pipeline, queue, converter);
+	link_elements(pipeline, converter, sink);
 	return queue;
 }
 
@@ -419,7 +1275,7 @@ static void build_video_overlay_pipeline(xg_pipeline *pipeline, const char *devi
 	GstElement *overlay_out = NULL;
 	GstElement *auto_sink = NULL;
 
-	source = make_video_source(pipeline, device);
+	source = make_source(pipeline, device);
 	tee_no_overlay = make_element(pipeline, "tee", "tee_no_overlay");
 	app_sink = make_app_sink(pipeline);
 	make_overlay(pipeline, &overlay_in, &overlay_out);
@@ -434,6 +1290,51 @@ static void build_video_overlay_pipeline(xg_pipeline *pipeline, const char *devi
 	link_elements(pipeline, tee_no_overlay, app_sink);
 	link_elements(pipeline, tee_no_overlay, overlay_in);
 	link_elements(pipeline, overlay_out, auto_sink);
+	pipeline->display_sink = auto_sink;
+}
+
+static void build_headless_pipeline(xg_pipeline *pipeline, const char *source)
+{
+	pipeline->gst_pipeline =
+	    GST_PIPELINE(gst_pipeline_new("headless-pipeline"));
+
+	GstElement *source_out = make_source(pipeline, source);
+	GstElement *app_sink = make_app_sink(pipeline);
+	if (pipeline->error_occurred)
+	{
+		return;
+	}
+	link_elements(pipeline, source_out, app_sink);
+}
+
+// Points the frame's plane pointers at their offsets within @frame->data,
+// which holds the whole buffer. The buffer's video meta, when it has one, describes the
+// layout its producer actually used: hardware converters pad their strides
+// and planes past what the caps imply.
+static void set_frame_planes(xg_frame *frame, const GstVideoInfo *video_info,
+			     const GstVideoMeta *meta)
+{
+	frame->n_planes = meta != NULL ? (int32_t)meta->n_planes
+				       : GST_VIDEO_INFO_N_PLANES(video_info);
+	if (frame->n_planes > XG_FRAME_MAX_PLANES)
+	{
+		frame->n_planes = XG_FRAME_MAX_PLANES;
+	}
+	for (int32_t i = 0; i < frame->n_planes; ++i)
+	{
+		if (meta != NULL)
+		{
+			frame->planes[i] = frame->data + meta->offset[i];
+			frame->strides[i] = meta->stride[i];
+		}
+		else
+		{
+			frame->planes[i] =
+			    frame->data + GST_VIDEO_INFO_PLANE_OFFSET(video_info, i);
+			frame->strides[i] =
+			    GST_VIDEO_INFO_PLANE_STRIDE(video_info, i);
+		}
+	}
 }
 
 static xg_pipeline *xg_create_base_pipeline(const char *window_title)
@@ -447,7 +1348,19 @@ static xg_pipeline *xg_create_base_pipeline(const char *window_title)
 
 	// Keep track of whether we are started or stopped
 	pipeline->running = false;
+	pipeline->zero_copy = true;
+	pipeline->frame_pool = xg_frame_pool_create();
+	pipeline->label_cache = xg_label_cache_create();
+	if (pipeline->frame_pool == NULL || pipeline->label_cache == NULL)
+	{
+		errorf(pipeline, "Couldn't allocate memory for the pipeline");
+		xg_frame_pool_free(pipeline->frame_pool);
+		xg_label_cache_free(pipeline->label_cache);
+		free(pipeline);
+		return NULL;
+	}
 	pthread_mutex_init(&pipeline->gst_pipeline_lock, NULL);
+	pthread_mutex_init(&pipeline->arenas_lock, NULL);
 
 	return pipeline;
 }
@@ -469,6 +1382,11 @@ static void xg_base_pipeline_init(xg_pipeline *pipeline)
 		errorf(pipeline, "Couldn't connect to pipeline messages");
 		return;
 	}
+	if (pipeline->headless)
+	{
+		// Only the display needs the synchronous messages
+		return;
+	}
 	if (g_signal_connect(pipeline->bus, "sync-message::element",
 			     G_CALLBACK(on_bus_sync_message), pipeline) == 0)
 	{
@@ -487,14 +1405,141 @@ void xg_init(int *argc, char **argv[])
 	gst_init(argc, argv);
 }
 
-xg_pipeline *xg_create_video_overlay_pipeline(const char *window_title, 
-						const char *device, bool gui)
+void xg_init_headless(int *argc, char **argv[]) { gst_init(argc, argv); }
+
+void xg_pipeline_config_init(xg_pipeline_config *config)
+{
+	memset(config, 0, sizeof(xg_pipeline_config));
+	config->width = 320;
+	config->height = 240;
+	config->flip = GST_VIDEO_ORIENTATION_HORIZ;
+}
+
+static bool parse_size(const char *value, int32_t *width, int32_t *height)
+{
+	char end;
+	return sscanf(value, "%dx%d%c", width, height, &end) == 2 &&
+	       *width >= 0 && *height >= 0;
+}
+
+static bool parse_count(const char *value, int32_t *count)
+{
+	char end;
+	return sscanf(value, "%d%c", count, &end) == 1 && *count >= 0;
+}
+
+static bool parse_flip(const char *value, int32_t *flip)
+{
+	static const struct
+	{
+		const char *name;
+		int32_t method;
+	} flips[] = {
+	    {"none", GST_VIDEO_ORIENTATION_IDENTITY},
+	    {"mirror", GST_VIDEO_ORIENTATION_HORIZ},
+	    {"vertical", GST_VIDEO_ORIENTATION_VERT},
+	    {"rotate-90", GST_VIDEO_ORIENTATION_90R},
+	    {"rotate-180", GST_VIDEO_ORIENTATION_180},
+	    {"rotate-270", GST_VIDEO_ORIENTATION_90L},
+	};
+	for (size_t i = 0; i < G_N_ELEMENTS(flips); ++i)
+	{
+		if (strcmp(value, flips[i].name) == 0)
+		{
+			*flip = flips[i].method;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool parse_setting(void *target, const char *key, const char *value)
+{
+	xg_pipeline_config *config = (xg_pipeline_config *)target;
+	if (strcmp(key, "size") == 0)
+	{
+		return parse_size(value, &config->width, &config->height);
+	}
+	if (strcmp(key, "fps") == 0)
+	{
+		return parse_count(value, &config->fps);
+	}
+	if (strcmp(key, "format") == 0)
+	{
+		config->format = g_intern_string(value);
+		return true;
+	}
+	if (strcmp(key, "flip") == 0)
+	{
+		return parse_flip(value, &config->flip);
+	}
+	if (strcmp(key, "pacing") == 0)
+	{
+		if (strcmp(value, "realtime") == 0)
+		{
+			config->pacing = XG_PACING_REALTIME;
+		}
+		else if (strcmp(value, "fast") == 0)
+		{
+			config->pacing = XG_PACING_FAST;
+		}
+		else
+		{
+			return false;
+		}
+		return true;
+	}
+	if (strcmp(key, "inference-size") == 0)
+	{
+		return parse_size(value, &config->inference_width,
+				  &config->inference_height);
+	}
+	if (strcmp(key, "appsink-queue") == 0)
+	{
+		return parse_count(value, &config->appsink_queue_depth);
+	}
+	if (strcmp(key, "display-queue") == 0)
+	{
+		return parse_count(value, &config->display_queue_depth);
+	}
+	return false;
+}
+
+bool xg_pipeline_config_parse(xg_pipeline_config *config, const char *settings)
+{
+	return xg_settings_parse(settings, "pipeline", parse_setting, config);
+}
+
+// Copies @config (or the defaults) into the pipeline
+static void set_pipeline_config(xg_pipeline *pipeline,
+				const xg_pipeline_config *config)
+{
+	if (config != NULL)
+	{
+		pipeline->config = *config;
+		if (config->format != NULL)
+		{
+			pipeline->config.format = g_intern_string(config->format);
+		}
+	}
+	else
+	{
+		xg_pipeline_config_init(&pipeline->config);
+	}
+	pipeline->inference_width = pipeline->config.inference_width;
+	pipeline->inference_height = pipeline->config.inference_height;
+}
+
+xg_pipeline *xg_create_video_overlay_pipeline(const char *window_title,
+					      const char *device, bool gui,
+					      const xg_pipeline_config *config)
 {
 	xg_pipeline *pipeline = xg_create_base_pipeline(window_title);
-	if (pipeline->error_occurred)
+	if (pipeline == NULL || pipeline->error_occurred)
 	{
 		return NULL;
 	}
+	set_pipeline_config(pipeline, config);
 
 	if (gui)
 		build_window(pipeline);
@@ -518,9 +1563,39 @@ xg_pipeline *xg_create_video_overlay_pipeline(const char *window_title,
 	}
 }
 
+xg_pipeline *xg_create_headless_pipeline(const char *source,
+					 const xg_pipeline_config *config)
+{
+	xg_pipeline *pipeline = xg_create_base_pipeline(NULL);
+	if (pipeline == NULL || pipeline->error_occurred)
+	{
+		return NULL;
+	}
+	pipeline->headless = true;
+	set_pipeline_config(pipeline, config);
+
+	build_headless_pipeline(pipeline, source);
+	if (pipeline->error_occurred)
+	{
+		xg_pipeline_free(pipeline);
+		return NULL;
+	}
+
+	xg_base_pipeline_init(pipeline);
+	if (pipeline->error_occurred)
+	{
+		xg_pipeline_free(pipeline);
+		return NULL;
+	}
+	return pipeline;
+}
+
 void xg_pipeline_start(xg_pipeline *pipeline)
 {
-	gtk_widget_show_all(GTK_WIDGET(pipeline->window));
+	if (pipeline->window != NULL)
+	{
+		gtk_widget_show_all(GTK_WIDGET(pipeline->window));
+	}
 
 	if (gst_element_set_state(GST_ELEMENT(pipeline->gst_pipeline),
 				  GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
@@ -560,6 +1635,38 @@ void xg_pipeline_toggle_pause(xg_pipeline *pipeline)
 
 bool xg_pipeline_running(xg_pipeline *pipeline) { return pipeline->running; }
 
+void xg_pipeline_dispatch_events(xg_pipeline *pipeline, bool may_block)
+{
+	if (pipeline->headless)
+	{
+		g_main_context_iteration(NULL, may_block);
+	}
+	else
+	{
+		gtk_main_iteration_do(may_block);
+	}
+}
+
+static gboolean stop_pipeline_idle(gpointer user_data)
+{
+	xg_pipeline *pipeline = (xg_pipeline *)user_data;
+	if (pipeline->running)
+	{
+		xg_pipeline_stop(pipeline);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+void xg_pipeline_request_stop(xg_pipeline *pipeline)
+{
+	g_idle_add(stop_pipeline_idle, pipeline);
+}
+
+bool xg_pipeline_error_occurred(xg_pipeline *pipeline)
+{
+	return atomic_load(&pipeline->error_occurred);
+}
+
 xg_frame *xg_pipeline_get_frame(xg_pipeline *pipeline)
 {
 	if (!pipeline->running)
@@ -568,112 +1675,318 @@ xg_frame *xg_pipeline_get_frame(xg_pipeline *pipeline)
 		return NULL;
 	}
 
-	while (gtk_events_pending())
+	if (pipeline->headless)
+	{
+		while (g_main_context_iteration(NULL, false))
+		{
+		}
+	}
+	else
 	{
-		gtk_main_iteration_do(false);
+		while (gtk_events_pending())
+		{
+			gtk_main_iteration_do(false);
+		}
+	}
+
+	return xg_pipeline_pull_frame(pipeline, GST_CLOCK_TIME_NONE);
+}
+
+xg_frame *xg_pipeline_pull_frame(xg_pipeline *pipeline, GstClockTime timeout)
+{
+	if (!pipeline->running)
+	{
+		return NULL;
 	}
 
 	GstState cur_state;
 	gst_element_get_state(GST_ELEMENT(pipeline->gst_pipeline), &cur_state, NULL,
 			      GST_SECOND);
 	GstSample *gst_sample = NULL;
+	uint64_t trace_start = XG_TRACE_BEGIN();
 	if (cur_state == GST_STATE_PLAYING)
 	{
 		acquire_mutex_or_die(&pipeline->gst_pipeline_lock);
-		gst_sample = gst_app_sink_pull_sample(GST_APP_SINK(pipeline->appsink));
+		gst_sample = gst_app_sink_try_pull_sample(
+		    GST_APP_SINK(pipeline->appsink), timeout);
 		release_mutex_or_die(&pipeline->gst_pipeline_lock);
 	}
 	else if (cur_state == GST_STATE_PAUSED)
 	{
 		acquire_mutex_or_die(&pipeline->gst_pipeline_lock);
-		gst_sample = gst_app_sink_pull_preroll(GST_APP_SINK(pipeline->appsink));
+		gst_sample = gst_app_sink_try_pull_preroll(
+		    GST_APP_SINK(pipeline->appsink), timeout);
 		release_mutex_or_die(&pipeline->gst_pipeline_lock);
 	}
 	else
 	{
-		errorf(pipeline, "Video pipeline is not playing; no frame to return");
+		// Stopped since @running was checked (the window was closed or the
+		// source ended), which is no error; the caller sees @running false
 		return NULL;
 	}
 
-	GstBuffer *data = gst_sample_get_buffer(gst_sample);
-	GstStructure *caps_struct =
-	    gst_caps_get_structure(gst_sample_get_caps(gst_sample), 0);
-	const char *frame_format =
-	    strdup(gst_structure_get_string(caps_struct, "format"));
-	int32_t frame_width, frame_height;
-	gst_structure_get_int(caps_struct, "width", &frame_width);
-	gst_structure_get_int(caps_struct, "height", &frame_height);
-	gpointer image_data = NULL;
-	gsize image_data_size = 0;
-	gst_buffer_extract_dup(data, 0, gst_buffer_get_size(data), &image_data,
-			       &image_data_size);
+	if (gst_sample == NULL)
+	{
+		// The appsink returns NULL when it is stopped, reaches EOS or times out
+		return NULL;
+	}
+	uint64_t sequence = pipeline->frames_pulled++;
+	XG_TRACE_END(XG_TRACE_PULL_SAMPLE, trace_start, sequence);
+	xg_startup_mark(XG_STARTUP_FIRST_FRAME);
+	trace_start = XG_TRACE_BEGIN();
+	GstBuffer *buffer = gst_sample_get_buffer(gst_sample);
+	GstClockTime pts = GST_BUFFER_PTS(buffer);
+	GstClockTime running_time = GST_CLOCK_TIME_NONE;
+	const GstSegment *segment = gst_sample_get_segment(gst_sample);
+	if (GST_CLOCK_TIME_IS_VALID(pts) && segment != NULL &&
+	    segment->format == GST_FORMAT_TIME)
+	{
+		running_time =
+		    gst_segment_to_running_time(segment, GST_FORMAT_TIME, pts);
+	}
 
-	gst_sample_unref(gst_sample);
+	GstCaps *caps = gst_sample_get_caps(gst_sample);
+	GstStructure *caps_struct = gst_caps_get_structure(caps, 0);
+	GstVideoInfo video_info;
+	if (!gst_video_info_from_caps(&video_info, caps))
+	{
+		errorf(pipeline, "Couldn't parse the caps of the frame");
+		gst_sample_unref(gst_sample);
+		return NULL;
+	}
 
-	xg_frame *result = calloc(1, sizeof(xg_frame));
+	// Copied frames need room for the whole buffer, which may be padded past
+	// the size the caps imply
+	size_t copy_size = 0;
+	if (!pipeline->zero_copy)
+	{
+		copy_size = MAX(GST_VIDEO_INFO_SIZE(&video_info),
+				gst_buffer_get_size(buffer));
+	}
+	const GstVideoMeta *meta = gst_buffer_get_video_meta(buffer);
+	xg_frame *result = xg_frame_pool_acquire(pipeline->frame_pool, copy_size);
 	if (result == NULL)
 	{
-		errorf(pipeline, "Failed to allocate memory for frame metadata");
-		g_free(image_data);
+		errorf(pipeline, "Failed to allocate memory for frame");
+		gst_sample_unref(gst_sample);
 		return NULL;
 	}
-	result->format = frame_format;
-	result->width = frame_width;
-	result->height = frame_height;
-	result->data = image_data;
+	result->format =
+	    g_intern_string(gst_structure_get_string(caps_struct, "format"));
+	result->width = GST_VIDEO_INFO_WIDTH(&video_info);
+	result->height = GST_VIDEO_INFO_HEIGHT(&video_info);
+	result->sequence = sequence;
+	result->pts = pts;
+	result->running_time = running_time;
+
+	if (pipeline->zero_copy)
+	{
+		// Keep the sample (and so the buffer) alive until the frame is freed,
+		// so the pixel data can be used in place.
+		if (!gst_buffer_map(buffer, &result->map, GST_MAP_READ))
+		{
+			errorf(pipeline, "Couldn't map frame buffer");
+			gst_sample_unref(gst_sample);
+			xg_frame_free(result);
+			return NULL;
+		}
+		result->sample = gst_sample;
+		result->data = result->map.data;
+		set_frame_planes(result, &video_info, meta);
+		XG_TRACE_END(XG_TRACE_COPY_FRAME, trace_start, sequence);
+		return result;
+	}
+
+	gst_buffer_extract(buffer, 0, result->storage, gst_buffer_get_size(buffer));
+	result->data = result->storage;
+	// The meta belongs to the buffer, so use it before letting go
+	set_frame_planes(result, &video_info, meta);
+	gst_sample_unref(gst_sample);
+	XG_TRACE_END(XG_TRACE_COPY_FRAME, trace_start, sequence);
 	return result;
 }
 
-void xg_pipeline_clear_overlays(xg_pipeline *pipeline)
+void xg_pipeline_set_native_format(xg_pipeline *pipeline, bool native)
 {
-	acquire_mutex_or_die(&pipeline->overlay_lock);
-	// free all overlays in the list
-	xg_overlay *item = pipeline->overlay_list;
-	while (item != NULL)
+	pipeline->native_format = native;
+	update_appsink_caps(pipeline);
+}
+
+void xg_pipeline_set_direct_overlays(xg_pipeline *pipeline, bool direct)
+{
+	if (direct == pipeline->direct_overlays ||
+	    pipeline->overlay_capsfilter == NULL)
 	{
-		xg_overlay *next = item->next;
-		xg_overlay_free(item);
-		item = next;
+		return;
+	}
+	GstElement *capsfilter = pipeline->overlay_capsfilter;
+	GstPad *pad = gst_element_get_static_pad(capsfilter, "src");
+	GstCaps *caps;
+	// cairooverlay stays in the bin while bypassed, just unlinked
+	if (direct)
+	{
+		gst_element_unlink(capsfilter, pipeline->cairo_overlay);
+		gst_element_unlink(pipeline->cairo_overlay, pipeline->display_sink);
+		link_elements(pipeline, capsfilter, pipeline->display_sink);
+		pipeline->direct_probe =
+		    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+				      draw_overlays_direct, pipeline, NULL);
+		caps = gst_caps_from_string(XG_RASTER_CAPS);
 	}
-	pipeline->overlay_list = NULL;
-	release_mutex_or_die(&pipeline->overlay_lock);
+	else
+	{
+		gst_pad_remove_probe(pad, pipeline->direct_probe);
+		pipeline->direct_probe = 0;
+		gst_element_unlink(capsfilter, pipeline->display_sink);
+		link_elements(pipeline, capsfilter, pipeline->cairo_overlay);
+		link_elements(pipeline, pipeline->cairo_overlay,
+			      pipeline->display_sink);
+		caps = gst_caps_new_any();
+	}
+	g_object_set(capsfilter, "caps", caps, NULL);
+	gst_caps_unref(caps);
+	gst_object_unref(pad);
+	pipeline->direct_overlays = direct;
 }
 
-void xg_pipeline_add_overlay(xg_pipeline *pipeline, xg_overlay *overlay)
+void xg_pipeline_set_zero_copy(xg_pipeline *pipeline, bool zero_copy)
 {
-	if (overlay == NULL)
+	pipeline->zero_copy = zero_copy;
+}
+
+xg_arena *xg_pipeline_acquire_arena(xg_pipeline *pipeline)
+{
+	xg_arena *arena = NULL;
+	acquire_mutex_or_die(&pipeline->arenas_lock);
+	if (pipeline->n_spare_arenas > 0)
+	{
+		arena = pipeline->spare_arenas[--pipeline->n_spare_arenas];
+	}
+	release_mutex_or_die(&pipeline->arenas_lock);
+	if (arena == NULL)
+	{
+		arena = xg_arena_create(0);
+	}
+	return arena;
+}
+
+void xg_pipeline_release_arena(xg_pipeline *pipeline, xg_arena *arena)
+{
+	if (arena == NULL)
 	{
 		return;
 	}
+	xg_arena_reset(arena);
+	acquire_mutex_or_die(&pipeline->arenas_lock);
+	bool kept = pipeline->n_spare_arenas < XG_PIPELINE_SPARE_ARENAS;
+	if (kept)
+	{
+		pipeline->spare_arenas[pipeline->n_spare_arenas++] = arena;
+	}
+	release_mutex_or_die(&pipeline->arenas_lock);
+	if (!kept)
+	{
+		xg_arena_free(arena);
+	}
+}
 
-	if (overlay->owned_by_pipeline)
+void xg_pipeline_set_frame_overlays(xg_pipeline *pipeline,
+				    const xg_frame *frame,
+				    xg_overlay *overlays, xg_arena *arena)
+{
+	xg_overlay_set *set = calloc(1, sizeof(xg_overlay_set));
+	if (set == NULL)
 	{
-		errorf(pipeline, "Overlay already owned by another pipeline");
+		errorf(pipeline, "Couldn't allocate memory for overlays");
+		free_overlay_list(overlays);
+		xg_pipeline_release_arena(pipeline, arena);
 		return;
 	}
-	overlay->owned_by_pipeline = true;
+	for (xg_overlay *item = overlays; item != NULL; item = item->next)
+	{
+		item->owned_by_pipeline = true;
+	}
+	set->head = overlays;
+	set->arena = arena;
+	set->sequence = frame ? frame->sequence : XG_TRACE_NO_FRAME;
+	set->pts = frame ? frame->pts : GST_CLOCK_TIME_NONE;
+	set->running_time = frame ? frame->running_time : GST_CLOCK_TIME_NONE;
+	atomic_init(&set->drawn, false);
+	publish_overlays(pipeline, set);
+	trace_since_capture(pipeline, XG_TRACE_CAPTURE_TO_INFERENCE,
+			    set->running_time, set->sequence);
+	// Headless pipelines never draw, so publishing is as far as they get
+	if (pipeline->headless)
+	{
+		xg_startup_mark(XG_STARTUP_FIRST_OVERLAY);
+	}
+}
 
-	if (pipeline->overlay_list == NULL)
+void xg_pipeline_set_overlays(xg_pipeline *pipeline, xg_overlay *overlays)
+{
+	xg_pipeline_set_frame_overlays(pipeline, NULL, overlays, NULL);
+}
+
+GstClockTime xg_pipeline_running_time(xg_pipeline *pipeline)
+{
+	GstElement *element = GST_ELEMENT(pipeline->gst_pipeline);
+	GstClock *clock = gst_element_get_clock(element);
+	if (clock == NULL)
+	{
+		return GST_CLOCK_TIME_NONE;
+	}
+	GstClockTime now = gst_clock_get_time(clock);
+	gst_object_unref(clock);
+	return now - gst_element_get_base_time(element);
+}
+
+void xg_pipeline_clear_overlays(xg_pipeline *pipeline)
+{
+	free_overlay_list(pipeline->back_overlays);
+	pipeline->back_overlays = NULL;
+	pipeline->back_tail = &pipeline->back_overlays;
+}
+
+void xg_pipeline_add_overlay(xg_pipeline *pipeline, xg_overlay *overlay)
+{
+	if (overlay == NULL)
 	{
-		pipeline->overlay_list = overlay;
-		overlay->next = NULL;
 		return;
 	}
 
-	// Traverse list to end, checking if overlay is already in the list to avoid
-	// cycles. This makes it linear in the number of overlays instead of constant
-	// time, but there probably aren't very many, so this is acceptable.
-	xg_overlay *item = pipeline->overlay_list;
-	while (item->next != NULL)
+	if (overlay->owned_by_pipeline)
 	{
-		if (overlay == item)
+		// Adding an overlay twice must not link the back set into a
+		// cycle. Only overlays already owned need the linear search.
+		for (xg_overlay *item = pipeline->back_overlays; item != NULL;
+		     item = item->next)
 		{
-			return;
+			if (item == overlay)
+			{
+				return;
+			}
 		}
-		item = item->next;
+		errorf(pipeline, "Overlay already owned by another pipeline");
+		return;
 	}
-	item->next = overlay;
+	overlay->owned_by_pipeline = true;
 	overlay->next = NULL;
+
+	// Nothing draws the back set, so it can simply be appended to
+	if (pipeline->back_tail == NULL)
+	{
+		pipeline->back_tail = &pipeline->back_overlays;
+	}
+	*pipeline->back_tail = overlay;
+	pipeline->back_tail = &overlay->next;
+}
+
+void xg_pipeline_swap_overlays(xg_pipeline *pipeline)
+{
+	xg_overlay *overlays = pipeline->back_overlays;
+	pipeline->back_overlays = NULL;
+	pipeline->back_tail = &pipeline->back_overlays;
+	xg_pipeline_set_overlays(pipeline, overlays);
 }
 
 void xg_pipeline_stop(xg_pipeline *pipeline)
@@ -681,7 +1994,10 @@ void xg_pipeline_stop(xg_pipeline *pipeline)
 	acquire_mutex_or_die(&pipeline->gst_pipeline_lock);
 	pipeline->running = false;
 	gst_element_set_state(GST_ELEMENT(pipeline->gst_pipeline), GST_STATE_NULL);
-	gtk_widget_hide(GTK_WIDGET(pipeline->window));
+	if (pipeline->window != NULL)
+	{
+		gtk_widget_hide(GTK_WIDGET(pipeline->window));
+	}
 	release_mutex_or_die(&pipeline->gst_pipeline_lock);
 }
 
@@ -691,6 +2007,11 @@ void xg_pipeline_free(xg_pipeline *pipeline)
 	{
 		return;
 	}
+	// A stop requested but not carried out yet must not run on a freed
+	// pipeline
+	while (g_idle_remove_by_data(pipeline))
+	{
+	}
 	if (pipeline->bus)
 	{
 		g_signal_handlers_disconnect_by_func(pipeline->bus, on_bus_message,
@@ -706,7 +2027,23 @@ void xg_pipeline_free(xg_pipeline *pipeline)
 						     pipeline);
 	}
 	gst_object_unref(pipeline->gst_pipeline);
-	gtk_widget_destroy(GTK_WIDGET(pipeline->window));
+	if (pipeline->window)
+	{
+		gtk_widget_destroy(GTK_WIDGET(pipeline->window));
+	}
+	free_overlay_set(pipeline, atomic_load(&pipeline->overlays));
+	free_overlay_set(pipeline, pipeline->retired_overlays);
+	free_overlay_list(pipeline->back_overlays);
+	xg_label_cache_free(pipeline->label_cache);
+	gst_caps_replace(&pipeline->direct_caps, NULL);
+	free_image_sequence(pipeline->image_sequence);
+	for (int32_t i = 0; i < pipeline->n_spare_arenas; ++i)
+	{
+		xg_arena_free(pipeline->spare_arenas[i]);
+	}
+	pthread_mutex_destroy(&pipeline->arenas_lock);
+	// Frames still held elsewhere keep the pool alive until they're freed
+	xg_frame_pool_free(pipeline->frame_pool);
 	free(pipeline);
 }
 
@@ -716,7 +2053,19 @@ void xg_frame_free(xg_frame *frame)
 	{
 		return;
 	}
-	free((char *)frame->format);
-	g_free(frame->data);
+	if (frame->sample != NULL)
+	{
+		// Zero-copy frame: the data belongs to the sample
+		gst_buffer_unmap(gst_sample_get_buffer(frame->sample), &frame->map);
+		gst_sample_unref(frame->sample);
+		frame->sample = NULL;
+	}
+	if (frame->pool != NULL)
+	{
+		xg_frame_pool_release(frame);
+		return;
+	}
+	free(frame->storage);
+	free(frame->packed);
 	free(frame);
 }
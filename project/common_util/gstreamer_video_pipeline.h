@@ -3,18 +3,61 @@
 #ifndef __COMMON_UTIL_GSTREAMER_VIDEO_PIPELINE_H__
 #define __COMMON_UTIL_GSTREAMER_VIDEO_PIPELINE_H__
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include <gtk/gtk.h>
 #include <gst/gst.h>
+#include <gst/video/video.h>
 #include <gst/video/videooverlay.h>
 
 #include "overlays.h"
 
+// How fast frames are delivered from sources that aren't live (files, image
+// sequences and videotestsrc); live sources always deliver at their own rate
+typedef enum xg_pacing
+{
+	// At the rate the source's timestamps say, like a camera: frames the
+	// model doesn't keep up with are dropped
+	XG_PACING_REALTIME,
+	// As fast as the slowest consumer takes them, without dropping any, so
+	// the pipeline doubles as a throughput benchmark
+	XG_PACING_FAST,
+} xg_pacing;
+
+// How the camera is captured and how the pipeline processes it. Start from
+// xg_pipeline_config_init() and override what the deployment needs, e.g. with
+// xg_pipeline_config_parse() so it can be changed without recompiling.
+typedef struct xg_pipeline_config
+{
+	// Smallest capture size and frame rate wanted, or 0 for no constraint.
+	// The pipeline picks the camera mode that satisfies these at the lowest
+	// pixel rate, so the video may be bigger than asked for if the camera
+	// has no exact match.
+	int32_t width, height;
+	int32_t fps;
+	// Pixel format to capture in (a GStreamer format name such as "YUY2"),
+	// or NULL for any raw format, preferring ones the model takes directly
+	const char *format;
+	// How to flip or rotate camera video, as a GstVideoOrientationMethod
+	// (e.g. GST_VIDEO_ORIENTATION_HORIZ to mirror it). Recorded sources are
+	// used as they are.
+	int32_t flip;
+	xg_pacing pacing;
+	// Size to scale the frames handed to xg_pipeline_get_frame() to, e.g.
+	// the resolution the model works at, or 0 for the capture size. The
+	// displayed video keeps the capture size. Scaling is done by the same
+	// hardware converter as the format conversion where the system has one
+	// (imxvideoconvert_g2d or v4l2convert), or by videoscale otherwise.
+	int32_t inference_width, inference_height;
+	// Most frames the queue ahead of each branch may hold, or 0 for
+	// GStreamer's default
+	int32_t appsink_queue_depth, display_queue_depth;
+} xg_pipeline_config;
+
 ////// matheus.castello
-#define DEMO_HEIGH 720;
-#define DEMO_WIDTH 576;
 
 typedef struct xg_error
 {
@@ -22,63 +65,276 @@ typedef struct xg_error
 	struct xg_error *next;
 } xg_error;
 
+enum
+{
+	// Arenas a pipeline keeps for reuse after the overlays built in them are
+	// freed. Only the current set, one retired set and whatever is being
+	// built are ever alive at once.
+	XG_PIPELINE_SPARE_ARENAS = 4
+};
+
 struct xg_pipeline
 {
-	bool running;
+	// Cleared by xg_pipeline_stop() on the main thread while capture threads
+	// may be pulling frames
+	atomic_bool running;
+	// Created by xg_create_headless_pipeline(): no window, no display branch,
+	// and events are dispatched without GTK
+	bool headless;
 	GtkWindow *window;
 
 	GstPipeline *gst_pipeline;
 	GstBus *bus;
 	GstElement *appsink;
+	GstElement *appsink_capsfilter;
 	GtkWidget *video_widget;
 	GstVideoOverlay *overlay;
 	// Prevent querying appsink while stream stopping
 	pthread_mutex_t gst_pipeline_lock;
 
-	xg_overlay *overlay_list;
-	// Prevent drawing overlays while updating the list
-	pthread_mutex_t overlay_lock;
+	// When true (the default), frames reference the mapped GStreamer buffer
+	// instead of copying it. See xg_pipeline_set_zero_copy().
+	bool zero_copy;
+	// What the appsink asks for; see xg_pipeline_set_native_format() and
+	// xg_pipeline_config.inference_width/height
+	bool native_format;
+	int32_t inference_width, inference_height;
+	// What the pipeline was created with; @config.format is interned
+	xg_pipeline_config config;
+	// Recycles frames and their pixel buffers; see frame_pool.h
+	struct xg_frame_pool *frame_pool;
 
-	bool error_occurred;
+	// Overlays currently drawn on the video. The draw callback reads this
+	// without locking: it announces the set it is drawing in @overlays_hazard,
+	// and a set replaced while still being drawn is parked in
+	// @retired_overlays until the next publish instead of being freed.
+	_Atomic(struct xg_overlay_set *) overlays;
+	_Atomic(struct xg_overlay_set *) overlays_hazard;
+	struct xg_overlay_set *retired_overlays;
+	// Overlays added since the last swap, which aren't drawn until
+	// xg_pipeline_swap_overlays() publishes them. @back_tail points at the
+	// list's terminating NULL, so adding is constant time.
+	xg_overlay *back_overlays;
+	xg_overlay **back_tail;
+	// Labels already rendered, for the draw callback only
+	xg_label_cache *label_cache;
+
+	// The display branch. Overlays are drawn by @cairo_overlay, or when
+	// @direct_overlays is set, by a probe on @overlay_capsfilter that
+	// rasterizes them into the video itself; either way the video then
+	// goes to @display_sink. See xg_pipeline_set_direct_overlays().
+	GstElement *overlay_capsfilter;
+	GstElement *cairo_overlay;
+	GstElement *display_sink;
+	bool direct_overlays;
+	gulong direct_probe;
+	// Files still to be played by an image-sequence source
+	struct xg_image_sequence *image_sequence;
+	// Caps of the frames the probe last drew on, and their layout
+	GstCaps *direct_caps;
+	GstVideoInfo direct_info;
+	// Arenas recycled from freed overlay sets, for
+	// xg_pipeline_acquire_arena(). Guarded by @arenas_lock, since overlays
+	// may be built on several threads at once.
+	pthread_mutex_t arenas_lock;
+	xg_arena *spare_arenas[XG_PIPELINE_SPARE_ARENAS];
+	int32_t n_spare_arenas;
+
+	// Set on whichever thread hits an error; read it from other threads
+	// through xg_pipeline_error_occurred()
+	atomic_bool error_occurred;
+	// Frames handed out by xg_pipeline_pull_frame() so far
+	uint64_t frames_pulled;
 };
 //////// matheus.castello
 
 // Xnor-sample Gstreamer pipeline
 typedef struct xg_pipeline xg_pipeline;
 
+enum
+{
+	// Most planes any format accepted by the pipeline has (I420)
+	XG_FRAME_MAX_PLANES = 3
+};
+
 // Xnor-sample Gstreamer video frame.
 typedef struct xg_frame
 {
-	// A string specifying the video format, e.g. "RGB"
+	// A string specifying the video format, e.g. "RGB", "YUY2" or "NV12".
+	// Interned, so it stays valid for the life of the program.
 	const char *format;
 	// Dimensions of the frame, in pixels
 	int32_t width, height;
+	// Number of frames pulled from the pipeline before this one, which
+	// identifies the frame in traces (see frame_trace.h)
+	uint64_t sequence;
+	// Per-frame scratch memory for the model's results and the overlays
+	// built from them, which lives as long as those overlays are shown. The
+	// runner sets this up before handing the frame to its callbacks (see
+	// threaded_runner.h); it is NULL otherwise and isn't owned by the frame.
+	xg_arena *arena;
+	// When the source captured the frame: its buffer's presentation timestamp,
+	// and that converted to the pipeline's running time, which
+	// xg_pipeline_running_time() can be compared against. Either may be
+	// GST_CLOCK_TIME_NONE if the source doesn't timestamp its buffers.
+	GstClockTime pts;
+	GstClockTime running_time;
 	// Raw frame data. Structure is dictated by @format
 	uint8_t *data;
+	// Start of each plane within @data and the byte offset from one row of that
+	// plane to the next. Packed formats (RGB, YUY2) only use the first plane.
+	int32_t n_planes;
+	uint8_t *planes[XG_FRAME_MAX_PLANES];
+	int32_t strides[XG_FRAME_MAX_PLANES];
+	// Scratch buffer of @packed_size bytes used when the planes have to be
+	// repacked to drop row padding before handing them to the model. Owned by
+	// the frame.
+	uint8_t *packed;
+	size_t packed_size;
+
+	// Zero-copy frames keep the sample alive and its buffer mapped for as long
+	// as the frame exists, and @data points straight into @map. For copied
+	// frames @sample is NULL and @data points into @storage.
+	GstSample *sample;
+	GstMapInfo map;
+
+	// Pool the frame goes back to when freed, if any, and the cache-aligned
+	// buffer of @storage_size bytes it keeps across uses
+	struct xg_frame_pool *pool;
+	uint8_t *storage;
+	size_t storage_size;
 } xg_frame;
 
 // Must be called exactly once at the start of the program
 void xg_init(int *argc, char **argv[]);
+// Like xg_init(), for programs that only use headless pipelines. Doesn't
+// initialize GTK, so no display needs to be available.
+void xg_init_headless(int *argc, char **argv[]);
+
+// Fills in the default configuration: 320x240 at any frame rate and format,
+// mirrored, with frames for the model at the capture size
+void xg_pipeline_config_init(xg_pipeline_config *config);
+// Overrides parts of @config from a comma-separated list of settings:
+//   size=WxH, fps=N, format=NAME, flip=none|mirror|vertical|rotate-90|
+//   rotate-180|rotate-270, pacing=realtime|fast, inference-size=WxH,
+//   appsink-queue=N, display-queue=N
+// e.g. "size=640x480,fps=15,inference-size=320x240". Prints an error and
+// returns false if a setting isn't recognized.
+bool xg_pipeline_config_parse(xg_pipeline_config *config, const char *settings);
 
 // Initializes a GStreamer pipeline. The pipeline opens a window which displays
-// a live video feed and draws arbitrary overlays on top of the video. You must
-// free the pipeline with xg_pipeline_free when you are done with it.
+// a live video feed and draws arbitrary overlays on top of the video. @device
+// names the source to capture from:
+//   /dev/videoN           a V4L2 camera
+//   file://PATH           a video file, decoded with decodebin
+//   videotestsrc          a generated test pattern
+//   a directory           the JPEG or PNG images in it, in name order, one
+//                         frame each at the configured fps (30 if unset)
+//   shm://SOCKET          raw frames from a GStreamer shmsink; the config must
+//                         give their exact size, format and fps
+// Recorded sources end the stream (and so stop the pipeline) when they run
+// out, and are paced as @config->pacing says. @config may be NULL for the
+// defaults. You must free the pipeline with xg_pipeline_free when you are done
+// with it.
 xg_pipeline *xg_create_video_overlay_pipeline(const char *window_title,
-						const char *device, bool gui);
-// Starts the pipeline and opens the window
+					      const char *device, bool gui,
+					      const xg_pipeline_config *config);
+// Creates a pipeline that only captures frames for inference: the source feeds
+// the appsink branch directly, with no display branch, window or overlay
+// drawing, and no GTK calls at all. @source is any of the sources
+// xg_create_video_overlay_pipeline() takes. Overlays may still be set on
+// it; they are simply never drawn. @config may be NULL for the defaults.
+xg_pipeline *xg_create_headless_pipeline(const char *source,
+					 const xg_pipeline_config *config);
+// Starts the pipeline and opens the window, if it has one
 void xg_pipeline_start(xg_pipeline *pipeline);
+// Dispatches pending window and pipeline bus events (GTK's for windowed
+// pipelines, the default GLib main context's for headless ones), waiting for
+// one if there are none and @may_block is set. Call it from the main thread to
+// keep the pipeline going, e.g. in a loop until xg_pipeline_running() is false.
+void xg_pipeline_dispatch_events(xg_pipeline *pipeline, bool may_block);
 // Returns whether or not the pipeline has been stopped (e.g. by a keyboard
 // event or WM message)
 bool xg_pipeline_running(xg_pipeline *pipeline);
-// Extracts the latest frame of video from the pipeline. You must free this
-// frame using xg_frame_free() when done with it.
+// Extracts the latest frame of video from the pipeline, without pumping GTK
+// events, so it can be called from a capture thread. Waits at most @timeout
+// for a frame (GST_CLOCK_TIME_NONE waits indefinitely) and returns NULL if none
+// arrived or the pipeline is stopped. Free the frame with xg_frame_free().
+xg_frame *xg_pipeline_pull_frame(xg_pipeline *pipeline, GstClockTime timeout);
+// Processes pending events, then waits for the latest frame of video from
+// the pipeline. Must be called from the GTK main thread. You must free this
+// frame using xg_frame_free() when done with it. Unless zero-copy mode has been
+// disabled, the frame's data is the GStreamer buffer itself, so hold on to it
+// only as long as needed: the buffer can't be recycled by upstream elements
+// until the frame is freed.
 xg_frame *xg_pipeline_get_frame(xg_pipeline *pipeline);
-// Adds an overlay to the pipeline, which will be drawn on top of the video each
-// frame until cleared. An overlay can only be added to one pipeline at a time,
-// and the pipeline takes ownership of the overlay's resources when it is added.
+// Selects whether xg_pipeline_get_frame() hands out frames that point directly
+// into the mapped GStreamer buffer (true, the default) or private copies of
+// the image data (false). Copies are only worth it if frames are kept around
+// for a long time, e.g. queued behind a slow consumer.
+void xg_pipeline_set_zero_copy(xg_pipeline *pipeline, bool zero_copy);
+// Selects the pixel formats the pipeline delivers to xg_pipeline_get_frame().
+// By default every frame is converted to RGB. In native mode the pipeline
+// instead accepts YUY2, NV12, NV21 and I420 as well, so a camera producing one
+// of those is passed through without a software conversion; use
+// xg_frame_create_xnor_input() to feed such frames to a model. Must be called
+// before xg_pipeline_start().
+void xg_pipeline_set_native_format(xg_pipeline *pipeline, bool native);
+// Selects how overlays are drawn on the displayed video. By default
+// cairooverlay draws them, which means converting every displayed frame to a
+// format cairo can draw into. With @direct set they are instead rasterized
+// straight into the video in its own format (see overlay_raster.h), so a
+// camera producing YUY2, NV12 or 32-bit RGB needs no conversion at all. A frame
+// with overlays is copied first if the appsink branch still holds it (e.g. in
+// zero-copy mode), which is still far cheaper than converting it. Must be
+// called before xg_pipeline_start().
+void xg_pipeline_set_direct_overlays(xg_pipeline *pipeline, bool direct);
+// Replaces every overlay on the pipeline with the linked list starting at
+// @overlays (which may be NULL), in a single atomic step. The pipeline takes
+// ownership of the list. Safe to call from any one thread at a time while the
+// video is being drawn; the previous overlays are freed once no longer drawn.
+void xg_pipeline_set_overlays(xg_pipeline *pipeline, xg_overlay *overlays);
+// Like xg_pipeline_set_overlays(), for overlays that show the results for
+// @frame. The set is tagged with the frame's capture time, so that when
+// tracing, how long after capture the overlays were published and then drawn
+// is recorded (see frame_trace.h). If the overlays (or anything else shown with
+// them) were allocated from @arena, the pipeline takes it over too and
+// recycles it once they are freed; otherwise @arena is NULL.
+void xg_pipeline_set_frame_overlays(xg_pipeline *pipeline,
+				    const xg_frame *frame,
+				    xg_overlay *overlays, xg_arena *arena);
+// Returns an empty arena (see arena.h) to build one frame's overlays in,
+// reusing one whose overlays have been taken down if possible, or NULL if out
+// of memory. Hand it back with the overlays to
+// xg_pipeline_set_frame_overlays(), or to xg_pipeline_release_arena() if they
+// are never published. Safe to call from any thread.
+xg_arena *xg_pipeline_acquire_arena(xg_pipeline *pipeline);
+void xg_pipeline_release_arena(xg_pipeline *pipeline, xg_arena *arena);
+// The pipeline's current running time, or GST_CLOCK_TIME_NONE if it has no
+// clock yet
+GstClockTime xg_pipeline_running_time(xg_pipeline *pipeline);
+// Asks the GTK main thread to stop the pipeline. Unlike xg_pipeline_stop(),
+// this may be called from any thread.
+void xg_pipeline_request_stop(xg_pipeline *pipeline);
+// Whether the pipeline has hit an error. Safe to call from any thread.
+bool xg_pipeline_error_occurred(xg_pipeline *pipeline);
+// The pipeline is double-buffered: the overlays being drawn (the front set)
+// are never modified, while the next set is built up in a back set that
+// nothing draws. So the video never shows a half-built or cleared list, and
+// the draw callback never waits for whoever is building.
+//
+// Adds an overlay to the back set, in constant time. Adding one already in
+// the back set does nothing. An overlay can only be added to one pipeline at
+// a time, and the pipeline takes ownership of the overlay's resources when it
+// is added.
 void xg_pipeline_add_overlay(xg_pipeline *pipeline, xg_overlay *overlay);
-// Removes all overlays from the pipeline, freeing them
+// Empties the back set, freeing its overlays. The overlays on screen stay up.
 void xg_pipeline_clear_overlays(xg_pipeline *pipeline);
+// Makes the back set the one drawn on the video, in a single atomic step, and
+// starts a new, empty back set. The old front set is freed once the draw
+// callback is done with it. Like xg_pipeline_set_overlays(), which replaces
+// the front set directly, only one thread at a time may build and swap.
+void xg_pipeline_swap_overlays(xg_pipeline *pipeline);
 // Toggles between paused and playing states
 void xg_pipeline_toggle_pause(xg_pipeline *pipeline);
 // Stops the pipeline, hiding the window
@@ -0,0 +1,98 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "image_input.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "model_library.h"
+
+static const char* const FORMAT_NAMES[] = {
+    [kImageFormatRGB] = "rgb",         [kImageFormatJPEG] = "jpeg",
+    [kImageFormatYUV422] = "yuv422",   [kImageFormatYUV420P] = "yuv420p",
+    [kImageFormatNV12] = "nv12",       [kImageFormatNV21] = "nv21",
+};
+static const int NUM_FORMATS = sizeof(FORMAT_NAMES) / sizeof(FORMAT_NAMES[0]);
+
+bool parse_image_format(const char* name, enum image_format* format_out) {
+  for (int i = 0; i < NUM_FORMATS; ++i) {
+    if (strcmp(name, FORMAT_NAMES[i]) == 0) {
+      *format_out = (enum image_format)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* image_format_name(enum image_format format) {
+  if ((int)format < 0 || (int)format >= NUM_FORMATS) {
+    return "unknown";
+  }
+  return FORMAT_NAMES[format];
+}
+
+// Size of one subsampled 4:2:0 chroma plane
+static int64_t chroma_size(int32_t width, int32_t height) {
+  return (((int64_t)width + 1) / 2) * (((int64_t)height + 1) / 2);
+}
+
+int64_t image_format_size(enum image_format format, int32_t width,
+                          int32_t height) {
+  switch (format) {
+    case kImageFormatRGB:
+      return (int64_t)width * height * 3;
+    case kImageFormatYUV422:
+      return (((int64_t)width + 1) / 2) * 4 * height;
+    case kImageFormatYUV420P:
+    case kImageFormatNV12:
+    case kImageFormatNV21:
+      return (int64_t)width * height + 2 * chroma_size(width, height);
+    case kImageFormatJPEG:
+      break;
+  }
+  return -1;
+}
+
+void image_format_planes(enum image_format format, int32_t width,
+                         int32_t height, const uint8_t* data,
+                         const uint8_t* planes_out[3]) {
+  planes_out[0] = data;
+  planes_out[1] = NULL;
+  planes_out[2] = NULL;
+  // Only the 4:2:0 formats have more than one, following each other
+  if (format == kImageFormatYUV420P || format == kImageFormatNV12 ||
+      format == kImageFormatNV21) {
+    planes_out[1] = data + (ptrdiff_t)width * height;
+    planes_out[2] = planes_out[1] + chroma_size(width, height);
+  }
+}
+
+bool create_image_input(enum image_format format, int32_t width, int32_t height,
+                        const uint8_t* data, int32_t size,
+                        xnor_input** input_out) {
+  // The library validates the images themselves, but takes raw ones on trust
+  // to be as large as their dimensions say
+  if (format != kImageFormatJPEG &&
+      (width <= 0 || height <= 0 ||
+       size < image_format_size(format, width, height))) {
+    fprintf(stderr, "%d bytes is too little for a %dx%d %s image\n", size,
+            width, height, image_format_name(format));
+    return false;
+  }
+  if (format != kImageFormatJPEG) {
+    // The raw formats go through the same switch as inputs for loaded
+    // bundles, with the linked library
+    const uint8_t* planes[3];
+    image_format_planes(format, width, height, data, planes);
+    return xg_model_library_create_input(xg_model_library_linked(), format,
+                                         width, height, planes, input_out);
+  }
+  xnor_error* error = xnor_input_create_jpeg_image(data, size, input_out);
+  if (error != NULL) {
+    fprintf(stderr, "%s\n", xnor_error_get_description(error));
+    xnor_error_free(error);
+    return false;
+  }
+  return true;
+}
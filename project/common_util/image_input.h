@@ -0,0 +1,52 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_IMAGE_INPUT_H__
+#define __COMMON_UTIL_IMAGE_INPUT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "xnornet.h"
+
+// Every image layout the model can take input in, one per
+// xnor_input_create_*_image() constructor
+enum image_format {
+  kImageFormatRGB,
+  kImageFormatJPEG,
+  kImageFormatYUV422,
+  kImageFormatYUV420P,
+  kImageFormatNV12,
+  kImageFormatNV21,
+};
+
+// Looks up a format by the name used on command lines: rgb, jpeg, yuv422,
+// yuv420p, nv12 or nv21. Returns false if @name isn't one of them.
+bool parse_image_format(const char* name, enum image_format* format_out);
+
+const char* image_format_name(enum image_format format);
+
+// Size in bytes of a tightly packed @width x @height image, or -1 for JPEG,
+// whose size depends on its content. Chroma planes of the 4:2:0 formats are
+// rounded up for odd dimensions. Computed in 64 bits, so that it doesn't
+// overflow for any dimensions.
+int64_t image_format_size(enum image_format format, int32_t width,
+                          int32_t height);
+
+// Finds the start of each plane of a tightly packed @width x @height image in
+// @data, in the order xg_model_library_create_input() takes them. RGB, YUV422
+// and JPEG images have only the first; the others are set to NULL.
+void image_format_planes(enum image_format format, int32_t width,
+                         int32_t height, const uint8_t* data,
+                         const uint8_t* planes_out[3]);
+
+// Creates a model input from an image in @format, using the constructor for
+// that format. Raw formats must be @width x @height and at least
+// image_format_size() bytes, which is checked; JPEG images carry their own
+// dimensions. As with
+// the constructors, @data must outlive the input. Prints the reason and returns
+// false on failure.
+bool create_image_input(enum image_format format, int32_t width, int32_t height,
+                        const uint8_t* data, int32_t size,
+                        xnor_input** input_out);
+
+#endif  // __COMMON_UTIL_IMAGE_INPUT_H__
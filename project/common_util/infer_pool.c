@@ -0,0 +1,455 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+// pthread_setaffinity_np() and the CPU_* macros are GNU extensions
+#define _GNU_SOURCE
+
+#include "infer_pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "frame_trace.h"
+#include "startup_profile.h"
+
+enum
+{
+	// Inputs each worker may have queued, including the one it is running.
+	// Two lets a worker start on its next input as soon as it finishes one.
+	WORKER_QUEUE_DEPTH = 2
+};
+
+typedef struct pool_job
+{
+	const xnor_input *input;
+	void *tag;
+	uint64_t seq;
+} pool_job;
+
+// A finished job waiting for the jobs submitted before it
+typedef struct pool_result
+{
+	bool ready;
+	void *tag;
+	xnor_evaluation_result *result;
+	xnor_error *error;
+} pool_result;
+
+typedef struct pool_worker
+{
+	xg_infer_pool *pool;
+	int32_t index;
+	pthread_t thread;
+	xnor_model *model;
+	xnor_error *load_error;
+
+	pool_job queue[WORKER_QUEUE_DEPTH];
+	int32_t queue_head, queue_length;
+	// Jobs queued plus the one being evaluated
+	int32_t load;
+	// Set by xg_infer_pool_warm_up() until the worker has run the warm-up
+	bool warmup_pending;
+	pthread_cond_t work_available;
+} pool_worker;
+
+struct xg_infer_pool
+{
+	xnor_threading_model threading_model;
+	enum xg_infer_pool_dispatch dispatch;
+	bool ordered;
+	xg_infer_pool_result_fn on_result;
+	void *user_data;
+
+	int32_t n_workers;
+	pool_worker *workers;
+	int32_t next_worker;
+
+	// Everything below is protected by @lock
+	pthread_mutex_t lock;
+	pthread_cond_t state_changed;
+	int32_t n_loaded;
+	bool shutting_down;
+	uint64_t next_seq;
+	// Results are delivered in sequence order out of this reorder window
+	pool_result *results;
+	int32_t window;
+	uint64_t next_delivery;
+	int32_t in_flight;
+	bool delivering;
+	// What xg_infer_pool_warm_up() asked for, and the workers yet to run it
+	xg_warmup_config warmup;
+	int32_t n_warming;
+};
+
+static void pin_to_core(pool_worker *worker)
+{
+	long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cores <= 1)
+	{
+		return;
+	}
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(worker->index % n_cores, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+	{
+		fprintf(stderr, "Couldn't pin inference worker %d to a core\n",
+			worker->index);
+	}
+}
+
+static bool load_model(pool_worker *worker)
+{
+	xnor_model_load_options *options = xnor_model_load_options_create();
+	worker->load_error = xnor_model_load_options_set_threading_model(
+	    options, worker->pool->threading_model);
+	if (worker->load_error == NULL)
+	{
+		worker->load_error =
+		    xnor_model_load_built_in("", options, &worker->model);
+	}
+	xnor_model_load_options_free(options);
+	return worker->load_error == NULL;
+}
+
+// Hands completed results to the callback in submission order. Only one thread
+// delivers at a time; a worker finishing out of order just parks its result.
+// Called and returns with the pool lock held.
+static void deliver_results(xg_infer_pool *pool)
+{
+	if (pool->delivering)
+	{
+		return;
+	}
+	pool->delivering = true;
+	for (;;)
+	{
+		pool_result *slot = &pool->results[pool->next_delivery % pool->window];
+		if (!slot->ready)
+		{
+			break;
+		}
+		pool_result done = *slot;
+		slot->ready = false;
+		++pool->next_delivery;
+
+		pthread_mutex_unlock(&pool->lock);
+		pool->on_result(done.tag, done.result, done.error, pool->user_data);
+		pthread_mutex_lock(&pool->lock);
+		--pool->in_flight;
+	}
+	pool->delivering = false;
+	pthread_cond_broadcast(&pool->state_changed);
+}
+
+static void *worker_main(void *arg)
+{
+	pool_worker *worker = (pool_worker *)arg;
+	xg_infer_pool *pool = worker->pool;
+	char name[32];
+	snprintf(name, sizeof(name), "inference pool %d", worker->index);
+	xg_trace_set_thread_name(name);
+
+	// A multi-threaded instance starts its own threads, which would inherit the
+	// pinning, so only single-threaded instances get a core to themselves.
+	if (pool->threading_model == kXnorThreadingModelSingleThreaded)
+	{
+		pin_to_core(worker);
+	}
+	bool loaded = load_model(worker);
+
+	pthread_mutex_lock(&pool->lock);
+	++pool->n_loaded;
+	pthread_cond_broadcast(&pool->state_changed);
+	if (!loaded)
+	{
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+	for (;;)
+	{
+		while (worker->queue_length == 0 && !worker->warmup_pending &&
+		       !pool->shutting_down)
+		{
+			pthread_cond_wait(&worker->work_available, &pool->lock);
+		}
+		// Warming up goes ahead of any frames queued meanwhile, which
+		// would otherwise pay for it instead
+		if (worker->warmup_pending && !pool->shutting_down)
+		{
+			worker->warmup_pending = false;
+			xg_warmup_config warmup = pool->warmup;
+			pthread_mutex_unlock(&pool->lock);
+			bool warmed = xg_warmup_run(worker->model, &warmup);
+			pthread_mutex_lock(&pool->lock);
+			if (warmed && --pool->n_warming == 0)
+			{
+				xg_startup_mark(XG_STARTUP_WARMED_UP);
+			}
+			continue;
+		}
+		if (worker->queue_length == 0)
+		{
+			break;
+		}
+		pool_job job = worker->queue[worker->queue_head];
+		worker->queue_head = (worker->queue_head + 1) % WORKER_QUEUE_DEPTH;
+		--worker->queue_length;
+		pthread_cond_broadcast(&pool->state_changed);
+		pthread_mutex_unlock(&pool->lock);
+
+		// The pool only sees tags, so evaluations aren't tied to a frame in
+		// the trace; the runner's events on either side of it are
+		xnor_evaluation_result *result = NULL;
+		uint64_t trace_start = XG_TRACE_BEGIN();
+		xnor_error *error =
+		    xnor_model_evaluate(worker->model, job.input, NULL, &result);
+		XG_TRACE_END(XG_TRACE_EVALUATE, trace_start, XG_TRACE_NO_FRAME);
+		if (error == NULL)
+		{
+			xg_startup_mark(XG_STARTUP_FIRST_EVALUATION);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		--worker->load;
+		if (!pool->ordered)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			pool->on_result(job.tag, result, error, pool->user_data);
+			pthread_mutex_lock(&pool->lock);
+			--pool->in_flight;
+			pthread_cond_broadcast(&pool->state_changed);
+			continue;
+		}
+		pool_result *slot = &pool->results[job.seq % pool->window];
+		slot->ready = true;
+		slot->tag = job.tag;
+		slot->result = result;
+		slot->error = error;
+		deliver_results(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// Stops and joins the first @n_started workers, then frees the pool
+static void destroy_pool(xg_infer_pool *pool, int32_t n_started)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->shutting_down = true;
+	for (int32_t i = 0; i < n_started; ++i)
+	{
+		pthread_cond_signal(&pool->workers[i].work_available);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int32_t i = 0; i < n_started; ++i)
+	{
+		pool_worker *worker = &pool->workers[i];
+		pthread_join(worker->thread, NULL);
+		pthread_cond_destroy(&worker->work_available);
+		xnor_model_free(worker->model);
+		xnor_error_free(worker->load_error);
+	}
+	pthread_cond_destroy(&pool->state_changed);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->results);
+	free(pool->workers);
+	free(pool);
+}
+
+xg_infer_pool *xg_infer_pool_create(int32_t n_instances,
+				    xnor_threading_model threading_model,
+				    xg_infer_pool_result_fn on_result,
+				    void *user_data)
+{
+	if (n_instances < 1)
+	{
+		fputs("An inference pool needs at least one model instance\n",
+		      stderr);
+		return NULL;
+	}
+	xg_infer_pool *pool = calloc(1, sizeof(xg_infer_pool));
+	if (pool == NULL)
+	{
+		fputs("Couldn't allocate memory for inference pool\n", stderr);
+		return NULL;
+	}
+	pool->threading_model = threading_model;
+	pool->dispatch = XG_INFER_POOL_LEAST_LOADED;
+	pool->ordered = true;
+	pool->on_result = on_result;
+	pool->user_data = user_data;
+	pool->n_workers = n_instances;
+	pool->window = n_instances * WORKER_QUEUE_DEPTH;
+	pool->workers = calloc(n_instances, sizeof(pool_worker));
+	pool->results = calloc(pool->window, sizeof(pool_result));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->state_changed, NULL);
+	if (pool->workers == NULL || pool->results == NULL)
+	{
+		fputs("Couldn't allocate memory for inference pool\n", stderr);
+		destroy_pool(pool, 0);
+		return NULL;
+	}
+
+	int32_t n_started = 0;
+	for (; n_started < n_instances; ++n_started)
+	{
+		pool_worker *worker = &pool->workers[n_started];
+		worker->pool = pool;
+		worker->index = n_started;
+		pthread_cond_init(&worker->work_available, NULL);
+		if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+		{
+			pthread_cond_destroy(&worker->work_available);
+			fputs("Couldn't start inference worker\n", stderr);
+			break;
+		}
+	}
+
+	// Wait for every instance to finish loading
+	pthread_mutex_lock(&pool->lock);
+	while (pool->n_loaded < n_started)
+	{
+		pthread_cond_wait(&pool->state_changed, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	bool ok = n_started == n_instances;
+	for (int32_t i = 0; i < n_started; ++i)
+	{
+		if (pool->workers[i].load_error != NULL)
+		{
+			fprintf(stderr, "%s\n", xnor_error_get_description(
+						    pool->workers[i].load_error));
+			ok = false;
+			break;
+		}
+	}
+	if (!ok)
+	{
+		destroy_pool(pool, n_started);
+		return NULL;
+	}
+	xg_startup_mark(XG_STARTUP_MODEL_LOADED);
+	return pool;
+}
+
+void xg_infer_pool_set_dispatch(xg_infer_pool *pool,
+				enum xg_infer_pool_dispatch dispatch)
+{
+	pool->dispatch = dispatch;
+}
+
+void xg_infer_pool_set_ordered(xg_infer_pool *pool, bool ordered)
+{
+	pool->ordered = ordered;
+}
+
+void xg_infer_pool_warm_up(xg_infer_pool *pool, const xg_warmup_config *config)
+{
+	if (config->evaluations <= 0)
+	{
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->warmup = *config;
+	pool->n_warming = pool->n_workers;
+	for (int32_t i = 0; i < pool->n_workers; ++i)
+	{
+		pool->workers[i].warmup_pending = true;
+		pthread_cond_signal(&pool->workers[i].work_available);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int32_t xg_infer_pool_size(xg_infer_pool *pool) { return pool->n_workers; }
+
+xnor_model *xg_infer_pool_model(xg_infer_pool *pool)
+{
+	return pool->workers[0].model;
+}
+
+// Picks the worker for the next job, or NULL if it has to wait for space.
+// Called with the pool lock held.
+static pool_worker *choose_worker(xg_infer_pool *pool)
+{
+	if (pool->in_flight >= pool->window)
+	{
+		return NULL;
+	}
+	if (pool->dispatch == XG_INFER_POOL_ROUND_ROBIN)
+	{
+		pool_worker *worker = &pool->workers[pool->next_worker];
+		if (worker->queue_length == WORKER_QUEUE_DEPTH)
+		{
+			return NULL;
+		}
+		pool->next_worker = (pool->next_worker + 1) % pool->n_workers;
+		return worker;
+	}
+
+	pool_worker *least_loaded = NULL;
+	for (int32_t i = 0; i < pool->n_workers; ++i)
+	{
+		// Start the scan after the last worker chosen, so ties rotate
+		pool_worker *worker =
+		    &pool->workers[(pool->next_worker + i) % pool->n_workers];
+		if (worker->queue_length == WORKER_QUEUE_DEPTH)
+		{
+			continue;
+		}
+		if (least_loaded == NULL || worker->load < least_loaded->load)
+		{
+			least_loaded = worker;
+		}
+	}
+	if (least_loaded != NULL)
+	{
+		pool->next_worker = (least_loaded->index + 1) % pool->n_workers;
+	}
+	return least_loaded;
+}
+
+void xg_infer_pool_submit(xg_infer_pool *pool, const xnor_input *input,
+			  void *tag)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool_worker *worker;
+	while ((worker = choose_worker(pool)) == NULL)
+	{
+		pthread_cond_wait(&pool->state_changed, &pool->lock);
+	}
+	int32_t tail =
+	    (worker->queue_head + worker->queue_length) % WORKER_QUEUE_DEPTH;
+	worker->queue[tail] = (pool_job){input, tag, pool->next_seq++};
+	++worker->queue_length;
+	++worker->load;
+	++pool->in_flight;
+	pthread_cond_signal(&worker->work_available);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void xg_infer_pool_drain(xg_infer_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->in_flight > 0)
+	{
+		pthread_cond_wait(&pool->state_changed, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void xg_infer_pool_free(xg_infer_pool *pool)
+{
+	if (pool == NULL)
+	{
+		return;
+	}
+	xg_infer_pool_drain(pool);
+	destroy_pool(pool, pool->n_workers);
+}
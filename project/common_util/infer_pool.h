@@ -0,0 +1,78 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_INFER_POOL_H__
+#define __COMMON_UTIL_INFER_POOL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "model_warmup.h"
+#include "xnornet.h"
+
+// A pool of independently loaded instances of the built-in model, each driven
+// by its own worker thread. A single xnor_model can't evaluate from two threads
+// at once, but separate instances can, so on a many-core board N
+// single-threaded instances (each pinned to its own core) usually get more
+// frames through than one multi-threaded instance.
+//
+// Inputs are dispatched to the workers as they are submitted, and results are
+// handed back through a callback strictly in submission order, whichever
+// worker finishes first.
+typedef struct xg_infer_pool xg_infer_pool;
+
+enum xg_infer_pool_dispatch
+{
+	// Send each input to the next worker in turn
+	XG_INFER_POOL_ROUND_ROBIN,
+	// Send each input to the worker with the fewest inputs queued or running
+	XG_INFER_POOL_LEAST_LOADED,
+};
+
+// Receives the outcome of evaluating the input submitted with @tag. Exactly one
+// of @result and @error is non-NULL; the callback takes ownership of it. Calls
+// are never concurrent and always arrive in submission order (unless the pool
+// is unordered, see xg_infer_pool_set_ordered()), but may come from any worker
+// thread.
+typedef void (*xg_infer_pool_result_fn)(void *tag,
+					xnor_evaluation_result *result,
+					xnor_error *error, void *user_data);
+
+// Loads @n_instances instances of the built-in model with the given threading
+// model, in parallel. Single-threaded instances are pinned to a core each.
+// Stamps XG_STARTUP_MODEL_LOADED once they all are, and the pool stamps
+// XG_STARTUP_FIRST_EVALUATION too (see startup_profile.h). Returns NULL and
+// prints a message to stderr on failure.
+xg_infer_pool *xg_infer_pool_create(int32_t n_instances,
+				    xnor_threading_model threading_model,
+				    xg_infer_pool_result_fn on_result,
+				    void *user_data);
+// Defaults to XG_INFER_POOL_LEAST_LOADED
+void xg_infer_pool_set_dispatch(xg_infer_pool *pool,
+				enum xg_infer_pool_dispatch dispatch);
+// Pools deliver results in submission order by default. An unordered pool
+// hands each result to the callback as soon as it is ready instead, straight
+// from the worker that evaluated it, so one slow evaluation doesn't hold up
+// the others; calls may then be concurrent and arrive in any order. Must be
+// called before anything is submitted.
+void xg_infer_pool_set_ordered(xg_infer_pool *pool, bool ordered);
+// Has every instance run the dummy evaluations of @config (see model_warmup.h)
+// on its worker thread, ahead of anything submitted. Returns straight away, so
+// the instances warm up while the caller e.g. starts the video pipeline; inputs
+// submitted meanwhile wait for their instance to finish. XG_STARTUP_WARMED_UP
+// is stamped once every instance has (see startup_profile.h).
+void xg_infer_pool_warm_up(xg_infer_pool *pool, const xg_warmup_config *config);
+// Number of model instances in the pool
+int32_t xg_infer_pool_size(xg_infer_pool *pool);
+// Gets the model of one of the instances, e.g. for xnor_model_get_info(). It
+// must not be evaluated directly.
+xnor_model *xg_infer_pool_model(xg_infer_pool *pool);
+// Queues @input for evaluation. Blocks while every worker already has a full
+// queue. @input must stay valid until its result has been delivered.
+void xg_infer_pool_submit(xg_infer_pool *pool, const xnor_input *input,
+			  void *tag);
+// Waits until the results of every submitted input have been delivered
+void xg_infer_pool_drain(xg_infer_pool *pool);
+// Drains the pool, stops the workers and frees every model instance
+void xg_infer_pool_free(xg_infer_pool *pool);
+
+#endif  // __COMMON_UTIL_INFER_POOL_H__
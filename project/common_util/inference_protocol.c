@@ -0,0 +1,283 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+// memfd_create() is a GNU extension
+#define _GNU_SOURCE
+
+#include "inference_protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "startup_profile.h"
+#include "xnornet.h"
+
+bool xg_infer_send(int connection, const void* header, uint32_t header_size,
+                   const void* payload, uint32_t payload_size,
+                   int fd_to_pass) {
+  struct iovec parts[2] = {
+      {(void*)header, header_size},
+      {(void*)payload, payload != NULL ? payload_size : 0},
+  };
+  struct iovec* part = parts;
+  int n_parts = 2;
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  while (n_parts > 0) {
+    struct msghdr message = {.msg_iov = part, .msg_iovlen = n_parts};
+    if (fd_to_pass >= 0) {
+      // The descriptor goes with the first byte; it is only sent once
+      memset(&control, 0, sizeof(control));
+      message.msg_control = control.buffer;
+      message.msg_controllen = sizeof(control.buffer);
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &fd_to_pass, sizeof(int));
+    }
+    ssize_t sent = sendmsg(connection, &message, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    fd_to_pass = -1;
+    // Skip whatever was sent
+    while (n_parts > 0 && (size_t)sent >= part->iov_len) {
+      sent -= part->iov_len;
+      ++part;
+      --n_parts;
+    }
+    if (n_parts > 0) {
+      part->iov_base = (uint8_t*)part->iov_base + sent;
+      part->iov_len -= sent;
+    }
+  }
+  return true;
+}
+
+bool xg_infer_recv(int connection, void* buffer, uint32_t size, int* fd_out) {
+  if (fd_out != NULL) {
+    *fd_out = -1;
+  }
+  uint8_t* next = buffer;
+  while (size > 0) {
+    struct iovec part = {next, size};
+    union {
+      struct cmsghdr header;
+      char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message = {.msg_iov = &part, .msg_iovlen = 1};
+    if (fd_out != NULL) {
+      message.msg_control = control.buffer;
+      message.msg_controllen = sizeof(control.buffer);
+    }
+    ssize_t received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      if (fd_out != NULL && *fd_out >= 0) {
+        close(*fd_out);
+        *fd_out = -1;
+      }
+      return false;
+    }
+    if (fd_out != NULL) {
+      for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL;
+           cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            *fd_out < 0) {
+          memcpy(fd_out, CMSG_DATA(cmsg), sizeof(int));
+        }
+      }
+    }
+    next += received;
+    size -= received;
+  }
+  return true;
+}
+
+const char* xg_infer_socket_path(void) {
+  const char* path = getenv(XG_INFER_SOCKET_ENV);
+  return path != NULL && path[0] != '\0' ? path : XG_INFER_DEFAULT_SOCKET;
+}
+
+int xg_infer_connect(const char* socket_path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+  int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (connection < 0) {
+    perror("Couldn't create socket");
+    return -1;
+  }
+  if (connect(connection, (struct sockaddr*)&address, sizeof(address)) != 0) {
+    fprintf(stderr,
+            "Couldn't connect to the inference server at %s: %s\n"
+            "(Is build/inference_server running?)\n",
+            socket_path, strerror(errno));
+    close(connection);
+    return -1;
+  }
+  return connection;
+}
+
+// Sends the request and waits for the response to it
+static bool exchange(int connection, const xg_infer_request* request,
+                     const uint8_t* data, int image_fd,
+                     xg_infer_response* response_out) {
+  memset(response_out, 0, sizeof(xg_infer_response));
+  if (!xg_infer_send(connection, request, sizeof(xg_infer_request), data,
+                     request->size, image_fd)) {
+    perror("Couldn't send request to the inference server");
+    return false;
+  }
+  xg_infer_response_header* header = &response_out->header;
+  if (!xg_infer_recv(connection, header, sizeof(xg_infer_response_header),
+                     NULL) ||
+      header->magic != XG_INFER_RESPONSE_MAGIC) {
+    fputs("Inference server closed the connection\n", stderr);
+    return false;
+  }
+  response_out->payload = malloc((size_t)header->size + 1);
+  if (response_out->payload == NULL) {
+    fputs("Couldn't allocate memory for response\n", stderr);
+    return false;
+  }
+  if (!xg_infer_recv(connection, response_out->payload, header->size, NULL)) {
+    fputs("Inference server closed the connection\n", stderr);
+    xg_infer_response_free(response_out);
+    return false;
+  }
+  response_out->payload[header->size] = '\0';
+  xg_startup_mark(XG_STARTUP_FIRST_EVALUATION);
+  return true;
+}
+
+static xg_infer_request make_request(enum image_format format, int32_t width,
+                                     int32_t height, int32_t size,
+                                     enum xg_infer_encoding encoding) {
+  xg_infer_request request = {
+      .magic = XG_INFER_REQUEST_MAGIC,
+      .version = XG_INFER_PROTOCOL_VERSION,
+      .format = format,
+      .encoding = encoding,
+      .width = width,
+      .height = height,
+      .size = size,
+  };
+  return request;
+}
+
+bool xg_infer_evaluate(int connection, enum image_format format, int32_t width,
+                       int32_t height, const uint8_t* data, int32_t size,
+                       enum xg_infer_encoding encoding,
+                       xg_infer_response* response_out) {
+  xg_infer_request request =
+      make_request(format, width, height, size, encoding);
+  return exchange(connection, &request, data, -1, response_out);
+}
+
+bool xg_infer_evaluate_fd(int connection, enum image_format format,
+                          int32_t width, int32_t height, int image_fd,
+                          int32_t size, enum xg_infer_encoding encoding,
+                          xg_infer_response* response_out) {
+  xg_infer_request request =
+      make_request(format, width, height, size, encoding);
+  request.flags = XG_INFER_IMAGE_IN_FD;
+  return exchange(connection, &request, NULL, image_fd, response_out);
+}
+
+bool xg_infer_evaluate_jpeg_file(int connection, const char* filename,
+                                 enum xg_infer_encoding encoding,
+                                 xg_infer_response* response_out) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Couldn't open %s: %s\n", filename, strerror(errno));
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0 ||
+      info.st_size > XG_INFER_MAX_IMAGE_SIZE) {
+    fprintf(stderr, "Couldn't read data from %s!\n", filename);
+    close(fd);
+    return false;
+  }
+  bool evaluated =
+      xg_infer_evaluate_fd(connection, kImageFormatJPEG, 0, 0, fd,
+                           info.st_size, encoding, response_out);
+  close(fd);
+  return evaluated;
+}
+
+bool xg_infer_create_shared_buffer(int32_t size, int* fd_out,
+                                   uint8_t** data_out) {
+  int fd = memfd_create("xnor-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    perror("Couldn't create shared buffer");
+    return false;
+  }
+  if (ftruncate(fd, size) != 0) {
+    perror("Couldn't size shared buffer");
+    close(fd);
+    return false;
+  }
+  // The server only maps buffers that can't shrink, and copies others
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+    perror("Couldn't seal shared buffer");
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("Couldn't map shared buffer");
+    close(fd);
+    return false;
+  }
+  *fd_out = fd;
+  *data_out = data;
+  return true;
+}
+
+void xg_infer_response_free(xg_infer_response* response) {
+  free(response->payload);
+  response->payload = NULL;
+}
+
+bool xg_infer_response_check(const xg_infer_response* response,
+                             uint32_t expected_type) {
+  if (response->header.status != XG_INFER_OK) {
+    fprintf(stderr, "Inference failed: %s\n", (const char*)response->payload);
+    return false;
+  }
+  if (response->header.result_type != expected_type) {
+    fputs("The inference server's model doesn't produce the kind of result "
+          "this sample needs!\n",
+          stderr);
+    return false;
+  }
+  return true;
+}
+
+uint32_t xg_infer_response_records(const xg_infer_response* response,
+                                   size_t record_size) {
+  uint32_t fit = response->header.size / record_size;
+  return response->header.count < fit ? response->header.count : fit;
+}
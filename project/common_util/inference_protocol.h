@@ -0,0 +1,166 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_INFERENCE_PROTOCOL_H__
+#define __COMMON_UTIL_INFERENCE_PROTOCOL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image_input.h"
+
+// Wire format between inference_server, which keeps the model loaded, and its
+// clients, over a Unix domain socket. Both ends are on the same machine, so
+// everything is in host byte order.
+//
+// A client sends an xg_infer_request, followed by the image unless it passes
+// the image as a file descriptor (a memfd, shared memory or even the image file
+// itself) alongside the request, in which case the server maps it instead of
+// copying it. The server answers with an xg_infer_response_header followed by
+// @size bytes: the result in the encoding asked for, or on failure an error
+// message. A connection can carry any number of requests, one at a time.
+
+// Where the server listens unless told otherwise, and the environment variable
+// clients look at to find it elsewhere
+#define XG_INFER_DEFAULT_SOCKET "/tmp/xnor-inference.sock"
+#define XG_INFER_SOCKET_ENV "XNOR_INFERENCE_SOCKET"
+
+enum {
+  XG_INFER_REQUEST_MAGIC = 0x52494758,   // "XGIR"
+  XG_INFER_RESPONSE_MAGIC = 0x41494758,  // "XGIA"
+  XG_INFER_PROTOCOL_VERSION = 1,
+  // Largest image the server accepts, inline or passed by descriptor
+  XG_INFER_MAX_IMAGE_SIZE = 64 * 1024 * 1024,
+  // Longest label in binary responses, including the terminator. Longer
+  // labels are cut off at XG_INFER_LABEL_SIZE - 1 characters; JSON responses
+  // carry them whole.
+  XG_INFER_LABEL_SIZE = 60,
+};
+
+enum xg_infer_encoding {
+  // Arrays of the record structs below
+  XG_INFER_ENCODING_BINARY,
+  // A compact JSON document
+  XG_INFER_ENCODING_JSON,
+};
+
+enum xg_infer_request_flags {
+  // The image isn't sent inline but is in the descriptor passed with the
+  // request, starting at offset 0. The server maps descriptors sealed with
+  // F_SEAL_SHRINK and copies the image out of any others.
+  XG_INFER_IMAGE_IN_FD = 1,
+};
+
+typedef struct xg_infer_request {
+  uint32_t magic;
+  uint16_t version;
+  // An enum image_format
+  uint16_t format;
+  // An enum xg_infer_encoding
+  uint16_t encoding;
+  uint16_t flags;
+  // Ignored for JPEG images
+  int32_t width, height;
+  // Bytes of image data
+  uint32_t size;
+} xg_infer_request;
+
+enum xg_infer_status {
+  XG_INFER_OK,
+  // The request was malformed or its image couldn't be read
+  XG_INFER_BAD_REQUEST,
+  // The model couldn't evaluate the image
+  XG_INFER_EVALUATION_FAILED,
+};
+
+typedef struct xg_infer_response_header {
+  uint32_t magic;
+  // An enum xg_infer_status
+  int32_t status;
+  // An xnor_evaluation_result_type
+  uint32_t result_type;
+  // Records in a binary response
+  uint32_t count;
+  // Bytes following the header
+  uint32_t size;
+} xg_infer_response_header;
+
+// Binary records. Bounding boxes and masks are in the same normalized
+// coordinates as the model's results. @label is always terminated, and holds
+// at most XG_INFER_LABEL_SIZE - 1 characters of the model's label.
+typedef struct xg_infer_label {
+  int32_t class_id;
+  char label[XG_INFER_LABEL_SIZE];
+} xg_infer_label;
+
+typedef struct xg_infer_box {
+  xg_infer_label class_label;
+  float x, y, width, height;
+} xg_infer_box;
+
+// The mask's 1 bit per pixel bitmap is in the response too, @bitmap_offset
+// bytes from its start
+typedef struct xg_infer_mask {
+  xg_infer_label class_label;
+  int32_t width, height, stride;
+  uint32_t bitmap_offset;
+} xg_infer_mask;
+
+typedef struct xg_infer_response {
+  xg_infer_response_header header;
+  // @header.size bytes, plus a NUL terminator so JSON documents and error
+  // messages can be used as strings
+  uint8_t* payload;
+} xg_infer_response;
+
+// Sends all of @header and @payload (if not NULL) as one message, passing
+// @fd_to_pass along with it unless it is -1. Returns false if the connection
+// failed.
+bool xg_infer_send(int connection, const void* header, uint32_t header_size,
+                   const void* payload, uint32_t payload_size, int fd_to_pass);
+// Receives exactly @size bytes. If @fd_out isn't NULL, it receives a
+// descriptor passed with them, or -1 if there was none. Returns false if the
+// connection was closed or failed.
+bool xg_infer_recv(int connection, void* buffer, uint32_t size, int* fd_out);
+
+// Socket path from XG_INFER_SOCKET_ENV, or the default
+const char* xg_infer_socket_path(void);
+// Connects to the server. Returns -1 and prints a message to stderr on failure.
+int xg_infer_connect(const char* socket_path);
+// Has the image evaluated. @data is sent inline; see xg_infer_evaluate_fd() to
+// avoid copying it. On success @response_out must be freed with
+// xg_infer_response_free(), even if the server reported an error. Returns false
+// and prints a message to stderr if the server couldn't be reached.
+bool xg_infer_evaluate(int connection, enum image_format format, int32_t width,
+                       int32_t height, const uint8_t* data, int32_t size,
+                       enum xg_infer_encoding encoding,
+                       xg_infer_response* response_out);
+// Like xg_infer_evaluate(), for an image in the first @size bytes of @image_fd
+bool xg_infer_evaluate_fd(int connection, enum image_format format,
+                          int32_t width, int32_t height, int image_fd,
+                          int32_t size, enum xg_infer_encoding encoding,
+                          xg_infer_response* response_out);
+// Like xg_infer_evaluate_fd(), for a JPEG file. The file itself is passed to
+// the server, which maps it rather than having it read and sent.
+bool xg_infer_evaluate_jpeg_file(int connection, const char* filename,
+                                 enum xg_infer_encoding encoding,
+                                 xg_infer_response* response_out);
+// Creates an anonymous shared memory buffer of @size bytes, to build an image
+// in and then pass to xg_infer_evaluate_fd(). It is sealed at that size, which
+// lets the server map it instead of copying it. Unmap @data_out and close
+// @fd_out when done. Returns false and prints a message on failure.
+bool xg_infer_create_shared_buffer(int32_t size, int* fd_out,
+                                   uint8_t** data_out);
+void xg_infer_response_free(xg_infer_response* response);
+
+// Prints the error message of a failed response to stderr and returns false,
+// or returns true if it succeeded with a result of @expected_type
+bool xg_infer_response_check(const xg_infer_response* response,
+                             uint32_t expected_type);
+// Number of @record_size records at the start of a binary response's payload
+// that are safe to read: @header.count, or fewer if the payload is too short
+// to hold that many
+uint32_t xg_infer_response_records(const xg_infer_response* response,
+                                   size_t record_size);
+
+#endif  // __COMMON_UTIL_INFERENCE_PROTOCOL_H__
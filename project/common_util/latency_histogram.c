@@ -0,0 +1,120 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "latency_histogram.h"
+
+#include <math.h>
+#include <string.h>
+
+static const int HALF_SUB_BUCKETS = LATENCY_HISTOGRAM_SUB_BUCKETS / 2;
+
+// Values below LATENCY_HISTOGRAM_SUB_BUCKETS map one-to-one onto the first
+// counts. Above that, the bucket is how far the value has to be shifted down to
+// fit in LATENCY_HISTOGRAM_SUB_BUCKET_BITS bits, and what remains (always in
+// the top half) picks the linear sub-bucket.
+static int bucket_of(uint64_t value) {
+  int magnitude = 63 - __builtin_clzll(value | (LATENCY_HISTOGRAM_SUB_BUCKETS - 1));
+  return magnitude - (LATENCY_HISTOGRAM_SUB_BUCKET_BITS - 1);
+}
+
+static int index_of(uint64_t value) {
+  if (value > LATENCY_HISTOGRAM_MAX_NS) {
+    value = LATENCY_HISTOGRAM_MAX_NS;
+  }
+  int bucket = bucket_of(value);
+  return bucket * HALF_SUB_BUCKETS + (int)(value >> bucket);
+}
+
+// The largest value that maps onto @index
+static uint64_t highest_value_at(int index) {
+  if (index < LATENCY_HISTOGRAM_SUB_BUCKETS) {
+    return index;
+  }
+  int bucket = index / HALF_SUB_BUCKETS - 1;
+  uint64_t sub_bucket = index % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS;
+  return ((sub_bucket + 1) << bucket) - 1;
+}
+
+void latency_histogram_reset(latency_histogram* histogram) {
+  memset(histogram, 0, sizeof(*histogram));
+  histogram->min = UINT64_MAX;
+}
+
+void latency_histogram_record(latency_histogram* histogram, uint64_t value_ns) {
+  histogram->counts[index_of(value_ns)]++;
+  histogram->total_count++;
+  if (value_ns < histogram->min) {
+    histogram->min = value_ns;
+  }
+  if (value_ns > histogram->max) {
+    histogram->max = value_ns;
+  }
+  histogram->sum += (double)value_ns;
+  histogram->sum_of_squares += (double)value_ns * (double)value_ns;
+}
+
+void latency_histogram_record_seconds(latency_histogram* histogram,
+                                      double seconds) {
+  latency_histogram_record(histogram,
+                           seconds > 0 ? (uint64_t)(seconds * 1e9 + 0.5) : 0);
+}
+
+void latency_histogram_merge(latency_histogram* to,
+                             const latency_histogram* from) {
+  for (int i = 0; i < LATENCY_HISTOGRAM_NUM_COUNTS; ++i) {
+    to->counts[i] += from->counts[i];
+  }
+  to->total_count += from->total_count;
+  if (from->min < to->min) {
+    to->min = from->min;
+  }
+  if (from->max > to->max) {
+    to->max = from->max;
+  }
+  to->sum += from->sum;
+  to->sum_of_squares += from->sum_of_squares;
+}
+
+uint64_t latency_histogram_percentile(const latency_histogram* histogram,
+                                      double percentile) {
+  if (histogram->total_count == 0) {
+    return 0;
+  }
+  // Nearest rank: the value of the ceil(p * n)th smallest sample
+  uint64_t rank = (uint64_t)ceil(percentile / 100 * histogram->total_count);
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank >= histogram->total_count) {
+    return histogram->max;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_HISTOGRAM_NUM_COUNTS; ++i) {
+    seen += histogram->counts[i];
+    if (seen >= rank) {
+      // Report the bucket's upper edge, kept within the exact extremes
+      uint64_t value = highest_value_at(i);
+      if (value < histogram->min) {
+        return histogram->min;
+      }
+      return value < histogram->max ? value : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+double latency_histogram_mean(const latency_histogram* histogram) {
+  if (histogram->total_count == 0) {
+    return 0;
+  }
+  return histogram->sum / histogram->total_count;
+}
+
+double latency_histogram_stddev(const latency_histogram* histogram) {
+  if (histogram->total_count == 0) {
+    return 0;
+  }
+  double mean = latency_histogram_mean(histogram);
+  double variance =
+      histogram->sum_of_squares / histogram->total_count - mean * mean;
+  return variance > 0 ? sqrt(variance) : 0;
+}
@@ -0,0 +1,59 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_LATENCY_HISTOGRAM_H__
+#define __COMMON_UTIL_LATENCY_HISTOGRAM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Log-bucketed (HDR-style) histogram of latencies in nanoseconds. Every power
+// of two is split into LATENCY_HISTOGRAM_SUB_BUCKETS / 2 linear buckets, so any
+// reported value is within 1/64 (about 1.6%) of the recorded one, whatever the
+// magnitude. Recording is O(1) and never allocates; values above
+// LATENCY_HISTOGRAM_MAX_NS land in the top bucket, but the exact maximum is
+// still tracked.
+enum {
+  LATENCY_HISTOGRAM_SUB_BUCKET_BITS = 7,
+  LATENCY_HISTOGRAM_SUB_BUCKETS = 1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS,
+  // 2^40 ns is a little over 18 minutes
+  LATENCY_HISTOGRAM_MAX_BITS = 40,
+  LATENCY_HISTOGRAM_NUM_COUNTS =
+      (LATENCY_HISTOGRAM_MAX_BITS - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 2) *
+      (LATENCY_HISTOGRAM_SUB_BUCKETS / 2),
+};
+#define LATENCY_HISTOGRAM_MAX_NS ((1ULL << LATENCY_HISTOGRAM_MAX_BITS) - 1)
+
+typedef struct latency_histogram {
+  uint64_t total_count;
+  uint64_t min;
+  uint64_t max;
+  // Kept in double so that the sums of squares don't overflow
+  double sum;
+  double sum_of_squares;
+  uint32_t counts[LATENCY_HISTOGRAM_NUM_COUNTS];
+} latency_histogram;
+
+// Empties the histogram
+void latency_histogram_reset(latency_histogram* histogram);
+
+void latency_histogram_record(latency_histogram* histogram, uint64_t value_ns);
+
+// Seconds are what the samples measure with, so they get a shorthand
+void latency_histogram_record_seconds(latency_histogram* histogram,
+                                      double seconds);
+
+// Adds every sample in @from to @to
+void latency_histogram_merge(latency_histogram* to,
+                             const latency_histogram* from);
+
+// Returns the smallest recorded value that at least @percentile percent of
+// samples are less than or equal to, or 0 if the histogram is empty.
+// latency_histogram_percentile(h, 100) is the exact maximum.
+uint64_t latency_histogram_percentile(const latency_histogram* histogram,
+                                      double percentile);
+
+double latency_histogram_mean(const latency_histogram* histogram);
+
+double latency_histogram_stddev(const latency_histogram* histogram);
+
+#endif  // __COMMON_UTIL_LATENCY_HISTOGRAM_H__
@@ -0,0 +1,223 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+// memfd_create() and RTLD_DEEPBIND are GNU extensions
+#define _GNU_SOURCE
+
+#include "model_library.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const xg_model_library LINKED = {
+	.path = "built-in",
+	.handle = NULL,
+	.error_get_description = xnor_error_get_description,
+	.error_free = xnor_error_free,
+	.input_create_rgb_image = xnor_input_create_rgb_image,
+	.input_create_yuv422_image = xnor_input_create_yuv422_image,
+	.input_create_yuv420p_image = xnor_input_create_yuv420p_image,
+	.input_create_yuv420sp_nv12_image = xnor_input_create_yuv420sp_nv12_image,
+	.input_create_yuv420sp_nv21_image = xnor_input_create_yuv420sp_nv21_image,
+	.input_free = xnor_input_free,
+	.model_load_options_create = xnor_model_load_options_create,
+	.model_load_options_free = xnor_model_load_options_free,
+	.model_load_options_set_threading_model =
+	    xnor_model_load_options_set_threading_model,
+	.model_load_built_in = xnor_model_load_built_in,
+	.model_get_info = xnor_model_get_info,
+	.model_evaluate = xnor_model_evaluate,
+	.model_free = xnor_model_free,
+	.evaluation_result_get_bounding_boxes =
+	    xnor_evaluation_result_get_bounding_boxes,
+	.evaluation_result_get_class_labels =
+	    xnor_evaluation_result_get_class_labels,
+	.evaluation_result_free = xnor_evaluation_result_free,
+};
+
+const xg_model_library *xg_model_library_linked(void) { return &LINKED; }
+
+// Copies the file at @path into an anonymous in-memory file. Returns its
+// descriptor, or -1 after printing why not.
+static int copy_to_memory(const char *path)
+{
+	int source = open(path, O_RDONLY | O_CLOEXEC);
+	if (source < 0)
+	{
+		fprintf(stderr, "Couldn't open model bundle %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	int copy = memfd_create("xnornet-bundle", MFD_CLOEXEC);
+	if (copy < 0)
+	{
+		perror("Couldn't create in-memory file for model bundle");
+		close(source);
+		return -1;
+	}
+	char buffer[64 * 1024];
+	ssize_t n_read;
+	while ((n_read = read(source, buffer, sizeof(buffer))) != 0)
+	{
+		if (n_read < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n_read < 0 || write(copy, buffer, n_read) != n_read)
+		{
+			fprintf(stderr, "Couldn't copy model bundle %s: %s\n", path,
+				strerror(errno));
+			close(source);
+			close(copy);
+			return -1;
+		}
+	}
+	close(source);
+	return copy;
+}
+
+// Looks up @name in @library, printing an error if it is missing
+static void *resolve(xg_model_library *library, const char *name, bool *ok)
+{
+	void *symbol = dlsym(library->handle, name);
+	if (symbol == NULL)
+	{
+		fprintf(stderr, "Model bundle %s has no %s\n", library->path, name);
+		*ok = false;
+	}
+	return symbol;
+}
+
+xg_model_library *xg_model_library_open(const char *path)
+{
+	xg_model_library *library = calloc(1, sizeof(xg_model_library));
+	char *path_copy = strdup(path);
+	if (library == NULL || path_copy == NULL)
+	{
+		fputs("Couldn't allocate memory for model bundle\n", stderr);
+		free(library);
+		free(path_copy);
+		return NULL;
+	}
+	library->path = path_copy;
+
+	int fd = copy_to_memory(path);
+	if (fd < 0)
+	{
+		xg_model_library_close(library);
+		return NULL;
+	}
+	// Each in-memory file is a distinct object to the dynamic linker, so this
+	// always gets a fresh copy rather than one already loaded. RTLD_LOCAL
+	// keeps its symbols from standing in for the linked library's, but the
+	// bundle's calls to its own exported functions would still bind to the
+	// linked library's, which comes first in the global scope; RTLD_DEEPBIND
+	// makes the bundle look in itself first, so its model runs its own code
+	// and data.
+	char fd_path[64];
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+	library->handle = dlopen(fd_path, RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+	close(fd);
+	if (library->handle == NULL)
+	{
+		fprintf(stderr, "Couldn't load model bundle %s: %s\n", path,
+			dlerror());
+		xg_model_library_close(library);
+		return NULL;
+	}
+
+	bool ok = true;
+#define RESOLVE(field) library->field = resolve(library, "xnor_" #field, &ok)
+	RESOLVE(error_get_description);
+	RESOLVE(error_free);
+	RESOLVE(input_create_rgb_image);
+	RESOLVE(input_create_yuv422_image);
+	RESOLVE(input_create_yuv420p_image);
+	RESOLVE(input_create_yuv420sp_nv12_image);
+	RESOLVE(input_create_yuv420sp_nv21_image);
+	RESOLVE(input_free);
+	RESOLVE(model_load_options_create);
+	RESOLVE(model_load_options_free);
+	RESOLVE(model_load_options_set_threading_model);
+	RESOLVE(model_load_built_in);
+	RESOLVE(model_get_info);
+	RESOLVE(model_evaluate);
+	RESOLVE(model_free);
+	RESOLVE(evaluation_result_get_bounding_boxes);
+	RESOLVE(evaluation_result_get_class_labels);
+	RESOLVE(evaluation_result_free);
+#undef RESOLVE
+	if (!ok)
+	{
+		xg_model_library_close(library);
+		return NULL;
+	}
+	return library;
+}
+
+void xg_model_library_close(xg_model_library *library)
+{
+	if (library == NULL || library == &LINKED)
+	{
+		return;
+	}
+	if (library->handle != NULL)
+	{
+		dlclose(library->handle);
+	}
+	free((char *)library->path);
+	free(library);
+}
+
+bool xg_model_library_create_input(const xg_model_library *library,
+				   enum image_format format, int32_t width,
+				   int32_t height, const uint8_t *const *planes,
+				   xnor_input **input_out)
+{
+	xnor_error *error = NULL;
+	switch (format)
+	{
+	case kImageFormatRGB:
+		error = library->input_create_rgb_image(width, height, planes[0],
+							input_out);
+		break;
+	case kImageFormatYUV422:
+		error = library->input_create_yuv422_image(width, height,
+							   planes[0], input_out);
+		break;
+	case kImageFormatYUV420P:
+		error = library->input_create_yuv420p_image(
+		    width, height, planes[0], planes[1], planes[2], input_out);
+		break;
+	case kImageFormatNV12:
+		error = library->input_create_yuv420sp_nv12_image(
+		    width, height, planes[0], planes[1], input_out);
+		break;
+	case kImageFormatNV21:
+		error = library->input_create_yuv420sp_nv21_image(
+		    width, height, planes[0], planes[1], input_out);
+		break;
+	default:
+		fprintf(stderr, "Can't create a model input from %s images\n",
+			image_format_name(format));
+		return false;
+	}
+	if (error != NULL)
+	{
+		xg_model_library_report(library, error);
+		return false;
+	}
+	return true;
+}
+
+void xg_model_library_report(const xg_model_library *library,
+			     xnor_error *error)
+{
+	fprintf(stderr, "%s\n", library->error_get_description(error));
+	library->error_free(error);
+}
@@ -0,0 +1,91 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_MODEL_LIBRARY_H__
+#define __COMMON_UTIL_MODEL_LIBRARY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "image_input.h"
+#include "xnornet.h"
+
+// The xnor API of one model bundle. Every bundle is a libxnornet.so exporting
+// the same functions, with its model built in, so more than one can only be
+// loaded into a process with dlopen() and called through a table like this.
+// Objects from one bundle (models, inputs, results and errors) must only ever
+// be passed to functions of the same bundle.
+typedef struct xg_model_library
+{
+	// Where the bundle was loaded from, or "built-in" for the library the
+	// program was linked with
+	const char *path;
+	// dlopen() handle, or NULL for the linked library
+	void *handle;
+
+	const char *(*error_get_description)(xnor_error *error);
+	void (*error_free)(xnor_error *error);
+	xnor_error *(*input_create_rgb_image)(int32_t width, int32_t height,
+					      const uint8_t *data,
+					      xnor_input **result);
+	xnor_error *(*input_create_yuv422_image)(int32_t width, int32_t height,
+						 const uint8_t *data,
+						 xnor_input **result);
+	xnor_error *(*input_create_yuv420p_image)(
+	    int32_t width, int32_t height, const uint8_t *y_plane_data,
+	    const uint8_t *u_plane_data, const uint8_t *v_plane_data,
+	    xnor_input **result);
+	xnor_error *(*input_create_yuv420sp_nv12_image)(
+	    int32_t width, int32_t height, const uint8_t *y_plane_data,
+	    const uint8_t *uv_plane_data, xnor_input **result);
+	xnor_error *(*input_create_yuv420sp_nv21_image)(
+	    int32_t width, int32_t height, const uint8_t *y_plane_data,
+	    const uint8_t *vu_plane_data, xnor_input **result);
+	void (*input_free)(xnor_input *input);
+	xnor_model_load_options *(*model_load_options_create)(void);
+	void (*model_load_options_free)(xnor_model_load_options *load_options);
+	xnor_error *(*model_load_options_set_threading_model)(
+	    xnor_model_load_options *options,
+	    xnor_threading_model threading_model);
+	xnor_error *(*model_load_built_in)(
+	    const char *model_name, const xnor_model_load_options *load_options,
+	    xnor_model **result);
+	xnor_error *(*model_get_info)(xnor_model *model, xnor_model_info *info);
+	xnor_error *(*model_evaluate)(xnor_model *model, const xnor_input *input,
+				      void *reserved,
+				      xnor_evaluation_result **result);
+	void (*model_free)(xnor_model *model);
+	int32_t (*evaluation_result_get_bounding_boxes)(
+	    xnor_evaluation_result *result, xnor_bounding_box *out,
+	    int32_t out_size);
+	int32_t (*evaluation_result_get_class_labels)(
+	    xnor_evaluation_result *result, xnor_class_label *out,
+	    int32_t out_size);
+	void (*evaluation_result_free)(xnor_evaluation_result *result);
+} xg_model_library;
+
+// The library the program was linked with
+const xg_model_library *xg_model_library_linked(void);
+
+// Loads the bundle at @path. It is copied into memory first and loaded from
+// there, so the same path can be loaded again after the file is replaced, and
+// replacing it never pulls the code out from under a loaded copy. The
+// bundle's references to its own xnor functions and data resolve within the
+// bundle (RTLD_DEEPBIND) rather than to the linked library's. Prints a
+// message to stderr and returns NULL on failure.
+xg_model_library *xg_model_library_open(const char *path);
+// Unloads a bundle. Everything created with it must have been freed.
+void xg_model_library_close(xg_model_library *library);
+
+// Creates a model input with @library from an image in one of the raw formats,
+// given the start of each of its planes (only the first for RGB and YUV422).
+// Prints the reason and returns false on failure.
+bool xg_model_library_create_input(const xg_model_library *library,
+				   enum image_format format, int32_t width,
+				   int32_t height, const uint8_t *const *planes,
+				   xnor_input **input_out);
+
+// Prints @error's description to stderr and frees it
+void xg_model_library_report(const xg_model_library *library,
+			     xnor_error *error);
+
+#endif  // __COMMON_UTIL_MODEL_LIBRARY_H__
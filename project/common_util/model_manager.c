@@ -0,0 +1,448 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "model_manager.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "frame_trace.h"
+#include "startup_profile.h"
+
+// How often the control file is checked for changes
+static const long CONTROL_POLL_NS = 500 * 1000 * 1000;
+
+// A model with the bookkeeping the manager keeps for it. @model comes first so
+// the xg_model handed out can be cast back.
+typedef struct managed_model
+{
+	xg_model model;
+	// Next model retired before this one was freed
+	struct managed_model *next;
+} managed_model;
+
+struct xg_model_manager
+{
+	xnor_threading_model threading_model;
+	xnor_evaluation_result_type result_type;
+	// The model being handed out. Only touched by the evaluating thread.
+	managed_model *current;
+	// Loaded and warmed up, waiting for the next xg_model_manager_acquire()
+	_Atomic(managed_model *) pending;
+
+	// Posted whenever the loader thread has something to do. A semaphore,
+	// as the SIGHUP handler can post one.
+	sem_t wake;
+	pthread_t loader;
+	bool loader_started;
+	// What the control file looked like when the loader thread last checked
+	// it, and whether it has checked it yet. Only the loader thread uses
+	// these.
+	bool control_checked;
+	struct timespec control_mtime;
+	off_t control_size;
+
+	// Everything below is protected by @lock
+	pthread_mutex_t lock;
+	bool stopping;
+	xg_warmup_config warmup;
+	// Bundle waiting to be loaded
+	char *requested;
+	// Swapped out models waiting to be freed by the loader thread
+	managed_model *retired;
+	// Set by xg_model_manager_watch()
+	char *bundle_path;
+	char *control_path;
+};
+
+// The manager SIGHUP reloads, and whether one has arrived since it last looked
+static _Atomic(xg_model_manager *) watching;
+static atomic_bool hangup_received;
+static struct sigaction previous_hangup_action;
+
+static void on_hangup(int signal_number)
+{
+	(void)signal_number;
+	atomic_store(&hangup_received, true);
+	xg_model_manager *manager = atomic_load(&watching);
+	if (manager != NULL)
+	{
+		sem_post(&manager->wake);
+	}
+}
+
+static void free_model(managed_model *model)
+{
+	if (model == NULL)
+	{
+		return;
+	}
+	const xg_model_library *library = model->model.library;
+	library->model_free(model->model.model);
+	xg_model_library_close((xg_model_library *)library);
+	free(model);
+}
+
+// Loads and checks the model built into @library, which the model takes over,
+// warming it up as @warmup says if it isn't NULL. Prints why and returns NULL
+// on failure.
+static managed_model *load_model(xg_model_manager *manager,
+				 xg_model_library *library,
+				 const xg_warmup_config *warmup)
+{
+	managed_model *model = calloc(1, sizeof(managed_model));
+	if (model == NULL)
+	{
+		fputs("Couldn't allocate memory for model\n", stderr);
+		xg_model_library_close(library);
+		return NULL;
+	}
+	model->model.library = library;
+
+	xnor_model_load_options *options = library->model_load_options_create();
+	xnor_error *error = library->model_load_options_set_threading_model(
+	    options, manager->threading_model);
+	if (error == NULL)
+	{
+		error = library->model_load_built_in("", options,
+						     &model->model.model);
+	}
+	library->model_load_options_free(options);
+	if (error == NULL)
+	{
+		model->model.info.xnor_model_info_size = sizeof(xnor_model_info);
+		error = library->model_get_info(model->model.model,
+						&model->model.info);
+	}
+	if (error != NULL)
+	{
+		xg_model_library_report(library, error);
+		free_model(model);
+		return NULL;
+	}
+	if (model->model.info.result_type != manager->result_type)
+	{
+		fprintf(stderr, "%s from %s returns the wrong kind of result for "
+				"this sample\n",
+			model->model.info.name, library->path);
+		free_model(model);
+		return NULL;
+	}
+	// A model that can't evaluate the frames is no good either
+	if (warmup != NULL &&
+	    !xg_warmup_run_library(library, model->model.model, warmup))
+	{
+		free_model(model);
+		return NULL;
+	}
+	return model;
+}
+
+// Loads the bundle at @path and queues its model to be swapped in
+static void load_bundle(xg_model_manager *manager, const char *path)
+{
+	pthread_mutex_lock(&manager->lock);
+	xg_warmup_config warmup = manager->warmup;
+	pthread_mutex_unlock(&manager->lock);
+
+	uint64_t started = xg_trace_now();
+	xg_model_library *library = xg_model_library_open(path);
+	managed_model *model =
+	    library != NULL ? load_model(manager, library, &warmup) : NULL;
+	if (model == NULL)
+	{
+		fprintf(stderr, "Keeping the current model\n");
+		return;
+	}
+	printf("Loaded %s (version '%s') from %s in %.0f ms\n",
+	       model->model.info.name, model->model.info.version, path,
+	       (xg_trace_now() - started) / 1e6);
+	fflush(stdout);
+	// A model loaded before it that was never handed out is no longer wanted
+	free_model(atomic_exchange(&manager->pending, model));
+}
+
+// Reads the bundle path out of the control file. Returns NULL if there is none.
+static char *read_control_file(const char *control_path)
+{
+	FILE *file = fopen(control_path, "r");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Couldn't open model control file %s: %s\n",
+			control_path, strerror(errno));
+		return NULL;
+	}
+	char path[PATH_MAX];
+	bool read = fgets(path, sizeof(path), file) != NULL;
+	fclose(file);
+	if (!read)
+	{
+		return NULL;
+	}
+	path[strcspn(path, "\r\n")] = '\0';
+	return path[0] != '\0' ? strdup(path) : NULL;
+}
+
+// Returns whether the control file at @control_path changed since it was last
+// looked at. Only called by the loader thread.
+static bool control_file_changed(xg_model_manager *manager,
+				 const char *control_path)
+{
+	struct stat info;
+	if (stat(control_path, &info) != 0)
+	{
+		return false;
+	}
+	bool changed = info.st_mtim.tv_sec != manager->control_mtime.tv_sec ||
+		       info.st_mtim.tv_nsec != manager->control_mtime.tv_nsec ||
+		       info.st_size != manager->control_size;
+	manager->control_mtime = info.st_mtim;
+	manager->control_size = info.st_size;
+	return changed;
+}
+
+// Waits until the loader thread is woken up or, when there is a control file
+// to poll, until it is time to check it again
+static void wait_for_work(xg_model_manager *manager, bool polling)
+{
+	if (!polling)
+	{
+		while (sem_wait(&manager->wake) != 0 && errno == EINTR)
+		{
+		}
+		return;
+	}
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += CONTROL_POLL_NS;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000;
+	}
+	while (sem_timedwait(&manager->wake, &deadline) != 0 && errno == EINTR)
+	{
+	}
+}
+
+static void *loader_main(void *arg)
+{
+	xg_model_manager *manager = (xg_model_manager *)arg;
+	xg_trace_set_thread_name("model loader");
+	for (;;)
+	{
+		pthread_mutex_lock(&manager->lock);
+		bool polling = manager->control_path != NULL;
+		pthread_mutex_unlock(&manager->lock);
+		wait_for_work(manager, polling);
+
+		pthread_mutex_lock(&manager->lock);
+		if (manager->stopping)
+		{
+			pthread_mutex_unlock(&manager->lock);
+			break;
+		}
+		managed_model *retired = manager->retired;
+		manager->retired = NULL;
+		char *path = manager->requested;
+		manager->requested = NULL;
+		bool watched = atomic_load(&watching) == manager;
+		const char *bundle_path = manager->bundle_path;
+		const char *control_path = manager->control_path;
+		pthread_mutex_unlock(&manager->lock);
+
+		// Models swapped out are freed here rather than on the thread
+		// that swapped them, which has frames to get on with
+		while (retired != NULL)
+		{
+			managed_model *next = retired->next;
+			free_model(retired);
+			retired = next;
+		}
+
+		// The first check only notes what the control file looks like,
+		// so that only changes made after xg_model_manager_watch() count
+		bool control_changed = false;
+		if (control_path != NULL)
+		{
+			control_changed =
+			    control_file_changed(manager, control_path) &&
+					  manager->control_checked;
+			manager->control_checked = true;
+		}
+		if (path == NULL && watched &&
+		    atomic_exchange(&hangup_received, false))
+		{
+			path = bundle_path != NULL ? strdup(bundle_path)
+			       : control_path != NULL
+				   ? read_control_file(control_path)
+				   : NULL;
+		}
+		if (path == NULL && control_changed)
+		{
+			path = read_control_file(control_path);
+		}
+		if (path != NULL)
+		{
+			load_bundle(manager, path);
+			free(path);
+		}
+	}
+	return NULL;
+}
+
+xg_model_manager *xg_model_manager_create(xnor_threading_model threading_model,
+					  xnor_evaluation_result_type result_type,
+					  const xg_warmup_config *warmup)
+{
+	xg_model_manager *manager = calloc(1, sizeof(xg_model_manager));
+	if (manager == NULL)
+	{
+		fputs("Couldn't allocate memory for model manager\n", stderr);
+		return NULL;
+	}
+	manager->threading_model = threading_model;
+	manager->result_type = result_type;
+	manager->warmup = *warmup;
+	atomic_init(&manager->pending, NULL);
+	pthread_mutex_init(&manager->lock, NULL);
+	sem_init(&manager->wake, 0, 0);
+
+	// The built-in model is warmed up by whoever runs it, e.g. while the
+	// video pipeline starts (see xg_runner_warm_up())
+	manager->current = load_model(
+	    manager, (xg_model_library *)xg_model_library_linked(), NULL);
+	if (manager->current == NULL)
+	{
+		xg_model_manager_free(manager);
+		return NULL;
+	}
+	xg_startup_mark(XG_STARTUP_MODEL_LOADED);
+
+	if (pthread_create(&manager->loader, NULL, loader_main, manager) != 0)
+	{
+		fputs("Couldn't start model loader thread\n", stderr);
+		xg_model_manager_free(manager);
+		return NULL;
+	}
+	manager->loader_started = true;
+	return manager;
+}
+
+void xg_model_manager_set_warmup(xg_model_manager *manager,
+				 const xg_warmup_config *warmup)
+{
+	pthread_mutex_lock(&manager->lock);
+	manager->warmup = *warmup;
+	pthread_mutex_unlock(&manager->lock);
+}
+
+void xg_model_manager_load(xg_model_manager *manager, const char *path)
+{
+	char *copy = strdup(path);
+	if (copy == NULL)
+	{
+		fputs("Couldn't allocate memory for model bundle path\n", stderr);
+		return;
+	}
+	pthread_mutex_lock(&manager->lock);
+	free(manager->requested);
+	manager->requested = copy;
+	pthread_mutex_unlock(&manager->lock);
+	sem_post(&manager->wake);
+}
+
+bool xg_model_manager_watch(xg_model_manager *manager, const char *bundle_path,
+			    const char *control_path)
+{
+	xg_model_manager *unwatched = NULL;
+	if (!atomic_compare_exchange_strong(&watching, &unwatched, manager))
+	{
+		fputs("Another model manager is already watching for reloads\n",
+		      stderr);
+		return false;
+	}
+	pthread_mutex_lock(&manager->lock);
+	manager->bundle_path = bundle_path ? strdup(bundle_path) : NULL;
+	manager->control_path = control_path ? strdup(control_path) : NULL;
+	pthread_mutex_unlock(&manager->lock);
+
+	struct sigaction action = {.sa_handler = on_hangup,
+				   .sa_flags = SA_RESTART};
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGHUP, &action, &previous_hangup_action) != 0)
+	{
+		perror("Couldn't install SIGHUP handler");
+		atomic_store(&watching, NULL);
+		return false;
+	}
+	// Start polling the control file
+	sem_post(&manager->wake);
+	return true;
+}
+
+const xg_model *xg_model_manager_acquire(xg_model_manager *manager)
+{
+	// One atomic load per frame unless a new model is ready
+	if (atomic_load_explicit(&manager->pending, memory_order_relaxed) == NULL)
+	{
+		return &manager->current->model;
+	}
+	managed_model *next = atomic_exchange(&manager->pending, NULL);
+	if (next == NULL)
+	{
+		return &manager->current->model;
+	}
+	printf("Switched to %s\n", next->model.info.name);
+	fflush(stdout);
+	pthread_mutex_lock(&manager->lock);
+	manager->current->next = manager->retired;
+	manager->retired = manager->current;
+	pthread_mutex_unlock(&manager->lock);
+	sem_post(&manager->wake);
+	manager->current = next;
+	return &manager->current->model;
+}
+
+void xg_model_manager_free(xg_model_manager *manager)
+{
+	if (manager == NULL)
+	{
+		return;
+	}
+	xg_model_manager *self = manager;
+	if (atomic_compare_exchange_strong(&watching, &self, NULL))
+	{
+		sigaction(SIGHUP, &previous_hangup_action, NULL);
+	}
+	if (manager->loader_started)
+	{
+		pthread_mutex_lock(&manager->lock);
+		manager->stopping = true;
+		pthread_mutex_unlock(&manager->lock);
+		sem_post(&manager->wake);
+		pthread_join(manager->loader, NULL);
+	}
+	free_model(manager->current);
+	free_model(atomic_load(&manager->pending));
+	while (manager->retired != NULL)
+	{
+		managed_model *next = manager->retired->next;
+		free_model(manager->retired);
+		manager->retired = next;
+	}
+	free(manager->requested);
+	free(manager->bundle_path);
+	free(manager->control_path);
+	sem_destroy(&manager->wake);
+	pthread_mutex_destroy(&manager->lock);
+	free(manager);
+}
@@ -0,0 +1,65 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_MODEL_MANAGER_H__
+#define __COMMON_UTIL_MODEL_MANAGER_H__
+
+#include <stdbool.h>
+
+#include "model_library.h"
+#include "model_warmup.h"
+#include "xnornet.h"
+
+// Swaps the model a live sample runs without restarting it. The manager starts
+// out with the model built into the library the program was linked with. When
+// asked to, it loads another bundle (a libxnornet.so with a different model
+// built in, see model_library.h), loads and warms up its model, all on a
+// thread of its own, and then hands it out in place of the old one the next
+// time the inference thread asks for the model to evaluate a frame with. The
+// video keeps going throughout, and the frame being evaluated when the new
+// model becomes ready still finishes on the old one.
+//
+// A reload can be asked for directly, by SIGHUP, or by writing the path of a
+// bundle into a control file (which may be on a FUSE mount like
+// tmp_intercomm's, or anywhere else).
+typedef struct xg_model_manager xg_model_manager;
+
+// A loaded model and the library it came from. Evaluate it, and create its
+// inputs and read its results, only through @library.
+typedef struct xg_model
+{
+	const xg_model_library *library;
+	xnor_model *model;
+	xnor_model_info info;
+} xg_model;
+
+// Loads the built-in model with @threading_model. Only bundles whose model
+// returns @result_type are swapped in later, and each is first warmed up as
+// @warmup says. Stamps XG_STARTUP_MODEL_LOADED (see startup_profile.h).
+// Returns NULL and prints a message to stderr on failure.
+xg_model_manager *xg_model_manager_create(xnor_threading_model threading_model,
+					  xnor_evaluation_result_type result_type,
+					  const xg_warmup_config *warmup);
+// Replaces the configuration later bundles are warmed up with, e.g. once the
+// size of the frames is known
+void xg_model_manager_set_warmup(xg_model_manager *manager,
+				 const xg_warmup_config *warmup);
+// Starts loading the bundle at @path in the background. If that fails, the
+// current model stays and the reason is printed to stderr. A request made
+// while another is still loading replaces it once that one is done.
+void xg_model_manager_load(xg_model_manager *manager, const char *path);
+// Reloads on SIGHUP, and whenever @control_path changes, until the manager is
+// freed. SIGHUP loads @bundle_path if it isn't NULL, and otherwise the bundle
+// named in the control file; the control file holds a bundle's path and is
+// checked twice a second. Either may be NULL. Only one manager may watch at a
+// time. Returns false if the signal handler couldn't be installed.
+bool xg_model_manager_watch(xg_model_manager *manager, const char *bundle_path,
+			    const char *control_path);
+// Returns the model to evaluate the next frame with: the current one, or one
+// that has just finished loading, which replaces it from now on. The model
+// returned stays valid until the next call. Must only be called from the one
+// thread that evaluates the models.
+const xg_model *xg_model_manager_acquire(xg_model_manager *manager);
+// Stops loading and watching, and frees every model and bundle
+void xg_model_manager_free(xg_model_manager *manager);
+
+#endif  // __COMMON_UTIL_MODEL_MANAGER_H__
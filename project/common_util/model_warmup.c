@@ -0,0 +1,168 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "model_warmup.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_trace.h"
+#include "model_library.h"
+#include "settings.h"
+#include "startup_profile.h"
+
+// Size warmed up at when the input's isn't known
+#define DEFAULT_WIDTH 320
+#define DEFAULT_HEIGHT 240
+
+struct xg_warmup
+{
+	xnor_model *model;
+	xg_warmup_config config;
+	pthread_t thread;
+	bool ok;
+};
+
+void xg_warmup_config_init(xg_warmup_config *config)
+{
+	memset(config, 0, sizeof(xg_warmup_config));
+	config->evaluations = 2;
+	config->format = kImageFormatRGB;
+}
+
+static bool parse_setting(void *target, const char *key, const char *value)
+{
+	xg_warmup_config *config = (xg_warmup_config *)target;
+	char end;
+	if (strcmp(key, "evaluations") == 0)
+	{
+		return sscanf(value, "%d%c", &config->evaluations, &end) == 1 &&
+		       config->evaluations >= 0;
+	}
+	if (strcmp(key, "size") == 0)
+	{
+		return sscanf(value, "%dx%d%c", &config->width, &config->height,
+			      &end) == 2 &&
+		       config->width >= 0 && config->height >= 0;
+	}
+	if (strcmp(key, "format") == 0)
+	{
+		return parse_image_format(value, &config->format) &&
+		       config->format != kImageFormatJPEG;
+	}
+	return false;
+}
+
+bool xg_warmup_config_parse(xg_warmup_config *config, const char *settings)
+{
+	return xg_settings_parse(settings, "warm-up", parse_setting, config);
+}
+
+bool xg_warmup_run(xnor_model *model, const xg_warmup_config *config)
+{
+	return xg_warmup_run_library(xg_model_library_linked(), model, config);
+}
+
+bool xg_warmup_run_library(const xg_model_library *library, xnor_model *model,
+			   const xg_warmup_config *config)
+{
+	if (config->evaluations <= 0)
+	{
+		return true;
+	}
+	int32_t width = config->width > 0 ? config->width : DEFAULT_WIDTH;
+	int32_t height = config->height > 0 ? config->height : DEFAULT_HEIGHT;
+	int64_t size = image_format_size(config->format, width, height);
+	if (size < 0)
+	{
+		fprintf(stderr, "Can't warm up with %s images\n",
+			image_format_name(config->format));
+		return false;
+	}
+	// Mid grey in every format, so the model sees an image rather than
+	// all-zero chroma
+	uint8_t *image = malloc(size);
+	if (image == NULL)
+	{
+		fputs("Couldn't allocate memory for warm-up image\n", stderr);
+		return false;
+	}
+	memset(image, 128, size);
+	const uint8_t *planes[3];
+	image_format_planes(config->format, width, height, image, planes);
+	xnor_input *input = NULL;
+	if (!xg_model_library_create_input(library, config->format, width,
+					   height, planes, &input))
+	{
+		free(image);
+		return false;
+	}
+
+	bool ok = true;
+	for (int32_t i = 0; ok && i < config->evaluations; ++i)
+	{
+		xnor_evaluation_result *result = NULL;
+		uint64_t trace_start = XG_TRACE_BEGIN();
+		xnor_error *error =
+		    library->model_evaluate(model, input, NULL, &result);
+		XG_TRACE_END(XG_TRACE_EVALUATE, trace_start, XG_TRACE_NO_FRAME);
+		if (error != NULL)
+		{
+			fputs("Warm-up evaluation failed: ", stderr);
+			xg_model_library_report(library, error);
+			ok = false;
+		}
+		library->evaluation_result_free(result);
+	}
+	library->input_free(input);
+	free(image);
+	return ok;
+}
+
+static void *warmup_main(void *arg)
+{
+	xg_warmup *warmup = (xg_warmup *)arg;
+	xg_trace_set_thread_name("warm-up");
+	warmup->ok = xg_warmup_run(warmup->model, &warmup->config);
+	return NULL;
+}
+
+xg_warmup *xg_warmup_start(xnor_model *model, const xg_warmup_config *config)
+{
+	if (config->evaluations <= 0)
+	{
+		return NULL;
+	}
+	xg_warmup *warmup = calloc(1, sizeof(xg_warmup));
+	if (warmup == NULL)
+	{
+		fputs("Couldn't allocate memory for warm-up\n", stderr);
+		return NULL;
+	}
+	warmup->model = model;
+	warmup->config = *config;
+	if (pthread_create(&warmup->thread, NULL, warmup_main, warmup) != 0)
+	{
+		fputs("Couldn't start warm-up thread\n", stderr);
+		free(warmup);
+		return NULL;
+	}
+	return warmup;
+}
+
+bool xg_warmup_finish(xg_warmup *warmup)
+{
+	if (warmup == NULL)
+	{
+		return true;
+	}
+	pthread_join(warmup->thread, NULL);
+	bool ok = warmup->ok;
+	free(warmup);
+	if (ok)
+	{
+		xg_startup_mark(XG_STARTUP_WARMED_UP);
+	}
+	return ok;
+}
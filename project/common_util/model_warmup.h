@@ -0,0 +1,61 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_MODEL_WARMUP_H__
+#define __COMMON_UTIL_MODEL_WARMUP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "image_input.h"
+#include "model_library.h"
+#include "xnornet.h"
+
+// Dummy evaluations that get a freshly loaded model ready for real input. The
+// first evaluations of a model are much slower than the ones after them: the
+// weights are paged in from libxnornet.so, working buffers are allocated and
+// sized for the input, and caches and CPU clocks start out cold. Running a few
+// on a blank image of the size and format the real input will have, e.g. while
+// the video pipeline is prerolling, takes that cost off the first frame.
+typedef struct xg_warmup_config
+{
+	// Dummy evaluations to run, or 0 not to warm up at all
+	int32_t evaluations;
+	// Layout of the blank image. JPEG isn't supported, as a blank JPEG would
+	// have to be encoded first.
+	enum image_format format;
+	// Size of the blank image, or 0 for whatever the input will be (see
+	// xg_runner_warm_up()). Warming up at another size than the real input's
+	// leaves part of the work to the first frame.
+	int32_t width, height;
+} xg_warmup_config;
+
+typedef struct xg_warmup xg_warmup;
+
+// Fills in two evaluations of an RGB image of the input's size
+void xg_warmup_config_init(xg_warmup_config *config);
+// Overrides parts of @config from a comma-separated list of settings:
+//   evaluations=N, size=WxH, format=rgb|yuv422|yuv420p|nv12|nv21
+// e.g. "evaluations=3,format=yuv422". Prints an error and returns false if a
+// setting isn't recognized.
+bool xg_warmup_config_parse(xg_warmup_config *config, const char *settings);
+
+// Runs the dummy evaluations on @model on the calling thread. Sizes left at 0
+// are taken to be 320x240, the video pipeline's default. Prints a message to
+// stderr and returns false if an evaluation failed.
+bool xg_warmup_run(xnor_model *model, const xg_warmup_config *config);
+// Like xg_warmup_run(), for a model loaded from @library (see model_library.h)
+bool xg_warmup_run_library(const xg_model_library *library, xnor_model *model,
+			   const xg_warmup_config *config);
+
+// Like xg_warmup_run(), on a background thread, so the caller can get on with
+// e.g. starting the video pipeline. @model must not be evaluated by anything
+// else until xg_warmup_finish(). Returns NULL if there is nothing to do or the
+// thread couldn't be started, in which case the model is simply left cold.
+xg_warmup *xg_warmup_start(xnor_model *model, const xg_warmup_config *config);
+// Waits for the evaluations started by xg_warmup_start(), frees @warmup and
+// stamps XG_STARTUP_WARMED_UP (see startup_profile.h). Returns false if an
+// evaluation failed, which leaves the model usable but still cold. Does
+// nothing and returns true if @warmup is NULL.
+bool xg_warmup_finish(xg_warmup *warmup);
+
+#endif  // __COMMON_UTIL_MODEL_WARMUP_H__
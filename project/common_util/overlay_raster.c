@@ -0,0 +1,385 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "overlay_raster.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RASTER_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RASTER_SSE2 1
+#endif
+
+// A frame being drawn into
+typedef struct raster_target
+{
+	GstVideoFormat format;
+	int32_t width, height;
+	// Packed formats only use the first plane; NV12 has luma, then
+	// interleaved chroma at half resolution
+	uint8_t *planes[2];
+	int32_t strides[2];
+	// Byte offsets of red, green and blue within a 4-byte RGB pixel
+	int32_t r, g, b;
+} raster_target;
+
+// A colour, prepared for the target's format
+typedef struct raster_color
+{
+	uint8_t rgb[3];
+	uint8_t y, u, v;
+	// One RGB pixel, or a YUY2 pair of pixels, as laid out in memory
+	uint32_t pixel;
+	// An NV12 chroma sample as laid out in memory
+	uint16_t chroma;
+} raster_color;
+
+bool xg_raster_supports_format(GstVideoFormat format)
+{
+	switch (format)
+	{
+	case GST_VIDEO_FORMAT_YUY2:
+	case GST_VIDEO_FORMAT_NV12:
+	case GST_VIDEO_FORMAT_BGRx:
+	case GST_VIDEO_FORMAT_RGBx:
+	case GST_VIDEO_FORMAT_xRGB:
+	case GST_VIDEO_FORMAT_xBGR:
+	case GST_VIDEO_FORMAT_BGRA:
+	case GST_VIDEO_FORMAT_RGBA:
+	case GST_VIDEO_FORMAT_ARGB:
+	case GST_VIDEO_FORMAT_ABGR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool init_target(raster_target *target, GstVideoFrame *frame)
+{
+	target->format = GST_VIDEO_FRAME_FORMAT(frame);
+	if (!xg_raster_supports_format(target->format))
+	{
+		return false;
+	}
+	target->width = GST_VIDEO_FRAME_WIDTH(frame);
+	target->height = GST_VIDEO_FRAME_HEIGHT(frame);
+	for (int32_t i = 0; i < 2 && i < (int32_t)GST_VIDEO_FRAME_N_PLANES(frame);
+	     ++i)
+	{
+		target->planes[i] = GST_VIDEO_FRAME_PLANE_DATA(frame, i);
+		target->strides[i] = GST_VIDEO_FRAME_PLANE_STRIDE(frame, i);
+	}
+	if (target->format != GST_VIDEO_FORMAT_YUY2 &&
+	    target->format != GST_VIDEO_FORMAT_NV12)
+	{
+		const GstVideoFormatInfo *info = frame->info.finfo;
+		target->r = GST_VIDEO_FORMAT_INFO_POFFSET(info, 0);
+		target->g = GST_VIDEO_FORMAT_INFO_POFFSET(info, 1);
+		target->b = GST_VIDEO_FORMAT_INFO_POFFSET(info, 2);
+	}
+	return true;
+}
+
+static uint8_t clamp_byte(int32_t value)
+{
+	return value < 0 ? 0 : value > 255 ? 255 : (uint8_t)value;
+}
+
+static raster_color make_color(const raster_target *target, xg_color color)
+{
+	raster_color result = {{color.r, color.g, color.b}};
+	uint8_t bytes[4] = {0};
+	// BT.601, limited range, as v4l2 cameras produce
+	int32_t r = color.r, g = color.g, b = color.b;
+	result.y = clamp_byte(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+	result.u = clamp_byte(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+	result.v = clamp_byte(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+
+	if (target->format == GST_VIDEO_FORMAT_YUY2)
+	{
+		bytes[0] = result.y;
+		bytes[1] = result.u;
+		bytes[2] = result.y;
+		bytes[3] = result.v;
+	}
+	else if (target->format != GST_VIDEO_FORMAT_NV12)
+	{
+		// Opaque, for the formats that have alpha
+		memset(bytes, 255, sizeof(bytes));
+		bytes[target->r] = color.r;
+		bytes[target->g] = color.g;
+		bytes[target->b] = color.b;
+	}
+	memcpy(&result.pixel, bytes, sizeof(result.pixel));
+	uint8_t chroma[2] = {result.u, result.v};
+	memcpy(&result.chroma, chroma, sizeof(result.chroma));
+	return result;
+}
+
+////////////////
+// Row fills
+////////////////
+
+static void fill_u32(uint8_t *dest, int32_t count, uint32_t value)
+{
+	int32_t i = 0;
+#if RASTER_NEON
+	uint32x4_t vector = vdupq_n_u32(value);
+	for (; i + 4 <= count; i += 4)
+	{
+		vst1q_u8(dest + i * 4, vreinterpretq_u8_u32(vector));
+	}
+#elif RASTER_SSE2
+	__m128i vector = _mm_set1_epi32((int32_t)value);
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm_storeu_si128((__m128i *)(dest + i * 4), vector);
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		memcpy(dest + i * 4, &value, sizeof(value));
+	}
+}
+
+static void fill_u16(uint8_t *dest, int32_t count, uint16_t value)
+{
+	int32_t i = 0;
+#if RASTER_NEON
+	uint16x8_t vector = vdupq_n_u16(value);
+	for (; i + 8 <= count; i += 8)
+	{
+		vst1q_u8(dest + i * 2, vreinterpretq_u8_u16(vector));
+	}
+#elif RASTER_SSE2
+	__m128i vector = _mm_set1_epi16((int16_t)value);
+	for (; i + 8 <= count; i += 8)
+	{
+		_mm_storeu_si128((__m128i *)(dest + i * 2), vector);
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		memcpy(dest + i * 2, &value, sizeof(value));
+	}
+}
+
+// Fills the pixels from (@x0, @y0) up to but not including (@x1, @y1)
+static void fill_rect(const raster_target *target, int32_t x0, int32_t y0,
+		      int32_t x1, int32_t y1, const raster_color *color)
+{
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+	x1 = x1 > target->width ? target->width : x1;
+	y1 = y1 > target->height ? target->height : y1;
+	if (x0 >= x1 || y0 >= y1)
+	{
+		return;
+	}
+
+	switch (target->format)
+	{
+	case GST_VIDEO_FORMAT_YUY2:
+		// Pixels come in pairs sharing their chroma
+		x0 &= ~1;
+		x1 = (x1 + 1) & ~1;
+		for (int32_t y = y0; y < y1; ++y)
+		{
+			fill_u32(target->planes[0] + y * target->strides[0] + x0 * 2,
+				 (x1 - x0) / 2, color->pixel);
+		}
+		break;
+	case GST_VIDEO_FORMAT_NV12:
+		for (int32_t y = y0; y < y1; ++y)
+		{
+			memset(target->planes[0] + y * target->strides[0] + x0,
+			       color->y, x1 - x0);
+		}
+		for (int32_t y = y0 / 2; y < (y1 + 1) / 2; ++y)
+		{
+			fill_u16(target->planes[1] + y * target->strides[1] +
+				     x0 / 2 * 2,
+				 (x1 + 1) / 2 - x0 / 2, color->chroma);
+		}
+		break;
+	default:
+		for (int32_t y = y0; y < y1; ++y)
+		{
+			fill_u32(target->planes[0] + y * target->strides[0] + x0 * 4,
+				 x1 - x0, color->pixel);
+		}
+		break;
+	}
+}
+
+////////////////
+// Text
+////////////////
+
+static uint8_t blend(uint8_t from, uint8_t to, int32_t alpha)
+{
+	return (uint8_t)(from + ((to - from) * alpha + 127) / 255);
+}
+
+// Coverage of the mask at (@x, @y) in mask coordinates, 0 outside it
+static int32_t coverage(const xg_label_mask *mask, int32_t x, int32_t y)
+{
+	if (x < 0 || y < 0 || x >= mask->width || y >= mask->height)
+	{
+		return 0;
+	}
+	return mask->data[y * mask->stride + x];
+}
+
+// Blends @color into the target through @mask, whose upper left corner is at
+// (@left, @top)
+static void blend_mask(const raster_target *target, const xg_label_mask *mask,
+		       int32_t left, int32_t top, const raster_color *color)
+{
+	int32_t x0 = left < 0 ? 0 : left;
+	int32_t y0 = top < 0 ? 0 : top;
+	int32_t x1 = left + mask->width;
+	int32_t y1 = top + mask->height;
+	x1 = x1 > target->width ? target->width : x1;
+	y1 = y1 > target->height ? target->height : y1;
+
+	switch (target->format)
+	{
+	case GST_VIDEO_FORMAT_YUY2:
+		x0 &= ~1;
+		for (int32_t y = y0; y < y1; ++y)
+		{
+			uint8_t *row = target->planes[0] + y * target->strides[0];
+			for (int32_t x = x0; x < x1; x += 2)
+			{
+				int32_t a0 = coverage(mask, x - left, y - top);
+				int32_t a1 = coverage(mask, x + 1 - left, y - top);
+				uint8_t *pair = row + x * 2;
+				pair[0] = blend(pair[0], color->y, a0);
+				pair[2] = blend(pair[2], color->y, a1);
+				pair[1] = blend(pair[1], color->u, (a0 + a1) / 2);
+				pair[3] = blend(pair[3], color->v, (a0 + a1) / 2);
+			}
+		}
+		break;
+	case GST_VIDEO_FORMAT_NV12:
+		for (int32_t y = y0; y < y1; ++y)
+		{
+			uint8_t *row = target->planes[0] + y * target->strides[0];
+			for (int32_t x = x0; x < x1; ++x)
+			{
+				row[x] = blend(row[x], color->y,
+					       coverage(mask, x - left, y - top));
+			}
+		}
+		for (int32_t y = y0 / 2; y < (y1 + 1) / 2; ++y)
+		{
+			uint8_t *row = target->planes[1] + y * target->strides[1];
+			for (int32_t x = x0 / 2; x < (x1 + 1) / 2; ++x)
+			{
+				int32_t mx = x * 2 - left, my = y * 2 - top;
+				int32_t alpha = (coverage(mask, mx, my) +
+						 coverage(mask, mx + 1, my) +
+						 coverage(mask, mx, my + 1) +
+						 coverage(mask, mx + 1, my + 1)) /
+						4;
+				row[x * 2] = blend(row[x * 2], color->u, alpha);
+				row[x * 2 + 1] =
+				    blend(row[x * 2 + 1], color->v, alpha);
+			}
+		}
+		break;
+	default:
+		for (int32_t y = y0; y < y1; ++y)
+		{
+			uint8_t *row = target->planes[0] + y * target->strides[0];
+			for (int32_t x = x0; x < x1; ++x)
+			{
+				int32_t alpha = coverage(mask, x - left, y - top);
+				if (alpha == 0)
+				{
+					continue;
+				}
+				uint8_t *pixel = row + x * 4;
+				pixel[target->r] =
+				    blend(pixel[target->r], color->rgb[0], alpha);
+				pixel[target->g] =
+				    blend(pixel[target->g], color->rgb[1], alpha);
+				pixel[target->b] =
+				    blend(pixel[target->b], color->rgb[2], alpha);
+			}
+		}
+		break;
+	}
+}
+
+////////////////
+// Overlays
+////////////////
+
+// Draws @text's label with its background's upper left corner where
+// xg_overlay_draw() puts it
+static void draw_label(const raster_target *target, const xg_overlay *text,
+		       xg_label_cache *labels)
+{
+	xg_label_mask mask;
+	if (!xg_label_cache_get_mask(labels, text, &mask))
+	{
+		return;
+	}
+	int32_t x = (int32_t)lround(text->x * target->width + OVERLAY_LINE_WIDTH);
+	int32_t y = (int32_t)lround(text->y * target->height + OVERLAY_LINE_WIDTH);
+	raster_color background = make_color(target, text->bg_color);
+	fill_rect(target, x, y, x + mask.background_width,
+		  y + mask.background_height, &background);
+	if (mask.data != NULL)
+	{
+		raster_color foreground = make_color(target, text->text_color);
+		blend_mask(target, &mask, x + mask.x, y + mask.y, &foreground);
+	}
+}
+
+// Strokes the outline of @box as cairo would: a line OVERLAY_LINE_WIDTH wide,
+// centred on the edges of the box offset by that much
+static void draw_box(const raster_target *target, const xg_overlay *box)
+{
+	const double half_line = OVERLAY_LINE_WIDTH / 2.0;
+	double x = box->x * target->width + OVERLAY_LINE_WIDTH;
+	double y = box->y * target->height + OVERLAY_LINE_WIDTH;
+	int32_t left = (int32_t)lround(x - half_line);
+	int32_t top = (int32_t)lround(y - half_line);
+	int32_t right = (int32_t)lround(x + box->width * target->width + half_line);
+	int32_t bottom =
+	    (int32_t)lround(y + box->height * target->height + half_line);
+
+	raster_color color = make_color(target, box->bg_color);
+	fill_rect(target, left, top, right, top + OVERLAY_LINE_WIDTH, &color);
+	fill_rect(target, left, bottom - OVERLAY_LINE_WIDTH, right, bottom,
+		  &color);
+	fill_rect(target, left, top, left + OVERLAY_LINE_WIDTH, bottom, &color);
+	fill_rect(target, right - OVERLAY_LINE_WIDTH, top, right, bottom, &color);
+}
+
+bool xg_raster_draw_overlays(GstVideoFrame *frame, const xg_overlay *overlays,
+			     xg_label_cache *labels)
+{
+	raster_target target;
+	if (!init_target(&target, frame))
+	{
+		return false;
+	}
+	for (const xg_overlay *overlay = overlays; overlay != NULL;
+	     overlay = overlay->next)
+	{
+		if (overlay->type == XG_OVERLAY_BOUNDING_BOX)
+		{
+			draw_box(&target, overlay);
+		}
+		draw_label(&target, overlay, labels);
+	}
+	return true;
+}
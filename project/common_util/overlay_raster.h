@@ -0,0 +1,31 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_OVERLAY_RASTER_H__
+#define __COMMON_UTIL_OVERLAY_RASTER_H__
+
+#include <stdbool.h>
+
+#include <gst/video/video.h>
+
+#include "overlays.h"
+
+// Draws overlays straight into video frames in the frame's own pixel format,
+// so the display branch needn't convert every frame to RGB for cairooverlay
+// and set up a cairo context for it. Box outlines and label backgrounds are
+// solid fills, written a row at a time with SSE2 or NEON where available;
+// label text is blended from the masks in an xg_label_cache, so it matches
+// what cairo draws. Colours are drawn opaque.
+
+// Formats xg_raster_draw_overlays() can draw into, as caps
+#define XG_RASTER_CAPS                                                         \
+	"video/x-raw,format={ YUY2, NV12, BGRx, RGBx, xRGB, xBGR, BGRA, RGBA, " \
+	"ARGB, ABGR }"
+
+bool xg_raster_supports_format(GstVideoFormat format);
+
+// Draws the linked list of @overlays into @frame, which must be mapped for
+// writing. Returns false if the frame's format isn't one of the above.
+bool xg_raster_draw_overlays(GstVideoFrame *frame, const xg_overlay *overlays,
+			     xg_label_cache *labels);
+
+#endif  // __COMMON_UTIL_OVERLAY_RASTER_H__
@@ -2,85 +2,131 @@
 //
 #include "overlays.h"
 
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 enum
 {
-	LINE_WIDTH = OVERLAY_TEXT_SIZE / 8
+	LINE_WIDTH = OVERLAY_LINE_WIDTH
 };
 
 static const char *const FONT = "Courier";
 
-xg_overlay *xg_overlay_create_bounding_box(float x, float y, float width,
-					   float height, const char *label,
-					   xg_color color)
+// Allocates an overlay with a copy of @label, from @arena if there is one
+static xg_overlay *create_overlay(xg_arena *arena, enum xg_overlay_type type,
+				  float x, float y, const char *label,
+				  xg_color color)
 {
-	xg_overlay *result = calloc(1, sizeof(xg_overlay));
-	if (result == NULL) {
-		return NULL;
+	xg_overlay *result;
+	if (arena != NULL)
+	{
+		result = xg_arena_calloc(arena, 1, sizeof(xg_overlay));
+		if (result == NULL)
+		{
+			return NULL;
+		}
+		result->text = xg_arena_strdup(arena, label);
+		if (result->text == NULL)
+		{
+			return NULL;
+		}
+		result->in_arena = true;
 	}
-	result->type = XG_OVERLAY_BOUNDING_BOX;
+	else
+	{
+		result = calloc(1, sizeof(xg_overlay));
+		if (result == NULL)
+		{
+			return NULL;
+		}
+		result->text = strdup(label);
+		if (result->text == NULL)
+		{
+			free(result);
+			return NULL;
+		}
+	}
+	result->type = type;
 	result->x = x;
 	result->y = y;
-	result->width = width;
-	result->height = height;
-	result->text = strdup(label);
-	if (result->text == NULL) {
-		free(result);
-		return NULL;
-	}
 	result->bg_color = color;
 	result->text_color = (xg_color){0, 0, 0, 255};
 	return result;
 }
 
-xg_overlay *xg_overlay_create_text(float x, float y, const char *label,
-				   xg_color color)
+xg_overlay *xg_overlay_create_bounding_box_in(xg_arena *arena, float x,
+					      float y, float width,
+					      float height, const char *label,
+					      xg_color color)
 {
-	xg_overlay *result = calloc(1, sizeof(xg_overlay));
+	xg_overlay *result = create_overlay(arena, XG_OVERLAY_BOUNDING_BOX, x,
+					    y, label, color);
 	if (result == NULL)
 	{
 		return NULL;
 	}
-	result->type = XG_OVERLAY_TEXT;
-	result->x = x;
-	result->y = y;
-	result->text = strdup(label);
-	if (result->text == NULL)
-	{
-		free(result);
-		return NULL;
-	}
-	result->bg_color = color;
-	result->text_color = (xg_color){0, 0, 0, 255};
+	result->width = width;
+	result->height = height;
 	return result;
 }
 
+xg_overlay *xg_overlay_create_bounding_box(float x, float y, float width,
+					   float height, const char *label,
+					   xg_color color)
+{
+	return xg_overlay_create_bounding_box_in(NULL, x, y, width, height,
+						 label, color);
+}
+
+xg_overlay *xg_overlay_create_text_in(xg_arena *arena, float x, float y,
+				      const char *label, xg_color color)
+{
+	return create_overlay(arena, XG_OVERLAY_TEXT, x, y, label, color);
+}
+
+xg_overlay *xg_overlay_create_text(float x, float y, const char *label,
+				   xg_color color)
+{
+	return xg_overlay_create_text_in(NULL, x, y, label, color);
+}
+
 void xg_overlay_free(xg_overlay *overlay)
 {
+	if (overlay->in_arena)
+	{
+		return;
+	}
 	free(overlay->text);
 	free(overlay);
 }
 
-static void xg_overlay_text_draw(xg_overlay *text, cairo_t *cr,
-				 int32_t surface_width,
-				 int32_t surface_height)
+// Where a label's text starts, relative to the upper left corner of its
+// background
+static const double TEXT_OFFSET_X = LINE_WIDTH / 2.0;
+static const double TEXT_OFFSET_Y = LINE_WIDTH * 1.5 + OVERLAY_TEXT_SIZE / 2.0;
+
+static void set_source_color(cairo_t *cr, xg_color color)
 {
-	// Absolute position of upper left corner of the current line
-	double x = text->x * surface_width + LINE_WIDTH;
-	double y = text->y * surface_height + LINE_WIDTH;
+	cairo_set_source_rgba(cr, color.r / 255.0f, color.g / 255.0f,
+			      color.b / 255.0f, color.a / 255.0f);
+}
 
-	cairo_push_group(cr);
-	cairo_move_to(cr, x + LINE_WIDTH / 2.0,
-		      y + LINE_WIDTH * 1.5 + OVERLAY_TEXT_SIZE / 2.0);
-	cairo_set_source_rgba(
-	    cr, text->text_color.r / 255.0f, text->text_color.g / 255.0f,
-	    text->text_color.b / 255.0f, text->text_color.a / 255.0f);
+static void select_label_font(cairo_t *cr)
+{
 	cairo_set_font_size(cr, OVERLAY_TEXT_SIZE);
 	cairo_select_font_face(cr, FONT, CAIRO_FONT_SLANT_NORMAL,
 			       CAIRO_FONT_WEIGHT_BOLD);
+}
+
+// Draws @text's label with the upper left corner of its background at (@x, @y)
+static void render_label(xg_overlay *text, cairo_t *cr, double x, double y)
+{
+	cairo_push_group(cr);
+	cairo_move_to(cr, x + TEXT_OFFSET_X, y + TEXT_OFFSET_Y);
+	set_source_color(cr, text->text_color);
+	select_label_font(cr);
 	cairo_show_text(cr, text->text);
 	double cur_x, cur_y;
 	cairo_get_current_point(cr, &cur_x, &cur_y);
@@ -88,9 +134,7 @@ static void xg_overlay_text_draw(xg_overlay *text, cairo_t *cr,
 	double line_height = cur_y - y;
 	cairo_pattern_t *text_surface = cairo_pop_group(cr);
 
-	cairo_set_source_rgba(cr, text->bg_color.r / 255.0f,
-			      text->bg_color.g / 255.0f, text->bg_color.b / 255.0f,
-			      text->bg_color.a / 255.0f);
+	set_source_color(cr, text->bg_color);
 	cairo_set_line_width(cr, 2);
 	cairo_rectangle(cr, x, y, line_width + LINE_WIDTH / 2.0,
 			line_height + LINE_WIDTH);
@@ -102,7 +146,283 @@ static void xg_overlay_text_draw(xg_overlay *text, cairo_t *cr,
 	cairo_pattern_destroy(text_surface);
 }
 
-static void xg_overlay_bounding_box_draw(xg_overlay *bounding_box, cairo_t *cr,
+/////////////////
+// Label cache
+/////////////////
+
+enum
+{
+	// Far more labels than any model has classes. If it does fill up, the
+	// cache is emptied and starts over.
+	LABEL_CACHE_CAPACITY = 256,
+	LABEL_CACHE_SLOTS = LABEL_CACHE_CAPACITY * 2,
+};
+
+typedef struct cached_label
+{
+	// NULL for an empty slot
+	char *text;
+	xg_color bg_color, text_color;
+	int32_t font_size;
+	uint32_t hash;
+	// The rendered label, and where its upper left corner is relative to the
+	// corner of its background (text may stick out above and to the left).
+	// Rendered the first time it's drawn with cairo.
+	cairo_surface_t *surface;
+	int32_t offset_x, offset_y;
+	// Coverage of the text alone, for xg_label_cache_get_mask()
+	cairo_surface_t *mask;
+	xg_label_mask mask_info;
+} cached_label;
+
+struct xg_label_cache
+{
+	// Open addressing with linear probing
+	cached_label slots[LABEL_CACHE_SLOTS];
+	int32_t count;
+};
+
+xg_label_cache *xg_label_cache_create(void)
+{
+	return calloc(1, sizeof(xg_label_cache));
+}
+
+static void clear_label_cache(xg_label_cache *cache)
+{
+	for (int32_t i = 0; i < LABEL_CACHE_SLOTS; ++i)
+	{
+		cached_label *label = &cache->slots[i];
+		if (label->text != NULL)
+		{
+			free(label->text);
+			cairo_surface_destroy(label->surface);
+			cairo_surface_destroy(label->mask);
+		}
+	}
+	memset(cache, 0, sizeof(xg_label_cache));
+}
+
+void xg_label_cache_free(xg_label_cache *cache)
+{
+	if (cache == NULL)
+	{
+		return;
+	}
+	clear_label_cache(cache);
+	free(cache);
+}
+
+static bool same_color(xg_color a, xg_color b)
+{
+	return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t size)
+{
+	// FNV-1a
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static uint32_t hash_label(const xg_overlay *text, int32_t font_size)
+{
+	uint32_t hash = 2166136261u;
+	hash = hash_bytes(hash, text->text, strlen(text->text));
+	uint8_t colors[] = {text->bg_color.r,	text->bg_color.g,
+			    text->bg_color.b,	text->bg_color.a,
+			    text->text_color.r, text->text_color.g,
+			    text->text_color.b, text->text_color.a};
+	hash = hash_bytes(hash, colors, sizeof(colors));
+	return hash_bytes(hash, &font_size, sizeof(font_size));
+}
+
+// Renders @text's label into a surface of its own, just big enough for the
+// background and the text's ink
+static bool render_cached_label(xg_overlay *text, cairo_t *cr,
+				cached_label *label)
+{
+	// Measure with the target's font options, so the cached text is
+	// identical to what would have been drawn directly
+	cairo_save(cr);
+	select_label_font(cr);
+	cairo_text_extents_t extents;
+	cairo_text_extents(cr, text->text, &extents);
+	cairo_restore(cr);
+
+	double background_width = extents.x_advance + LINE_WIDTH;
+	double background_height = TEXT_OFFSET_Y + LINE_WIDTH;
+	double left = fmin(0, TEXT_OFFSET_X + extents.x_bearing);
+	double top = fmin(0, TEXT_OFFSET_Y + extents.y_bearing);
+	double right =
+	    fmax(background_width, TEXT_OFFSET_X + extents.x_bearing + extents.width);
+	double bottom = fmax(background_height,
+			     TEXT_OFFSET_Y + extents.y_bearing + extents.height);
+	label->offset_x = (int32_t)floor(left);
+	label->offset_y = (int32_t)floor(top);
+	int32_t width = (int32_t)ceil(right) - label->offset_x;
+	int32_t height = (int32_t)ceil(bottom) - label->offset_y;
+
+	label->surface =
+	    cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	if (cairo_surface_status(label->surface) != CAIRO_STATUS_SUCCESS)
+	{
+		cairo_surface_destroy(label->surface);
+		label->surface = NULL;
+		return false;
+	}
+	cairo_t *label_cr = cairo_create(label->surface);
+	render_label(text, label_cr, -label->offset_x, -label->offset_y);
+	cairo_destroy(label_cr);
+	cairo_surface_flush(label->surface);
+	return true;
+}
+
+// Finds @text's label in the cache, adding an entry with nothing rendered yet
+// if it isn't there. Returns NULL if out of memory.
+static cached_label *find_label(xg_label_cache *cache, const xg_overlay *text)
+{
+	int32_t font_size = OVERLAY_TEXT_SIZE;
+	uint32_t hash = hash_label(text, font_size);
+	int32_t slot = hash % LABEL_CACHE_SLOTS;
+	for (;;)
+	{
+		cached_label *label = &cache->slots[slot];
+		if (label->text == NULL)
+		{
+			break;
+		}
+		if (label->hash == hash && label->font_size == font_size &&
+		    same_color(label->bg_color, text->bg_color) &&
+		    same_color(label->text_color, text->text_color) &&
+		    strcmp(label->text, text->text) == 0)
+		{
+			return label;
+		}
+		slot = (slot + 1) % LABEL_CACHE_SLOTS;
+	}
+
+	if (cache->count == LABEL_CACHE_CAPACITY)
+	{
+		clear_label_cache(cache);
+		slot = hash % LABEL_CACHE_SLOTS;
+	}
+	cached_label *label = &cache->slots[slot];
+	label->text = strdup(text->text);
+	if (label->text == NULL)
+	{
+		return NULL;
+	}
+	label->bg_color = text->bg_color;
+	label->text_color = text->text_color;
+	label->font_size = font_size;
+	label->hash = hash;
+	++cache->count;
+	return label;
+}
+
+// Renders just the text of @label into an A8 surface, recording where it goes
+// relative to the background
+static bool render_label_mask(cached_label *label)
+{
+	// Measure on a scratch surface of the same kind
+	cairo_surface_t *scratch = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+	cairo_t *cr = cairo_create(scratch);
+	select_label_font(cr);
+	cairo_text_extents_t extents;
+	cairo_text_extents(cr, label->text, &extents);
+	cairo_destroy(cr);
+	cairo_surface_destroy(scratch);
+
+	xg_label_mask *info = &label->mask_info;
+	info->background_width = (int32_t)ceil(extents.x_advance + LINE_WIDTH);
+	info->background_height = (int32_t)ceil(TEXT_OFFSET_Y + LINE_WIDTH);
+	info->x = (int32_t)floor(TEXT_OFFSET_X + extents.x_bearing);
+	info->y = (int32_t)floor(TEXT_OFFSET_Y + extents.y_bearing);
+	info->width =
+	    (int32_t)ceil(TEXT_OFFSET_X + extents.x_bearing + extents.width) -
+	    info->x;
+	info->height =
+	    (int32_t)ceil(TEXT_OFFSET_Y + extents.y_bearing + extents.height) -
+	    info->y;
+	if (info->width <= 0 || info->height <= 0)
+	{
+		// Nothing but spaces
+		info->width = info->height = 0;
+		info->data = NULL;
+		return true;
+	}
+
+	label->mask = cairo_image_surface_create(CAIRO_FORMAT_A8, info->width,
+						 info->height);
+	if (cairo_surface_status(label->mask) != CAIRO_STATUS_SUCCESS)
+	{
+		cairo_surface_destroy(label->mask);
+		label->mask = NULL;
+		memset(info, 0, sizeof(xg_label_mask));
+		return false;
+	}
+	cr = cairo_create(label->mask);
+	select_label_font(cr);
+	cairo_set_source_rgba(cr, 0, 0, 0, 1);
+	cairo_move_to(cr, TEXT_OFFSET_X - info->x, TEXT_OFFSET_Y - info->y);
+	cairo_show_text(cr, label->text);
+	cairo_destroy(cr);
+	cairo_surface_flush(label->mask);
+	info->data = cairo_image_surface_get_data(label->mask);
+	info->stride = cairo_image_surface_get_stride(label->mask);
+	return true;
+}
+
+bool xg_label_cache_get_mask(xg_label_cache *cache, const xg_overlay *text,
+			     xg_label_mask *mask_out)
+{
+	cached_label *label = find_label(cache, text);
+	if (label == NULL)
+	{
+		return false;
+	}
+	if (label->mask == NULL && label->mask_info.background_width == 0 &&
+	    !render_label_mask(label))
+	{
+		return false;
+	}
+	*mask_out = label->mask_info;
+	return true;
+}
+
+static void xg_overlay_text_draw(xg_overlay *text, xg_label_cache *cache,
+				 cairo_t *cr, int32_t surface_width,
+				 int32_t surface_height)
+{
+	// Absolute position of upper left corner of the current line
+	double x = text->x * surface_width + LINE_WIDTH;
+	double y = text->y * surface_height + LINE_WIDTH;
+
+	cached_label *label = cache ? find_label(cache, text) : NULL;
+	if (label != NULL && label->surface == NULL &&
+	    !render_cached_label(text, cr, label))
+	{
+		label = NULL;
+	}
+	if (label == NULL)
+	{
+		render_label(text, cr, x, y);
+		return;
+	}
+	// Painting at whole pixels keeps this a straight copy, with no
+	// resampling
+	cairo_set_source_surface(cr, label->surface,
+				 round(x) + label->offset_x,
+				 round(y) + label->offset_y);
+	cairo_paint(cr);
+}
+
+static void xg_overlay_bounding_box_draw(xg_overlay *bounding_box,
+					 xg_label_cache *cache, cairo_t *cr,
 					 int32_t surface_width,
 					 int32_t surface_height)
 {
@@ -124,22 +444,32 @@ static void xg_overlay_bounding_box_draw(xg_overlay *bounding_box, cairo_t *cr,
 	cairo_rectangle(cr, x, y, width, height);
 	cairo_stroke(cr);
 
-	xg_overlay_text_draw(bounding_box, cr, surface_width, surface_height);
+	xg_overlay_text_draw(bounding_box, cache, cr, surface_width,
+			     surface_height);
 }
 
 void xg_overlay_draw(xg_overlay *overlay, cairo_t *cr, int32_t surface_width,
 		     int32_t surface_height)
+{
+	xg_overlay_draw_cached(overlay, NULL, cr, surface_width, surface_height);
+}
+
+void xg_overlay_draw_cached(xg_overlay *overlay, xg_label_cache *cache,
+			    cairo_t *cr, int32_t surface_width,
+			    int32_t surface_height)
 {
 	switch (overlay->type)
 	{
 	case XG_OVERLAY_BOUNDING_BOX:
 		{
-			xg_overlay_bounding_box_draw(overlay, cr, surface_width, surface_height);
+			xg_overlay_bounding_box_draw(overlay, cache, cr, surface_width,
+						     surface_height);
 			break;
 		}
 	case XG_OVERLAY_TEXT:
 		{
-			xg_overlay_text_draw(overlay, cr, surface_width, surface_height);
+			xg_overlay_text_draw(overlay, cache, cr, surface_width,
+					     surface_height);
 			break;
 		}
 	}
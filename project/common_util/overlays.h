@@ -8,6 +8,7 @@
 
 #include <cairo.h>
 
+#include "arena.h"
 #include "colors.h"
 
 enum xg_overlay_type {
@@ -25,12 +26,17 @@ typedef struct xg_overlay {
   // linked list functionality
   struct xg_overlay* next;
   bool owned_by_pipeline;
+  // Allocated from an arena along with its text, so xg_overlay_free() leaves
+  // it for the arena to reclaim
+  bool in_arena;
 } xg_overlay;
 
 enum {
   // Height of the overlay text, in pixels. Used as the font size when drawing
   // text in cairo.
-  OVERLAY_TEXT_SIZE = 24
+  OVERLAY_TEXT_SIZE = 24,
+  // Width of bounding box outlines, in pixels
+  OVERLAY_LINE_WIDTH = OVERLAY_TEXT_SIZE / 8
 };
 
 xg_overlay* xg_overlay_create_text(float x, float y, const char* label,
@@ -38,8 +44,49 @@ xg_overlay* xg_overlay_create_text(float x, float y, const char* label,
 xg_overlay* xg_overlay_create_bounding_box(float x, float y, float width,
                                            float height, const char* label,
                                            xg_color color);
+// Like the above, but allocate the overlay and a copy of its label from
+// @arena (or the heap, if it is NULL). Such overlays are only valid until the
+// arena is reset; see xg_pipeline_acquire_arena().
+xg_overlay* xg_overlay_create_text_in(xg_arena* arena, float x, float y,
+                                      const char* label, xg_color color);
+xg_overlay* xg_overlay_create_bounding_box_in(xg_arena* arena, float x,
+                                              float y, float width,
+                                              float height, const char* label,
+                                              xg_color color);
 void xg_overlay_draw(xg_overlay* overlay, cairo_t* cr, int32_t surface_width,
                      int32_t surface_height);
+
+// Rendered labels, keyed by text, colours and font size. Labels come from the
+// model's small, fixed set of classes, so rather than laying out and
+// rasterizing the same text every frame, each one is rendered into an image
+// surface once and painted from there. Not thread-safe.
+typedef struct xg_label_cache xg_label_cache;
+
+xg_label_cache* xg_label_cache_create(void);
+void xg_label_cache_free(xg_label_cache* cache);
+// Like xg_overlay_draw(), but paints the label from @cache, rendering it into
+// the cache first if this is the first time it is drawn
+void xg_overlay_draw_cached(xg_overlay* overlay, xg_label_cache* cache,
+                            cairo_t* cr, int32_t surface_width,
+                            int32_t surface_height);
+
+// Where a label's text covers its background, for drawing labels without
+// cairo (see overlay_raster.h). The text is drawn in the label's text colour
+// with @data as coverage, over a box of the background colour.
+typedef struct xg_label_mask {
+  // One byte of coverage per pixel, or NULL if there's nothing to draw
+  const uint8_t* data;
+  int32_t width, height, stride;
+  // Position of the mask relative to the background's upper left corner
+  int32_t x, y;
+  int32_t background_width, background_height;
+} xg_label_mask;
+
+// Gets the text mask for @text's label, rendering it into @cache the first
+// time. The mask stays valid until the cache is next used or freed. Returns
+// false if it couldn't be rendered.
+bool xg_label_cache_get_mask(xg_label_cache* cache, const xg_overlay* text,
+                             xg_label_mask* mask_out);
 void xg_overlay_free(xg_overlay* overlay);
 
 #endif  // __COMMON_UTIL_OVERLAYS_H__
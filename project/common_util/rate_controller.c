@@ -0,0 +1,261 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "rate_controller.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "settings.h"
+
+enum
+{
+	// How often the CPU load is sampled, in nanoseconds
+	LOAD_SAMPLE_INTERVAL = 1000000000,
+};
+
+// How quickly the latency estimate follows new measurements
+static const double LATENCY_SMOOTHING = 0.2;
+// How much the spacing between evaluations grows each sample the load is over
+// budget, and shrinks back each sample it isn't
+static const double BACKOFF_GROWTH = 1.25;
+static const double BACKOFF_DECAY = 0.9;
+static const double MAX_BACKOFF = 16.0;
+
+struct xg_rate_controller
+{
+	xg_rate_config config;
+
+	// Guards @latency, which evaluations may report from any thread
+	pthread_mutex_t lock;
+	// Smoothed evaluation latency in nanoseconds, 0 until the first report
+	double latency;
+
+	// The rest is only used by the deciding thread
+	uint64_t last_evaluated_at;
+	uint64_t last_keyframe;
+	bool evaluated_any;
+	// Multiplies the latency to get the least spacing between evaluations
+	double backoff;
+	// Totals from /proc/stat at the last load sample
+	uint64_t last_load_sample;
+	uint64_t cpu_busy, cpu_total;
+
+	uint64_t n_evaluated, n_tracked, n_skipped;
+};
+
+void xg_rate_config_init(xg_rate_config *config)
+{
+	memset(config, 0, sizeof(xg_rate_config));
+}
+
+// Accepts finite numbers that aren't negative
+static bool parse_number(const char *value, double *number)
+{
+	char end;
+	return sscanf(value, "%lf%c", number, &end) == 1 && isfinite(*number) &&
+	       *number >= 0;
+}
+
+static bool parse_setting(void *target, const char *key, const char *value)
+{
+	xg_rate_config *config = (xg_rate_config *)target;
+	double number;
+	if (!parse_number(value, &number))
+	{
+		return false;
+	}
+	if (strcmp(key, "fps") == 0)
+	{
+		config->target_fps = number;
+		return true;
+	}
+	if (strcmp(key, "max-cpu") == 0)
+	{
+		config->max_cpu_load = number / 100;
+		return number <= 100;
+	}
+	if (strcmp(key, "keyframes") == 0)
+	{
+		// A frame count, so truncating e.g. 0.5 to 0 would silently
+		// turn keyframe mode off
+		if (number < 1 || number > INT32_MAX || number != floor(number))
+		{
+			return false;
+		}
+		config->keyframe_interval = (int32_t)number;
+		return true;
+	}
+	return false;
+}
+
+bool xg_rate_config_parse(xg_rate_config *config, const char *settings)
+{
+	return xg_settings_parse(settings, "rate", parse_setting, config);
+}
+
+xg_rate_controller *xg_rate_controller_create(const xg_rate_config *config)
+{
+	xg_rate_controller *controller = calloc(1, sizeof(xg_rate_controller));
+	if (controller == NULL)
+	{
+		fputs("Couldn't allocate memory for rate controller\n", stderr);
+		return NULL;
+	}
+	controller->config = *config;
+	controller->backoff = 1.0;
+	pthread_mutex_init(&controller->lock, NULL);
+	return controller;
+}
+
+void xg_rate_controller_free(xg_rate_controller *controller)
+{
+	if (controller == NULL)
+	{
+		return;
+	}
+	pthread_mutex_destroy(&controller->lock);
+	free(controller);
+}
+
+// Reads the busy and total CPU time of all cores so far, in clock ticks
+static bool read_cpu_times(uint64_t *busy_out, uint64_t *total_out)
+{
+	FILE *stat = fopen("/proc/stat", "r");
+	if (stat == NULL)
+	{
+		return false;
+	}
+	uint64_t user, nice, system, idle, iowait, irq, softirq, steal;
+	int fields = fscanf(stat,
+			    "cpu %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+			    " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+			    &user, &nice, &system, &idle, &iowait, &irq, &softirq,
+			    &steal);
+	fclose(stat);
+	if (fields != 8)
+	{
+		return false;
+	}
+	*busy_out = user + nice + system + irq + softirq + steal;
+	*total_out = *busy_out + idle + iowait;
+	return true;
+}
+
+// Samples the CPU load once every LOAD_SAMPLE_INTERVAL and adjusts the backoff
+static void update_backoff(xg_rate_controller *controller, uint64_t now)
+{
+	if (controller->config.max_cpu_load <= 0 ||
+	    now - controller->last_load_sample < LOAD_SAMPLE_INTERVAL)
+	{
+		return;
+	}
+	controller->last_load_sample = now;
+	uint64_t busy, total;
+	if (!read_cpu_times(&busy, &total))
+	{
+		return;
+	}
+	uint64_t busy_delta = busy - controller->cpu_busy;
+	uint64_t total_delta = total - controller->cpu_total;
+	bool first_sample = controller->cpu_total == 0;
+	controller->cpu_busy = busy;
+	controller->cpu_total = total;
+	if (first_sample || total_delta == 0)
+	{
+		return;
+	}
+	double load = (double)busy_delta / total_delta;
+	if (load > controller->config.max_cpu_load)
+	{
+		controller->backoff *= BACKOFF_GROWTH;
+		if (controller->backoff > MAX_BACKOFF)
+		{
+			controller->backoff = MAX_BACKOFF;
+		}
+	}
+	else
+	{
+		controller->backoff *= BACKOFF_DECAY;
+		if (controller->backoff < 1.0)
+		{
+			controller->backoff = 1.0;
+		}
+	}
+}
+
+xg_rate_decision xg_rate_controller_decide(xg_rate_controller *controller,
+					   uint64_t sequence, uint64_t now)
+{
+	update_backoff(controller, now);
+
+	pthread_mutex_lock(&controller->lock);
+	double spacing = controller->latency * controller->backoff;
+	pthread_mutex_unlock(&controller->lock);
+	if (controller->config.target_fps > 0)
+	{
+		double target = 1e9 / controller->config.target_fps;
+		if (target > spacing)
+		{
+			spacing = target;
+		}
+	}
+
+	bool due = !controller->evaluated_any ||
+		   now - controller->last_evaluated_at >= spacing;
+	bool keyframes = controller->config.keyframe_interval > 1;
+	if (keyframes && controller->evaluated_any &&
+	    sequence - controller->last_keyframe <
+		(uint64_t)controller->config.keyframe_interval)
+	{
+		due = false;
+	}
+
+	if (due)
+	{
+		controller->evaluated_any = true;
+		controller->last_evaluated_at = now;
+		controller->last_keyframe = sequence;
+		controller->n_evaluated++;
+		return XG_RATE_EVALUATE;
+	}
+	if (keyframes)
+	{
+		controller->n_tracked++;
+		return XG_RATE_TRACK;
+	}
+	controller->n_skipped++;
+	return XG_RATE_SKIP;
+}
+
+void xg_rate_controller_evaluated(xg_rate_controller *controller,
+				  uint64_t latency)
+{
+	pthread_mutex_lock(&controller->lock);
+	if (controller->latency == 0)
+	{
+		controller->latency = latency;
+	}
+	else
+	{
+		controller->latency += LATENCY_SMOOTHING *
+				       ((double)latency - controller->latency);
+	}
+	pthread_mutex_unlock(&controller->lock);
+}
+
+void xg_rate_controller_print_summary(xg_rate_controller *controller)
+{
+	pthread_mutex_lock(&controller->lock);
+	double latency = controller->latency;
+	pthread_mutex_unlock(&controller->lock);
+	fprintf(stderr,
+		"Frames evaluated: %" PRIu64 ", tracked: %" PRIu64
+		", skipped: %" PRIu64 " (evaluation latency %.1f ms, "
+		"backoff x%.2f)\n",
+		controller->n_evaluated, controller->n_tracked,
+		controller->n_skipped, latency / 1e6, controller->backoff);
+}
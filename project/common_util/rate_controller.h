@@ -0,0 +1,66 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_RATE_CONTROLLER_H__
+#define __COMMON_UTIL_RATE_CONTROLLER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Decides which captured frames the model runs on. Left alone, the runner
+// evaluates whichever frame is newest whenever the model is free, so the frames
+// evaluated (and how stale the overlays are) depend on when evaluations happen
+// to finish. The controller instead spaces evaluations out explicitly:
+//  - no closer together than a target rate, if one is set;
+//  - no closer together than the measured evaluation latency, stretched
+//    further while the system's CPU load is over a budget, so inference backs
+//    off instead of starving everything else on the box;
+//  - in keyframe mode, at most every Nth frame, with the boxes of the last
+//    keyframes moved along on the frames in between (see box_tracker.h).
+typedef struct xg_rate_config
+{
+	// Most frames a second to evaluate, or 0 for as many as the model can
+	double target_fps;
+	// Share of the total CPU time of all cores (0 to 1) above which
+	// evaluations are spaced further apart, or 0 to ignore the load
+	double max_cpu_load;
+	// If more than 1, evaluate at most every this many frames and track the
+	// boxes in between
+	int32_t keyframe_interval;
+} xg_rate_config;
+
+// What to do with a frame
+typedef enum xg_rate_decision
+{
+	XG_RATE_EVALUATE,
+	// Keyframe mode only: move the last keyframes' boxes along instead
+	XG_RATE_TRACK,
+	XG_RATE_SKIP,
+} xg_rate_decision;
+
+typedef struct xg_rate_controller xg_rate_controller;
+
+// Fills in a configuration that evaluates every frame the model keeps up with
+void xg_rate_config_init(xg_rate_config *config);
+// Overrides parts of @config from a comma-separated list of settings:
+//   fps=N, max-cpu=PERCENT, keyframes=N
+// e.g. "fps=5,max-cpu=60". Prints an error and returns false if a setting
+// isn't recognized.
+bool xg_rate_config_parse(xg_rate_config *config, const char *settings);
+
+// Returns NULL and prints a message to stderr on failure
+xg_rate_controller *xg_rate_controller_create(const xg_rate_config *config);
+void xg_rate_controller_free(xg_rate_controller *controller);
+// Decides what to do with frame number @sequence, which arrived at @now (a
+// monotonic time in nanoseconds, e.g. xg_trace_now()). Frames must be decided
+// in order, from one thread.
+xg_rate_decision xg_rate_controller_decide(xg_rate_controller *controller,
+					   uint64_t sequence, uint64_t now);
+// Reports how long an evaluation took, in nanoseconds. With several model
+// instances working in parallel, report the latency divided by their number.
+// Safe to call from any thread.
+void xg_rate_controller_evaluated(xg_rate_controller *controller,
+				  uint64_t latency);
+// Prints how many frames were evaluated, tracked and skipped to stderr
+void xg_rate_controller_print_summary(xg_rate_controller *controller);
+
+#endif  // __COMMON_UTIL_RATE_CONTROLLER_H__
@@ -0,0 +1,36 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "settings.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool xg_settings_parse(const char *settings, const char *what,
+		       xg_setting_fn apply, void *target)
+{
+	char *copy = strdup(settings);
+	if (copy == NULL)
+	{
+		fprintf(stderr, "Couldn't allocate memory for %s settings\n", what);
+		return false;
+	}
+	bool ok = true;
+	char *saveptr = NULL;
+	for (char *setting = strtok_r(copy, ",", &saveptr);
+	     ok && setting != NULL; setting = strtok_r(NULL, ",", &saveptr))
+	{
+		char *value = strchr(setting, '=');
+		if (value != NULL)
+		{
+			*value++ = '\0';
+		}
+		ok = value != NULL && apply(target, setting, value);
+		if (!ok)
+		{
+			fprintf(stderr, "Invalid %s setting '%s'\n", what, setting);
+		}
+	}
+	free(copy);
+	return ok;
+}
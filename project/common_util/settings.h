@@ -0,0 +1,20 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_SETTINGS_H__
+#define __COMMON_UTIL_SETTINGS_H__
+
+#include <stdbool.h>
+
+// Applies one setting to @target. Returns false if @key isn't recognized or
+// @value isn't valid for it.
+typedef bool (*xg_setting_fn)(void *target, const char *key,
+			      const char *value);
+
+// Splits a comma-separated list of key=value settings, e.g. "fps=5,max-cpu=60",
+// and hands each to @apply in order. @what names the settings in error
+// messages (e.g. "rate"). Prints an error and returns false at the first
+// setting that has no value or that @apply rejects.
+bool xg_settings_parse(const char *settings, const char *what,
+		       xg_setting_fn apply, void *target);
+
+#endif  // __COMMON_UTIL_SETTINGS_H__
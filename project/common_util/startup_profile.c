@@ -0,0 +1,138 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "startup_profile.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *const MILESTONE_NAMES[XG_STARTUP_MILESTONE_COUNT] = {
+	[XG_STARTUP_MAIN] = "main",
+	[XG_STARTUP_MODEL_LOADED] = "model loaded",
+	[XG_STARTUP_WARMED_UP] = "warmed up",
+	[XG_STARTUP_FIRST_FRAME] = "first frame",
+	[XG_STARTUP_FIRST_EVALUATION] = "first evaluation",
+	[XG_STARTUP_FIRST_OVERLAY] = "first overlay",
+};
+
+// When each milestone was reached, in nanoseconds of CLOCK_BOOTTIME, or 0 if
+// it hasn't been yet
+static _Atomic uint64_t stamps[XG_STARTUP_MILESTONE_COUNT];
+// XG_STARTUP_MILESTONE_COUNT until xg_startup_begin() is called, so nothing
+// prints the profile by itself
+static _Atomic int last_milestone = XG_STARTUP_MILESTONE_COUNT;
+static atomic_bool printed;
+
+// CLOCK_BOOTTIME rather than CLOCK_MONOTONIC, as it is what the kernel's
+// record of when the process started counts from
+static uint64_t boot_time_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// When the process was started, from field 22 of /proc/self/stat, or 0 if it
+// can't be read. It is counted in clock ticks, usually 10 ms each.
+static uint64_t process_start_time(void)
+{
+	FILE *file = fopen("/proc/self/stat", "r");
+	if (file == NULL)
+	{
+		return 0;
+	}
+	char line[1024];
+	bool read = fgets(line, sizeof(line), file) != NULL;
+	fclose(file);
+	// The command name in field 2 may contain spaces, so count the fields
+	// from the parenthesis closing it
+	char *fields = read ? strrchr(line, ')') : NULL;
+	unsigned long long start_ticks;
+	long ticks_per_second = sysconf(_SC_CLK_TCK);
+	if (fields == NULL || ticks_per_second <= 0 ||
+	    sscanf(fields + 1,
+		   " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d "
+		   "%*d %*d %*d %*d %llu",
+		   &start_ticks) != 1)
+	{
+		return 0;
+	}
+	return (uint64_t)start_ticks * 1000000000 / ticks_per_second;
+}
+
+void xg_startup_begin(xg_startup_milestone last)
+{
+	atomic_store(&last_milestone, last);
+	xg_startup_mark(XG_STARTUP_MAIN);
+}
+
+void xg_startup_mark(xg_startup_milestone milestone)
+{
+	if (atomic_load_explicit(&stamps[milestone], memory_order_relaxed) != 0)
+	{
+		return;
+	}
+	uint64_t unstamped = 0;
+	if (atomic_compare_exchange_strong(&stamps[milestone], &unstamped,
+					   boot_time_now()) &&
+	    (int)milestone == atomic_load(&last_milestone))
+	{
+		xg_startup_print();
+	}
+}
+
+void xg_startup_print(void)
+{
+	if (atomic_exchange(&printed, true))
+	{
+		return;
+	}
+	uint64_t reached[XG_STARTUP_MILESTONE_COUNT];
+	int order[XG_STARTUP_MILESTONE_COUNT];
+	int n_reached = 0;
+	for (int i = 0; i < XG_STARTUP_MILESTONE_COUNT; ++i)
+	{
+		reached[i] = atomic_load(&stamps[i]);
+		if (reached[i] == 0)
+		{
+			continue;
+		}
+		// Insertion sort by time reached; there are only a handful
+		int j = n_reached++;
+		for (; j > 0 && reached[order[j - 1]] > reached[i]; --j)
+		{
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+	if (n_reached == 0)
+	{
+		return;
+	}
+
+	// Without the process start time, count from main() instead
+	uint64_t origin = process_start_time();
+	const char *since = "since the process started";
+	if (origin == 0 || origin > reached[order[0]])
+	{
+		origin = reached[order[0]];
+		since = "since main";
+	}
+	fprintf(stderr, "Startup profile (ms %s):\n", since);
+	uint64_t previous = origin;
+	for (int i = 0; i < n_reached; ++i)
+	{
+		uint64_t stamp = reached[order[i]];
+		fprintf(stderr, "  %-18s %8.1f", MILESTONE_NAMES[order[i]],
+			(stamp - origin) / 1e6);
+		if (i > 0)
+		{
+			fprintf(stderr, "  (+%.1f)", (stamp - previous) / 1e6);
+		}
+		fputc('\n', stderr);
+		previous = stamp;
+	}
+}
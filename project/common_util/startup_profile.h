@@ -0,0 +1,54 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_STARTUP_PROFILE_H__
+#define __COMMON_UTIL_STARTUP_PROFILE_H__
+
+#include <stdbool.h>
+
+// Where the time goes between launching a sample and its first result. Each
+// milestone is stamped the first time it is reached, by whichever thread gets
+// there, and once the sample's last milestone is reached the profile is
+// printed to stderr, e.g.:
+//
+//   Startup profile (ms since the process started):
+//     main                 38.2
+//     model loaded        412.9  (+374.7)
+//     first frame         655.0  (+242.1)
+//     ...
+//
+// The common utilities stamp the milestones they reach themselves (the video
+// pipeline its first frame and overlays, the inference pool its models and
+// first evaluation); samples stamp the ones in their own code.
+
+typedef enum xg_startup_milestone
+{
+	// main() was entered. Everything before it is exec and dynamic linking,
+	// including mapping libxnornet.so and the model built into it.
+	XG_STARTUP_MAIN,
+	// xnor_model_load_built_in() returned, for every instance
+	XG_STARTUP_MODEL_LOADED,
+	// The dummy evaluations of model_warmup.h finished
+	XG_STARTUP_WARMED_UP,
+	// The video pipeline handed over its first frame
+	XG_STARTUP_FIRST_FRAME,
+	// The first real input was evaluated
+	XG_STARTUP_FIRST_EVALUATION,
+	// Overlays were first drawn on the video, or published by a headless
+	// pipeline, which draws nothing
+	XG_STARTUP_FIRST_OVERLAY,
+	XG_STARTUP_MILESTONE_COUNT,
+} xg_startup_milestone;
+
+// Stamps XG_STARTUP_MAIN and sets the milestone whose stamping prints the
+// profile. Call first thing in main().
+void xg_startup_begin(xg_startup_milestone last);
+
+// Stamps @milestone if it hasn't been already. Cheap enough to call for every
+// frame: after the first time it is a single atomic load.
+void xg_startup_mark(xg_startup_milestone milestone);
+
+// Prints the milestones reached so far, in the order they were reached. Called
+// by xg_startup_mark() for the last milestone; only prints once.
+void xg_startup_print(void);
+
+#endif  // __COMMON_UTIL_STARTUP_PROFILE_H__
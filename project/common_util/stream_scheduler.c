@@ -0,0 +1,543 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "stream_scheduler.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "frame_input.h"
+#include "frame_trace.h"
+#include "infer_pool.h"
+#include "startup_profile.h"
+
+// How long a capture thread waits for a frame before checking whether its
+// stream has been stopped
+static const GstClockTime CAPTURE_TIMEOUT = 100 * GST_MSECOND;
+
+typedef struct queued_frame
+{
+	xg_frame *frame;
+	uint64_t queued_at;
+} queued_frame;
+
+typedef struct stream
+{
+	xg_scheduler *scheduler;
+	int32_t index;
+	xg_pipeline *pipeline;
+	xg_stream_config config;
+	xg_runner_result_fn on_result;
+	void *user_data;
+	pthread_t capture_thread;
+	atomic_bool stopping;
+
+	// Protected by the scheduler's lock
+	queued_frame queue[XG_SCHEDULER_MAX_QUEUE_DEPTH];
+	int32_t queue_head, queue_length;
+	// Start tag of the stream's next evaluation in the fair queue: how many
+	// evaluations it has had so far, divided by its weight
+	double virtual_time;
+	int32_t in_flight;
+	uint64_t captured, evaluated, replaced, expired, superseded;
+	uint64_t total_latency;
+
+	// Overlays are published one at a time, newest frame wins
+	pthread_mutex_t publish_lock;
+	uint64_t published_sequence;
+	bool published_any;
+} stream;
+
+struct xg_scheduler
+{
+	xg_infer_pool *pool;
+	int32_t n_instances;
+	stream *streams[XG_SCHEDULER_MAX_STREAMS];
+	int32_t n_streams;
+	pthread_t dispatch_thread;
+	atomic_bool failed;
+
+	// Everything below is protected by @lock
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	// Evaluations in flight; never more than there are instances, so the
+	// choice of frame is made as late as possible
+	int32_t busy;
+	// Start tag of the last evaluation dispatched, which a stream that was
+	// idle catches up to rather than claiming the turns it didn't need
+	double virtual_clock;
+	bool stopping;
+};
+
+// A frame being evaluated by the pool
+typedef struct scheduled_frame
+{
+	stream *stream;
+	xg_frame *frame;
+	xnor_input *input;
+	uint64_t queued_at;
+} scheduled_frame;
+
+void xg_stream_config_init(xg_stream_config *config)
+{
+	config->weight = 1;
+	config->deadline_ms = 200;
+	config->queue_depth = 1;
+}
+
+// Stops the stream's pipeline and the run because of an error
+static void fail_stream(stream *stream)
+{
+	atomic_store(&stream->scheduler->failed, true);
+	xg_pipeline_request_stop(stream->pipeline);
+}
+
+// Removes the stream's oldest frame from its queue. Called with the scheduler
+// lock held.
+static queued_frame pop_frame(stream *stream)
+{
+	queued_frame oldest = stream->queue[stream->queue_head];
+	stream->queue_head =
+	    (stream->queue_head + 1) % XG_SCHEDULER_MAX_QUEUE_DEPTH;
+	--stream->queue_length;
+	return oldest;
+}
+
+static void *capture_main(void *arg)
+{
+	stream *stream = arg;
+	xg_scheduler *scheduler = stream->scheduler;
+	char name[32];
+	snprintf(name, sizeof(name), "capture %d", stream->index);
+	xg_trace_set_thread_name(name);
+	while (!atomic_load(&stream->stopping))
+	{
+		xg_frame *frame =
+		    xg_pipeline_pull_frame(stream->pipeline, CAPTURE_TIMEOUT);
+		if (frame == NULL)
+		{
+			if (xg_pipeline_error_occurred(stream->pipeline))
+			{
+				fail_stream(stream);
+				break;
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&scheduler->lock);
+		if (stream->queue_length == stream->config.queue_depth)
+		{
+			xg_frame_free(pop_frame(stream).frame);
+			++stream->replaced;
+		}
+		if (stream->queue_length == 0 && stream->in_flight == 0 &&
+		    stream->virtual_time < scheduler->virtual_clock)
+		{
+			stream->virtual_time = scheduler->virtual_clock;
+		}
+		int32_t tail = (stream->queue_head + stream->queue_length) %
+			       XG_SCHEDULER_MAX_QUEUE_DEPTH;
+		stream->queue[tail] = (queued_frame){frame, xg_trace_now()};
+		++stream->queue_length;
+		++stream->captured;
+		pthread_cond_signal(&scheduler->changed);
+		pthread_mutex_unlock(&scheduler->lock);
+	}
+	return NULL;
+}
+
+// Drops the frames at the front of @stream's queue that have missed their
+// deadline. Called with the scheduler lock held.
+static void expire_frames(stream *stream, uint64_t now)
+{
+	if (stream->config.deadline_ms == 0)
+	{
+		return;
+	}
+	uint64_t deadline = (uint64_t)stream->config.deadline_ms * 1000000;
+	while (stream->queue_length > 0 &&
+	       now - stream->queue[stream->queue_head].queued_at > deadline)
+	{
+		xg_frame_free(pop_frame(stream).frame);
+		++stream->expired;
+	}
+}
+
+// When @stream's oldest frame has to be evaluated by; UINT64_MAX without a
+// deadline. Called with the scheduler lock held.
+static uint64_t frame_deadline(const stream *stream)
+{
+	if (stream->config.deadline_ms == 0)
+	{
+		return UINT64_MAX;
+	}
+	return stream->queue[stream->queue_head].queued_at +
+	       (uint64_t)stream->config.deadline_ms * 1000000;
+}
+
+// Picks the stream to evaluate a frame of next, or NULL if none has one.
+// Called with the scheduler lock held.
+static stream *choose_stream(xg_scheduler *scheduler)
+{
+	uint64_t now = xg_trace_now();
+	stream *chosen = NULL;
+	for (int32_t i = 0; i < scheduler->n_streams; ++i)
+	{
+		stream *candidate = scheduler->streams[i];
+		expire_frames(candidate, now);
+		if (candidate->queue_length == 0)
+		{
+			continue;
+		}
+		if (chosen == NULL ||
+		    candidate->virtual_time < chosen->virtual_time ||
+		    (candidate->virtual_time == chosen->virtual_time &&
+		     frame_deadline(candidate) < frame_deadline(chosen)))
+		{
+			chosen = candidate;
+		}
+	}
+	return chosen;
+}
+
+// Hands @queued to the pool, which calls on_pool_result() with it
+static bool submit_frame(stream *stream, queued_frame queued)
+{
+	xg_frame *frame = queued.frame;
+	scheduled_frame *job = calloc(1, sizeof(scheduled_frame));
+	if (job == NULL)
+	{
+		fputs("Couldn't allocate memory for frame job\n", stderr);
+		xg_frame_free(frame);
+		return false;
+	}
+	job->stream = stream;
+	job->frame = frame;
+	job->queued_at = queued.queued_at;
+	uint64_t trace_start = XG_TRACE_BEGIN();
+	if (!xg_frame_create_xnor_input(frame, &job->input))
+	{
+		xg_frame_free(frame);
+		free(job);
+		return false;
+	}
+	XG_TRACE_END(XG_TRACE_CREATE_INPUT, trace_start, frame->sequence);
+	// Never blocks, as there are never more frames in flight than instances
+	xg_infer_pool_submit(stream->scheduler->pool, job->input, job);
+	return true;
+}
+
+static void *dispatch_main(void *arg)
+{
+	xg_scheduler *scheduler = arg;
+	xg_trace_set_thread_name("scheduler");
+	pthread_mutex_lock(&scheduler->lock);
+	for (;;)
+	{
+		stream *next = NULL;
+		while (!scheduler->stopping &&
+		       (scheduler->busy == scheduler->n_instances ||
+			(next = choose_stream(scheduler)) == NULL))
+		{
+			pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+		}
+		if (scheduler->stopping)
+		{
+			break;
+		}
+		queued_frame queued = pop_frame(next);
+		scheduler->virtual_clock = next->virtual_time;
+		next->virtual_time += 1.0 / next->config.weight;
+		++next->in_flight;
+		++scheduler->busy;
+		pthread_mutex_unlock(&scheduler->lock);
+
+		bool submitted = submit_frame(next, queued);
+
+		pthread_mutex_lock(&scheduler->lock);
+		if (!submitted)
+		{
+			--next->in_flight;
+			--scheduler->busy;
+			fail_stream(next);
+		}
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+	return NULL;
+}
+
+// Publishes the overlays built for @frame unless newer ones already are.
+// Returns false if they were dropped instead.
+static bool publish_overlays(stream *stream, xg_frame *frame,
+			     xg_overlay *overlays)
+{
+	pthread_mutex_lock(&stream->publish_lock);
+	bool newest = !stream->published_any ||
+		      frame->sequence > stream->published_sequence;
+	if (newest)
+	{
+		xg_pipeline_set_frame_overlays(stream->pipeline, frame, overlays,
+					       frame->arena);
+		stream->published_sequence = frame->sequence;
+		stream->published_any = true;
+	}
+	else
+	{
+		xg_pipeline_release_arena(stream->pipeline, frame->arena);
+	}
+	frame->arena = NULL;
+	pthread_mutex_unlock(&stream->publish_lock);
+	return newest;
+}
+
+static void on_pool_result(void *tag, xnor_evaluation_result *result,
+			   xnor_error *error, void *user_data)
+{
+	xg_scheduler *scheduler = user_data;
+	scheduled_frame *job = tag;
+	stream *stream = job->stream;
+	xg_frame *frame = job->frame;
+	bool published = false;
+	if (error != NULL)
+	{
+		fprintf(stderr, "%s\n", xnor_error_get_description(error));
+		xnor_error_free(error);
+		fail_stream(stream);
+	}
+	else
+	{
+		uint64_t trace_start = XG_TRACE_BEGIN();
+		xg_overlay *overlays = NULL;
+		frame->arena = xg_pipeline_acquire_arena(stream->pipeline);
+		if (frame->arena != NULL &&
+		    stream->on_result(frame, result, &overlays, stream->user_data))
+		{
+			published = publish_overlays(stream, frame, overlays);
+			XG_TRACE_END(XG_TRACE_BUILD_OVERLAYS, trace_start,
+				     frame->sequence);
+		}
+		else
+		{
+			if (frame->arena == NULL)
+			{
+				fputs("Couldn't allocate memory for overlays\n",
+				      stderr);
+			}
+			xg_pipeline_release_arena(stream->pipeline, frame->arena);
+			fail_stream(stream);
+		}
+		xnor_evaluation_result_free(result);
+	}
+	uint64_t latency = xg_trace_now() - job->queued_at;
+	xnor_input_free(job->input);
+	xg_frame_free(frame);
+	free(job);
+
+	pthread_mutex_lock(&scheduler->lock);
+	--stream->in_flight;
+	--scheduler->busy;
+	if (error == NULL)
+	{
+		++stream->evaluated;
+		stream->total_latency += latency;
+		stream->superseded += !published;
+	}
+	pthread_cond_signal(&scheduler->changed);
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+xg_scheduler *xg_scheduler_create(int32_t n_instances,
+				  xnor_threading_model threading_model)
+{
+	xg_scheduler *scheduler = calloc(1, sizeof(xg_scheduler));
+	if (scheduler == NULL)
+	{
+		fputs("Couldn't allocate memory for scheduler\n", stderr);
+		return NULL;
+	}
+	scheduler->pool = xg_infer_pool_create(n_instances, threading_model,
+					       on_pool_result, scheduler);
+	if (scheduler->pool == NULL)
+	{
+		free(scheduler);
+		return NULL;
+	}
+	// Results go straight back to their stream, whichever stream submitted
+	// before them
+	xg_infer_pool_set_ordered(scheduler->pool, false);
+	scheduler->n_instances = n_instances;
+	atomic_init(&scheduler->failed, false);
+	pthread_mutex_init(&scheduler->lock, NULL);
+	pthread_cond_init(&scheduler->changed, NULL);
+	return scheduler;
+}
+
+xnor_model *xg_scheduler_model(xg_scheduler *scheduler)
+{
+	return xg_infer_pool_model(scheduler->pool);
+}
+
+void xg_scheduler_warm_up(xg_scheduler *scheduler,
+			  const xg_warmup_config *config)
+{
+	xg_infer_pool_warm_up(scheduler->pool, config);
+}
+
+bool xg_scheduler_add_stream(xg_scheduler *scheduler, xg_pipeline *pipeline,
+			     const xg_stream_config *config,
+			     xg_runner_result_fn on_result, void *user_data)
+{
+	if (scheduler->n_streams == XG_SCHEDULER_MAX_STREAMS)
+	{
+		fprintf(stderr, "A scheduler can run at most %d streams\n",
+			XG_SCHEDULER_MAX_STREAMS);
+		return false;
+	}
+	if (config->weight < 1 || config->deadline_ms < 0 ||
+	    config->queue_depth < 1 ||
+	    config->queue_depth > XG_SCHEDULER_MAX_QUEUE_DEPTH)
+	{
+		fprintf(stderr,
+			"Streams need a weight of at least 1, a deadline of at "
+			"least 0 ms and a queue of 1 to %d frames\n",
+			XG_SCHEDULER_MAX_QUEUE_DEPTH);
+		return false;
+	}
+	stream *added = calloc(1, sizeof(stream));
+	if (added == NULL)
+	{
+		fputs("Couldn't allocate memory for stream\n", stderr);
+		return false;
+	}
+	added->scheduler = scheduler;
+	added->index = scheduler->n_streams;
+	added->pipeline = pipeline;
+	added->config = *config;
+	added->on_result = on_result;
+	added->user_data = user_data;
+	atomic_init(&added->stopping, false);
+	pthread_mutex_init(&added->publish_lock, NULL);
+	xg_pipeline_set_zero_copy(pipeline, false);
+	scheduler->streams[scheduler->n_streams++] = added;
+	return true;
+}
+
+// Stops the dispatcher and waits for the evaluations in flight
+static void stop_dispatching(xg_scheduler *scheduler)
+{
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->stopping = true;
+	pthread_cond_broadcast(&scheduler->changed);
+	pthread_mutex_unlock(&scheduler->lock);
+	pthread_join(scheduler->dispatch_thread, NULL);
+	xg_infer_pool_drain(scheduler->pool);
+}
+
+static void print_summary(const xg_scheduler *scheduler)
+{
+	for (int32_t i = 0; i < scheduler->n_streams; ++i)
+	{
+		const stream *stream = scheduler->streams[i];
+		printf("Stream %d: %llu frames captured, %llu evaluated "
+		       "(%.1f ms after capture on average), %llu replaced by "
+		       "newer frames, %llu past their deadline, %llu results "
+		       "superseded\n",
+		       i, (unsigned long long)stream->captured,
+		       (unsigned long long)stream->evaluated,
+		       stream->evaluated > 0
+			   ? stream->total_latency / 1e6 / stream->evaluated
+			   : 0.0,
+		       (unsigned long long)stream->replaced,
+		       (unsigned long long)stream->expired,
+		       (unsigned long long)stream->superseded);
+	}
+}
+
+bool xg_scheduler_run(xg_scheduler *scheduler)
+{
+	if (scheduler->n_streams == 0)
+	{
+		fputs("The scheduler has no streams to run\n", stderr);
+		return false;
+	}
+	if (!xg_trace_start_from_env())
+	{
+		return false;
+	}
+	xg_trace_set_thread_name("main");
+	if (pthread_create(&scheduler->dispatch_thread, NULL, dispatch_main,
+			   scheduler) != 0)
+	{
+		fputs("Couldn't start scheduler thread\n", stderr);
+		xg_trace_stop(NULL);
+		return false;
+	}
+	int32_t n_started = 0;
+	for (; n_started < scheduler->n_streams; ++n_started)
+	{
+		stream *stream = scheduler->streams[n_started];
+		if (pthread_create(&stream->capture_thread, NULL, capture_main,
+				   stream) != 0)
+		{
+			fputs("Couldn't start capture thread\n", stderr);
+			atomic_store(&scheduler->failed, true);
+			break;
+		}
+	}
+
+	// Every pipeline's window and bus events go through the same main
+	// context, so dispatching through any of them serves them all. A stream
+	// whose pipeline stops just stops capturing; the others carry on.
+	int32_t n_running = n_started == scheduler->n_streams ? n_started : 0;
+	while (n_running > 0)
+	{
+		xg_pipeline_dispatch_events(scheduler->streams[0]->pipeline, true);
+		n_running = 0;
+		for (int32_t i = 0; i < scheduler->n_streams; ++i)
+		{
+			stream *stream = scheduler->streams[i];
+			if (xg_pipeline_running(stream->pipeline))
+			{
+				++n_running;
+			}
+			else
+			{
+				atomic_store(&stream->stopping, true);
+			}
+		}
+	}
+
+	for (int32_t i = 0; i < n_started; ++i)
+	{
+		atomic_store(&scheduler->streams[i]->stopping, true);
+		pthread_join(scheduler->streams[i]->capture_thread, NULL);
+	}
+	stop_dispatching(scheduler);
+	print_summary(scheduler);
+	xg_startup_print();
+	bool traced = xg_trace_stop_from_env();
+	return !atomic_load(&scheduler->failed) && traced;
+}
+
+void xg_scheduler_free(xg_scheduler *scheduler)
+{
+	if (scheduler == NULL)
+	{
+		return;
+	}
+	xg_infer_pool_free(scheduler->pool);
+	for (int32_t i = 0; i < scheduler->n_streams; ++i)
+	{
+		stream *stream = scheduler->streams[i];
+		while (stream->queue_length > 0)
+		{
+			xg_frame_free(pop_frame(stream).frame);
+		}
+		pthread_mutex_destroy(&stream->publish_lock);
+		free(stream);
+	}
+	pthread_cond_destroy(&scheduler->changed);
+	pthread_mutex_destroy(&scheduler->lock);
+	free(scheduler);
+}
@@ -0,0 +1,83 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_STREAM_SCHEDULER_H__
+#define __COMMON_UTIL_STREAM_SCHEDULER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gstreamer_video_pipeline.h"
+#include "threaded_runner.h"
+#include "xnornet.h"
+
+// Runs several live video pipelines ("streams", e.g. one per camera) through
+// one shared pool of model instances (see infer_pool.h), so the instances stay
+// busy however many cameras there are, rather than each pipeline getting a
+// model loop of its own.
+//
+// Each stream has a capture thread queueing its frames. Whenever a model
+// instance is free, the scheduler picks the stream that has had the least of
+// its fair share of evaluations so far (start-time fair queueing, weighted by
+// xg_stream_config.weight), breaking ties by the earliest deadline, and hands
+// it that stream's oldest queued frame. Frames are dropped per stream: a full
+// queue drops its oldest frame, and frames that waited longer than the
+// stream's deadline are dropped rather than evaluated, so one busy camera
+// can't make the others' results stale. Results go back to the stream they
+// came from, as overlays on its own pipeline.
+typedef struct xg_scheduler xg_scheduler;
+
+enum
+{
+	XG_SCHEDULER_MAX_STREAMS = 16,
+	// Longest queue a stream may have
+	XG_SCHEDULER_MAX_QUEUE_DEPTH = 8
+};
+
+typedef struct xg_stream_config
+{
+	// Share of the evaluations this stream gets when streams compete,
+	// relative to the other streams' weights
+	int32_t weight;
+	// Frames queued for longer than this many milliseconds are dropped
+	// instead of being evaluated; 0 for no limit
+	int32_t deadline_ms;
+	// Frames the stream may have queued before the oldest is dropped. 1
+	// always evaluates the newest frame, like xg_runner does.
+	int32_t queue_depth;
+} xg_stream_config;
+
+// Weight 1, a deadline of 200 ms and a queue of one frame
+void xg_stream_config_init(xg_stream_config *config);
+
+// Loads @n_instances model instances to share between the streams. Returns
+// NULL and prints a message to stderr on failure.
+xg_scheduler *xg_scheduler_create(int32_t n_instances,
+				  xnor_threading_model threading_model);
+// Gets the model of one of the instances, e.g. for xnor_model_get_info(). It
+// must not be evaluated directly.
+xnor_model *xg_scheduler_model(xg_scheduler *scheduler);
+// Warms up every instance in the background (see xg_infer_pool_warm_up()), so
+// they are ready by the time the streams' first frames arrive. The dummy
+// image's size must be set in @config, as the streams may differ.
+void xg_scheduler_warm_up(xg_scheduler *scheduler,
+			  const xg_warmup_config *config);
+// Adds a pipeline that has already been started as a stream, whose results
+// are turned into overlays by @on_result (see threaded_runner.h). Since
+// frames of the same stream may be evaluated at once on different instances,
+// @on_result may be called concurrently, and overlays older than those
+// already shown are discarded. Switches the pipeline out of zero-copy mode, as
+// queued frames would otherwise hold on to the camera's buffers. Must be
+// called before xg_scheduler_run(). Returns false if there are too many
+// streams or @config is invalid.
+bool xg_scheduler_add_stream(xg_scheduler *scheduler, xg_pipeline *pipeline,
+			     const xg_stream_config *config,
+			     xg_runner_result_fn on_result, void *user_data);
+// Runs until every stream's pipeline has stopped, then prints how each
+// stream's frames were spent. Must be called from the main thread, and all
+// the pipelines must be either headless or not. Returns false if a thread
+// couldn't be started or inference failed.
+bool xg_scheduler_run(xg_scheduler *scheduler);
+// Frees the model instances. The pipelines stay with the caller.
+void xg_scheduler_free(xg_scheduler *scheduler);
+
+#endif  // __COMMON_UTIL_STREAM_SCHEDULER_H__
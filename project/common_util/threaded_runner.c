@@ -0,0 +1,457 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#include "threaded_runner.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "box_tracker.h"
+#include "frame_input.h"
+#include "frame_mailbox.h"
+#include "frame_trace.h"
+#include "model_warmup.h"
+#include "rate_controller.h"
+#include "startup_profile.h"
+
+// How long the capture thread waits for a frame before checking whether the
+// pipeline has been stopped
+static const GstClockTime CAPTURE_TIMEOUT = 100 * GST_MSECOND;
+
+struct xg_runner
+{
+	xg_pipeline *pipeline;
+	xg_runner_infer_fn infer;
+	void *user_data;
+	// Pooled runners only
+	xg_infer_pool *pool;
+	xg_runner_result_fn on_result;
+	// Set by xg_runner_set_rate(); @tracker only in keyframe mode
+	xg_rate_controller *rate;
+	xg_box_tracker *tracker;
+	// Set by xg_runner_share_frames()
+	xg_frame_ring *ring;
+	// Single-model runners only: warm-up started by xg_runner_warm_up(),
+	// which the inference thread waits for before its first frame
+	xg_warmup *warmup;
+
+	xg_mailbox frames;
+	pthread_t capture_thread;
+	pthread_t inference_thread;
+	atomic_bool stopping;
+	atomic_bool failed;
+};
+
+static void discard_frame(void *frame) { xg_frame_free((xg_frame *)frame); }
+
+// Stops both threads and the pipeline because of an error on one of them
+static void fail(xg_runner *runner)
+{
+	atomic_store(&runner->failed, true);
+	xg_pipeline_request_stop(runner->pipeline);
+}
+
+static void *capture_main(void *arg)
+{
+	xg_runner *runner = (xg_runner *)arg;
+	xg_trace_set_thread_name("capture");
+	while (!atomic_load(&runner->stopping))
+	{
+		xg_frame *frame =
+		    xg_pipeline_pull_frame(runner->pipeline, CAPTURE_TIMEOUT);
+		if (frame == NULL)
+		{
+			if (xg_pipeline_error_occurred(runner->pipeline))
+			{
+				fail(runner);
+				break;
+			}
+			continue;
+		}
+		// Other processes get the frame before the model does, whether
+		// or not it ends up being evaluated
+		if (runner->ring != NULL &&
+		    !xg_frame_ring_publish(runner->ring, frame))
+		{
+			xg_frame_free(frame);
+			fail(runner);
+			break;
+		}
+		if (runner->pipeline->config.pacing == XG_PACING_FAST)
+		{
+			// Benchmarking: every frame is evaluated, and the source
+			// waits for the model rather than the other way around
+			if (!xg_mailbox_post_wait(&runner->frames, frame))
+			{
+				break;
+			}
+		}
+		else
+		{
+			xg_mailbox_post(&runner->frames, frame);
+		}
+	}
+	return NULL;
+}
+
+// Gives @frame an empty arena for the callbacks to build its overlays in
+static bool begin_frame_arena(xg_runner *runner, xg_frame *frame)
+{
+	frame->arena = xg_pipeline_acquire_arena(runner->pipeline);
+	if (frame->arena == NULL)
+	{
+		fputs("Couldn't allocate memory for overlays\n", stderr);
+		return false;
+	}
+	return true;
+}
+
+// Publishes the overlays built for @frame, handing its arena over with them
+static void publish_overlays(xg_runner *runner, xg_frame *frame,
+			     xg_overlay *overlays)
+{
+	xg_pipeline_set_frame_overlays(runner->pipeline, frame, overlays,
+				       frame->arena);
+	frame->arena = NULL;
+}
+
+// A frame being evaluated by the inference pool
+typedef struct pooled_frame
+{
+	xg_frame *frame;
+	xnor_input *input;
+	uint64_t submitted_at;
+} pooled_frame;
+
+static void on_pool_result(void *tag, xnor_evaluation_result *result,
+			   xnor_error *error, void *user_data)
+{
+	xg_runner *runner = (xg_runner *)user_data;
+	pooled_frame *job = (pooled_frame *)tag;
+	if (runner->rate != NULL)
+	{
+		// The instances work in parallel, so each takes a share of the
+		// frames
+		xg_rate_controller_evaluated(
+		    runner->rate, (xg_trace_now() - job->submitted_at) /
+				      xg_infer_pool_size(runner->pool));
+	}
+	if (error != NULL)
+	{
+		fprintf(stderr, "%s\n", xnor_error_get_description(error));
+		xnor_error_free(error);
+		fail(runner);
+	}
+	else
+	{
+		uint64_t trace_start = XG_TRACE_BEGIN();
+		xg_overlay *overlays = NULL;
+		if (begin_frame_arena(runner, job->frame) &&
+		    runner->on_result(job->frame, result, &overlays,
+				      runner->user_data))
+		{
+			publish_overlays(runner, job->frame, overlays);
+			XG_TRACE_END(XG_TRACE_BUILD_OVERLAYS, trace_start,
+				     job->frame->sequence);
+		}
+		else
+		{
+			xg_pipeline_release_arena(runner->pipeline,
+						  job->frame->arena);
+			fail(runner);
+		}
+		xnor_evaluation_result_free(result);
+	}
+	xnor_input_free(job->input);
+	xg_frame_free(job->frame);
+	free(job);
+}
+
+// Feeds the latest frames to the inference pool, which calls on_pool_result()
+static bool submit_to_pool(xg_runner *runner, xg_frame *frame)
+{
+	pooled_frame *job = calloc(1, sizeof(pooled_frame));
+	if (job == NULL)
+	{
+		fputs("Couldn't allocate memory for frame job\n", stderr);
+		xg_frame_free(frame);
+		return false;
+	}
+	job->frame = frame;
+	uint64_t trace_start = XG_TRACE_BEGIN();
+	if (!xg_frame_create_xnor_input(frame, &job->input))
+	{
+		xg_frame_free(frame);
+		free(job);
+		return false;
+	}
+	XG_TRACE_END(XG_TRACE_CREATE_INPUT, trace_start, frame->sequence);
+	job->submitted_at = xg_trace_now();
+	// Blocks while every instance is busy; meanwhile the mailbox keeps only the
+	// newest frame, so the pool never works through stale ones.
+	xg_infer_pool_submit(runner->pool, job->input, job);
+	return true;
+}
+
+// Publishes the boxes of the last keyframe, moved along to @frame
+static bool track_frame(xg_runner *runner, xg_frame *frame)
+{
+	xg_overlay *overlays = NULL;
+	bool ok = begin_frame_arena(runner, frame) &&
+		  xg_box_tracker_predict(runner->tracker, frame->sequence,
+					 frame->arena, &overlays);
+	if (ok)
+	{
+		publish_overlays(runner, frame, overlays);
+	}
+	else
+	{
+		xg_pipeline_release_arena(runner->pipeline, frame->arena);
+	}
+	xg_frame_free(frame);
+	return ok;
+}
+
+static xg_rate_decision decide_frame(xg_runner *runner, xg_frame *frame)
+{
+	if (runner->rate == NULL)
+	{
+		return XG_RATE_EVALUATE;
+	}
+	xg_rate_decision decision = xg_rate_controller_decide(
+	    runner->rate, frame->sequence, xg_trace_now());
+	if (decision == XG_RATE_TRACK && runner->tracker == NULL)
+	{
+		return XG_RATE_SKIP;
+	}
+	return decision;
+}
+
+static void *inference_main(void *arg)
+{
+	xg_runner *runner = (xg_runner *)arg;
+	xg_trace_set_thread_name("inference");
+	// The model is the warm-up thread's until it finishes. Frames arriving
+	// meanwhile are dropped by the mailbox as usual; a failed warm-up only
+	// means the first frame will be slow.
+	xg_warmup_finish(runner->warmup);
+	runner->warmup = NULL;
+	xg_frame *frame;
+	while ((frame = xg_mailbox_take(&runner->frames)) != NULL)
+	{
+		xg_rate_decision decision = decide_frame(runner, frame);
+		if (decision == XG_RATE_SKIP)
+		{
+			xg_frame_free(frame);
+			continue;
+		}
+		if (decision == XG_RATE_TRACK)
+		{
+			if (!track_frame(runner, frame))
+			{
+				fail(runner);
+				break;
+			}
+			continue;
+		}
+		if (runner->pool != NULL)
+		{
+			if (!submit_to_pool(runner, frame))
+			{
+				fail(runner);
+				break;
+			}
+			continue;
+		}
+		xg_overlay *overlays = NULL;
+		uint64_t started = xg_trace_now();
+		bool ok = begin_frame_arena(runner, frame) &&
+			  runner->infer(frame, &overlays, runner->user_data);
+		bool tracked = true;
+		if (ok && runner->rate != NULL)
+		{
+			xg_rate_controller_evaluated(runner->rate,
+						     xg_trace_now() - started);
+		}
+		if (ok && runner->tracker != NULL)
+		{
+			tracked = xg_box_tracker_update(runner->tracker,
+							frame->sequence, overlays);
+		}
+		if (ok)
+		{
+			publish_overlays(runner, frame, overlays);
+		}
+		else
+		{
+			xg_pipeline_release_arena(runner->pipeline, frame->arena);
+		}
+		xg_frame_free(frame);
+		if (!ok || !tracked)
+		{
+			fail(runner);
+			break;
+		}
+	}
+	return NULL;
+}
+
+xg_runner *xg_runner_create(xg_pipeline *pipeline, xg_runner_infer_fn infer,
+			    void *user_data)
+{
+	xg_runner *runner = calloc(1, sizeof(xg_runner));
+	if (runner == NULL)
+	{
+		fputs("Couldn't allocate memory for runner\n", stderr);
+		return NULL;
+	}
+	runner->pipeline = pipeline;
+	runner->infer = infer;
+	runner->user_data = user_data;
+	atomic_init(&runner->stopping, false);
+	atomic_init(&runner->failed, false);
+	if (!xg_mailbox_init(&runner->frames, discard_frame))
+	{
+		fputs("Couldn't create frame mailbox\n", stderr);
+		free(runner);
+		return NULL;
+	}
+	return runner;
+}
+
+xg_runner *xg_runner_create_pooled(xg_pipeline *pipeline, int32_t n_instances,
+				   xnor_threading_model threading_model,
+				   xg_runner_result_fn on_result,
+				   void *user_data)
+{
+	xg_runner *runner = xg_runner_create(pipeline, NULL, user_data);
+	if (runner == NULL)
+	{
+		return NULL;
+	}
+	runner->on_result = on_result;
+	runner->pool = xg_infer_pool_create(n_instances, threading_model,
+					    on_pool_result, runner);
+	if (runner->pool == NULL)
+	{
+		xg_runner_free(runner);
+		return NULL;
+	}
+	xg_pipeline_set_zero_copy(pipeline, false);
+	return runner;
+}
+
+bool xg_runner_set_rate(xg_runner *runner, const xg_rate_config *config)
+{
+	xg_rate_controller_free(runner->rate);
+	xg_box_tracker_free(runner->tracker);
+	runner->rate = NULL;
+	runner->tracker = NULL;
+	if (config->keyframe_interval > 1 && runner->pool != NULL)
+	{
+		fputs("Keyframe tracking needs a single model instance; skipping "
+		      "frames between keyframes instead\n",
+		      stderr);
+	}
+	else if (config->keyframe_interval > 1)
+	{
+		runner->tracker = xg_box_tracker_create();
+		if (runner->tracker == NULL)
+		{
+			return false;
+		}
+	}
+	runner->rate = xg_rate_controller_create(config);
+	return runner->rate != NULL;
+}
+
+bool xg_runner_share_frames(xg_runner *runner, const char *name,
+			    int32_t n_slots)
+{
+	xg_frame_ring_free(runner->ring);
+	runner->ring = xg_frame_ring_create(name, n_slots);
+	return runner->ring != NULL;
+}
+
+void xg_runner_warm_up(xg_runner *runner, xnor_model *model,
+		       const xg_warmup_config *config)
+{
+	xg_warmup_config warmup = *config;
+	xg_pipeline_fill_warmup_config(runner->pipeline, &warmup);
+	if (runner->pool != NULL)
+	{
+		xg_infer_pool_warm_up(runner->pool, &warmup);
+		return;
+	}
+	xg_warmup_finish(runner->warmup);
+	runner->warmup = xg_warmup_start(model, &warmup);
+}
+
+xg_infer_pool *xg_runner_pool(xg_runner *runner) { return runner->pool; }
+
+bool xg_runner_run(xg_runner *runner)
+{
+	if (!xg_trace_start_from_env())
+	{
+		return false;
+	}
+	xg_trace_set_thread_name("main");
+	if (pthread_create(&runner->inference_thread, NULL, inference_main,
+			   runner) != 0)
+	{
+		fputs("Couldn't start inference thread\n", stderr);
+		xg_trace_stop(NULL);
+		return false;
+	}
+	if (pthread_create(&runner->capture_thread, NULL, capture_main, runner) !=
+	    0)
+	{
+		fputs("Couldn't start capture thread\n", stderr);
+		xg_mailbox_close(&runner->frames);
+		pthread_join(runner->inference_thread, NULL);
+		xg_trace_stop(NULL);
+		return false;
+	}
+
+	// Window and bus events (including a stop requested by either thread) are
+	// dispatched here on the main thread
+	while (xg_pipeline_running(runner->pipeline))
+	{
+		xg_pipeline_dispatch_events(runner->pipeline, true);
+	}
+
+	// Closing the mailbox first also releases a capture thread waiting for
+	// an inference thread that has already given up
+	atomic_store(&runner->stopping, true);
+	xg_mailbox_close(&runner->frames);
+	pthread_join(runner->capture_thread, NULL);
+	pthread_join(runner->inference_thread, NULL);
+	if (runner->pool != NULL)
+	{
+		xg_infer_pool_drain(runner->pool);
+	}
+	if (runner->rate != NULL)
+	{
+		xg_rate_controller_print_summary(runner->rate);
+	}
+	bool traced = xg_trace_stop_from_env();
+	// In case the run ended before the sample's last milestone
+	xg_startup_print();
+	return !atomic_load(&runner->failed) && traced;
+}
+
+void xg_runner_free(xg_runner *runner)
+{
+	if (runner == NULL)
+	{
+		return;
+	}
+	xg_infer_pool_free(runner->pool);
+	xg_rate_controller_free(runner->rate);
+	xg_box_tracker_free(runner->tracker);
+	xg_frame_ring_free(runner->ring);
+	xg_warmup_finish(runner->warmup);
+	xg_mailbox_destroy(&runner->frames);
+	free(runner);
+}
@@ -0,0 +1,92 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+#ifndef __COMMON_UTIL_THREADED_RUNNER_H__
+#define __COMMON_UTIL_THREADED_RUNNER_H__
+
+#include <stdbool.h>
+
+#include "frame_ring.h"
+#include "gstreamer_video_pipeline.h"
+#include "infer_pool.h"
+#include "model_warmup.h"
+#include "overlays.h"
+#include "rate_controller.h"
+#include "xnornet.h"
+
+// Runs a live video pipeline with capture, inference and rendering decoupled:
+//  - a capture thread pulls frames from the pipeline and posts them into a
+//    single-slot "latest frame" mailbox, dropping any the inference thread
+//    hasn't got to yet;
+//  - an inference thread takes the latest frame, calls the inference callback
+//    and publishes the resulting overlays with xg_pipeline_set_overlays();
+//  - the calling (main) thread handles window and bus events, while
+//    GStreamer's own streaming thread draws whichever overlays were last
+//    published (headless pipelines just drop them).
+// So a slow model never delays the video, and the video never waits for a lock
+// held by the model.
+typedef struct xg_runner xg_runner;
+
+// Runs the model on @frame and returns the overlays to draw for it through
+// @overlays_out (a linked list, or NULL for none). Called on the inference
+// thread. Returning false stops the pipeline and makes xg_runner_run() fail.
+//
+// Both kinds of callback get a fresh @frame->arena, which lives until the
+// overlays are taken down again: allocate the overlays (with
+// xg_overlay_create_*_in()) and any scratch memory for the result from it
+// rather than the heap, and don't free any of it.
+typedef bool (*xg_runner_infer_fn)(xg_frame *frame, xg_overlay **overlays_out,
+				   void *user_data);
+
+// Turns the model's result for @frame into the overlays to draw for it. Called
+// in frame order, on one of the inference pool's worker threads. The result is
+// freed by the runner afterwards. Returning false stops the pipeline.
+typedef bool (*xg_runner_result_fn)(xg_frame *frame,
+				    xnor_evaluation_result *result,
+				    xg_overlay **overlays_out, void *user_data);
+
+// Creates a runner for @pipeline, which must be started before
+// xg_runner_run()
+xg_runner *xg_runner_create(xg_pipeline *pipeline, xg_runner_infer_fn infer,
+			    void *user_data);
+// Creates a runner that evaluates frames on a pool of @n_instances model
+// instances (see infer_pool.h) instead of a single inference thread. Frames
+// are handed out to the pool as soon as an instance is free, and the overlays
+// are still published in frame order. Since several frames are in flight at
+// once, this switches the pipeline out of zero-copy mode so the frames don't
+// hold on to the camera's buffers.
+xg_runner *xg_runner_create_pooled(xg_pipeline *pipeline, int32_t n_instances,
+				   xnor_threading_model threading_model,
+				   xg_runner_result_fn on_result,
+				   void *user_data);
+// Controls which frames are evaluated, as described in rate_controller.h,
+// instead of evaluating the newest frame whenever the model is free. In
+// keyframe mode the frames in between get the keyframes' boxes moved along
+// (see box_tracker.h); pooled runners can't track, so skip them instead. Must
+// be called before xg_runner_run(). Returns false if out of memory.
+bool xg_runner_set_rate(xg_runner *runner, const xg_rate_config *config);
+// Publishes every captured frame to the shared memory frame ring @name, with
+// @n_slots slots, so that other processes can read the frames too (see
+// frame_ring.h). The ring is removed when the runner is freed. Must be called
+// before xg_runner_run(). Returns false if the ring couldn't be created.
+bool xg_runner_share_frames(xg_runner *runner, const char *name,
+			    int32_t n_slots);
+// Warms the model up (see model_warmup.h) in the background, so it is ready by
+// the time the first frame arrives. Call it before xg_pipeline_start() to have
+// it overlap the pipeline prerolling. @model is the model the inference
+// callback evaluates, which the runner's inference thread waits for before
+// evaluating anything; pooled runners warm up every instance instead and
+// ignore @model. If @config leaves the size at 0, the dummy image gets the
+// size and format the pipeline will hand to the model.
+void xg_runner_warm_up(xg_runner *runner, xnor_model *model,
+		       const xg_warmup_config *config);
+// The inference pool of a runner made with xg_runner_create_pooled(), e.g. to
+// get its model's information; NULL for other runners
+xg_infer_pool *xg_runner_pool(xg_runner *runner);
+// Runs until the pipeline stops. Must be called from the main thread.
+// Returns false if a thread couldn't be started or inference failed. Traces
+// frame timing when the XG_TRACE environment variable is set (see
+// frame_trace.h).
+bool xg_runner_run(xg_runner *runner);
+void xg_runner_free(xg_runner *runner);
+
+#endif  // __COMMON_UTIL_THREADED_RUNNER_H__
@@ -0,0 +1,173 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+// This sample reads the frames another process shares through a frame ring
+// (e.g. gstreamer_live_overlay_object_detector --share NAME) and prints a line
+// of health statistics every second: how many frames arrived, how many it
+// missed, how old they were by the time it got them, and whether the picture
+// is frozen or dark. It never touches the camera itself.
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common_util/frame_ring.h"
+
+// Pixels sampled from each frame for its brightness and fingerprint
+#define SAMPLES 1024
+// Average brightness (0-255) under which the picture counts as dark
+#define DARK_LEVEL 16
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_stop_signal(int signal_number) {
+  (void)signal_number;
+  stopping = 1;
+}
+
+static uint64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Statistics gathered over one reporting interval
+typedef struct interval {
+  uint64_t frames, dropped, torn;
+  uint64_t total_age_ns, max_age_ns;
+  uint64_t total_brightness;
+  // Frames whose samples matched the frame before them exactly
+  uint64_t unchanged;
+} interval;
+
+// Samples the first plane (luma, or the packed pixels) of @frame evenly. Its
+// sum goes into @brightness_out and a fingerprint of the samples is returned.
+static uint64_t sample_frame(const xg_frame_ring_frame* frame,
+                             uint64_t* brightness_out) {
+  size_t plane_size = (size_t)frame->strides[0] * frame->height;
+  if (frame->planes[0] + plane_size > frame->data + frame->size) {
+    plane_size = frame->data + frame->size - frame->planes[0];
+  }
+  size_t step = plane_size / SAMPLES > 0 ? plane_size / SAMPLES : 1;
+  uint64_t sum = 0, fingerprint = 1469598103934665603ULL;
+  int32_t n = 0;
+  for (size_t offset = 0; offset < plane_size && n < SAMPLES;
+       offset += step, ++n) {
+    uint8_t value = frame->planes[0][offset];
+    sum += value;
+    fingerprint = (fingerprint ^ value) * 1099511628211ULL;
+  }
+  *brightness_out = n > 0 ? sum / n : 0;
+  return fingerprint;
+}
+
+static void print_interval(const interval* stats,
+                           const xg_frame_ring_frame* last, double seconds) {
+  if (stats->frames == 0) {
+    printf("no frames (%llu torn)\n", (unsigned long long)stats->torn);
+    return;
+  }
+  uint64_t brightness = stats->total_brightness / stats->frames;
+  printf("%dx%d %s: %.1f fps, %llu missed, %llu torn, age %.1f ms avg "
+         "%.1f ms max, brightness %llu%s%s\n",
+         last->width, last->height, last->format, stats->frames / seconds,
+         (unsigned long long)stats->dropped, (unsigned long long)stats->torn,
+         stats->total_age_ns / 1e6 / stats->frames, stats->max_age_ns / 1e6,
+         (unsigned long long)brightness,
+         stats->unchanged == stats->frames ? ", FROZEN" : "",
+         brightness < DARK_LEVEL ? ", DARK" : "");
+}
+
+static void print_usage(const char* program) {
+  fprintf(stderr,
+          "Usage: %s [--in-order] NAME\n"
+          "  NAME        Frame ring to read, as given to the producer's "
+          "--share\n"
+          "  --in-order  Read every frame in turn, as a recorder would, "
+          "rather than\n"
+          "              only the newest\n",
+          program);
+}
+
+int main(int argc, char* argv[]) {
+  xg_frame_ring_mode mode = XG_FRAME_RING_LATEST;
+  const struct option options[] = {
+      {"in-order", no_argument, NULL, 'o'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+    if (opt == 'o') {
+      mode = XG_FRAME_RING_IN_ORDER;
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  xg_frame_ring_reader* reader = xg_frame_ring_reader_open(argv[optind], mode);
+  if (reader == NULL) {
+    return EXIT_FAILURE;
+  }
+  signal(SIGINT, on_stop_signal);
+  signal(SIGTERM, on_stop_signal);
+
+  interval stats = {0};
+  xg_frame_ring_frame frame, last = {.format = ""};
+  uint64_t last_fingerprint = 0;
+  uint64_t interval_start = monotonic_ns();
+  bool closed = false;
+  while (!stopping && !closed) {
+    switch (xg_frame_ring_reader_next(reader, 100, &frame)) {
+      case XG_FRAME_RING_FRAME: {
+        uint64_t age = monotonic_ns() - frame.published_ns;
+        uint64_t brightness;
+        uint64_t fingerprint = sample_frame(&frame, &brightness);
+        // Anything read from a frame that was overwritten meanwhile is
+        // garbage
+        if (!xg_frame_ring_reader_check(reader, &frame)) {
+          ++stats.torn;
+          break;
+        }
+        ++stats.frames;
+        stats.dropped += frame.dropped;
+        stats.total_age_ns += age;
+        if (age > stats.max_age_ns) {
+          stats.max_age_ns = age;
+        }
+        stats.total_brightness += brightness;
+        if (fingerprint == last_fingerprint) {
+          ++stats.unchanged;
+        }
+        last_fingerprint = fingerprint;
+        last = frame;
+        break;
+      }
+      case XG_FRAME_RING_TIMEOUT:
+        break;
+      case XG_FRAME_RING_CLOSED:
+        puts("The producer has stopped");
+        closed = true;
+        break;
+    }
+
+    uint64_t now = monotonic_ns();
+    if (now - interval_start >= 1000000000) {
+      print_interval(&stats, &last, (now - interval_start) / 1e9);
+      fflush(stdout);
+      memset(&stats, 0, sizeof(stats));
+      interval_start = now;
+    }
+  }
+
+  xg_frame_ring_reader_close(reader);
+  return EXIT_SUCCESS;
+}
@@ -1,15 +1,30 @@
 // Copyright (c) 2019 Xnor.ai, Inc.
 //
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common_util/colors.h"
+#include "common_util/frame_input.h"
+#include "common_util/frame_trace.h"
 #include "common_util/gstreamer_video_pipeline.h"
+#include "common_util/model_library.h"
+#include "common_util/model_manager.h"
+#include "common_util/model_warmup.h"
 #include "common_util/overlays.h"
+#include "common_util/startup_profile.h"
+#include "common_util/threaded_runner.h"
 #include "xnornet.h"
 
+// Frames kept in the ring shared with --share: enough for a reader to finish
+// with one while a few more arrive
+#define FRAME_RING_SLOTS 4
+
+// Set when running headless, where there's no video to draw the boxes on
+static bool print_boxes = false;
+
 static xg_color color_by_id(int32_t id)
 {
 	xg_color color;
@@ -20,84 +35,315 @@ static xg_color color_by_id(int32_t id)
 	return color;
 }
 
-int main(int argc, char *argv[])
+// Turns every bounding box in the detector's result, which came from @library,
+// into an overlay
+static bool library_boxes_to_overlays(const xg_model_library *library,
+				      xg_frame *frame,
+				      xnor_evaluation_result *result,
+				      xg_overlay **overlays_out)
 {
-	// Forward declare variables we may need to clean up later
-	xnor_model *model = NULL;
+	// Ask how many bounding boxes there were, then allocate enough memory to
+	// hold them all. Everything here comes from the frame's arena, which the
+	// pipeline reclaims in one go once the overlays are replaced.
+	int32_t num_bounding_boxes =
+	    library->evaluation_result_get_bounding_boxes(result, NULL, 0);
+	xnor_bounding_box *boxes = xg_arena_calloc(
+	    frame->arena, num_bounding_boxes, sizeof(xnor_bounding_box));
+	if (boxes == NULL)
+	{
+		fputs("Couldn't allocate memory for bounding boxes\n", stderr);
+		return false;
+	}
+
+	// Get the box data and build an overlay for each box, in order
+	library->evaluation_result_get_bounding_boxes(result, boxes,
+						      num_bounding_boxes);
+	xg_overlay **tail = overlays_out;
+	for (int32_t i = 0; i < num_bounding_boxes; ++i)
+	{
+		xg_overlay *bbox = xg_overlay_create_bounding_box_in(
+			frame->arena,
+			boxes[i].rectangle.x,
+			boxes[i].rectangle.y,
+			boxes[i].rectangle.width,
+			boxes[i].rectangle.height,
+			boxes[i].class_label.label,
+			color_by_id(boxes[i].class_label.class_id)
+		);
+		if (bbox == NULL)
+		{
+			continue;
+		}
+		if (print_boxes)
+		{
+			printf("frame %llu: %s at %.2f,%.2f %.2fx%.2f\n",
+			       (unsigned long long)frame->sequence,
+			       boxes[i].class_label.label, boxes[i].rectangle.x,
+			       boxes[i].rectangle.y, boxes[i].rectangle.width,
+			       boxes[i].rectangle.height);
+		}
+		*tail = bbox;
+		tail = &bbox->next;
+	}
+
+	return true;
+}
+
+// The pooled runner's callback: its instances all come from the linked library
+static bool boxes_to_overlays(xg_frame *frame, xnor_evaluation_result *result,
+			      xg_overlay **overlays_out, void *user_data)
+{
+	return library_boxes_to_overlays(xg_model_library_linked(), frame, result,
+					 overlays_out);
+}
+
+// Runs the detector on one frame and turns every bounding box it finds into an
+// overlay. Called by the runner on its inference thread, which is where the
+// model manager swaps in a newly loaded model, between one frame and the next.
+static bool detect_objects(xg_frame *frame, xg_overlay **overlays_out,
+			   void *user_data)
+{
+	const xg_model *model =
+	    xg_model_manager_acquire((xg_model_manager *)user_data);
+	const xg_model_library *library = model->library;
 	xnor_error *error = NULL;
-	xg_pipeline *pipeline = NULL;
-	xg_frame *frame = NULL;
 	xnor_input *input = NULL;
 	xnor_evaluation_result *result = NULL;
-	xnor_model_load_options* load_options
-		= xnor_model_load_options_create();
+
+	// Create a handle so we can pass the input frame to the Xnor model. This
+	// picks the input constructor matching the frame's pixel format.
+	uint64_t trace_start = XG_TRACE_BEGIN();
+	if (!xg_frame_create_model_input(frame, library, &input))
+	{
+		return false;
+	}
+	XG_TRACE_END(XG_TRACE_CREATE_INPUT, trace_start, frame->sequence);
+
+	// Call the model! This is where the magic happens.
+	trace_start = XG_TRACE_BEGIN();
+	error = library->model_evaluate(model->model, input, NULL, &result);
+	XG_TRACE_END(XG_TRACE_EVALUATE, trace_start, frame->sequence);
+	library->input_free(input);
+	if (error != NULL)
+	{
+		xg_model_library_report(library, error);
+		return false;
+	}
+	xg_startup_mark(XG_STARTUP_FIRST_EVALUATION);
+
+	// Clean up after the frame-specific stuff
+	trace_start = XG_TRACE_BEGIN();
+	bool ok = library_boxes_to_overlays(library, frame, result, overlays_out);
+	XG_TRACE_END(XG_TRACE_BUILD_OVERLAYS, trace_start, frame->sequence);
+	library->evaluation_result_free(result);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	xg_startup_begin(XG_STARTUP_FIRST_OVERLAY);
+
+	// Forward declare variables we may need to clean up later
+	xg_model_manager *models = NULL;
+	xg_pipeline *pipeline = NULL;
+	xg_runner *runner = NULL;
 
 	if (argc > 1)
 	{
 		if (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h"))
 		{
-			fprintf(stderr, "Usage: %s <gst_flags> <gtk_flags>\n", argv[0]);
+			fprintf(stderr,
+				"Usage: %s [--instances N] [--direct-overlays] "
+				"[--headless] [--pipeline SETTINGS]\n"
+				"          [--rate SETTINGS] [--share NAME] "
+				"[--warmup SETTINGS]\n"
+				"          [--model-bundle PATH] [--model-control FILE]\n"
+				"          [source [nogui]] <gst_flags> <gtk_flags>\n"
+				"  source         /dev/videoN (default /dev/video0), "
+				"file://PATH, a directory\n"
+				"                 of images, videotestsrc or shm://SOCKET\n"
+				"  --instances N  Evaluate frames on N single-threaded "
+				"model instances,\n"
+				"                 each pinned to its own core (default: one "
+				"multi-threaded\n"
+				"                 instance)\n"
+				"  --direct-overlays\n"
+				"                 Draw boxes straight into the video "
+				"instead of through\n"
+				"                 cairooverlay\n"
+				"  --headless     Only capture and detect, printing the "
+				"boxes found, without\n"
+				"                 a window or display\n"
+				"  --pipeline SETTINGS\n"
+				"                 Capture and processing settings, e.g. "
+				"size=640x480,fps=15,\n"
+				"                 inference-size=320x240; pacing=fast "
+				"evaluates every frame\n"
+				"                 of a recorded source as fast as possible "
+				"(see\n"
+				"                 xg_pipeline_config_parse())\n"
+				"  --rate SETTINGS\n"
+				"                 Which frames to evaluate, e.g. fps=5,"
+				"max-cpu=60,keyframes=3\n"
+				"                 to evaluate at most 5 frames a second, "
+				"fewer while the CPU\n"
+				"                 is over 60%% busy, and move the boxes "
+				"along in between (see\n"
+				"                 rate_controller.h)\n"
+				"  --share NAME   Publish every frame to the shared memory "
+				"frame ring NAME,\n"
+				"                 for other processes such as "
+				"frame_ring_monitor to read\n"
+				"                 (see frame_ring.h)\n"
+				"  --warmup SETTINGS\n"
+				"                 Dummy evaluations to run while the video "
+				"starts, e.g.\n"
+				"                 evaluations=5; evaluations=0 turns them "
+				"off (see\n"
+				"                 model_warmup.h)\n"
+				"  --model-bundle PATH\n"
+				"                 Switch to the model built into the "
+				"libxnornet.so at PATH\n"
+				"                 whenever the sample gets SIGHUP, "
+				"without stopping the video\n"
+				"  --model-control FILE\n"
+				"                 Switch to the bundle whose path is "
+				"written into FILE\n"
+				"                 whenever it changes (or on SIGHUP "
+				"without --model-bundle)\n",
+				argv[0]);
 			return EXIT_FAILURE;
 		}
 	}
 
-	// Allow the video pipeline to parse the arguments, we will be ignoring them
-	xg_init(&argc, &argv);
-
-	error = xnor_model_load_options_set_threading_model(load_options,
-			kXnorThreadingModelMultiThreaded);
-	if (error != NULL) {
-		fprintf(stderr, "%s\n", xnor_error_get_description(error));
-		return EXIT_FAILURE;
+	// Headless runs must not initialize GTK, as there may be no display to
+	// connect to, so look for the flag before anything else parses arguments
+	bool headless = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--headless") == 0)
+		{
+			headless = true;
+		}
 	}
 
-	// Load the Xnor model to get a model handle. We will free this at the end of
-	// main(), either via a successful return or after the fail: label.
-	error = xnor_model_load_built_in("", NULL, &model);
-	if (error != NULL)
+	// Allow the video pipeline to parse the arguments, we will be ignoring them
+	if (headless)
 	{
-		fprintf(stderr, "%s\n", xnor_error_get_description(error));
-		goto fail;
+		xg_init_headless(&argc, &argv);
+	}
+	else
+	{
+		xg_init(&argc, &argv);
 	}
 
-	// Get the model information
-	xnor_model_info model_info;
-	model_info.xnor_model_info_size = sizeof(model_info);
-	error = xnor_model_get_info(model, &model_info);
-	if (error != NULL)
+	// Then pick out our own options; whatever is left is the device and the
+	// optional "nogui" flag
+	int32_t instances = 1;
+	bool direct_overlays = false;
+	xg_pipeline_config config;
+	xg_pipeline_config_init(&config);
+	xg_rate_config rate;
+	xg_rate_config_init(&rate);
+	bool rate_set = false;
+	const char *share_name = NULL;
+	const char *bundle_path = NULL;
+	const char *control_path = NULL;
+	// Sized to match the frames once the pipeline is known
+	xg_warmup_config warmup;
+	xg_warmup_config_init(&warmup);
+	const struct option options[] = {
+		{"instances", required_argument, NULL, 'n'},
+		{"direct-overlays", no_argument, NULL, 'd'},
+		{"pipeline", required_argument, NULL, 'p'},
+		{"headless", no_argument, NULL, 'H'},
+		{"rate", required_argument, NULL, 'r'},
+		{"share", required_argument, NULL, 's'},
+		{"warmup", required_argument, NULL, 'w'},
+		{"model-bundle", required_argument, NULL, 'b'},
+		{"model-control", required_argument, NULL, 'c'},
+		{NULL, 0, NULL, 0}};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
 	{
-		fprintf(stderr, "%s\n", xnor_error_get_description(error));
-		goto fail;
+		if (opt == 'n')
+		{
+			instances = atoi(optarg);
+		}
+		else if (opt == 'd')
+		{
+			direct_overlays = true;
+		}
+		else if (opt == 'H')
+		{
+			// Already handled above
+		}
+		else if (opt == 'r')
+		{
+			if (!xg_rate_config_parse(&rate, optarg))
+			{
+				return EXIT_FAILURE;
+			}
+			rate_set = true;
+		}
+		else if (opt == 's')
+		{
+			share_name = optarg;
+		}
+		else if (opt == 'w')
+		{
+			if (!xg_warmup_config_parse(&warmup, optarg))
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else if (opt == 'b')
+		{
+			bundle_path = optarg;
+		}
+		else if (opt == 'c')
+		{
+			control_path = optarg;
+		}
+		else if (opt == 'p')
+		{
+			if (!xg_pipeline_config_parse(&config, optarg))
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else
+		{
+			return EXIT_FAILURE;
+		}
 	}
+	const char *device = optind < argc ? argv[optind] : "/dev/video0";
+	bool gui = argc - optind < 2;
 
-	// Make sure that the model is actually an object detection model. If you
-	// see this, it means you should either switch which model is listed in the
-	// Makefile, or run one of the other demos.
-	if (model_info.result_type != kXnorEvaluationResultTypeBoundingBoxes)
+	bool swappable = bundle_path != NULL || control_path != NULL;
+	if (swappable && instances > 1)
 	{
-		fprintf(stderr, "%s is not a detection model! This sample "
-				"requires a detection model to be installed (e.g. "
-				"person-pet-vehicle-detector).",
-			model_info.name);
-		goto fail;
+		fputs("--model-bundle and --model-control need a single model "
+		      "instance\n",
+		      stderr);
+		return EXIT_FAILURE;
 	}
 
 	puts("Xnor Live Object Detection Demo");
-	printf("Model: %s\n", model_info.name);
-	printf("  version '%s'\n", model_info.version);
 
 	// Set up the video pipeline. The argument to this function is the title that
 	// goes in the title bar of the window, see gstreamer_video_pipeline.h for
 	// more information.
-	if (argc == 1)
-		pipeline = xg_create_video_overlay_pipeline(
-			"Xnor Object Detection Demo", "/dev/video0", true);
-	else if (argc > 2)
-		pipeline = xg_create_video_overlay_pipeline(
-			"Xnor Object Detection Demo", argv[1], false);
-	else 
+	if (headless)
+	{
+		print_boxes = true;
+		pipeline = xg_create_headless_pipeline(device, &config);
+	}
+	else
+	{
 		pipeline = xg_create_video_overlay_pipeline(
-			"Xnor Object Detection Demo", argv[1], true);
+		    "Xnor Object Detection Demo", device, gui, &config);
+	}
 
 	if (pipeline == NULL)
 	{
@@ -105,90 +351,111 @@ int main(int argc, char *argv[])
 		goto fail;
 	}
 
-	// Start up the video pipeline (this opens the window and starts polling the
-	// video input device).
-	xg_pipeline_start(pipeline);
+	// Let the camera's own YUV format through to the model rather than
+	// converting every frame to RGB first.
+	xg_pipeline_set_native_format(pipeline, true);
+	xg_pipeline_set_direct_overlays(pipeline, direct_overlays);
 
-	// xg_pipeline_running() will return true until the window is closed
-	while (xg_pipeline_running(pipeline))
+	// Capture, inference and drawing each run on their own thread from here on.
+	// The runner always hands the model the most recent frame, dropping any
+	// that arrive while it is busy, and returns once the window is closed.
+	// With several instances, up to that many frames are evaluated at once.
+	// Each path loads only the models it evaluates: the pool its own
+	// instances, the single runner the manager's model, which the manager can
+	// later swap for the model of another bundle without the video stopping.
+	xnor_model_info model_info;
+	model_info.xnor_model_info_size = sizeof(model_info);
+	if (instances > 1)
 	{
-		// Retrieves the last video frame from the pipeline. These are not
-		// necessarily sequential, e.g. if inference is running slower than the
-		// video input device. The pipeline will handle dropping intermediate frames
-		// so that this call always gets the most recent one.
-		frame = xg_pipeline_get_frame(pipeline);
-
-		// NULL frame can mean the pipeline stopped in the middle of the above call,
-		// so just break out of the loop now.
-		if (frame == NULL)
+		printf("Running %d single-threaded model instances\n", instances);
+		runner = xg_runner_create_pooled(pipeline, instances,
+						 kXnorThreadingModelSingleThreaded,
+						 boxes_to_overlays, NULL);
+		if (runner == NULL)
 		{
-			break;
+			goto fail;
 		}
-
-		// Create a handle so we can pass the input frame to the Xnor model
-		error = xnor_input_create_rgb_image(frame->width, frame->height,
-			frame->data, &input);
+		xnor_error *error = xnor_model_get_info(
+		    xg_infer_pool_model(xg_runner_pool(runner)), &model_info);
 		if (error != NULL)
 		{
 			fprintf(stderr, "%s\n", xnor_error_get_description(error));
+			xnor_error_free(error);
 			goto fail;
 		}
-
-		// Call the model! This is where the magic happens.
-		error = xnor_model_evaluate(model, input, NULL, &result);
-		if (error != NULL)
+	}
+	else
+	{
+		models = xg_model_manager_create(
+		    kXnorThreadingModelMultiThreaded,
+		    kXnorEvaluationResultTypeBoundingBoxes, &warmup);
+		if (models == NULL)
 		{
-			fprintf(stderr, "%s\n", xnor_error_get_description(error));
+			// Most likely not a detection model, as below
+			fputs("This sample requires a detection model to be "
+			      "installed (e.g. person-pet-vehicle-detector)\n",
+			      stderr);
 			goto fail;
 		}
-
-		xg_pipeline_clear_overlays(pipeline);
-
-		// Ask how many bounding boxes there were, then allocate enough memory to
-		// hold them all
-		int32_t num_bounding_boxes =
-		    xnor_evaluation_result_get_bounding_boxes(result, NULL, 0);
-		xnor_bounding_box *boxes =
-		    calloc(num_bounding_boxes, sizeof(xnor_bounding_box));
-		if (boxes == NULL)
+		model_info = xg_model_manager_acquire(models)->info;
+		runner = xg_runner_create(pipeline, detect_objects, models);
+		if (runner == NULL)
 		{
-			fputs("Couldn't allocate memory for bounding boxes\n", stderr);
 			goto fail;
 		}
+	}
 
-		// Get the box data and display the results
-		xnor_evaluation_result_get_bounding_boxes(result, boxes,
-							  num_bounding_boxes);
+	// Make sure that the model is actually an object detection model. If you
+	// see this, it means you should either switch which model is listed in the
+	// Makefile, or run one of the other demos.
+	if (model_info.result_type != kXnorEvaluationResultTypeBoundingBoxes)
+	{
+		fprintf(stderr, "%s is not a detection model! This sample "
+				"requires a detection model to be installed (e.g. "
+				"person-pet-vehicle-detector).\n",
+			model_info.name);
+		goto fail;
+	}
+	printf("Model: %s\n", model_info.name);
+	printf("  version '%s'\n", model_info.version);
+	if (rate_set && !xg_runner_set_rate(runner, &rate))
+	{
+		goto fail;
+	}
+	if (share_name != NULL &&
+	    !xg_runner_share_frames(runner, share_name, FRAME_RING_SLOTS))
+	{
+		goto fail;
+	}
 
-		for (int32_t i = 0; i < num_bounding_boxes; ++i)
+	// The model warms up in the background while the video pipeline starts
+	// (this opens the window and starts polling the video input device), so
+	// the first frame doesn't pay for the model's first evaluations.
+	// Pooled runners warm up their own instances.
+	xg_runner_warm_up(runner,
+			  models != NULL ? xg_model_manager_acquire(models)->model
+					 : NULL,
+			  &warmup);
+	// Bundles swapped in later are warmed up with frames of the same size
+	// before they take over
+	if (swappable)
+	{
+		xg_pipeline_fill_warmup_config(pipeline, &warmup);
+		xg_model_manager_set_warmup(models, &warmup);
+		if (!xg_model_manager_watch(models, bundle_path, control_path))
 		{
-			// set bbox
-			xg_overlay *bbox = xg_overlay_create_bounding_box(
-				boxes[i].rectangle.x, 
-				boxes[i].rectangle.y, 
-				boxes[i].rectangle.width,
-				boxes[i].rectangle.height, 
-				boxes[i].class_label.label,
-				color_by_id(boxes[i].class_label.class_id)
-			);
-			// add the bbox to be draw
-			xg_pipeline_add_overlay(pipeline, bbox);
+			goto fail;
 		}
-
-		// Clean up after the frame-specific stuff
-		free(boxes);
-		xnor_evaluation_result_free(result);
-		xnor_input_free(input);
-		xg_frame_free(frame);
-
-		// Set the variables to NULL so we don't double-free if we jump to fail:
-		result = NULL;
-		input = NULL;
-		frame = NULL;
 	}
+	xg_pipeline_start(pipeline);
+	if (!xg_runner_run(runner))
+	{
+		goto fail;
+	}
+	xg_runner_free(runner);
 
 	xg_pipeline_free(pipeline);
-	xnor_model_free(model);
+	xg_model_manager_free(models);
 	return EXIT_SUCCESS;
 fail:
 	if (pipeline && xg_pipeline_running(pipeline))
@@ -197,12 +464,9 @@ fail:
 	}
 
 	// If any of these are NULL, the corresponding free() function will do nothing
-	xg_frame_free(frame);
+	xg_runner_free(runner);
 	xg_pipeline_free(pipeline);
-	xnor_error_free(error);
-	xnor_input_free(input);
-	xnor_model_free(model);
-	xnor_evaluation_result_free(result);
+	xg_model_manager_free(models);
 	
 	return EXIT_FAILURE;
 }
@@ -6,8 +6,13 @@
 #include <string.h>
 
 #include "common_util/colors.h"
+#include "common_util/frame_input.h"
+#include "common_util/frame_trace.h"
 #include "common_util/gstreamer_video_pipeline.h"
+#include "common_util/model_warmup.h"
 #include "common_util/overlays.h"
+#include "common_util/startup_profile.h"
+#include "common_util/threaded_runner.h"
 #include "xnornet.h"
 
 static xg_color color_by_id(int32_t id)
@@ -15,15 +20,90 @@ static xg_color color_by_id(int32_t id)
 	return xg_color_palette[id % xg_color_palette_length];
 }
 
+// Runs the classifier on one frame and lists the labels it returns, most
+// confident first. Called by the runner on its inference thread.
+static bool classify_scene(xg_frame *frame, xg_overlay **overlays_out,
+			   void *user_data)
+{
+	xnor_model *model = (xnor_model *)user_data;
+	xnor_error *error = NULL;
+	xnor_input *input = NULL;
+	xnor_evaluation_result *result = NULL;
+
+	// Create a handle so we can pass the input frame to the Xnor model. This
+	// picks the input constructor matching the frame's pixel format.
+	uint64_t trace_start = XG_TRACE_BEGIN();
+	if (!xg_frame_create_xnor_input(frame, &input))
+	{
+		return false;
+	}
+	XG_TRACE_END(XG_TRACE_CREATE_INPUT, trace_start, frame->sequence);
+
+	// Call the model! This is where the magic happens.
+	trace_start = XG_TRACE_BEGIN();
+	error = xnor_model_evaluate(model, input, NULL, &result);
+	XG_TRACE_END(XG_TRACE_EVALUATE, trace_start, frame->sequence);
+	xnor_input_free(input);
+	if (error != NULL)
+	{
+		fprintf(stderr, "%s\n", xnor_error_get_description(error));
+		xnor_error_free(error);
+		return false;
+	}
+	xg_startup_mark(XG_STARTUP_FIRST_EVALUATION);
+
+	trace_start = XG_TRACE_BEGIN();
+
+	// Ask how many class labels there were, then allocate enough memory to
+	// hold them all
+	int32_t num_class_labels =
+	    xnor_evaluation_result_get_class_labels(result, NULL, 0);
+	xnor_class_label *classes = xg_arena_calloc(
+	    frame->arena, num_class_labels, sizeof(xnor_class_label));
+	if (classes == NULL)
+	{
+		fputs("Couldn't allocate memory for class labels\n", stderr);
+		xnor_evaluation_result_free(result);
+		return false;
+	}
+
+	// Get the label data and display the results
+	xnor_evaluation_result_get_class_labels(result, classes, num_class_labels);
+	// Approximate height of the overlay text as a fraction of the frame
+	const float overlay_line_height = OVERLAY_TEXT_SIZE * 1.5f / frame->height;
+	xg_overlay **tail = overlays_out;
+	for (int32_t i = 0; i < num_class_labels; ++i)
+	{
+		xg_overlay *text =
+		    xg_overlay_create_text_in(frame->arena, 0,
+					      i * overlay_line_height,
+					      classes[i].label,
+					      color_by_id(classes[i].class_id));
+		if (text == NULL)
+		{
+			continue;
+		}
+		*tail = text;
+		tail = &text->next;
+	}
+
+	XG_TRACE_END(XG_TRACE_BUILD_OVERLAYS, trace_start, frame->sequence);
+
+	// Clean up after the frame-specific stuff; the labels and overlays live
+	// in the frame's arena
+	xnor_evaluation_result_free(result);
+	return true;
+}
+
 int main(int argc, char *argv[])
 {
+	xg_startup_begin(XG_STARTUP_FIRST_OVERLAY);
+
 	// Forward declare variables we may need to clean up later
 	xnor_model *model = NULL;
 	xnor_error *error = NULL;
 	xg_pipeline *pipeline = NULL;
-	xg_frame *frame = NULL;
-	xnor_input *input = NULL;
-	xnor_evaluation_result *result = NULL;
+	xg_runner *runner = NULL;
 
 	if (argc > 1)
 	{
@@ -44,6 +124,7 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "%s\n", xnor_error_get_description(error));
 		goto fail;
 	}
+	xg_startup_mark(XG_STARTUP_MODEL_LOADED);
 
 	// Get the model information
 	xnor_model_info model_info;
@@ -77,10 +158,10 @@ int main(int argc, char *argv[])
 
 	if (argc == 1)
 		pipeline = xg_create_video_overlay_pipeline(
-				"Xnor Object Detection Demo", "/dev/video0", true);
+				"Xnor Object Detection Demo", "/dev/video0", true, NULL);
 	else
 		pipeline = xg_create_video_overlay_pipeline(
-				"Xnor Object Detection Demo", argv[1], true);
+				"Xnor Object Detection Demo", argv[1], true, NULL);
 
 	if (pipeline == NULL)
 	{
@@ -88,79 +169,30 @@ int main(int argc, char *argv[])
 		goto fail;
 	}
 
-	// Start up the video pipeline (this opens the window and starts polling the
-	// video input device).
-	xg_pipeline_start(pipeline);
+	// Let the camera's own YUV format through to the model rather than
+	// converting every frame to RGB first.
+	xg_pipeline_set_native_format(pipeline, true);
 
-	// xg_pipeline_running() will return true until the window is closed
-	while (xg_pipeline_running(pipeline))
+	// Capture, inference and drawing each run on their own thread from here on.
+	// The runner always hands the model the most recent frame, dropping any
+	// that arrive while it is busy, and returns once the window is closed.
+	runner = xg_runner_create(pipeline, classify_scene, model);
+	if (runner == NULL)
 	{
-		// Retrieves the last video frame from the pipeline. These are not
-		// necessarily sequential, e.g. if inference is running slower than the
-		// video input device. The pipeline will handle dropping intermediate frames
-		// so that this call always gets the most recent one.
-		frame = xg_pipeline_get_frame(pipeline);
-		// NULL frame can mean the pipeline stopped in the middle of the above call,
-		// so just break out of the loop now.
-		if (frame == NULL)
-		{
-			break;
-		}
-
-		// Create a handle so we can pass the input frame to the Xnor model
-		error = xnor_input_create_rgb_image(frame->width, frame->height,
-						    frame->data, &input);
-		if (error != NULL)
-		{
-			fprintf(stderr, "%s\n", xnor_error_get_description(error));
-			goto fail;
-		}
-
-		// Call the model! This is where the magic happens.
-		error = xnor_model_evaluate(model, input, NULL, &result);
-		if (error != NULL)
-		{
-			fprintf(stderr, "%s\n", xnor_error_get_description(error));
-			goto fail;
-		}
-
-		xg_pipeline_clear_overlays(pipeline);
-
-		// Ask how many class labels there were, then allocate enough memory to
-		// hold them all
-		int32_t num_class_labels =
-		    xnor_evaluation_result_get_class_labels(result, NULL, 0);
-		xnor_class_label *classes =
-		    calloc(num_class_labels, sizeof(xnor_class_label));
-		if (classes == NULL)
-		{
-			fputs("Couldn't allocate memory for class labels\n", stderr);
-			goto fail;
-		}
-
-		// Get the label data and display the results
-		xnor_evaluation_result_get_class_labels(result, classes,
-							num_class_labels);
-		// Approximate height of the overlay text as a fraction of the 1080p frame
-		const float overlay_line_height = OVERLAY_TEXT_SIZE * 1.5f / frame->height;
-		for (int32_t i = 0; i < num_class_labels; ++i)
-		{
-			xg_overlay *text =
-			    xg_overlay_create_text(0, i * overlay_line_height, classes[i].label,
-						   color_by_id(classes[i].class_id));
-			xg_pipeline_add_overlay(pipeline, text);
-		}
+		goto fail;
+	}
 
-		// Clean up after the frame-specific stuff
-		free(classes);
-		xnor_evaluation_result_free(result);
-		xnor_input_free(input);
-		xg_frame_free(frame);
-		// Set the variables to NULL so we don't double-free if we jump to fail:
-		result = NULL;
-		input = NULL;
-		frame = NULL;
+	// Warm the model up while the video pipeline starts (this opens the window
+	// and starts polling the video input device)
+	xg_warmup_config warmup;
+	xg_warmup_config_init(&warmup);
+	xg_runner_warm_up(runner, model, &warmup);
+	xg_pipeline_start(pipeline);
+	if (!xg_runner_run(runner))
+	{
+		goto fail;
 	}
+	xg_runner_free(runner);
 
 	xg_pipeline_free(pipeline);
 	xnor_model_free(model);
@@ -171,11 +203,9 @@ fail:
 		xg_pipeline_stop(pipeline);
 	}
 	// If any of these are NULL, the corresponding free() function will do nothing
-	xg_frame_free(frame);
+	xg_runner_free(runner);
 	xg_pipeline_free(pipeline);
 	xnor_error_free(error);
-	xnor_input_free(input);
 	xnor_model_free(model);
-	xnor_evaluation_result_free(result);
 	return EXIT_FAILURE;
 }
@@ -0,0 +1,393 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+// This sample runs the object detector on several video sources at once, e.g.
+// a few cameras, each in its own window. Rather than every source getting a
+// model of its own, their frames take turns on one shared pool of model
+// instances, so a handful of instances keeps up with however many cameras
+// there are (see common_util/stream_scheduler.h).
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common_util/colors.h"
+#include "common_util/gstreamer_video_pipeline.h"
+#include "common_util/model_warmup.h"
+#include "common_util/overlays.h"
+#include "common_util/startup_profile.h"
+#include "common_util/stream_scheduler.h"
+#include "xnornet.h"
+
+// Set when running headless, where there's no video to draw the boxes on
+static bool print_boxes = false;
+
+static xg_color color_by_id(int32_t id)
+{
+	xg_color color;
+	color.r = 243;
+	color.g = 0;
+	color.b = 32;
+	color.a = 255;
+	return color;
+}
+
+// Turns every bounding box in the detector's result into an overlay. The
+// scheduler calls this on whichever model instance evaluated the frame;
+// @user_data is the number of the stream the frame came from.
+static bool boxes_to_overlays(xg_frame *frame, xnor_evaluation_result *result,
+			      xg_overlay **overlays_out, void *user_data)
+{
+	int32_t stream = (int32_t)(intptr_t)user_data;
+	int32_t num_bounding_boxes =
+	    xnor_evaluation_result_get_bounding_boxes(result, NULL, 0);
+	xnor_bounding_box *boxes = xg_arena_calloc(
+	    frame->arena, num_bounding_boxes, sizeof(xnor_bounding_box));
+	if (boxes == NULL)
+	{
+		fputs("Couldn't allocate memory for bounding boxes\n", stderr);
+		return false;
+	}
+
+	xnor_evaluation_result_get_bounding_boxes(result, boxes,
+						  num_bounding_boxes);
+	xg_overlay **tail = overlays_out;
+	for (int32_t i = 0; i < num_bounding_boxes; ++i)
+	{
+		xg_overlay *bbox = xg_overlay_create_bounding_box_in(
+			frame->arena,
+			boxes[i].rectangle.x,
+			boxes[i].rectangle.y,
+			boxes[i].rectangle.width,
+			boxes[i].rectangle.height,
+			boxes[i].class_label.label,
+			color_by_id(boxes[i].class_label.class_id)
+		);
+		if (bbox == NULL)
+		{
+			continue;
+		}
+		if (print_boxes)
+		{
+			printf("stream %d frame %llu: %s at %.2f,%.2f %.2fx%.2f\n",
+			       stream, (unsigned long long)frame->sequence,
+			       boxes[i].class_label.label, boxes[i].rectangle.x,
+			       boxes[i].rectangle.y, boxes[i].rectangle.width,
+			       boxes[i].rectangle.height);
+		}
+		*tail = bbox;
+		tail = &bbox->next;
+	}
+
+	return true;
+}
+
+// Parses the value of @option as a whole number of at least @minimum
+static bool parse_option_number(const char *option, const char *value,
+				int32_t minimum, int32_t *number)
+{
+	char end;
+	if (sscanf(value, "%d%c", number, &end) != 1 || *number < minimum)
+	{
+		fprintf(stderr, "--%s: Please pass a whole number of at least %d\n",
+			option, minimum);
+		return false;
+	}
+	return true;
+}
+
+// Parses a comma-separated list of stream weights into @weights, returning
+// how many there were, or -1 if any is invalid
+static int32_t parse_weights(const char *value, int32_t *weights)
+{
+	int32_t n_weights = 0;
+	const char *start = value;
+	for (;;)
+	{
+		char number[16];
+		size_t length = strcspn(start, ",");
+		if (n_weights == XG_SCHEDULER_MAX_STREAMS ||
+		    length >= sizeof(number))
+		{
+			fputs("--weights: Please pass one weight per source\n",
+			      stderr);
+			return -1;
+		}
+		memcpy(number, start, length);
+		number[length] = '\0';
+		if (!parse_option_number("weights", number, 1,
+					 &weights[n_weights++]))
+		{
+			return -1;
+		}
+		if (start[length] == '\0')
+		{
+			return n_weights;
+		}
+		start += length + 1;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	xg_startup_begin(XG_STARTUP_FIRST_OVERLAY);
+
+	// Forward declare variables we may need to clean up later
+	xg_scheduler *scheduler = NULL;
+	xg_pipeline *pipelines[XG_SCHEDULER_MAX_STREAMS] = {NULL};
+	int32_t n_pipelines = 0;
+
+	if (argc > 1)
+	{
+		if (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h"))
+		{
+			fprintf(stderr,
+				"Usage: %s [--instances N] [--deadline MS] "
+				"[--weights W,...] [--queue N]\n"
+				"          [--headless] [--pipeline SETTINGS]\n"
+				"          source... <gst_flags> <gtk_flags>\n"
+				"  source         /dev/videoN, file://PATH, a directory "
+				"of images,\n"
+				"                 videotestsrc or shm://SOCKET; up to %d "
+				"of them\n"
+				"  --instances N  Share N single-threaded model "
+				"instances, each pinned to\n"
+				"                 its own core, between the sources "
+				"(default: one\n"
+				"                 multi-threaded instance)\n"
+				"  --deadline MS  Drop frames that have waited longer than "
+				"MS milliseconds\n"
+				"                 for a model instance (default 200, 0 "
+				"for no limit)\n"
+				"  --weights W,...\n"
+				"                 Share of the evaluations each source "
+				"gets while they\n"
+				"                 compete, e.g. 2,1 gives the first "
+				"twice the second's\n"
+				"                 (default 1 each)\n"
+				"  --queue N      Frames each source may have waiting "
+				"for a model instance,\n"
+				"                 up to %d (default 1: always the newest)\n"
+				"  --headless     Only capture and detect, printing the "
+				"boxes found, without\n"
+				"                 windows or a display\n"
+				"  --pipeline SETTINGS\n"
+				"                 Capture and processing settings for "
+				"every source, e.g.\n"
+				"                 size=640x480,fps=15 (see "
+				"xg_pipeline_config_parse())\n",
+				argv[0], XG_SCHEDULER_MAX_STREAMS,
+				XG_SCHEDULER_MAX_QUEUE_DEPTH);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Headless runs must not initialize GTK, as there may be no display to
+	// connect to, so look for the flag before anything else parses arguments
+	bool headless = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--headless") == 0)
+		{
+			headless = true;
+		}
+	}
+	if (headless)
+	{
+		xg_init_headless(&argc, &argv);
+	}
+	else
+	{
+		xg_init(&argc, &argv);
+	}
+
+	// Then pick out our own options; whatever is left are the sources
+	int32_t instances = 1;
+	xg_pipeline_config config;
+	xg_pipeline_config_init(&config);
+	xg_stream_config stream_config;
+	xg_stream_config_init(&stream_config);
+	int32_t weights[XG_SCHEDULER_MAX_STREAMS];
+	int32_t n_weights = 0;
+	const struct option options[] = {
+		{"instances", required_argument, NULL, 'n'},
+		{"deadline", required_argument, NULL, 'D'},
+		{"weights", required_argument, NULL, 'W'},
+		{"queue", required_argument, NULL, 'q'},
+		{"pipeline", required_argument, NULL, 'p'},
+		{"headless", no_argument, NULL, 'H'},
+		{NULL, 0, NULL, 0}};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+	{
+		if (opt == 'n')
+		{
+			if (!parse_option_number("instances", optarg, 1,
+						 &instances))
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else if (opt == 'D')
+		{
+			if (!parse_option_number("deadline", optarg, 0,
+						 &stream_config.deadline_ms))
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else if (opt == 'W')
+		{
+			n_weights = parse_weights(optarg, weights);
+			if (n_weights < 0)
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else if (opt == 'q')
+		{
+			if (!parse_option_number("queue", optarg, 1,
+						 &stream_config.queue_depth))
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else if (opt == 'H')
+		{
+			// Already handled above
+		}
+		else if (opt == 'p')
+		{
+			if (!xg_pipeline_config_parse(&config, optarg))
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else
+		{
+			return EXIT_FAILURE;
+		}
+	}
+	int32_t n_sources = argc - optind;
+	if (n_sources < 1 || n_sources > XG_SCHEDULER_MAX_STREAMS)
+	{
+		fprintf(stderr, "Give between 1 and %d sources (see --help)\n",
+			XG_SCHEDULER_MAX_STREAMS);
+		return EXIT_FAILURE;
+	}
+	if (n_weights > n_sources)
+	{
+		fputs("--weights: Please pass one weight per source\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	// Load the shared model instances. A single instance gets every core;
+	// several each get one of their own.
+	scheduler = xg_scheduler_create(
+	    instances, instances > 1 ? kXnorThreadingModelSingleThreaded
+				     : kXnorThreadingModelMultiThreaded);
+	if (scheduler == NULL)
+	{
+		goto fail;
+	}
+
+	xnor_model_info model_info;
+	model_info.xnor_model_info_size = sizeof(model_info);
+	xnor_error *error =
+	    xnor_model_get_info(xg_scheduler_model(scheduler), &model_info);
+	if (error != NULL)
+	{
+		fprintf(stderr, "%s\n", xnor_error_get_description(error));
+		xnor_error_free(error);
+		goto fail;
+	}
+	if (model_info.result_type != kXnorEvaluationResultTypeBoundingBoxes)
+	{
+		fprintf(stderr, "%s is not a detection model! This sample "
+				"requires a detection model to be installed (e.g. "
+				"person-pet-vehicle-detector).",
+			model_info.name);
+		goto fail;
+	}
+
+	puts("Xnor Multi-Stream Object Detection Demo");
+	printf("Model: %s\n", model_info.name);
+	printf("  version '%s'\n", model_info.version);
+	printf("Sharing %d model instance%s between %d stream%s\n", instances,
+	       instances == 1 ? "" : "s", n_sources, n_sources == 1 ? "" : "s");
+
+	// The instances warm up while the pipelines are created and started, on
+	// frames like the ones most webcams deliver at the configured size
+	xg_warmup_config warmup;
+	xg_warmup_config_init(&warmup);
+	warmup.format = kImageFormatYUV422;
+	warmup.width = config.inference_width ? config.inference_width
+					      : config.width;
+	warmup.height = config.inference_height ? config.inference_height
+						: config.height;
+	xg_scheduler_warm_up(scheduler, &warmup);
+
+	// One pipeline per source, each with a window of its own
+	print_boxes = headless;
+	for (; n_pipelines < n_sources; ++n_pipelines)
+	{
+		const char *source = argv[optind + n_pipelines];
+		xg_pipeline *pipeline;
+		if (headless)
+		{
+			pipeline = xg_create_headless_pipeline(source, &config);
+		}
+		else
+		{
+			char title[64];
+			snprintf(title, sizeof(title),
+				 "Xnor Multi-Stream Demo %d", n_pipelines);
+			pipeline = xg_create_video_overlay_pipeline(
+			    title, source, true, &config);
+		}
+		if (pipeline == NULL)
+		{
+			fprintf(stderr, "Couldn't create video pipeline for %s\n",
+				source);
+			goto fail;
+		}
+		pipelines[n_pipelines] = pipeline;
+		xg_pipeline_set_native_format(pipeline, true);
+		xg_pipeline_start(pipeline);
+		// Sources without a weight of their own get the default
+		stream_config.weight =
+		    n_pipelines < n_weights ? weights[n_pipelines] : 1;
+		if (!xg_scheduler_add_stream(scheduler, pipeline, &stream_config,
+					     boxes_to_overlays,
+					     (void *)(intptr_t)n_pipelines))
+		{
+			++n_pipelines;
+			goto fail;
+		}
+	}
+
+	// Returns once every window is closed or every source has ended
+	if (!xg_scheduler_run(scheduler))
+	{
+		goto fail;
+	}
+	xg_scheduler_free(scheduler);
+	for (int32_t i = 0; i < n_pipelines; ++i)
+	{
+		xg_pipeline_free(pipelines[i]);
+	}
+	return EXIT_SUCCESS;
+fail:
+	// The scheduler goes first, as its threads may still use the pipelines
+	xg_scheduler_free(scheduler);
+	for (int32_t i = 0; i < n_pipelines; ++i)
+	{
+		if (pipelines[i] && xg_pipeline_running(pipelines[i]))
+		{
+			xg_pipeline_stop(pipelines[i]);
+		}
+		xg_pipeline_free(pipelines[i]);
+	}
+	return EXIT_FAILURE;
+}
@@ -8,7 +8,9 @@
 
 #include "common_util/colors.h"
 #include "common_util/gstreamer_video_pipeline.h"
+#include "common_util/model_warmup.h"
 #include "common_util/overlays.h"
+#include "common_util/startup_profile.h"
 #include "xnornet.h"
 #include "common_util/tmp_intercomm.h"
 #include "common_util/implement_operations.h"
@@ -20,6 +22,8 @@ static xg_color color_by_id(int32_t id)
 
 int main(int argc, char *argv[])
 {
+	xg_startup_begin(XG_STARTUP_FIRST_OVERLAY);
+
 	// Forward declare variables we may need to clean up later
 	xnor_model *model = NULL;
 	xnor_error *error = NULL;
@@ -60,6 +64,7 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "%s\n", xnor_error_get_description(error));
 		goto fail;
 	}
+	xg_startup_mark(XG_STARTUP_MODEL_LOADED);
 
 	// Get the model information
 	xnor_model_info model_info;
@@ -92,13 +97,13 @@ int main(int argc, char *argv[])
 	// more information.
 	if (argc == 1)
 		pipeline = xg_create_video_overlay_pipeline(
-			"Xnor Object Detection Demo", "/dev/video0", true);
+			"Xnor Object Detection Demo", "/dev/video0", true, NULL);
 	else if (argc > 2)
 		pipeline = xg_create_video_overlay_pipeline(
-			"Xnor Object Detection Demo", argv[1], false);
+			"Xnor Object Detection Demo", argv[1], false, NULL);
 	else 
 		pipeline = xg_create_video_overlay_pipeline(
-			"Xnor Object Detection Demo", argv[1], true);
+			"Xnor Object Detection Demo", argv[1], true, NULL);
 
 	if (pipeline == NULL)
 	{
@@ -107,8 +112,13 @@ int main(int argc, char *argv[])
 	}
 
 	// Start up the video pipeline (this opens the window and starts polling the
-	// video input device).
+	// video input device), warming the model up on RGB frames of the default
+	// size meanwhile
+	xg_warmup_config warmup_config;
+	xg_warmup_config_init(&warmup_config);
+	xg_warmup *warmup = xg_warmup_start(model, &warmup_config);
 	xg_pipeline_start(pipeline);
+	xg_warmup_finish(warmup);
 
 	// xg_pipeline_running() will return true until the window is closed
 	while (xg_pipeline_running(pipeline))
@@ -147,6 +157,7 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "%s\n", xnor_error_get_description(error));
 			goto fail;
 		}
+		xg_startup_mark(XG_STARTUP_FIRST_EVALUATION);
 
 		xg_pipeline_clear_overlays(pipeline);
 
@@ -199,6 +210,9 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		// Show this frame's boxes in place of the last frame's, all at once
+		xg_pipeline_swap_overlays(pipeline);
+
 		// where we are?
 		if (tmp_intercomm_global_interface)
 		{
@@ -0,0 +1,640 @@
+// Copyright (c) 2019 Xnor.ai, Inc.
+//
+// This sample keeps the built-in model loaded and evaluates images for any
+// number of clients over a Unix domain socket, so that each request costs one
+// evaluation instead of a model load as well. The image samples
+// (classify_image_file and friends) are clients of it; see
+// common_util/inference_protocol.h for the protocol.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common_util/image_input.h"
+#include "common_util/inference_protocol.h"
+#include "common_util/infer_pool.h"
+#include "common_util/model_warmup.h"
+#include "common_util/startup_profile.h"
+#include "xnornet.h"
+
+// Connections still waiting to be accepted when the server is busy
+static const int LISTEN_BACKLOG = 16;
+
+// A request waiting for the pool to evaluate it
+typedef struct pending_evaluation {
+  sem_t done;
+  xnor_evaluation_result* result;
+  xnor_error* error;
+} pending_evaluation;
+
+// One client connection, served by its own thread
+typedef struct connection {
+  int socket;
+  struct server* server;
+  struct connection* next;
+} connection;
+
+typedef struct server {
+  xg_infer_pool* pool;
+  int listener;
+  // Open connections, so they can be shut down when the server stops
+  pthread_mutex_t lock;
+  pthread_cond_t all_closed;
+  connection* connections;
+} server;
+
+static atomic_bool stopping;
+
+static void on_stop_signal(int signal_number) {
+  (void)signal_number;
+  atomic_store(&stopping, true);
+}
+
+// The pool is unordered, so this may run on several workers at once; each
+// call only touches its own request
+static void on_pool_result(void* tag, xnor_evaluation_result* result,
+                           xnor_error* error, void* user_data) {
+  (void)user_data;
+  pending_evaluation* pending = (pending_evaluation*)tag;
+  pending->result = result;
+  pending->error = error;
+  sem_post(&pending->done);
+}
+
+// Growable buffer a response payload is built in
+typedef struct payload {
+  uint8_t* data;
+  uint32_t size, capacity;
+  bool failed;
+} payload;
+
+static void* payload_reserve(payload* out, uint32_t size) {
+  if (out->failed) {
+    return NULL;
+  }
+  if (out->size + size > out->capacity) {
+    uint32_t capacity = out->capacity > 0 ? out->capacity : 1024;
+    while (capacity < out->size + size) {
+      capacity *= 2;
+    }
+    uint8_t* data = realloc(out->data, capacity);
+    if (data == NULL) {
+      out->failed = true;
+      return NULL;
+    }
+    out->data = data;
+    out->capacity = capacity;
+  }
+  void* reserved = out->data + out->size;
+  out->size += size;
+  return reserved;
+}
+
+static void payload_append(payload* out, const void* data, uint32_t size) {
+  void* reserved = payload_reserve(out, size);
+  if (reserved != NULL) {
+    memcpy(reserved, data, size);
+  }
+}
+
+static void payload_printf(payload* out, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+static void payload_printf(payload* out, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  // vsnprintf() always writes a terminator, which the next append overwrites
+  char* reserved = payload_reserve(out, length + 1);
+  if (reserved == NULL) {
+    return;
+  }
+  va_start(args, format);
+  vsnprintf(reserved, length + 1, format, args);
+  va_end(args);
+  out->size -= 1;
+}
+
+static void json_append_string(payload* out, const char* string) {
+  payload_append(out, "\"", 1);
+  for (const char* c = string; *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\') {
+      payload_printf(out, "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      payload_printf(out, "\\u%04x", *c);
+    } else {
+      payload_append(out, c, 1);
+    }
+  }
+  payload_append(out, "\"", 1);
+}
+
+static void json_append_label(payload* out, const xnor_class_label* label) {
+  payload_printf(out, "\"class_id\":%d,\"label\":", label->class_id);
+  json_append_string(out, label->label);
+}
+
+static xg_infer_label make_label(const xnor_class_label* label) {
+  xg_infer_label record = {.class_id = label->class_id};
+  snprintf(record.label, sizeof(record.label), "%s", label->label);
+  return record;
+}
+
+// Encodes every item of @result into @out. Returns how many there were.
+static uint32_t encode_result(xnor_evaluation_result* result,
+                              enum xg_infer_encoding encoding, payload* out) {
+  bool json = encoding == XG_INFER_ENCODING_JSON;
+  switch (xnor_evaluation_result_get_type(result)) {
+    case kXnorEvaluationResultTypeClassLabels: {
+      int32_t count = xnor_evaluation_result_get_class_labels(result, NULL, 0);
+      xnor_class_label* labels = calloc(count, sizeof(xnor_class_label));
+      if (count > 0 && labels == NULL) {
+        out->failed = true;
+        return 0;
+      }
+      xnor_evaluation_result_get_class_labels(result, labels, count);
+      if (json) {
+        payload_printf(out, "{\"class_labels\":[");
+      }
+      for (int32_t i = 0; i < count; ++i) {
+        if (json) {
+          payload_printf(out, "%s{", i > 0 ? "," : "");
+          json_append_label(out, &labels[i]);
+          payload_printf(out, "}");
+        } else {
+          xg_infer_label record = make_label(&labels[i]);
+          payload_append(out, &record, sizeof(record));
+        }
+      }
+      if (json) {
+        payload_printf(out, "]}");
+      }
+      free(labels);
+      return count;
+    }
+    case kXnorEvaluationResultTypeBoundingBoxes: {
+      int32_t count =
+          xnor_evaluation_result_get_bounding_boxes(result, NULL, 0);
+      xnor_bounding_box* boxes = calloc(count, sizeof(xnor_bounding_box));
+      if (count > 0 && boxes == NULL) {
+        out->failed = true;
+        return 0;
+      }
+      xnor_evaluation_result_get_bounding_boxes(result, boxes, count);
+      if (json) {
+        payload_printf(out, "{\"bounding_boxes\":[");
+      }
+      for (int32_t i = 0; i < count; ++i) {
+        const xnor_rectangle* box = &boxes[i].rectangle;
+        if (json) {
+          payload_printf(out, "%s{", i > 0 ? "," : "");
+          json_append_label(out, &boxes[i].class_label);
+          payload_printf(out,
+                         ",\"x\":%g,\"y\":%g,\"width\":%g,\"height\":%g}",
+                         box->x, box->y, box->width, box->height);
+        } else {
+          xg_infer_box record = {
+              .class_label = make_label(&boxes[i].class_label),
+              .x = box->x,
+              .y = box->y,
+              .width = box->width,
+              .height = box->height,
+          };
+          payload_append(out, &record, sizeof(record));
+        }
+      }
+      if (json) {
+        payload_printf(out, "]}");
+      }
+      free(boxes);
+      return count;
+    }
+    case kXnorEvaluationResultTypeSegmentationMasks: {
+      int32_t count =
+          xnor_evaluation_result_get_segmentation_masks(result, NULL, 0);
+      xnor_segmentation_mask* masks =
+          calloc(count, sizeof(xnor_segmentation_mask));
+      if (count > 0 && masks == NULL) {
+        out->failed = true;
+        return 0;
+      }
+      xnor_evaluation_result_get_segmentation_masks(result, masks, count);
+      if (json) {
+        // Bitmaps are only sent in binary responses
+        payload_printf(out, "{\"segmentation_masks\":[");
+        for (int32_t i = 0; i < count; ++i) {
+          payload_printf(out, "%s{", i > 0 ? "," : "");
+          json_append_label(out, &masks[i].class_label);
+          payload_printf(out, ",\"width\":%d,\"height\":%d}",
+                         masks[i].bitmap.width, masks[i].bitmap.height);
+        }
+        payload_printf(out, "]}");
+        free(masks);
+        return count;
+      }
+      // The records first, then every bitmap after them
+      uint32_t bitmap_offset = count * sizeof(xg_infer_mask);
+      for (int32_t i = 0; i < count; ++i) {
+        const xnor_bitmap* bitmap = &masks[i].bitmap;
+        xg_infer_mask record = {
+            .class_label = make_label(&masks[i].class_label),
+            .width = bitmap->width,
+            .height = bitmap->height,
+            .stride = bitmap->stride,
+            .bitmap_offset = bitmap_offset,
+        };
+        payload_append(out, &record, sizeof(record));
+        bitmap_offset += bitmap->stride * bitmap->height;
+      }
+      for (int32_t i = 0; i < count; ++i) {
+        const xnor_bitmap* bitmap = &masks[i].bitmap;
+        payload_append(out, bitmap->data, bitmap->stride * bitmap->height);
+      }
+      free(masks);
+      return count;
+    }
+    default:
+      return 0;
+  }
+}
+
+static bool send_error(int socket, enum xg_infer_status status,
+                       const char* message) {
+  xg_infer_response_header header = {
+      .magic = XG_INFER_RESPONSE_MAGIC,
+      .status = status,
+      .size = strlen(message),
+  };
+  return xg_infer_send(socket, &header, sizeof(header), message, header.size,
+                       -1);
+}
+
+// Evaluates @image on whichever model instance is free and sends back the
+// result. Returns false if the connection failed.
+static bool evaluate_and_respond(server* server, int socket,
+                                 const xg_infer_request* request,
+                                 const uint8_t* image) {
+  xnor_input* input = NULL;
+  if (!create_image_input(request->format, request->width, request->height,
+                          image, request->size, &input)) {
+    return send_error(socket, XG_INFER_BAD_REQUEST,
+                      "Couldn't create an input from the image");
+  }
+
+  pending_evaluation pending = {.result = NULL, .error = NULL};
+  sem_init(&pending.done, 0, 0);
+  xg_infer_pool_submit(server->pool, input, &pending);
+  while (sem_wait(&pending.done) != 0 && errno == EINTR) {
+  }
+  sem_destroy(&pending.done);
+  xnor_input_free(input);
+  if (pending.error != NULL) {
+    bool sent = send_error(socket, XG_INFER_EVALUATION_FAILED,
+                           xnor_error_get_description(pending.error));
+    xnor_error_free(pending.error);
+    return sent;
+  }
+
+  payload out = {NULL};
+  uint32_t count = encode_result(pending.result, request->encoding, &out);
+  xg_infer_response_header header = {
+      .magic = XG_INFER_RESPONSE_MAGIC,
+      .status = XG_INFER_OK,
+      .result_type = xnor_evaluation_result_get_type(pending.result),
+      .count = count,
+      .size = out.size,
+  };
+  xnor_evaluation_result_free(pending.result);
+  bool sent;
+  if (out.failed) {
+    sent = send_error(socket, XG_INFER_EVALUATION_FAILED,
+                      "Out of memory encoding the result");
+  } else {
+    sent = xg_infer_send(socket, &header, sizeof(header), out.data, out.size,
+                         -1);
+  }
+  free(out.data);
+  return sent;
+}
+
+static bool valid_request(const xg_infer_request* request, bool has_fd) {
+  if (request->magic != XG_INFER_REQUEST_MAGIC ||
+      request->version != XG_INFER_PROTOCOL_VERSION ||
+      request->format > kImageFormatNV21 ||
+      request->encoding > XG_INFER_ENCODING_JSON || request->size == 0 ||
+      request->size > XG_INFER_MAX_IMAGE_SIZE ||
+      has_fd != ((request->flags & XG_INFER_IMAGE_IN_FD) != 0)) {
+    return false;
+  }
+  // Raw images are read straight from the data, so it must hold all of them
+  return request->format == kImageFormatJPEG ||
+         (request->width > 0 && request->height > 0 &&
+          request->size >= image_format_size(request->format, request->width,
+                                             request->height));
+}
+
+// Copies @size bytes from the start of @image_fd. Returns NULL if there
+// aren't that many.
+static uint8_t* copy_image(int image_fd, uint32_t size) {
+  uint8_t* data = malloc(size);
+  if (data == NULL) {
+    return NULL;
+  }
+  for (uint32_t copied = 0; copied < size;) {
+    ssize_t n = pread(image_fd, data + copied, size - copied, copied);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      free(data);
+      return NULL;
+    }
+    copied += n;
+  }
+  return data;
+}
+
+// Reads the request's image. One passed as a descriptor is mapped if the
+// descriptor is sealed against shrinking, and copied otherwise: the client
+// could truncate an unsealed file mid-evaluation, and reading a mapping past
+// the end of its file raises SIGBUS. Returns NULL if it couldn't be read.
+static uint8_t* receive_image(int socket, const xg_infer_request* request,
+                              int image_fd, bool* mapped_out) {
+  *mapped_out = false;
+  if (image_fd >= 0) {
+    int seals = fcntl(image_fd, F_GET_SEALS);
+    if (seals < 0 || (seals & F_SEAL_SHRINK) == 0) {
+      return copy_image(image_fd, request->size);
+    }
+    struct stat info;
+    if (fstat(image_fd, &info) != 0 || info.st_size < request->size) {
+      return NULL;
+    }
+    void* data = mmap(NULL, request->size, PROT_READ, MAP_SHARED, image_fd, 0);
+    if (data == MAP_FAILED) {
+      return NULL;
+    }
+    *mapped_out = true;
+    return data;
+  }
+  uint8_t* data = malloc(request->size);
+  if (data != NULL && !xg_infer_recv(socket, data, request->size, NULL)) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+static void* serve_connection(void* arg) {
+  connection* client = (connection*)arg;
+  server* server = client->server;
+  for (;;) {
+    xg_infer_request request;
+    int image_fd;
+    if (!xg_infer_recv(client->socket, &request, sizeof(request),
+                       &image_fd)) {
+      break;
+    }
+    if (!valid_request(&request, image_fd >= 0)) {
+      // The stream can't be trusted to be in step any more
+      send_error(client->socket, XG_INFER_BAD_REQUEST, "Malformed request");
+      if (image_fd >= 0) {
+        close(image_fd);
+      }
+      break;
+    }
+    bool mapped;
+    uint8_t* image = receive_image(client->socket, &request, image_fd, &mapped);
+    if (image_fd >= 0) {
+      close(image_fd);
+    }
+    bool ok;
+    if (image == NULL) {
+      // An image sent inline leaves the stream out of step if it couldn't be
+      // received, one passed as a descriptor doesn't
+      ok = image_fd >= 0 && send_error(client->socket, XG_INFER_BAD_REQUEST,
+                                       "Couldn't read the image");
+    } else {
+      ok = evaluate_and_respond(server, client->socket, &request, image);
+      if (mapped) {
+        munmap(image, request.size);
+      } else {
+        free(image);
+      }
+    }
+    if (!ok) {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&server->lock);
+  for (connection** link = &server->connections; *link != NULL;
+       link = &(*link)->next) {
+    if (*link == client) {
+      *link = client->next;
+      break;
+    }
+  }
+  if (server->connections == NULL) {
+    pthread_cond_broadcast(&server->all_closed);
+  }
+  pthread_mutex_unlock(&server->lock);
+  close(client->socket);
+  free(client);
+  return NULL;
+}
+
+static int listen_on(const char* socket_path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    perror("Couldn't create socket");
+    return -1;
+  }
+  // Replace the socket of a server that didn't exit cleanly
+  unlink(socket_path);
+  if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listener, LISTEN_BACKLOG) != 0) {
+    fprintf(stderr, "Couldn't listen on %s: %s\n", socket_path,
+            strerror(errno));
+    close(listener);
+    return -1;
+  }
+  return listener;
+}
+
+static void accept_connections(server* server) {
+  while (!atomic_load(&stopping)) {
+    int socket = accept4(server->listener, NULL, NULL, SOCK_CLOEXEC);
+    if (socket < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        perror("Couldn't accept connection");
+      }
+      continue;
+    }
+    connection* client = calloc(1, sizeof(connection));
+    if (client == NULL) {
+      fputs("Couldn't allocate memory for connection\n", stderr);
+      close(socket);
+      continue;
+    }
+    client->socket = socket;
+    client->server = server;
+    pthread_mutex_lock(&server->lock);
+    client->next = server->connections;
+    server->connections = client;
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_connection, client) != 0) {
+      fputs("Couldn't start connection thread\n", stderr);
+      pthread_mutex_lock(&server->lock);
+      server->connections = client->next;
+      pthread_mutex_unlock(&server->lock);
+      close(socket);
+      free(client);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+// Hangs up on every client and waits for their threads to finish
+static void close_connections(server* server) {
+  pthread_mutex_lock(&server->lock);
+  for (connection* client = server->connections; client != NULL;
+       client = client->next) {
+    shutdown(client->socket, SHUT_RDWR);
+  }
+  while (server->connections != NULL) {
+    pthread_cond_wait(&server->all_closed, &server->lock);
+  }
+  pthread_mutex_unlock(&server->lock);
+}
+
+static void print_usage(const char* program) {
+  fprintf(stderr,
+          "Usage: %s [--socket PATH] [--instances N] [--warmup SETTINGS]\n"
+          "  --socket PATH  Where to listen (default: $%s, or %s)\n"
+          "  --instances N  Evaluate up to N images at once, on N "
+          "single-threaded\n"
+          "                 model instances (default: one multi-threaded "
+          "instance)\n"
+          "  --warmup SETTINGS\n"
+          "                 Dummy evaluations each instance runs before "
+          "serving, e.g.\n"
+          "                 evaluations=3,size=640x480; evaluations=0 "
+          "turns them off\n"
+          "                 (see model_warmup.h)\n",
+          program, XG_INFER_SOCKET_ENV, XG_INFER_DEFAULT_SOCKET);
+}
+
+int main(int argc, char* argv[]) {
+  xg_startup_begin(XG_STARTUP_FIRST_EVALUATION);
+  const char* socket_path = xg_infer_socket_path();
+  int32_t instances = 1;
+  xg_warmup_config warmup;
+  xg_warmup_config_init(&warmup);
+  const struct option options[] = {
+      {"socket", required_argument, NULL, 's'},
+      {"instances", required_argument, NULL, 'n'},
+      {"warmup", required_argument, NULL, 'w'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+    if (opt == 's') {
+      socket_path = optarg;
+    } else if (opt == 'n') {
+      instances = atoi(optarg);
+    } else if (opt == 'w') {
+      if (!xg_warmup_config_parse(&warmup, optarg)) {
+        return EXIT_FAILURE;
+      }
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (instances < 1) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  server server = {.listener = -1, .connections = NULL};
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.all_closed, NULL);
+  server.pool = xg_infer_pool_create(
+      instances,
+      instances > 1 ? kXnorThreadingModelSingleThreaded
+                    : kXnorThreadingModelMultiThreaded,
+      on_pool_result, NULL);
+  if (server.pool == NULL) {
+    return EXIT_FAILURE;
+  }
+  // Each connection waits for its own results only, so one client's slow
+  // evaluation mustn't hold up those of the others
+  xg_infer_pool_set_ordered(server.pool, false);
+  // The instances warm up while the socket is set up; the first requests
+  // queue behind them
+  xg_infer_pool_warm_up(server.pool, &warmup);
+  xnor_model_info model_info;
+  model_info.xnor_model_info_size = sizeof(model_info);
+  xnor_error* error =
+      xnor_model_get_info(xg_infer_pool_model(server.pool), &model_info);
+  if (error != NULL) {
+    fprintf(stderr, "%s\n", xnor_error_get_description(error));
+    xnor_error_free(error);
+    xg_infer_pool_free(server.pool);
+    return EXIT_FAILURE;
+  }
+
+  server.listener = listen_on(socket_path);
+  if (server.listener < 0) {
+    xg_infer_pool_free(server.pool);
+    return EXIT_FAILURE;
+  }
+
+  // Stop on SIGINT/SIGTERM by interrupting accept() (no SA_RESTART)
+  struct sigaction action = {.sa_handler = on_stop_signal};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  printf("Serving %s (version '%s') on %s with %d instance%s\n",
+         model_info.name, model_info.version, socket_path, instances,
+         instances > 1 ? "s" : "");
+  fflush(stdout);
+  accept_connections(&server);
+
+  puts("Shutting down");
+  close(server.listener);
+  unlink(socket_path);
+  close_connections(&server);
+  xg_infer_pool_free(server.pool);
+  pthread_cond_destroy(&server.all_closed);
+  pthread_mutex_destroy(&server.lock);
+  return EXIT_SUCCESS;
+}
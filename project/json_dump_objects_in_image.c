@@ -1,8 +1,9 @@
 // Copyright (c) 2019 Xnor.ai, Inc.
 //
-// This sample runs a detection model over an input image and prints out the
-// resulting detected object locations as a JSON document. (Useful for e.g.
-// reading results from another application or over HTTP).
+// This sample has a detection model, kept loaded by inference_server, evaluate
+// an input image and prints out the resulting detected object locations as a
+// JSON document. (Useful for e.g. reading results from another application or
+// over HTTP).
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -11,20 +12,13 @@
 #include <string.h>
 #include <unistd.h>
 
-// File-loading helpers
-#include "common_util/file.h"
+// Client side of the inference server's protocol
+#include "common_util/inference_protocol.h"
+// Where the time goes until the first result
+#include "common_util/startup_profile.h"
 // Definitions for the Xnor model API
 #include "xnornet.h"
 
-struct input {
-  xnor_input* xnor_input;
-  uint8_t* input_image_data;
-};
-// Load the image at @image_filename and pass it to the model to create an input
-// handle.  Returned as a struct so that we can free the allocated image data
-// after the inference completes.
-struct input input_create_from_jpeg(const char* image_filename);
-
 // This variable specifies whether to tabify and linebreak when printing the
 // JSON document. It could also be a command line argument, but using a
 // preprocessor variable lets us avoid running some of the code altogether.
@@ -33,10 +27,11 @@ struct input input_create_from_jpeg(const char* image_filename);
 // starting at the indentation level given by @indentlevel
 // If JSON_PRETTY is false, no indentation or newlines are printed and
 // @indentlevel is ignored.
-void json_dump_bounding_boxes(xnor_bounding_box* boxes, int32_t num_boxes,
+void json_dump_bounding_boxes(const xg_infer_box* boxes, int32_t num_boxes,
                               FILE* dest, int32_t indentlevel);
 
 int main(int argc, char* argv[]) {
+  xg_startup_begin(XG_STARTUP_FIRST_EVALUATION);
   if (argc == 2) {
     if (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h")) {
       fprintf(stderr, "Usage: %s <image.jpg> > output.json\n", argv[0]);
@@ -53,115 +48,51 @@ int main(int argc, char* argv[]) {
     return EXIT_FAILURE;
   }
 
-  struct input input;
-  if ((input = input_create_from_jpeg(filename)).xnor_input == NULL) {
+  // Make sure we got a JPEG
+  const char* image_ext = strrchr(filename, '.');
+  if (image_ext == NULL ||
+      (strcasecmp(image_ext, ".jpg") != 0 &&
+       strcasecmp(image_ext, ".jpeg") != 0)) {
+    fprintf(stderr, "Sorry, this demo only supports jpeg images!\n");
     return EXIT_FAILURE;
   }
 
-  // Initialize the Xnornet model
-  xnor_model* model = NULL;
-  xnor_error* error = NULL;
-  if ((error = xnor_model_load_built_in("", NULL, &model)) != NULL) {
-    fputs(xnor_error_get_description(error), stderr);
-    xnor_error_free(error);
-    xnor_input_free(input.xnor_input);
-    free(input.input_image_data);
+  // Connect to the inference server, which already has the model loaded
+  int connection = xg_infer_connect(xg_infer_socket_path());
+  if (connection < 0) {
     return EXIT_FAILURE;
   }
 
-  // Get the model information
-  xnor_model_info model_info;
-  model_info.xnor_model_info_size = sizeof(model_info);
-  error = xnor_model_get_info(model, &model_info);
-  if (error != NULL) {
-    fprintf(stderr, "%s\n", xnor_error_get_description(error));
-    xnor_error_free(error);
-    xnor_model_free(model);
-    xnor_input_free(input.xnor_input);
-    free(input.input_image_data);
-    return false;
+  // Have the model evaluate the image! (The model looks for known objects in
+  // the image, using deep learning.) The server can answer in JSON itself, but
+  // binary records let this sample lay the document out as it likes.
+  xg_infer_response response;
+  bool evaluated = xg_infer_evaluate_jpeg_file(
+      connection, filename, XG_INFER_ENCODING_BINARY, &response);
+  close(connection);
+  if (!evaluated) {
+    return EXIT_FAILURE;
   }
 
   // Make sure that the model is actually an object detection model. If you
   // see this, it means you should either switch which model is listed in the
   // Makefile, or run one of the other demos.
-  if (model_info.result_type != kXnorEvaluationResultTypeBoundingBoxes) {
-    fprintf(stderr, "%s is not a detection model! This sample "
-            "requires a detection model to be installed (e.g. "
-            "person-pet-vehicle-detector).", model_info.name);
-    xnor_model_free(model);
-    xnor_input_free(input.xnor_input);
-    free(input.input_image_data);
-    return false;
-  }
-
-  // Evaluate the model! (The model looks for known objects in the image, using
-  // deep learning)
-  xnor_evaluation_result* result = NULL;
-  if ((error = xnor_model_evaluate(model, input.xnor_input, NULL, &result)) !=
-      NULL) {
-    fputs(xnor_error_get_description(error), stderr);
-    xnor_error_free(error);
-    xnor_model_free(model);
-    xnor_input_free(input.xnor_input);
-    free(input.input_image_data);
+  if (!xg_infer_response_check(&response,
+                               kXnorEvaluationResultTypeBoundingBoxes)) {
+    xg_infer_response_free(&response);
     return EXIT_FAILURE;
   }
 
-  // Don't need to keep around the image data any more, now that the model has
-  // used it.
-  xnor_input_free(input.xnor_input);
-  free(input.input_image_data);
-
-  // And, since we're done evaluating the model, free the model too
-  xnor_model_free(model);
-
-  // Dynamically allocate enough space to hold all of the returned bounding
-  // boxes
-  int32_t num_objects =
-      xnor_evaluation_result_get_bounding_boxes(result, NULL, 0);
-  xnor_bounding_box* objects = malloc(sizeof(xnor_bounding_box) * num_objects);
-  xnor_evaluation_result_get_bounding_boxes(result, objects, num_objects);
-
-  json_dump_bounding_boxes(objects, num_objects, stdout, 0);
+  json_dump_bounding_boxes(
+      (const xg_infer_box*)response.payload,
+      xg_infer_response_records(&response, sizeof(xg_infer_box)), stdout, 0);
   fputs("\n", stdout);
 
-  xnor_evaluation_result_free(result);
-  free(objects);
+  xg_infer_response_free(&response);
 
   return EXIT_SUCCESS;
 }
 
-struct input input_create_from_jpeg(const char* image_filename) {
-  // Make sure we got a JPEG
-  const char* image_ext = strrchr(image_filename, '.');
-  if (strcasecmp(image_ext, ".jpg") != 0 &&
-      strcasecmp(image_ext, ".jpeg") != 0) {
-    fprintf(stderr, "Sorry, this demo only supports jpeg images!\n");
-    return (struct input){NULL};
-  }
-
-  // Read the JPEG into memory
-  uint8_t* jpeg_data;
-  int32_t data_size;
-  if (!read_entire_file(image_filename, &jpeg_data, &data_size)) {
-    fprintf(stderr, "Couldn't read data from %s!\n", image_filename);
-    return (struct input){NULL};
-  }
-
-  // Create the input handle for the Xnornet model.
-  xnor_error* error = NULL;
-  xnor_input* input = NULL;
-  if ((error = xnor_input_create_jpeg_image(jpeg_data, data_size, &input)) !=
-      NULL) {
-    fputs(xnor_error_get_description(error), stderr);
-    free(jpeg_data);
-    return (struct input){NULL};
-  }
-
-  return (struct input){input, jpeg_data};
-}
-
 #if JSON_PRETTY
 #define JSON_PRETTY_NEWLINE "\n"
 #define JSON_PRETTY_INDENT "  "
@@ -195,7 +126,7 @@ void json_dump_rectangle(xnor_rectangle rect, FILE* dest, int32_t indentlevel) {
   fputs("}", dest);
 }
 
-void json_dump_class_label(xnor_class_label label, FILE* dest,
+void json_dump_class_label(xg_infer_label label, FILE* dest,
                            int32_t indentlevel) {
   do_indent(dest, indentlevel);
   fputs("{" JSON_PRETTY_NEWLINE, dest);
@@ -209,21 +140,22 @@ void json_dump_class_label(xnor_class_label label, FILE* dest,
   fputs("}", dest);
 }
 
-void json_dump_bounding_box(xnor_bounding_box box, FILE* dest,
+void json_dump_bounding_box(xg_infer_box box, FILE* dest,
                             int32_t indentlevel) {
   do_indent(dest, indentlevel);
   fputs("{" JSON_PRETTY_NEWLINE, dest);
 
   json_dump_class_label(box.class_label, dest, indentlevel + 1);
   fputs("," JSON_PRETTY_NEWLINE, dest);
-  json_dump_rectangle(box.rectangle, dest, indentlevel + 1);
+  xnor_rectangle rectangle = {box.x, box.y, box.width, box.height};
+  json_dump_rectangle(rectangle, dest, indentlevel + 1);
   fputs(JSON_PRETTY_NEWLINE, dest);
 
   do_indent(dest, indentlevel);
   fputs("}", dest);
 }
 
-void json_dump_bounding_boxes(xnor_bounding_box* boxes, int32_t num_boxes,
+void json_dump_bounding_boxes(const xg_infer_box* boxes, int32_t num_boxes,
                               FILE* dest, int32_t indentlevel) {
   do_indent(dest, indentlevel);
   fputs("[", dest);
@@ -3,38 +3,75 @@
 
 // -std=c99 needs this macro to be defined in order to use some POSIX functions.
 // eg. <sys/*>
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
 
+#include <dirent.h>
 #include <getopt.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>  // pid_t
+#include <sys/utsname.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "common_util/file.h"
+#include "common_util/image_input.h"
+#include "common_util/infer_pool.h"
+#include "common_util/latency_histogram.h"
+#include "common_util/startup_profile.h"
 #include "xnornet.h"
 
-static const int CHANNELS = 3;
 static const int WARM_UP_DURATION = 5;
 static const int BYTES_PER_KiB = 1024;
 static const int KiB_PER_MiB = 1024;
 static const double NANO_PER_SEC = 1000000000;
+static const int MAX_SWEEP_SIZES = 16;
 
 enum print_format {
   PRINT_FORMAT_SIMPLE,
   PRINT_FORMAT_FULL,
+  PRINT_FORMAT_JSON,
+  PRINT_FORMAT_CSV,
 };
 
+// Describes what was benchmarked and where, so that machine-readable results
+// from different runs can be told apart
+typedef struct benchmark_metadata {
+  char model_name[128];
+  char model_version[64];
+  int input_width;
+  int input_height;
+  enum image_format input_format;
+  int input_images;
+  xnor_threading_model threading_model;
+  int instances;
+  char cpu_governor[64];
+  char kernel[256];
+  char timestamp[32];
+} benchmark_metadata;
+
 typedef struct performance_results {
+  // Both summed over the evaluations only, so the input and result stages
+  // around them count towards neither the FPS nor the CPU%
   double duration;
   double cpu_duration;
   int total_iterations;
   int num_threads;
   double min_latency;
+  // Evaluation only, the figure all the other results are based on
+  latency_histogram latencies;
+  // The stages around it: creating the model's input from the image, and
+  // reading everything out of the evaluation result
+  latency_histogram input_latencies;
+  latency_histogram result_latencies;
 } performance_results;
 
 // Some Apple devices will have ru_opaque[14] in place of the last 14 positions
@@ -116,8 +153,204 @@ bool read_status(pid_t pid, performance_results* stats) {
 }
 #endif /* defined(__APPLE__) */
 
-void print_performance(performance_results* stats, enum print_format format) {
+// Copies the first line of a small text file (e.g. in /sys) into @out, or
+// "unknown" if it can't be read
+void read_first_line(const char* path, char* out, size_t size) {
+  snprintf(out, size, "unknown");
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    return;
+  }
+  if (fgets(out, size, file) != NULL) {
+    out[strcspn(out, "\n")] = '\0';
+  } else {
+    snprintf(out, size, "unknown");
+  }
+  fclose(file);
+}
+
+// Fills in everything about the machine and the time of the run; the model and
+// configuration fields are left to the caller
+void read_system_metadata(benchmark_metadata* metadata) {
+  read_first_line("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor",
+                  metadata->cpu_governor, sizeof(metadata->cpu_governor));
+  struct utsname name;
+  if (uname(&name) == 0) {
+    snprintf(metadata->kernel, sizeof(metadata->kernel), "%s %s %s",
+             name.sysname, name.release, name.machine);
+  } else {
+    snprintf(metadata->kernel, sizeof(metadata->kernel), "unknown");
+  }
+  time_t now = time(NULL);
+  strftime(metadata->timestamp, sizeof(metadata->timestamp),
+           "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+}
+
+void set_model_metadata(benchmark_metadata* metadata,
+                        const xnor_model_info* model_info) {
+  snprintf(metadata->model_name, sizeof(metadata->model_name), "%s",
+           model_info->name);
+  snprintf(metadata->model_version, sizeof(metadata->model_version), "%s",
+           model_info->version);
+}
+
+// Machine-readable results are flat records of named fields. JSON prints each
+// record as an object; CSV prints the field names once as a header row, then
+// one row per record. The same function fills in the fields either way, so the
+// two formats always carry the same metrics.
+typedef struct record_printer {
+  enum print_format format;
+  // For CSV, print field names instead of values
+  bool header;
+  int num_fields;
+} record_printer;
+
+void record_begin(record_printer* printer) {
+  printer->num_fields = 0;
+  if (printer->format == PRINT_FORMAT_JSON) {
+    printf("{");
+  }
+}
+
+void record_end(record_printer* printer) {
+  printf(printer->format == PRINT_FORMAT_JSON ? "\n}" : "\n");
+}
+
+// Starts a field, printing the key if this format wants it
+void record_key(record_printer* printer, const char* key) {
+  if (printer->format == PRINT_FORMAT_JSON) {
+    printf("%s\n  \"%s\": ", printer->num_fields > 0 ? "," : "", key);
+  } else {
+    printf("%s", printer->num_fields > 0 ? "," : "");
+    if (printer->header) {
+      printf("%s", key);
+    }
+  }
+  ++printer->num_fields;
+}
+
+void record_string(record_printer* printer, const char* key,
+                   const char* value) {
+  record_key(printer, key);
+  if (printer->header) {
+    return;
+  }
+  putchar('"');
+  for (const char* c = value; *c != '\0'; ++c) {
+    if (printer->format == PRINT_FORMAT_CSV) {
+      // CSV escapes a quote by doubling it
+      if (*c == '"') {
+        putchar('"');
+      }
+      putchar(*c);
+    } else if (*c == '"' || *c == '\\') {
+      printf("\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      printf("\\u%04x", *c);
+    } else {
+      putchar(*c);
+    }
+  }
+  putchar('"');
+}
+
+void record_number(record_printer* printer, const char* key, double value,
+                   int decimals) {
+  record_key(printer, key);
+  if (printer->header) {
+    return;
+  }
+  if (isfinite(value)) {
+    printf("%.*f", decimals, value);
+  } else if (printer->format == PRINT_FORMAT_JSON) {
+    printf("null");
+  }
+}
+
+void record_metadata(record_printer* printer,
+                     const benchmark_metadata* metadata) {
+  record_string(printer, "timestamp", metadata->timestamp);
+  record_string(printer, "model_name", metadata->model_name);
+  record_string(printer, "model_version", metadata->model_version);
+  record_number(printer, "input_width", metadata->input_width, 0);
+  record_number(printer, "input_height", metadata->input_height, 0);
+  record_string(printer, "input_format",
+                image_format_name(metadata->input_format));
+  record_number(printer, "input_images", metadata->input_images, 0);
+  record_string(printer, "threading_model",
+                metadata->threading_model == kXnorThreadingModelSingleThreaded
+                    ? "single"
+                    : "multi");
+  record_number(printer, "instances", metadata->instances, 0);
+  record_string(printer, "cpu_governor", metadata->cpu_governor);
+  record_string(printer, "kernel", metadata->kernel);
+}
+
+void record_latencies(record_printer* printer,
+                      const latency_histogram* latencies) {
+  const double NS_PER_MS = 1e6;
+  record_number(printer, "latency_min_ms",
+                latency_histogram_percentile(latencies, 0) / NS_PER_MS, 3);
+  record_number(printer, "latency_mean_ms",
+                latency_histogram_mean(latencies) / NS_PER_MS, 3);
+  record_number(printer, "latency_stddev_ms",
+                latency_histogram_stddev(latencies) / NS_PER_MS, 3);
+  record_number(printer, "latency_p50_ms",
+                latency_histogram_percentile(latencies, 50) / NS_PER_MS, 3);
+  record_number(printer, "latency_p90_ms",
+                latency_histogram_percentile(latencies, 90) / NS_PER_MS, 3);
+  record_number(printer, "latency_p99_ms",
+                latency_histogram_percentile(latencies, 99) / NS_PER_MS, 3);
+  record_number(printer, "latency_p99_9_ms",
+                latency_histogram_percentile(latencies, 99.9) / NS_PER_MS, 3);
+  record_number(printer, "latency_max_ms",
+                latency_histogram_percentile(latencies, 100) / NS_PER_MS, 3);
+}
+
+// Milliseconds at the given percentile of the latency histogram
+static double latency_ms(const latency_histogram* latencies, double percentile) {
+  return latency_histogram_percentile(latencies, percentile) / 1e6;
+}
+
+void record_performance(record_printer* printer,
+                        const benchmark_metadata* metadata,
+                        const performance_results* stats, long rss) {
+  record_begin(printer);
+  record_metadata(printer, metadata);
+  record_number(printer, "duration_s", stats->duration, 3);
+  record_number(printer, "total_frames", stats->total_iterations, 0);
+  record_number(printer, "average_fps",
+                stats->total_iterations / stats->duration, 3);
+  record_number(printer, "num_threads", stats->num_threads, 0);
+  // Relative to the cores the benchmark's threads could use, so 100 means
+  // every one of them was busy throughout
+  record_number(printer, "cpu_percent",
+                100 * stats->cpu_duration /
+                    (stats->duration * stats->num_threads),
+                2);
+  record_latencies(printer, &stats->latencies);
+  const double NS_PER_MS = 1e6;
+  record_number(printer, "input_create_mean_ms",
+                latency_histogram_mean(&stats->input_latencies) / NS_PER_MS, 3);
+  record_number(printer, "input_create_p99_ms",
+                latency_histogram_percentile(&stats->input_latencies, 99) /
+                    NS_PER_MS,
+                3);
+  record_number(printer, "result_extract_mean_ms",
+                latency_histogram_mean(&stats->result_latencies) / NS_PER_MS,
+                3);
+  record_number(printer, "result_extract_p99_ms",
+                latency_histogram_percentile(&stats->result_latencies, 99) /
+                    NS_PER_MS,
+                3);
+  record_number(printer, "max_resident_set_bytes", rss != 0 ? rss : NAN, 0);
+  record_end(printer);
+}
+
+void print_performance(const benchmark_metadata* metadata,
+                       performance_results* stats, enum print_format format) {
   long rss = getrss();
+  const latency_histogram* latencies = &stats->latencies;
   double cpu_percent =
       100 * stats->cpu_duration / (stats->duration * stats->num_threads);
   double average_fps = ((double)stats->total_iterations) / stats->duration;
@@ -129,6 +362,17 @@ void print_performance(performance_results* stats, enum print_format format) {
       printf("Num threads\t");
       printf("Avg CPU%%\t");
       printf("Minimum latency\t");
+      printf("Mean latency\t");
+      printf("Latency stddev\t");
+      printf("p50 latency\t");
+      printf("p90 latency\t");
+      printf("p99 latency\t");
+      printf("p99.9 latency\t");
+      printf("Max latency\t");
+      printf("Input creation mean\t");
+      printf("Input creation p99\t");
+      printf("Result extraction mean\t");
+      printf("Result extraction p99\t");
       printf("Max Resident Set\n");
       printf("%.3f\t", stats->duration);
       printf("%d\t", stats->total_iterations);
@@ -136,6 +380,19 @@ void print_performance(performance_results* stats, enum print_format format) {
       printf("%d\t", stats->num_threads);
       printf("%.2f%%\t", cpu_percent);
       printf("%.1f ms\t", stats->min_latency * 1000);
+      printf("%.3f ms\t", latency_histogram_mean(latencies) / 1e6);
+      printf("%.3f ms\t", latency_histogram_stddev(latencies) / 1e6);
+      printf("%.3f ms\t", latency_ms(latencies, 50));
+      printf("%.3f ms\t", latency_ms(latencies, 90));
+      printf("%.3f ms\t", latency_ms(latencies, 99));
+      printf("%.3f ms\t", latency_ms(latencies, 99.9));
+      printf("%.3f ms\t", latency_ms(latencies, 100));
+      printf("%.3f ms\t",
+             latency_histogram_mean(&stats->input_latencies) / 1e6);
+      printf("%.3f ms\t", latency_ms(&stats->input_latencies, 99));
+      printf("%.3f ms\t",
+             latency_histogram_mean(&stats->result_latencies) / 1e6);
+      printf("%.3f ms\t", latency_ms(&stats->result_latencies, 99));
       if (rss != 0) {
         printf("%ld bytes\n", rss);
       } else {
@@ -156,7 +413,39 @@ void print_performance(performance_results* stats, enum print_format format) {
       } else {
         printf("  Max Resident Set:   Could not be determined\n");
       }
+      printf("Latency\n");
+      printf("  Mean:               %.3f ms\n",
+             latency_histogram_mean(latencies) / 1e6);
+      printf("  Stddev:             %.3f ms\n",
+             latency_histogram_stddev(latencies) / 1e6);
+      printf("  p50:                %.3f ms\n", latency_ms(latencies, 50));
+      printf("  p90:                %.3f ms\n", latency_ms(latencies, 90));
+      printf("  p99:                %.3f ms\n", latency_ms(latencies, 99));
+      printf("  p99.9:              %.3f ms\n", latency_ms(latencies, 99.9));
+      printf("  Max:                %.3f ms\n", latency_ms(latencies, 100));
+      printf("Stages (mean / p99)\n");
+      printf("  Input creation:     %.3f / %.3f ms\n",
+             latency_histogram_mean(&stats->input_latencies) / 1e6,
+             latency_ms(&stats->input_latencies, 99));
+      printf("  Evaluate:           %.3f / %.3f ms\n",
+             latency_histogram_mean(latencies) / 1e6, latency_ms(latencies, 99));
+      printf("  Result extraction:  %.3f / %.3f ms\n",
+             latency_histogram_mean(&stats->result_latencies) / 1e6,
+             latency_ms(&stats->result_latencies, 99));
       break;
+    case PRINT_FORMAT_JSON:
+    case PRINT_FORMAT_CSV: {
+      if (format == PRINT_FORMAT_CSV) {
+        record_printer header = {.format = format, .header = true};
+        record_performance(&header, metadata, stats, rss);
+      }
+      record_printer printer = {.format = format};
+      record_performance(&printer, metadata, stats, rss);
+      if (format == PRINT_FORMAT_JSON) {
+        printf("\n");
+      }
+      break;
+    }
   }
 }
 
@@ -165,6 +454,9 @@ void print_help() {
           "Usage: ./build/model_benchmark [-h]\n"
           "                               [--input_width INPUT_WIDTH]\n"
           "                               [--input_height INPUT_HEIGHT]\n"
+          "                               [--input_format {rgb, jpeg, yuv422, "
+          "yuv420p, nv12, nv21}]\n"
+          "                               [--input_dir INPUT_DIR]\n"
           "                               [--warm_up_iterations "
           "WARM_UP_ITERATIONS]\n"
           "                               [--max_benchmark_iterations "
@@ -172,7 +464,11 @@ void print_help() {
           "                               [--max_benchmark_duration "
           "MAX_BENCHMARK_DURATION}\n"
           "                               [--single_threaded]\n"
-          "                               [--format {simple, full}]\n"
+          "                               [--sweep]\n"
+          "                               [--max_instances MAX_INSTANCES]\n"
+          "                               [--sweep_sizes WxH[,WxH...]]\n"
+          "                               [--latency_csv LATENCY_CSV]\n"
+          "                               [--format {simple, full, json, csv}]\n"
           "                               [--quiet]\n");
 }
 
@@ -191,6 +487,16 @@ void print_extended_help() {
       "                        Input Resolution width of the camera.\n"
       "  --input_height  INPUT_HEIGHT\n"
       "                        Input Resolution height of the camera.\n"
+      "  --input_format {rgb, jpeg, yuv422, yuv420p, nv12, nv21}\n"
+      "                        Image format to create the model's input from\n"
+      "                        (default rgb). Each format uses its own input\n"
+      "                        constructor; jpeg requires --input_dir.\n"
+      "  --input_dir INPUT_DIR\n"
+      "                        Cycle through the images in INPUT_DIR instead of\n"
+      "                        one random image. For jpeg these are the *.jpg\n"
+      "                        and *.jpeg files; for the other formats, raw\n"
+      "                        files of exactly INPUT_WIDTH x INPUT_HEIGHT\n"
+      "                        pixels. Neither option works with --sweep.\n"
       "  --warm_up_iterations WARM_UP_ITERATIONS\n"
       "                        Iterations required for warming up.\n"
       "  --max_benchmark_iterations MAX_BENCHMARK_ITERATIONS\n"
@@ -205,77 +511,631 @@ void print_extended_help() {
       "  --single_threaded\n"
       "                        Run the model in single-threaded mode (default\n"
       "                        is multi-threaded)\n"
-      "  --format {simple, full}\n"
+      "  --sweep\n"
+      "                        Benchmark every combination of 1 to\n"
+      "                        MAX_INSTANCES concurrent model instances, single-\n"
+      "                        and multi-threaded instances, and each of the\n"
+      "                        --sweep_sizes, reporting throughput, latency\n"
+      "                        percentiles and CPU usage for each\n"
+      "  --max_instances MAX_INSTANCES\n"
+      "                        Most concurrent model instances to sweep over\n"
+      "                        (default is the number of online cores)\n"
+      "  --sweep_sizes WxH[,WxH...]\n"
+      "                        Input sizes to sweep over (default is\n"
+      "                        INPUT_WIDTHxINPUT_HEIGHT)\n"
+      "  --latency_csv LATENCY_CSV\n"
+      "                        Also write every benchmark iteration's latency\n"
+      "                        to LATENCY_CSV\n"
+      "  --format {simple, full, json, csv}\n"
       "                        Output format. 'full' has labels and tabular \n"
-      "                        formatting\n"
+      "                        formatting. 'json' and 'csv' also record the\n"
+      "                        model, input size, threading model, CPU\n"
+      "                        governor, kernel and time of the run, and imply\n"
+      "                        --quiet\n"
       "  --quiet\n"
       "                        Suppress output indicating benchmark "
       "progress\n");
 }
 
-bool perform_inference_loop(xnor_model* model, xnor_input* input,
+// The images the benchmark cycles through, all in one format
+typedef struct benchmark_inputs {
+  enum image_format format;
+  int width;
+  int height;
+  int count;
+  uint8_t** images;
+  int32_t* sizes;
+} benchmark_inputs;
+
+double seconds_between(const struct timespec* start, const struct timespec* end) {
+  return (double)(end->tv_sec - start->tv_sec) +
+         ((double)(end->tv_nsec - start->tv_nsec)) / NANO_PER_SEC;
+}
+
+// Reads everything a sample would out of @result, so that the cost of doing so
+// is part of the benchmark
+bool extract_result(xnor_evaluation_result* result) {
+  int32_t count = 0;
+  switch (xnor_evaluation_result_get_type(result)) {
+    case kXnorEvaluationResultTypeBoundingBoxes: {
+      count = xnor_evaluation_result_get_bounding_boxes(result, NULL, 0);
+      xnor_bounding_box* boxes = calloc(count, sizeof(xnor_bounding_box));
+      if (count > 0 && boxes == NULL) {
+        return false;
+      }
+      xnor_evaluation_result_get_bounding_boxes(result, boxes, count);
+      free(boxes);
+      break;
+    }
+    case kXnorEvaluationResultTypeClassLabels: {
+      count = xnor_evaluation_result_get_class_labels(result, NULL, 0);
+      xnor_class_label* labels = calloc(count, sizeof(xnor_class_label));
+      if (count > 0 && labels == NULL) {
+        return false;
+      }
+      xnor_evaluation_result_get_class_labels(result, labels, count);
+      free(labels);
+      break;
+    }
+    case kXnorEvaluationResultTypeSegmentationMasks: {
+      count = xnor_evaluation_result_get_segmentation_masks(result, NULL, 0);
+      xnor_segmentation_mask* masks =
+          calloc(count, sizeof(xnor_segmentation_mask));
+      if (count > 0 && masks == NULL) {
+        return false;
+      }
+      xnor_evaluation_result_get_segmentation_masks(result, masks, count);
+      free(masks);
+      break;
+    }
+    default:
+      break;
+  }
+  return count >= 0;
+}
+
+// Each iteration creates the model's input from the next image, evaluates it
+// and extracts the result, timing each stage separately. If @samples_out isn't
+// NULL, it must have room for @max_iterations latencies, which are stored there
+// in order, in seconds. The loop stops after @max_duration seconds of wall
+// time, every stage included.
+bool perform_inference_loop(xnor_model* model, const benchmark_inputs* inputs,
                             int max_iterations, double max_duration,
-                            performance_results* stats) {
+                            performance_results* stats, double* samples_out) {
   xnor_error* error = NULL;
+  xnor_input* input = NULL;
   xnor_evaluation_result* result = NULL;
 
   stats->min_latency = INFINITY;
   stats->duration = 0;
-  struct timespec start_real, end_real, start_cpu, end_cpu;
-  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_cpu)) {
-    fprintf(stderr, "Clock returned error\n");
-    goto inference_loop_fail;
-  }
+  stats->cpu_duration = 0;
+  latency_histogram_reset(&stats->latencies);
+  latency_histogram_reset(&stats->input_latencies);
+  latency_histogram_reset(&stats->result_latencies);
+  struct timespec start_loop, start_input, start_real, end_real, end_result,
+      start_cpu, end_cpu;
+  clock_gettime(CLOCK_MONOTONIC, &start_loop);
   stats->total_iterations = max_iterations;
   for (int i = 0; i < max_iterations; ++i) {
-    if (clock_gettime(CLOCK_REALTIME, &start_real)) {
+    int image = i % inputs->count;
+    clock_gettime(CLOCK_MONOTONIC, &start_input);
+    if (!create_image_input(inputs->format, inputs->width, inputs->height,
+                            inputs->images[image], inputs->sizes[image],
+                            &input)) {
+      goto inference_loop_fail;
+    }
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_cpu)) {
       fprintf(stderr, "Clock returned error\n");
       goto inference_loop_fail;
     }
+    clock_gettime(CLOCK_MONOTONIC, &start_real);
     error = xnor_model_evaluate(model, input, NULL, &result);
-    if (clock_gettime(CLOCK_REALTIME, &end_real)) {
+    clock_gettime(CLOCK_MONOTONIC, &end_real);
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end_cpu)) {
       fprintf(stderr, "Clock returned error\n");
       goto inference_loop_fail;
     }
+    if (error == NULL) {
+      xg_startup_mark(XG_STARTUP_FIRST_EVALUATION);
+    }
+    xnor_input_free(input);
+    input = NULL;
     if (error != NULL) {
       fprintf(stderr, "%s\n", xnor_error_get_description(error));
       goto inference_loop_fail;
     }
-    double latency =
-        (double)(end_real.tv_sec - start_real.tv_sec) +
-        ((double)(end_real.tv_nsec - start_real.tv_nsec)) / NANO_PER_SEC;
+    if (!extract_result(result)) {
+      fprintf(stderr, "Failed to extract the evaluation result\n");
+      goto inference_loop_fail;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_result);
+    xnor_evaluation_result_free(result);
+    result = NULL;
+
+    double latency = seconds_between(&start_real, &end_real);
+    latency_histogram_record_seconds(&stats->input_latencies,
+                                     seconds_between(&start_input, &start_real));
+    latency_histogram_record_seconds(&stats->result_latencies,
+                                     seconds_between(&end_real, &end_result));
     stats->duration += latency;
+    stats->cpu_duration += seconds_between(&start_cpu, &end_cpu);
+    latency_histogram_record_seconds(&stats->latencies, latency);
+    if (samples_out != NULL) {
+      samples_out[i] = latency;
+    }
     if (latency < stats->min_latency) {
       stats->min_latency = latency;
     }
-    if (stats->duration > max_duration) {
+    if (seconds_between(&start_loop, &end_result) > max_duration) {
       stats->total_iterations = i + 1;
       break;
     }
   }
-  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end_cpu)) {
-    fprintf(stderr, "Clock returned error\n");
-    goto inference_loop_fail;
-  }
-  stats->cpu_duration =
-      (double)(end_cpu.tv_sec - start_cpu.tv_sec) +
-      ((double)(end_cpu.tv_nsec - start_cpu.tv_nsec)) / NANO_PER_SEC;
 
   pid_t pid = getpid();
   if (!read_status(pid, stats)) {  // Check num_threads
     goto inference_loop_fail;
   }
 
-  xnor_evaluation_result_free(result);
   return true;
 inference_loop_fail:
   // If any of these are NULL, the corresponding free() function will do nothing
   xnor_error_free(error);
+  xnor_input_free(input);
   xnor_evaluation_result_free(result);
   return false;
 }
 
+// Writes one row per benchmark iteration with its latency in milliseconds
+bool write_latency_csv(const char* filename, const double* samples,
+                       int num_samples) {
+  FILE* file = fopen(filename, "w");
+  if (file == NULL) {
+    perror("Error opening latency CSV");
+    return false;
+  }
+  fprintf(file, "iteration,latency_ms\n");
+  for (int i = 0; i < num_samples; ++i) {
+    fprintf(file, "%d,%.6f\n", i, samples[i] * 1000);
+  }
+  if (fclose(file) != 0) {
+    perror("Error writing latency CSV");
+    return false;
+  }
+  return true;
+}
+
+// Fills a new buffer with @size random bytes, which is a valid image in any of
+// the raw formats. Returns NULL if out of memory, or if @size is more than an
+// input can hold.
+uint8_t* generate_random_image(int64_t size) {
+  if (size <= 0 || size > INT32_MAX) {
+    return NULL;
+  }
+  uint8_t* image = malloc(size);
+  if (!image) {
+    return NULL;
+  }
+  // Currently generating a long int then casting down
+  for (int32_t i = 0; i < size; ++i) {
+    image[i] = (uint8_t)rand();
+  }
+  return image;
+}
+
+int compare_strings(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+bool has_jpeg_extension(const char* name) {
+  const char* extension = strrchr(name, '.');
+  return extension != NULL && (strcasecmp(extension, ".jpg") == 0 ||
+                               strcasecmp(extension, ".jpeg") == 0);
+}
+
+void free_inputs(benchmark_inputs* inputs) {
+  for (int i = 0; i < inputs->count; ++i) {
+    free(inputs->images[i]);
+  }
+  free(inputs->images);
+  free(inputs->sizes);
+  inputs->images = NULL;
+  inputs->sizes = NULL;
+  inputs->count = 0;
+}
+
+// Adds one image to @inputs, taking ownership of @image
+bool add_input(benchmark_inputs* inputs, uint8_t* image, int32_t size) {
+  uint8_t** images =
+      realloc(inputs->images, sizeof(uint8_t*) * (inputs->count + 1));
+  if (images != NULL) {
+    inputs->images = images;
+  }
+  int32_t* sizes = realloc(inputs->sizes, sizeof(int32_t) * (inputs->count + 1));
+  if (sizes != NULL) {
+    inputs->sizes = sizes;
+  }
+  if (images == NULL || sizes == NULL) {
+    free(image);
+    return false;
+  }
+  inputs->images[inputs->count] = image;
+  inputs->sizes[inputs->count] = size;
+  ++inputs->count;
+  return true;
+}
+
+// Reads every image in @directory that matches the inputs' format, in name
+// order: files ending in .jpg or .jpeg for JPEG, and files of exactly the right
+// size for the raw formats. Anything else is skipped with a warning.
+bool load_input_dir(const char* directory, benchmark_inputs* inputs) {
+  DIR* dir = opendir(directory);
+  if (dir == NULL) {
+    perror("Error opening input directory");
+    return false;
+  }
+  char** names = NULL;
+  int num_names = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char** grown = realloc(names, sizeof(char*) * (num_names + 1));
+    char* name = grown != NULL ? strdup(entry->d_name) : NULL;
+    if (grown != NULL) {
+      names = grown;
+    }
+    if (name == NULL) {
+      fprintf(stderr, "Couldn't allocate memory for the file names in %s\n",
+              directory);
+      closedir(dir);
+      for (int i = 0; i < num_names; ++i) {
+        free(names[i]);
+      }
+      free(names);
+      return false;
+    }
+    names[num_names++] = name;
+  }
+  closedir(dir);
+  qsort(names, num_names, sizeof(char*), compare_strings);
+
+  int64_t expected_size =
+      image_format_size(inputs->format, inputs->width, inputs->height);
+  bool ok = true;
+  for (int i = 0; i < num_names && ok; ++i) {
+    char path[4096];
+    struct stat info;
+    snprintf(path, sizeof(path), "%s/%s", directory, names[i]);
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+      continue;
+    }
+    if (inputs->format == kImageFormatJPEG ? !has_jpeg_extension(names[i])
+                                           : info.st_size != expected_size) {
+      fprintf(stderr, "Skipping %s: %s\n", path,
+              inputs->format == kImageFormatJPEG
+                  ? "not a .jpg or .jpeg file"
+                  : "size doesn't match the input format and size");
+      continue;
+    }
+    uint8_t* image = NULL;
+    int32_t size = 0;
+    ok = read_entire_file(path, &image, &size) &&
+         add_input(inputs, image, size);
+  }
+  for (int i = 0; i < num_names; ++i) {
+    free(names[i]);
+  }
+  free(names);
+  if (ok && inputs->count == 0) {
+    fprintf(stderr, "No %s images in %s\n", image_format_name(inputs->format),
+            directory);
+    ok = false;
+  }
+  return ok;
+}
+
+
+// One point in the sweep matrix, and what was measured for it
+typedef struct sweep_point {
+  int instances;
+  xnor_threading_model threading_model;
+  int input_width;
+  int input_height;
+
+  double duration;
+  double cpu_duration;
+  int total_frames;
+  latency_histogram latencies;
+} sweep_point;
+
+// Shared between the benchmark loop and the pool's result callback
+typedef struct sweep_state {
+  // Keeps exactly as many frames in flight as there are instances, so each
+  // latency is one evaluation rather than time spent queued behind others
+  sem_t free_instances;
+  // Submission time of each frame in flight, indexed by frame % instances
+  struct timespec* submit_times;
+  int instances;
+  latency_histogram* latencies;
+  bool failed;
+} sweep_state;
+
+void on_sweep_result(void* tag, xnor_evaluation_result* result,
+                     xnor_error* error, void* user_data) {
+  sweep_state* state = (sweep_state*)user_data;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long frame = (long)tag;
+  if (error != NULL) {
+    fprintf(stderr, "%s\n", xnor_error_get_description(error));
+    xnor_error_free(error);
+    state->failed = true;
+  }
+  xnor_evaluation_result_free(result);
+
+  // Results arrive one at a time, so no locking is needed here
+  latency_histogram_record_seconds(
+      state->latencies,
+      seconds_between(&state->submit_times[frame % state->instances], &now));
+  sem_post(&state->free_instances);
+}
+
+// Submits frames to the pool until either limit is hit, returning the number
+// of frames submitted
+int run_sweep_frames(xg_infer_pool* pool, sweep_state* state,
+                     const xnor_input* input, int max_iterations,
+                     double max_duration) {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int frame = 0;
+  for (; frame < max_iterations && !state->failed; ++frame) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (seconds_between(&start, &now) > max_duration) {
+      break;
+    }
+    sem_wait(&state->free_instances);
+    clock_gettime(CLOCK_MONOTONIC, &state->submit_times[frame % state->instances]);
+    // Every instance reads the same input; evaluation doesn't modify it
+    xg_infer_pool_submit(pool, input, (void*)(long)frame);
+  }
+  xg_infer_pool_drain(pool);
+  return frame;
+}
+
+bool benchmark_sweep_point(sweep_point* point, benchmark_metadata* metadata,
+                           int warm_up_iterations, int max_iterations,
+                           double max_duration) {
+  bool ok = false;
+  xg_infer_pool* pool = NULL;
+  xnor_input* input = NULL;
+  xnor_error* error = NULL;
+  sweep_state state = {0};
+  state.instances = point->instances;
+  state.latencies = &point->latencies;
+  state.submit_times = calloc(point->instances, sizeof(struct timespec));
+  uint8_t* image = generate_random_image(image_format_size(
+      kImageFormatRGB, point->input_width, point->input_height));
+  if (state.submit_times == NULL || image == NULL ||
+      sem_init(&state.free_instances, 0, point->instances) != 0) {
+    fprintf(stderr, "Failed to set up benchmark\n");
+    free(state.submit_times);
+    free(image);
+    return false;
+  }
+
+  error = xnor_input_create_rgb_image(point->input_width, point->input_height,
+                                      image, &input);
+  if (error != NULL) {
+    fprintf(stderr, "%s\n", xnor_error_get_description(error));
+    goto sweep_point_done;
+  }
+  pool = xg_infer_pool_create(point->instances, point->threading_model,
+                              on_sweep_result, &state);
+  if (pool == NULL) {
+    goto sweep_point_done;
+  }
+  xnor_model_info model_info;
+  model_info.xnor_model_info_size = sizeof(model_info);
+  error = xnor_model_get_info(xg_infer_pool_model(pool), &model_info);
+  if (error != NULL) {
+    fprintf(stderr, "%s\n", xnor_error_get_description(error));
+    goto sweep_point_done;
+  }
+  set_model_metadata(metadata, &model_info);
+
+  run_sweep_frames(pool, &state, input, warm_up_iterations, WARM_UP_DURATION);
+  latency_histogram_reset(&point->latencies);
+
+  struct timespec start_real, end_real, start_cpu, end_cpu;
+  clock_gettime(CLOCK_MONOTONIC, &start_real);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_cpu);
+  point->total_frames =
+      run_sweep_frames(pool, &state, input, max_iterations, max_duration);
+  clock_gettime(CLOCK_MONOTONIC, &end_real);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end_cpu);
+  if (state.failed) {
+    goto sweep_point_done;
+  }
+  point->duration = seconds_between(&start_real, &end_real);
+  point->cpu_duration = seconds_between(&start_cpu, &end_cpu);
+  ok = true;
+
+sweep_point_done:
+  xg_infer_pool_free(pool);
+  xnor_input_free(input);
+  xnor_error_free(error);
+  sem_destroy(&state.free_instances);
+  free(state.submit_times);
+  free(image);
+  return ok;
+}
+
+void record_sweep_point(record_printer* printer,
+                        const benchmark_metadata* metadata,
+                        const sweep_point* point) {
+  double fps = point->total_frames / point->duration;
+  double cores_used = point->cpu_duration / point->duration;
+  record_begin(printer);
+  record_metadata(printer, metadata);
+  record_number(printer, "duration_s", point->duration, 3);
+  record_number(printer, "total_frames", point->total_frames, 0);
+  record_number(printer, "average_fps", fps, 3);
+  record_number(printer, "fps_per_core", cores_used > 0 ? fps / cores_used : 0,
+                3);
+  // Relative to a single core, unlike record_performance()'s cpu_percent:
+  // 250 means two and a half cores were busy throughout
+  record_number(printer, "cpu_core_percent", 100 * cores_used, 2);
+  record_latencies(printer, &point->latencies);
+  record_end(printer);
+}
+
+void print_sweep_header(enum print_format format) {
+  switch (format) {
+    case PRINT_FORMAT_JSON:
+      printf("[");
+      break;
+    case PRINT_FORMAT_CSV: {
+      record_printer header = {.format = format, .header = true};
+      sweep_point point = {0};
+      benchmark_metadata metadata = {0};
+      record_sweep_point(&header, &metadata, &point);
+      break;
+    }
+    case PRINT_FORMAT_SIMPLE:
+      printf("Instances\tThreading\tInput\tTotal frames\tFPS\t"
+             "FPS per core\tCore%%\tMean latency\tp50 latency\t"
+             "p90 latency\tp99 latency\tMax latency\n");
+      break;
+    case PRINT_FORMAT_FULL:
+      printf("%9s  %-9s  %-9s  %8s  %8s  %7s  %8s  %8s  %8s  %8s  %8s\n",
+             "Instances", "Threading", "Input", "FPS", "FPS/core", "Core%",
+             "Mean ms", "p50 ms", "p90 ms", "p99 ms", "Max ms");
+      break;
+  }
+}
+
+void print_sweep_footer(enum print_format format) {
+  if (format == PRINT_FORMAT_JSON) {
+    printf("\n]\n");
+  }
+}
+
+// Core% is CPU time relative to a single core, so FPS per core (frames per CPU-second)
+// is the efficiency figure to compare when optimizing for frames per watt.
+void print_sweep_point(const benchmark_metadata* metadata,
+                       const sweep_point* point, bool first,
+                       enum print_format format) {
+  const char* threading =
+      point->threading_model == kXnorThreadingModelSingleThreaded ? "single"
+                                                                   : "multi";
+  char input_size[32];
+  snprintf(input_size, sizeof(input_size), "%dx%d", point->input_width,
+           point->input_height);
+  const latency_histogram* latencies = &point->latencies;
+  double fps = point->total_frames / point->duration;
+  double cores_used = point->cpu_duration / point->duration;
+  double fps_per_core = cores_used > 0 ? fps / cores_used : 0;
+  switch (format) {
+    case PRINT_FORMAT_SIMPLE:
+      printf("%d\t%s\t%s\t%d\t%.3f\t%.3f\t%.2f%%\t%.1f ms\t%.1f ms\t"
+             "%.1f ms\t%.1f ms\t%.1f ms\n",
+             point->instances, threading, input_size, point->total_frames, fps,
+             fps_per_core, 100 * cores_used, latency_histogram_mean(latencies) / 1e6,
+             latency_ms(latencies, 50), latency_ms(latencies, 90),
+             latency_ms(latencies, 99), latency_ms(latencies, 100));
+      break;
+    case PRINT_FORMAT_FULL:
+      printf("%9d  %-9s  %-9s  %8.2f  %8.2f  %6.1f%%  %8.1f  %8.1f  %8.1f  "
+             "%8.1f  %8.1f\n",
+             point->instances, threading, input_size, fps, fps_per_core,
+             100 * cores_used, latency_histogram_mean(latencies) / 1e6,
+             latency_ms(latencies, 50), latency_ms(latencies, 90),
+             latency_ms(latencies, 99), latency_ms(latencies, 100));
+      break;
+    case PRINT_FORMAT_JSON:
+    case PRINT_FORMAT_CSV: {
+      if (format == PRINT_FORMAT_JSON) {
+        printf(first ? "\n" : ",\n");
+      }
+      record_printer printer = {.format = format};
+      record_sweep_point(&printer, metadata, point);
+      break;
+    }
+  }
+  fflush(stdout);
+}
+
+// Runs the whole {instances} x {threading model} x {input size} matrix
+bool run_sweep(int max_instances, const int* widths, const int* heights,
+               int num_sizes, int warm_up_iterations, int max_iterations,
+               double max_duration, enum print_format format, bool quiet) {
+  const xnor_threading_model threading_models[] = {
+      kXnorThreadingModelSingleThreaded, kXnorThreadingModelMultiThreaded};
+  benchmark_metadata metadata = {
+      .input_format = kImageFormatRGB,
+      .input_images = 1,
+  };
+  read_system_metadata(&metadata);
+  bool first = true;
+  print_sweep_header(format);
+  for (int size = 0; size < num_sizes; ++size) {
+    for (int t = 0; t < 2; ++t) {
+      for (int instances = 1; instances <= max_instances; ++instances) {
+        sweep_point point = {
+            .instances = instances,
+            .threading_model = threading_models[t],
+            .input_width = widths[size],
+            .input_height = heights[size],
+        };
+        if (!quiet) {
+          fprintf(stderr, "Benchmarking %d %s-threaded instance(s) at %dx%d...\n",
+                  instances, t == 0 ? "single" : "multi", widths[size],
+                  heights[size]);
+        }
+        metadata.instances = instances;
+        metadata.threading_model = threading_models[t];
+        metadata.input_width = widths[size];
+        metadata.input_height = heights[size];
+        if (!benchmark_sweep_point(&point, &metadata, warm_up_iterations,
+                                   max_iterations, max_duration)) {
+          return false;
+        }
+        print_sweep_point(&metadata, &point, first, format);
+        first = false;
+      }
+    }
+  }
+  print_sweep_footer(format);
+  return true;
+}
+
+// Parses a comma-separated list of WxH sizes. Returns the number parsed, or -1
+// if the list is malformed.
+int parse_sizes(const char* list, int* widths, int* heights, int max_sizes) {
+  int count = 0;
+  while (*list != '\0') {
+    int consumed = 0;
+    if (count == max_sizes ||
+        sscanf(list, "%dx%d%n", &widths[count], &heights[count], &consumed) != 2 ||
+        widths[count] <= 0 || heights[count] <= 0) {
+      return -1;
+    }
+    ++count;
+    list += consumed;
+    if (*list == ',') {
+      ++list;
+    } else if (*list != '\0') {
+      return -1;
+    }
+  }
+  return count;
+}
+
 int main(int argc, char* argv[]) {
+  // The profile prints once the model is warm, ahead of the benchmark results
+  xg_startup_begin(XG_STARTUP_WARMED_UP);
   int opt;
   // Set default values
   int input_width = 448;
@@ -286,14 +1146,28 @@ int main(int argc, char* argv[]) {
   bool single_threaded = false;
   enum print_format format = PRINT_FORMAT_FULL;
   bool quiet = false;
+  const char* latency_csv = NULL;
+  const char* input_dir = NULL;
+  enum image_format input_format = kImageFormatRGB;
+  bool sweep = false;
+  int max_instances = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int sweep_widths[MAX_SWEEP_SIZES];
+  int sweep_heights[MAX_SWEEP_SIZES];
+  int num_sweep_sizes = 0;
 
   enum option_values {
     OPTION_INPUT_WIDTH = 1,
     OPTION_INPUT_HEIGHT,
+    OPTION_INPUT_FORMAT,
+    OPTION_INPUT_DIR,
     OPTION_WARM_UP_ITERATIONS,
     OPTION_MAX_BENCHMARK_ITERATIONS,
     OPTION_MAX_BENCHMARK_DURATION,
     OPTION_SINGLE_THREADED,
+    OPTION_SWEEP,
+    OPTION_MAX_INSTANCES,
+    OPTION_SWEEP_SIZES,
+    OPTION_LATENCY_CSV,
     OPTION_RESULT_FORMAT,
     OPTION_QUIET,
     OPTION_HELP,
@@ -303,12 +1177,18 @@ int main(int argc, char* argv[]) {
   struct option options[] = {
       {"input_width", required_argument, 0, OPTION_INPUT_WIDTH},
       {"input_height", required_argument, 0, OPTION_INPUT_HEIGHT},
+      {"input_format", required_argument, 0, OPTION_INPUT_FORMAT},
+      {"input_dir", required_argument, 0, OPTION_INPUT_DIR},
       {"warm_up_iterations", required_argument, 0, OPTION_WARM_UP_ITERATIONS},
       {"max_benchmark_iterations", required_argument, 0,
        OPTION_MAX_BENCHMARK_ITERATIONS},
       {"max_benchmark_duration", required_argument, 0,
        OPTION_MAX_BENCHMARK_DURATION},
       {"single_threaded", no_argument, 0, OPTION_SINGLE_THREADED},
+      {"sweep", no_argument, 0, OPTION_SWEEP},
+      {"max_instances", required_argument, 0, OPTION_MAX_INSTANCES},
+      {"sweep_sizes", required_argument, 0, OPTION_SWEEP_SIZES},
+      {"latency_csv", required_argument, 0, OPTION_LATENCY_CSV},
       {"format", required_argument, 0, OPTION_RESULT_FORMAT},
       {"quiet", no_argument, 0, OPTION_QUIET},
       {"help", no_argument, 0, OPTION_HELP},
@@ -323,6 +1203,16 @@ int main(int argc, char* argv[]) {
       case OPTION_INPUT_HEIGHT:
         input_height = atoi(optarg);
         break;
+      case OPTION_INPUT_FORMAT:
+        if (!parse_image_format(optarg, &input_format)) {
+          fprintf(stderr, "--input_format: Please pass one of {rgb, jpeg, "
+                          "yuv422, yuv420p, nv12, nv21}\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPTION_INPUT_DIR:
+        input_dir = optarg;
+        break;
       case OPTION_WARM_UP_ITERATIONS:
         warm_up_iterations = atoi(optarg);
         break;
@@ -335,13 +1225,36 @@ int main(int argc, char* argv[]) {
       case OPTION_SINGLE_THREADED:
         single_threaded = true;
         break;
+      case OPTION_SWEEP:
+        sweep = true;
+        break;
+      case OPTION_MAX_INSTANCES:
+        max_instances = atoi(optarg);
+        break;
+      case OPTION_SWEEP_SIZES:
+        num_sweep_sizes = parse_sizes(optarg, sweep_widths, sweep_heights,
+                                      MAX_SWEEP_SIZES);
+        if (num_sweep_sizes <= 0) {
+          fprintf(stderr, "--sweep_sizes: Please pass sizes like "
+                          "224x224,448x448\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      case OPTION_LATENCY_CSV:
+        latency_csv = optarg;
+        break;
       case OPTION_RESULT_FORMAT:
         if (strcmp(optarg, "simple") == 0) {
           format = PRINT_FORMAT_SIMPLE;
         } else if (strcmp(optarg, "full") == 0) {
           format = PRINT_FORMAT_FULL;
+        } else if (strcmp(optarg, "json") == 0) {
+          format = PRINT_FORMAT_JSON;
+        } else if (strcmp(optarg, "csv") == 0) {
+          format = PRINT_FORMAT_CSV;
         } else {
-          fprintf(stderr, "--format: Please pass one of {simple, full}\n");
+          fprintf(stderr,
+                  "--format: Please pass one of {simple, full, json, csv}\n");
           return EXIT_FAILURE;
         }
         break;
@@ -358,12 +1271,52 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  if (input_format == kImageFormatJPEG && input_dir == NULL) {
+    fprintf(stderr, "--input_format jpeg: Please pass --input_dir\n");
+    return EXIT_FAILURE;
+  }
+
+  // Nothing but the results may go to stdout in machine-readable formats
+  bool machine_readable =
+      format == PRINT_FORMAT_JSON || format == PRINT_FORMAT_CSV;
+  if (machine_readable) {
+    quiet = true;
+  }
+
+  if (sweep) {
+    // Every sweep point evaluates random RGB images of its own size
+    if (input_dir != NULL || input_format != kImageFormatRGB) {
+      fprintf(stderr, "--sweep: --input_format and --input_dir are not "
+                      "supported; the sweep evaluates random RGB images\n");
+      return EXIT_FAILURE;
+    }
+    if (num_sweep_sizes == 0) {
+      sweep_widths[0] = input_width;
+      sweep_heights[0] = input_height;
+      num_sweep_sizes = 1;
+    }
+    if (max_instances < 1) {
+      max_instances = 1;
+    }
+    srand(time(NULL));
+    bool swept = run_sweep(max_instances, sweep_widths, sweep_heights,
+                           num_sweep_sizes, warm_up_iterations,
+                           test_iterations, test_duration, format, quiet);
+    // Covers the first sweep point's model load and evaluation
+    xg_startup_print();
+    return swept ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   // Forward declare variables we will need to clean up later
   xnor_model* model = NULL;
   xnor_error* error = NULL;
-  xnor_input* input = NULL;
   xnor_model_load_options* load_options = xnor_model_load_options_create();
-  uint8_t* input_image = NULL;
+  benchmark_inputs inputs = {
+      .format = input_format,
+      .width = input_width,
+      .height = input_height,
+  };
+  double* latency_samples = NULL;
 
   // Load the Xnor model to get a model handle. We will free this at the end of
   // main(), either via a successful return or after the fail: label.
@@ -387,6 +1340,7 @@ int main(int argc, char* argv[]) {
     fprintf(stderr, "%s\n", xnor_error_get_description(error));
     goto fail;
   }
+  xg_startup_mark(XG_STARTUP_MODEL_LOADED);
 
   // Get the model information
   xnor_model_info model_info;
@@ -397,67 +1351,85 @@ int main(int argc, char* argv[]) {
     goto fail;
   }
 
-  printf("Model: %s\n", model_info.name);
-  printf("  version '%s'\n", model_info.version);
+  if (!machine_readable) {
+    printf("Model: %s\n", model_info.name);
+    printf("  version '%s'\n", model_info.version);
+  }
+
+  benchmark_metadata metadata = {
+      .input_width = input_width,
+      .input_height = input_height,
+      .input_format = input_format,
+      .threading_model = single_threaded ? kXnorThreadingModelSingleThreaded
+                                         : kXnorThreadingModelMultiThreaded,
+      .instances = 1,
+  };
+  set_model_metadata(&metadata, &model_info);
+  read_system_metadata(&metadata);
 
   if (!quiet) {
     printf("Generating Input...\n");
   }
-  input_image = malloc(sizeof(uint8_t) * input_width * input_height * CHANNELS);
-  if (!input_image) {
-    fprintf(stderr, "Failed to allocate space for input image\n");
-    goto fail;
-  }
-
-  srand(time(NULL));
-  // Generate a random byte for each position
-  // Currently generating a long int then casting down
-  for (int i = 0; i < input_width; ++i) {
-    for (int j = 0; j < input_height; ++j) {
-      for (int k = 0; k < CHANNELS; ++k) {
-        input_image[i * (input_height * CHANNELS) + j * (CHANNELS) + k] =
-            (uint8_t)rand();
-      }
+  if (input_dir != NULL) {
+    if (!load_input_dir(input_dir, &inputs)) {
+      goto fail;
+    }
+  } else {
+    srand(time(NULL));
+    int64_t size = image_format_size(input_format, input_width, input_height);
+    uint8_t* input_image = generate_random_image(size);
+    if (!input_image || !add_input(&inputs, input_image, size)) {
+      fprintf(stderr, "Failed to allocate space for input image\n");
+      goto fail;
     }
   }
-
-  error = xnor_input_create_rgb_image(input_width, input_height, input_image,
-                                      &input);
+  metadata.input_images = inputs.count;
 
   if (!quiet) {
     printf("Warming up...\n");
   }
   performance_results warm_up_results;
-  if (!perform_inference_loop(model, input, warm_up_iterations,
-                              WARM_UP_DURATION, &warm_up_results)) {
+  if (!perform_inference_loop(model, &inputs, warm_up_iterations,
+                              WARM_UP_DURATION, &warm_up_results, NULL)) {
     fprintf(stderr, "Warmup failure\n");
     goto fail;
   }
+  xg_startup_mark(XG_STARTUP_WARMED_UP);
   if (!quiet) {
     printf("Finished warming up.\n");
     printf("Benchmarking...\n\n");
   }
+  if (latency_csv != NULL) {
+    latency_samples = malloc(sizeof(double) * test_iterations);
+    if (!latency_samples) {
+      fprintf(stderr, "Failed to allocate space for latency samples\n");
+      goto fail;
+    }
+  }
   performance_results test_results;
-  if (!perform_inference_loop(model, input, test_iterations, test_duration,
-                              &test_results)) {
+  if (!perform_inference_loop(model, &inputs, test_iterations, test_duration,
+                              &test_results, latency_samples)) {
     fprintf(stderr, "Benchmarking failure\n");
     goto fail;
   }
 
-  print_performance(&test_results, format);
+  print_performance(&metadata, &test_results, format);
+  if (latency_csv != NULL &&
+      !write_latency_csv(latency_csv, latency_samples,
+                         test_results.total_iterations)) {
+    goto fail;
+  }
 
-  free(input_image);
-  xnor_input_free(input);
+  free(latency_samples);
+  free_inputs(&inputs);
   xnor_model_free(model);
 
   return EXIT_SUCCESS;
 fail:
-  if (input_image) {
-    free(input_image);
-  }
+  free_inputs(&inputs);
+  free(latency_samples);
   // If any of these are NULL, the corresponding free() function will do nothing
   xnor_error_free(error);
-  xnor_input_free(input);
   xnor_model_free(model);
   xnor_model_load_options_free(load_options);
   return EXIT_FAILURE;
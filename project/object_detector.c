@@ -6,6 +6,7 @@
 #include <stdnoreturn.h>
 
 #include "common_util/file.h"
+#include "common_util/startup_profile.h"
 #include "xnornet.h"
 
 void panic_on_error(xnor_error* error) {
@@ -17,8 +18,10 @@ void panic_on_error(xnor_error* error) {
 }
 
 int main(int argc, char* argv[]) {
+  xg_startup_begin(XG_STARTUP_FIRST_EVALUATION);
   xnor_model* model;
   panic_on_error(xnor_model_load_built_in(NULL, NULL, &model));
+  xg_startup_mark(XG_STARTUP_MODEL_LOADED);
 
   const char* filename = "../../test-images/dog.jpg";
   if (argc >= 2) {
@@ -39,6 +42,7 @@ int main(int argc, char* argv[]) {
 
   xnor_evaluation_result* result;
   panic_on_error(xnor_model_evaluate(model, input, NULL, &result));
+  xg_startup_mark(XG_STARTUP_FIRST_EVALUATION);
 
 #define MAX_BOXES 10
   xnor_bounding_box boxes[MAX_BOXES];
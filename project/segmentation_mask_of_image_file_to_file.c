@@ -1,7 +1,7 @@
 // Copyright (c) 2019 Xnor.ai, Inc.
 //
-// This sample runs a segmentation model over an input jpeg and saves the
-// resulting mask to a TGA.
+// This sample has a segmentation model, kept loaded by inference_server,
+// evaluate an input jpeg and saves the resulting mask to a TGA.
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -11,14 +11,21 @@
 
 // File-related helpers
 #include "common_util/file.h"
+// Client side of the inference server's protocol
+#include "common_util/inference_protocol.h"
+// Where the time goes until the first result
+#include "common_util/startup_profile.h"
 // Definitions for the Xnor model API
 #include "xnornet.h"
 
 // Returns a mask identifying the precisely bounded area of the image
 // representing by a particular class, using deep learning.
 // If the model returns more than one segmentation mask, only uses the first.
-xnor_evaluation_result* segment_jpeg_using_xnornet(
-    const char* filename, xnor_segmentation_mask* mask_out);
+// @mask_out and its bitmap point into @response_out, which must be freed with
+// xg_infer_response_free() on success.
+bool segment_jpeg_using_xnornet(const char* filename,
+                                xg_infer_response* response_out,
+                                const xg_infer_mask** mask_out);
 
 // Helper that replaces the ".jpg" or ".jpeg" of a file name with ".class.tga",
 // where class is the given class_label
@@ -26,6 +33,7 @@ char* make_tga_filename(const char* original_jpeg_name,
                         const char* class_label);
 
 int main(int argc, char* argv[]) {
+  xg_startup_begin(XG_STARTUP_FIRST_EVALUATION);
   if (argc == 2) {
     if (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h")) {
       fprintf(stderr, "Usage: %s <image.jpg>\n", argv[0]);
@@ -42,114 +50,85 @@ int main(int argc, char* argv[]) {
     return EXIT_FAILURE;
   }
 
-  xnor_evaluation_result* result = NULL;
-  xnor_segmentation_mask mask;
-  if ((result = segment_jpeg_using_xnornet(filename, &mask)) == NULL) {
+  xg_infer_response response;
+  const xg_infer_mask* mask;
+  if (!segment_jpeg_using_xnornet(filename, &response, &mask)) {
     return EXIT_FAILURE;
   }
 
-  char* new_filename = make_tga_filename(filename, mask.class_label.label);
+  char* new_filename = make_tga_filename(filename, mask->class_label.label);
   if (new_filename == NULL) {
-    xnor_evaluation_result_free(result);
+    xg_infer_response_free(&response);
     return EXIT_FAILURE;
   }
 
-  if (write_tga_file(new_filename, mask.bitmap.data, kColorDepth1Bit,
-                     mask.bitmap.width, mask.bitmap.height,
-                     mask.bitmap.stride)) {
-    printf("Saved segmentation mask for '%s' to '%s'\n", mask.class_label.label,
-           new_filename);
+  const uint8_t* bitmap = response.payload + mask->bitmap_offset;
+  if (write_tga_file(new_filename, bitmap, kColorDepth1Bit, mask->width,
+                     mask->height, mask->stride)) {
+    printf("Saved segmentation mask for '%s' to '%s'\n",
+           mask->class_label.label, new_filename);
   } else {
-    xnor_evaluation_result_free(result);
+    xg_infer_response_free(&response);
     free(new_filename);
     return EXIT_FAILURE;
   }
 
-  xnor_evaluation_result_free(result);
+  xg_infer_response_free(&response);
   free(new_filename);
   return EXIT_SUCCESS;
 }
 
-void fputs_and_free_error(xnor_error* error) {
-  fputs(xnor_error_get_description(error), stderr);
-  xnor_error_free(error);
-}
-
-xnor_evaluation_result* segment_jpeg_using_xnornet(
-    const char* image_filename, xnor_segmentation_mask* mask_out) {
+bool segment_jpeg_using_xnornet(const char* image_filename,
+                                xg_infer_response* response_out,
+                                const xg_infer_mask** mask_out) {
   // Make sure we got a JPEG
   const char* image_ext = strrchr(image_filename, '.');
-  if (strcasecmp(image_ext, ".jpg") != 0 &&
-      strcasecmp(image_ext, ".jpeg") != 0) {
+  if (image_ext == NULL ||
+      (strcasecmp(image_ext, ".jpg") != 0 &&
+       strcasecmp(image_ext, ".jpeg") != 0)) {
     fprintf(stderr, "Sorry, this demo only supports jpeg images!\n");
-    return NULL;
-  }
-
-  // Read the JPEG into memory
-  uint8_t* jpeg_data;
-  int32_t data_size;
-  if (!read_entire_file(image_filename, &jpeg_data, &data_size)) {
-    fprintf(stderr, "Couldn't read data from %s!\n", image_filename);
-    return NULL;
-  }
-
-  // Create the input handle for the Xnornet model.
-  xnor_error* error = NULL;
-  xnor_input* input = NULL;
-  if ((error = xnor_input_create_jpeg_image(jpeg_data, data_size,
-                                            &input)) != NULL) {
-    fputs_and_free_error(error);
-    free(jpeg_data);
-    return NULL;
+    return false;
   }
 
-  // Initialize the Xnornet model
-  xnor_model* model = NULL;
-  if ((error = xnor_model_load_built_in("", NULL, &model)) != NULL) {
-    fputs_and_free_error(error);
-    xnor_input_free(input);
-    free(jpeg_data);
-    return NULL;
+  // Connect to the inference server, which already has the model loaded
+  int connection = xg_infer_connect(xg_infer_socket_path());
+  if (connection < 0) {
+    return false;
   }
 
-  // Evaluate the model! (The model looks for known objects in the image, using
-  // deep learning)
-  xnor_evaluation_result* result = NULL;
-  if ((error = xnor_model_evaluate(model, input, NULL, &result)) != NULL) {
-    fputs_and_free_error(error);
-    xnor_input_free(input);
-    xnor_model_free(model);
-    free(jpeg_data);
-    return NULL;
+  // Have the model evaluate the image! (The model looks for known objects in
+  // the image, using deep learning)
+  bool evaluated = xg_infer_evaluate_jpeg_file(
+      connection, image_filename, XG_INFER_ENCODING_BINARY, response_out);
+  close(connection);
+  if (!evaluated) {
+    return false;
   }
 
-  // Don't need to keep around the image data any more, now that the model has
-  // used it.
-  xnor_input_free(input);
-  free(jpeg_data);
-
-  // And, since we're done evaluating the model, free the model too
-  xnor_model_free(model);
-
   // Check what kind of model this is by investigating the kind of results it
   // returned.
   // A Segmentation model should always return one or more Segmentation Masks
-  if (xnor_evaluation_result_get_type(result) !=
-      kXnorEvaluationResultTypeSegmentationMasks) {
-    fputs("Oops! I wasn't linked with a segmentation model!\n", stderr);
-    xnor_evaluation_result_free(result);
-    return NULL;
+  if (!xg_infer_response_check(response_out,
+                               kXnorEvaluationResultTypeSegmentationMasks)) {
+    xg_infer_response_free(response_out);
+    return false;
   }
 
-  int32_t num_masks =
-      xnor_evaluation_result_get_segmentation_masks(result, mask_out, 1);
-  if (num_masks < 1) {
+  if (xg_infer_response_records(response_out, sizeof(xg_infer_mask)) < 1) {
     fputs("Couldn't get any masks from the model!\n", stderr);
-    xnor_evaluation_result_free(result);
-    return NULL;
+    xg_infer_response_free(response_out);
+    return false;
   }
 
-  return result;
+  const xg_infer_mask* mask = (const xg_infer_mask*)response_out->payload;
+  if (mask->bitmap_offset + (uint64_t)mask->stride * mask->height >
+      response_out->header.size) {
+    fputs("The inference server sent a truncated mask!\n", stderr);
+    xg_infer_response_free(response_out);
+    return false;
+  }
+  *mask_out = mask;
+  return true;
 }
 
 char* make_tga_filename(const char* filename, const char* class_label) {